@@ -1,4 +1,5 @@
 import itertools
+import mmap
 import os
 import queue
 from select import poll, \
@@ -11,11 +12,12 @@ from struct import Struct
 import logging
 import errno
 from collections import namedtuple
-from base64 import b64decode, b64encode
 import stat
 import signal
+import socket
 from weakref import ref
 import subprocess
+import time
 
 try:
     from vdsm import pthread
@@ -37,6 +39,48 @@ OUTPUT_READY_FLAGS = POLLOUT | POLLWRBAND | ERROR_FLAGS
 
 ERR_IOPROCESS_CRASH = 100001
 
+WIRE_FORMAT_JSON = "json"
+WIRE_FORMAT_BINARY = "binary"
+
+TRANSPORT_PIPE = "pipe"
+TRANSPORT_SHM = "shm"
+
+# Size of each of the shared memory rings used by TRANSPORT_SHM.
+DEFAULT_SHM_RING_SIZE = 1024**2
+
+# Request priority classes. Queued requests run in class order, and
+# PRIORITY_HIGH requests use the reserved threads if there are any.
+IO_BACKEND_THREADS = "threads"
+IO_BACKEND_URING = "uring"
+
+PRIORITY_LOW = 0
+PRIORITY_NORMAL = 1
+PRIORITY_HIGH = 2
+
+# Max bytes read from the pipe at once.
+_READ_SIZE = 1024**2
+
+# Chunks of a streamed response sent before the client acknowledges them.
+# ioprocess waits for an acknowledgement before sending more, so this is
+# also the most chunks buffered in the client.
+_STREAM_WINDOW = 2
+
+# Type tags of the binary wire format, must match JsonNodeType in
+# src/json-dom.h.
+_BT_LONG = 1
+_BT_STRING = 2
+_BT_MAP = 3
+_BT_ARRAY = 4
+_BT_NULL = 5
+_BT_BOOLEAN = 6
+_BT_DOUBLE = 7
+_BT_BINARY = 8
+
+_BinTag = Struct("=B")
+_BinLong = Struct("=q")
+_BinDouble = Struct("=d")
+_BinLen = Struct("=I")
+
 StatResult = namedtuple("StatResult", "st_mode, st_ino, st_dev, st_nlink,"
                                       "st_uid, st_gid, st_size, st_atime,"
                                       "st_mtime, st_ctime, st_blocks")
@@ -72,9 +116,10 @@ class PollError(Exception):
 
 # Communicate is a function to prevent the bound method from strong referencing
 # ioproc
-def _communicate(ioproc_ref, proc, readPipe, writePipe):
+def _communicate(ioproc_ref, proc, readPipe, writePipe, channel):
     real_ioproc = ioproc_ref()
     if real_ioproc is None:
+        channel.close()
         return
 
     # Keeps the name for logging in this thread.
@@ -84,9 +129,12 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
 
     dataSender = None
     pendingRequests = {}
-    responseReader = ResponseReader(readPipe)
+    # Ids of abandoned streams, their remaining frames are dropped.
+    abandoned = set()
+    responseReader = ResponseReader(channel, real_ioproc._decode)
 
-    err = proc.stderr.fileno()
+    # Clients connected to the socket of another ioprocess have no process.
+    err = proc.stderr.fileno() if proc else -1
 
     poller = poll()
 
@@ -99,10 +147,17 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
             evtReciever = -1
             return
 
-        poller.register(err, INPUT_READY_FLAGS)
+        if proc:
+            poller.register(err, INPUT_READY_FLAGS)
         poller.register(evtReciever, INPUT_READY_FLAGS)
-        poller.register(readPipe, INPUT_READY_FLAGS)
-        poller.register(writePipe, ERROR_FLAGS)
+        poller.register(channel.readFd, INPUT_READY_FLAGS)
+        poller.register(channel.writeFd, ERROR_FLAGS)
+
+        # With shared memory the pipes only report hangups.
+        if channel.readFd != readPipe:
+            poller.register(readPipe, ERROR_FLAGS)
+        if channel.writeFd != writePipe:
+            poller.register(writePipe, ERROR_FLAGS)
 
         while True:
             real_ioproc = None
@@ -125,23 +180,41 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
                     real_ioproc._processLogs(os.read(fd, 1024))
                     continue
 
-                if fd == readPipe:
+                if fd == channel.readFd:
                     if not responseReader.process():
                         continue
 
-                    res = responseReader.pop()
-                    reqId = res['id']
-                    pendingReq = pendingRequests.pop(reqId, None)
-                    if pendingReq is not None:
-                        pendingReq.result = res
-                        pendingReq.event.set()
-                    else:
-                        _log.warning("(%s) Unknown request id %d",
-                                     ioproc_name, reqId)
+                    for res in responseReader.popAll():
+                        reqId = res['id']
+                        if res.get('chunk'):
+                            # More chunks or the final response will follow.
+                            # The window keeps the queue from filling up.
+                            pendingReq = pendingRequests.get(reqId)
+                            if pendingReq is not None:
+                                pendingReq.chunks.put_nowait(res['result'])
+                            continue
+
+                        pendingReq = pendingRequests.pop(reqId, None)
+                        if pendingReq is not None:
+                            pendingReq.complete(res)
+                        elif reqId in abandoned:
+                            abandoned.discard(reqId)
+                        else:
+                            _log.warning("(%s) Unknown request id %d",
+                                         ioproc_name, reqId)
                     continue
 
                 if fd == evtReciever:
                     os.read(fd, 1)
+                    while True:
+                        try:
+                            resObj = real_ioproc._abandonQueue.get_nowait()
+                        except queue.Empty:
+                            break
+                        if resObj.reqId is not None:
+                            pendingRequests.pop(resObj.reqId, None)
+                            abandoned.add(resObj.reqId)
+
                     if dataSender:
                         continue
 
@@ -150,17 +223,27 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
                     except queue.Empty:
                         continue
 
+                    if resObj.abandoned:
+                        continue
+
                     reqId = real_ioproc._getRequestId()
                     pendingRequests[reqId] = resObj
+                    resObj.reqId = reqId
+                    resObj.sending = time.monotonic()
                     reqString = real_ioproc._requestToBytes(cmd, reqId)
-                    dataSender = DataSender(writePipe, reqString)
-                    poller.modify(writePipe, OUTPUT_READY_FLAGS)
+                    dataSender = DataSender(channel, reqString)
+                    if dataSender.process():
+                        dataSender = None
+                        real_ioproc._pingPoller()
+                    else:
+                        poller.modify(channel.writeFd,
+                                      channel.writeReadyFlags)
                     continue
 
-                if fd == writePipe:
-                    if dataSender.process():
+                if fd == channel.writeFd:
+                    if dataSender and dataSender.process():
                         dataSender = None
-                        poller.modify(writePipe, ERROR_FLAGS)
+                        poller.modify(channel.writeFd, ERROR_FLAGS)
                         real_ioproc._pingPoller()
     except PollError as e:
         # Normal during shutdown - don't log an error.
@@ -171,27 +254,16 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
         _log.exception("(%s) Communication thread failed", ioproc_name)
         _cleanup(pendingRequests)
     finally:
+        channel.close()
         os.close(readPipe)
         os.close(writePipe)
         if (evtReciever >= 0):
             os.close(evtReciever)
 
-        rc = proc.poll()
-
-        if rc is None:
-            _log.info("(%s) Killing ioprocess", ioproc_name)
-            if IOProcess._DEBUG_VALGRIND:
-                os.kill(proc.pid, signal.SIGTERM)
-            else:
-                proc.kill()
-            rc = proc.wait()
-
-        if rc < 0:
-            _log.info("(%s) ioprocess was terminated by signal %s",
-                      ioproc_name, -rc)
+        if proc:
+            _terminate(proc, ioproc_name)
         else:
-            _log.info("(%s) ioprocess terminated with code %s",
-                      ioproc_name, rc)
+            _log.info("(%s) Disconnected from ioprocess", ioproc_name)
 
         real_ioproc = ioproc_ref()
         if real_ioproc is not None:
@@ -200,11 +272,194 @@ def _communicate(ioproc_ref, proc, readPipe, writePipe):
                     real_ioproc._run()
 
 
+def _terminate(proc, ioproc_name):
+    rc = proc.poll()
+
+    if rc is None:
+        _log.info("(%s) Killing ioprocess", ioproc_name)
+        if IOProcess._DEBUG_VALGRIND:
+            os.kill(proc.pid, signal.SIGTERM)
+        else:
+            proc.kill()
+        rc = proc.wait()
+
+    if rc < 0:
+        _log.info("(%s) ioprocess was terminated by signal %s",
+                  ioproc_name, -rc)
+    else:
+        _log.info("(%s) ioprocess terminated with code %s",
+                  ioproc_name, rc)
+
+
 def _cleanup(pending):
     for request in pending.values():
-        request.result = {"errcode": ERR_IOPROCESS_CRASH,
-                          "errstr": "ioprocess crashed unexpectedly"}
-        request.event.set()
+        request.complete({"errcode": ERR_IOPROCESS_CRASH,
+                          "errstr": "ioprocess crashed unexpectedly"})
+
+
+def _binaryEncodeValue(value, out):
+    if value is None:
+        out.append(_BinTag.pack(_BT_NULL))
+    elif isinstance(value, bool):
+        out.append(_BinTag.pack(_BT_BOOLEAN))
+        out.append(_BinTag.pack(1 if value else 0))
+    elif isinstance(value, int):
+        out.append(_BinTag.pack(_BT_LONG))
+        out.append(_BinLong.pack(value))
+    elif isinstance(value, float):
+        out.append(_BinTag.pack(_BT_DOUBLE))
+        out.append(_BinDouble.pack(value))
+    elif isinstance(value, str):
+        data = value.encode('utf8')
+        out.append(_BinTag.pack(_BT_STRING))
+        out.append(_BinLen.pack(len(data)))
+        out.append(data)
+    elif isinstance(value, (bytes, bytearray, memoryview)):
+        out.append(_BinTag.pack(_BT_BINARY))
+        out.append(_BinLen.pack(len(value)))
+        out.append(bytes(value))
+    elif isinstance(value, dict):
+        out.append(_BinTag.pack(_BT_MAP))
+        out.append(_BinLen.pack(len(value)))
+        for key, item in value.items():
+            key = key.encode('utf8')
+            out.append(_BinLen.pack(len(key)))
+            out.append(key)
+            _binaryEncodeValue(item, out)
+    elif isinstance(value, (list, tuple)):
+        out.append(_BinTag.pack(_BT_ARRAY))
+        out.append(_BinLen.pack(len(value)))
+        for item in value:
+            _binaryEncodeValue(item, out)
+    else:
+        raise TypeError("Cannot encode %r" % (value,))
+
+
+def binaryEncode(value):
+    """
+    Encode value using the ioprocess binary wire format.
+    """
+    out = []
+    _binaryEncodeValue(value, out)
+    return b''.join(out)
+
+
+def _binaryDecodeBytes(buf, pos):
+    length, = _BinLen.unpack_from(buf, pos)
+    pos += _BinLen.size
+    if pos + length > len(buf):
+        raise ValueError("Truncated value of %d bytes at offset %d" %
+                         (length, pos))
+    return bytes(buf[pos:pos + length]), pos + length
+
+
+def _binaryDecodeValue(buf, pos):
+    tag, = _BinTag.unpack_from(buf, pos)
+    pos += _BinTag.size
+
+    if tag == _BT_NULL:
+        return None, pos
+
+    if tag == _BT_BOOLEAN:
+        value, = _BinTag.unpack_from(buf, pos)
+        return bool(value), pos + _BinTag.size
+
+    if tag == _BT_LONG:
+        value, = _BinLong.unpack_from(buf, pos)
+        return value, pos + _BinLong.size
+
+    if tag == _BT_DOUBLE:
+        value, = _BinDouble.unpack_from(buf, pos)
+        return value, pos + _BinDouble.size
+
+    if tag == _BT_STRING:
+        value, pos = _binaryDecodeBytes(buf, pos)
+        return value.decode('utf8'), pos
+
+    if tag == _BT_BINARY:
+        return _binaryDecodeBytes(buf, pos)
+
+    if tag == _BT_MAP:
+        count, = _BinLen.unpack_from(buf, pos)
+        pos += _BinLen.size
+        value = {}
+        for i in range(count):
+            key, pos = _binaryDecodeBytes(buf, pos)
+            value[key.decode('utf8')], pos = _binaryDecodeValue(buf, pos)
+        return value, pos
+
+    if tag == _BT_ARRAY:
+        count, = _BinLen.unpack_from(buf, pos)
+        pos += _BinLen.size
+        value = []
+        for i in range(count):
+            item, pos = _binaryDecodeValue(buf, pos)
+            value.append(item)
+        return value, pos
+
+    raise ValueError("Unknown binary type tag %d at offset %d" %
+                     (tag, pos - _BinTag.size))
+
+
+def binaryDecode(data):
+    """
+    Decode a value encoded with the ioprocess binary wire format.
+    """
+    buf = memoryview(data)
+    value, pos = _binaryDecodeValue(buf, 0)
+    if pos != len(buf):
+        raise ValueError("Trailing data at offset %d" % pos)
+    return value
+
+
+def _jsonEncode(value):
+    return json.dumps(value).encode('utf8')
+
+
+def _jsonDecode(data):
+    return json.loads(data.decode('utf8'))
+
+
+_WIRE_FORMATS = {
+    WIRE_FORMAT_JSON: (_jsonEncode, _jsonDecode),
+    WIRE_FORMAT_BINARY: (binaryEncode, binaryDecode),
+}
+
+
+def _batchResult(item):
+    errcode = item.get('errcode', 0)
+    if errcode != 0:
+        return OSError(errcode, item.get('errstr', os.strerror(errcode)))
+
+    return item.get('result', None)
+
+
+def _timing(res):
+    timing = {stage: usec / 1000000.0
+              for stage, usec in res.result['timing'].items()}
+    timing['queued'] = res.queued
+    timing['sending'] = res.sending
+    timing['replied'] = res.replied
+    return timing
+
+
+def percentile(histogram, pct):
+    """
+    Return an upper bound in seconds of the pct percentile (0-100] of a
+    histogram reported by IOProcess.stats(), or None if it is empty.
+
+    Bucket 0 counts durations under 2 microseconds and bucket i those under
+    2 ** (i + 1) microseconds, so the bound is at most twice the real value.
+    """
+    buckets = histogram["buckets"]
+    rank = sum(buckets) * pct / 100.0
+    seen = 0
+    for i, count in enumerate(buckets):
+        seen += count
+        if count and seen >= rank:
+            return (2 ** (i + 1)) / 1000000.0
+
+    return None
 
 
 def dict2namedtuple(d, ntType):
@@ -250,59 +505,269 @@ def setNonBlocking(fd):
 
 
 class CmdResult(object):
-    def __init__(self):
+    def __init__(self, chunks=None):
         self.event = Event()
         self.result = None
+        # Queue receiving the chunks of a streamed response, None marks the
+        # end of the stream.
+        self.chunks = chunks
+        # Set by the communication thread once the request is sent.
+        self.reqId = None
+        # Set when the caller stops waiting for a streamed response.
+        self.abandoned = False
+        # Monotonic times, reported with the timing of the request.
+        self.queued = time.monotonic()
+        self.sending = None
+        self.replied = None
+
+    def complete(self, result):
+        self.replied = time.monotonic()
+        self.result = result
+        self.event.set()
+        if self.chunks is not None:
+            self.chunks.put(None)
+
+
+class _PipeChannel(object):
+    """
+    Requests and responses go through the pipes.
+    """
+    writeReadyFlags = OUTPUT_READY_FLAGS
+
+    def __init__(self, readPipe, writePipe):
+        self.readFd = readPipe
+        self.writeFd = writePipe
+
+    def read(self):
+        try:
+            return os.read(self.readFd, _READ_SIZE)
+        except OSError as e:
+            if e.errno in (errno.EAGAIN, errno.EINTR):
+                return b''
+            raise
+
+    def write(self, data):
+        try:
+            return os.write(self.writeFd, data)
+        except OSError as e:
+            if e.errno in (errno.EAGAIN, errno.EINTR):
+                return 0
+            raise
+
+    def close(self):
+        # The pipes are closed by the communication thread.
+        pass
+
+
+class _ShmRing(object):
+    """
+    One direction of the shared memory transport, see src/shm-ring.c.
+
+    The producer adds the number of bytes written to dataFd, and the consumer
+    adds the number of bytes read to spaceFd, so each side knows how much it
+    may read or overwrite without sharing any other state.
+    """
+
+    def __init__(self, buf, dataFd, spaceFd, producer):
+        self._buf = buf
+        self._size = len(buf)
+        self._dataFd = dataFd
+        self._spaceFd = spaceFd
+        self._pos = 0
+        self._available = self._size if producer else 0
+
+    def _collect(self, fd):
+        try:
+            self._available += os.eventfd_read(fd)
+        except BlockingIOError:
+            pass
+
+    def write(self, data):
+        self._collect(self._spaceFd)
+        n = min(len(data), self._available)
+        if n == 0:
+            return 0
+
+        offset = self._pos % self._size
+        first = min(n, self._size - offset)
+        self._buf[offset:offset + first] = data[:first]
+        self._buf[:n - first] = data[first:n]
+
+        self._pos += n
+        self._available -= n
+        os.eventfd_write(self._dataFd, n)
+        return n
+
+    def read(self):
+        self._collect(self._dataFd)
+        n = self._available
+        if n == 0:
+            return b''
+
+        offset = self._pos % self._size
+        first = min(n, self._size - offset)
+        data = self._buf[offset:offset + first].tobytes()
+        if first < n:
+            data += self._buf[:n - first].tobytes()
+
+        self._pos += n
+        self._available = 0
+        os.eventfd_write(self._spaceFd, n)
+        return data
+
+    def release(self):
+        self._buf.release()
+
+
+class _ShmChannel(object):
+    """
+    Requests and responses go through two rings in a memfd shared with
+    ioprocess, with eventfds as doorbells.
+
+    The response doorbell is polled for reading; when the request ring is
+    full, the request space doorbell is polled until ioprocess makes room.
+    """
+    writeReadyFlags = INPUT_READY_FLAGS
+
+    def __init__(self, ringSize):
+        self._memfd = os.memfd_create("ioprocess-shm", os.MFD_CLOEXEC)
+        os.ftruncate(self._memfd, ringSize * 2)
+        self._mmap = mmap.mmap(self._memfd, ringSize * 2)
+
+        flags = os.EFD_CLOEXEC | os.EFD_NONBLOCK
+        self._eventFds = [os.eventfd(0, flags) for i in range(4)]
+        requestFd, requestSpaceFd, responseFd, responseSpaceFd = \
+            self._eventFds
+
+        view = memoryview(self._mmap)
+        self._requestRing = _ShmRing(
+            view[:ringSize], requestFd, requestSpaceFd, producer=True)
+        self._responseRing = _ShmRing(
+            view[ringSize:], responseFd, responseSpaceFd, producer=False)
+        view.release()
+
+        self.readFd = responseFd
+        self.writeFd = requestSpaceFd
+
+    def ioprocessFds(self):
+        return (self._memfd,) + tuple(self._eventFds)
+
+    def ioprocessArgs(self):
+        requestFd, requestSpaceFd, responseFd, responseSpaceFd = \
+            self._eventFds
+        return ["--shm-fd", str(self._memfd),
+                "--shm-request-fd", str(requestFd),
+                "--shm-request-space-fd", str(requestSpaceFd),
+                "--shm-response-fd", str(responseFd),
+                "--shm-response-space-fd", str(responseSpaceFd)]
+
+    def started(self):
+        # ioprocess has its own copy now.
+        os.close(self._memfd)
+        self._memfd = -1
+
+    def read(self):
+        return self._responseRing.read()
+
+    def write(self, data):
+        return self._requestRing.write(data)
+
+    def close(self):
+        if self._memfd >= 0:
+            os.close(self._memfd)
+            self._memfd = -1
+
+        self._requestRing.release()
+        self._responseRing.release()
+        self._mmap.close()
+        for fd in self._eventFds:
+            os.close(fd)
+        self._eventFds = []
 
 
 class DataSender(object):
-    def __init__(self, fd, data):
-        self._fd = fd
-        self._dataPending = data
+    def __init__(self, channel, data):
+        self._channel = channel
+        # Slicing a memoryview does not copy the pending data.
+        self._dataPending = memoryview(data)
 
     def process(self):
-        if not self._dataPending:
-            return True
+        """
+        Returns True when all the data was sent.
+        """
+        if self._dataPending:
+            n = self._channel.write(self._dataPending)
+            self._dataPending = self._dataPending[n:]
 
-        n = os.write(self._fd, self._dataPending)
-        self._dataPending = self._dataPending[n:]
-        return False
+        return not self._dataPending
 
 
 class ResponseReader(object):
-    def __init__(self, fd):
-        self._fd = fd
+    def __init__(self, channel, decode=_jsonDecode):
+        self._channel = channel
+        self._decode = decode
         self._responses = []
-        self._dataRemaining = 0
-        self._dataBuffer = b''
+        self._dataBuffer = bytearray()
+        # Response waiting for its attachment
+        self._pendingResponse = None
+        self._attachmentSize = 0
         self.timeout = 10
 
     def process(self):
-        if self._dataRemaining == 0:
-            self._dataRemaining = Size.unpack(os.read(self._fd, Size.size))[0]
+        """
+        Reads what the channel has, returns True if complete responses are
+        ready.
+        """
+        self._dataBuffer += self._channel.read()
+        self._parse()
+        return bool(self._responses)
+
+    def _parse(self):
+        buf = self._dataBuffer
+        pos = 0
 
         while True:
-            try:
-                buff = os.read(self._fd, self._dataRemaining)
+            if self._pendingResponse is not None:
+                # Raw bytes following the envelope are the result.
+                end = pos + self._attachmentSize
+                if len(buf) < end:
+                    break
+
+                resObj = self._pendingResponse
+                self._pendingResponse = None
+                resObj['result'] = bytes(buf[pos:end])
+                self._responses.append(resObj)
+                pos = end
+                continue
+
+            if len(buf) - pos < Size.size:
                 break
-            except OSError as e:
-                if e.errno in (errno.EAGAIN, errno.EINTR):
-                    continue
 
-                raise
+            size = Size.unpack_from(buf, pos)[0]
+            end = pos + Size.size + size
+            if len(buf) < end:
+                break
+
+            resObj = self._decode(bytes(buf[pos + Size.size:end]))
+            pos = end
+
+            attachmentSize = resObj.pop('attachmentSize', None)
+            if attachmentSize:
+                self._pendingResponse = resObj
+                self._attachmentSize = attachmentSize
+                continue
+            elif attachmentSize is not None:
+                resObj['result'] = b''
 
-        self._dataRemaining -= len(buff)
-        self._dataBuffer += buff
-        if self._dataRemaining == 0:
-            resObj = json.loads(self._dataBuffer.decode('utf8'))
             self._responses.append(resObj)
-            self._dataBuffer = b''
-            return True
 
-        return False
+        if pos:
+            del buf[:pos]
 
-    def pop(self):
-        return self._responses.pop()
+    def popAll(self):
+        responses = self._responses
+        self._responses = []
+        return responses
 
 
 class IOProcess(object):
@@ -313,13 +778,118 @@ class IOProcess(object):
     _counter = itertools.count()
 
     def __init__(self, max_threads=0, timeout=60, max_queued_requests=-1,
-                 name=None, wait_until_ready=2):
+                 name=None, wait_until_ready=2,
+                 wire_format=WIRE_FORMAT_JSON, max_write_bytes=None,
+                 max_write_iovecs=None, transport=TRANSPORT_PIPE,
+                 shm_ring_size=DEFAULT_SHM_RING_SIZE, listen=None,
+                 connect=None, priority=PRIORITY_NORMAL,
+                 reserved_threads=0, max_threads_per_mount=0,
+                 max_mount_threads=None, stuck_timeout=0, max_extra_threads=0,
+                 io_backend=IO_BACKEND_THREADS, on_timing=None,
+                 upload_timeout=None):
+        """
+        Start an ioprocess, or connect to a running one.
+
+        If listen is a path, the ioprocess also serves clients connecting
+        to a unix socket at this path. All its clients share one thread
+        pool, and the ioprocess exits when this client is closed. The
+        socket is only accessible to the user running the ioprocess, and
+        a socket left by an ioprocess that was killed is replaced. When
+        this client is closed, the socket clients are disconnected once
+        the requests they already sent are answered.
+
+        If connect is a path, connect to the socket of an ioprocess
+        started with listen instead of starting one. The process options
+        are ignored and wire_format must match the one used by the
+        ioprocess.
+
+        Requests are sent with the given priority class. The ioprocess
+        keeps reserved_threads threads, in addition to max_threads, for
+        PRIORITY_HIGH requests, so health checks and monitoring requests
+        are served while the other threads are busy. PRIORITY_HIGH requests
+        use them only when all the other threads are busy, and have their
+        own queue of max_queued_requests requests. ping() always uses
+        PRIORITY_HIGH.
+
+        If max_threads_per_mount is set, requests for a path run on a
+        separate pool of this many threads for each mount, so requests to
+        a hung mount do not block requests to other mounts. Paths are
+        matched to mounts after resolving the symlinks found in the kernel
+        caches. The mount pools have at most max_mount_threads threads in
+        total, 64 by default or unlimited with 0, requests for other mounts
+        run on the main pool. The pool of an unmounted mount is freed once
+        its requests are done.
+
+        If stuck_timeout is set, requests running longer than this many
+        seconds are logged and reported by stuckRequests(), and up to
+        max_extra_threads threads are added to replace their threads until
+        they finish.
+
+        Chunked uploads, as used by writefile_stream(), that were not
+        written, committed or aborted for upload_timeout seconds are closed
+        by ioprocess, 600 by default or never with 0.
+
+        With io_backend=IO_BACKEND_URING, stat, lstat, unlink, rmdir, mkdir,
+        rename, link, symlink, fsyncPath, readfile and writefile run
+        asynchronously with io_uring instead of on the threads, if ioprocess
+        was built with liburing and the kernel supports it. They still count
+        in max_queued_requests and are watched by stuck_timeout.
+        stats()["ioBackend"] reports the backend in use.
+
+        If on_timing is set, requests ask ioprocess for their timing, and
+        on_timing(methodName, timing) is called by the caller of each
+        request once its response is received. timing maps the stages the
+        request went through to their time in seconds, on the clock of
+        time.monotonic(): "queued" and "sending" by the client, "received"
+        when ioprocess read its first byte, "parsed", "scheduled" on a
+        thread pool, "dequeued" by a worker, "started" and "finished"
+        running, "encoding" its response in ioprocess, and "replied" when
+        the client got the response. Stages a request did not go through
+        are left out.
+        """
+        if io_backend not in (IO_BACKEND_THREADS, IO_BACKEND_URING):
+            raise ValueError("Unsupported io backend %r" % io_backend)
+
+        if wire_format not in _WIRE_FORMATS:
+            raise ValueError("Unsupported wire format %r" % wire_format)
+
+        if connect is not None and (listen is not None or
+                                    transport != TRANSPORT_PIPE):
+            raise ValueError("connect can't be used with listen or "
+                             "transport %r" % transport)
+
+        if transport == TRANSPORT_SHM:
+            if not hasattr(os, "eventfd"):
+                raise ValueError("Transport %r requires python 3.10"
+                                 % transport)
+        elif transport != TRANSPORT_PIPE:
+            raise ValueError("Unsupported transport %r" % transport)
+
         self.timeout = timeout
         self._max_threads = max_threads
         self._max_queued_requests = max_queued_requests
+        self._wire_format = wire_format
+        self._max_write_bytes = max_write_bytes
+        self._max_write_iovecs = max_write_iovecs
+        self._transport = transport
+        self._shm_ring_size = shm_ring_size
+        self._listen = listen
+        self._connect = connect
+        self._priority = priority
+        self._reserved_threads = reserved_threads
+        self._max_threads_per_mount = max_threads_per_mount
+        self._max_mount_threads = max_mount_threads
+        self._stuck_timeout = stuck_timeout
+        self._max_extra_threads = max_extra_threads
+        self._upload_timeout = upload_timeout
+        self._io_backend = io_backend
+        self._on_timing = on_timing
+        self._encode, self._decode = _WIRE_FORMATS[wire_format]
         self._name = name or "ioprocess-%d" % next(self._counter)
         self._wait_until_ready = wait_until_ready
         self._commandQueue = queue.Queue()
+        # Streamed responses the caller stopped waiting for.
+        self._abandonQueue = queue.Queue()
         self._eventFdReciever, self._eventFdSender = os.pipe()
         self._reqId = 0
         self._isRunning = True
@@ -340,6 +910,10 @@ class IOProcess(object):
         return self._pid
 
     def _run(self):
+        if self._connect is not None:
+            self._runConnected()
+            return
+
         _log.debug("(%s) Starting ioprocess", self.name)
         myRead, hisWrite = os.pipe()
         hisRead, myWrite = os.pipe()
@@ -359,6 +933,45 @@ class IOProcess(object):
                "--max-queued-requests", str(self._max_queued_requests),
                ]
 
+        if self._wire_format != WIRE_FORMAT_JSON:
+            cmd.extend(("--wire-format", self._wire_format))
+
+        if self._max_write_bytes is not None:
+            cmd.extend(("--max-write-bytes", str(self._max_write_bytes)))
+
+        if self._max_write_iovecs is not None:
+            cmd.extend(("--max-write-iovecs", str(self._max_write_iovecs)))
+
+        if self._listen is not None:
+            cmd.extend(("--socket", self._listen))
+
+        if self._reserved_threads:
+            cmd.extend(("--reserved-threads", str(self._reserved_threads)))
+
+        if self._max_threads_per_mount:
+            cmd.extend(("--max-threads-per-mount",
+                        str(self._max_threads_per_mount)))
+
+        if self._max_mount_threads is not None:
+            cmd.extend(("--max-mount-threads", str(self._max_mount_threads)))
+
+        if self._stuck_timeout:
+            cmd.extend(("--stuck-timeout", str(self._stuck_timeout),
+                        "--max-extra-threads", str(self._max_extra_threads)))
+
+        if self._io_backend != IO_BACKEND_THREADS:
+            cmd.extend(("--io-backend", self._io_backend))
+
+        if self._upload_timeout is not None:
+            cmd.extend(("--upload-timeout", str(self._upload_timeout)))
+
+        passFds = (hisRead, hisWrite)
+        shmChannel = None
+        if self._transport == TRANSPORT_SHM:
+            shmChannel = _ShmChannel(self._shm_ring_size)
+            cmd.extend(shmChannel.ioprocessArgs())
+            passFds += shmChannel.ioprocessFds()
+
         if self._TRACE_DEBUGGING:
             cmd.append("--trace-enabled")
 
@@ -369,7 +982,7 @@ class IOProcess(object):
 
         p = subprocess.Popen(
             cmd,
-            pass_fds=(hisRead, hisWrite),
+            pass_fds=passFds,
             stderr=subprocess.PIPE
         )
 
@@ -381,7 +994,33 @@ class IOProcess(object):
         setNonBlocking(myRead)
         setNonBlocking(myWrite)
 
-        self._startCommunication(p, myRead, myWrite)
+        if shmChannel:
+            shmChannel.started()
+            channel = shmChannel
+        else:
+            channel = _PipeChannel(myRead, myWrite)
+
+        self._startCommunication(p, myRead, myWrite, channel)
+
+    def _runConnected(self):
+        _log.debug("(%s) Connecting to %s", self.name, self._connect)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self._connect)
+        except:
+            sock.close()
+            raise
+
+        # The communication thread closes both fds.
+        readFd = sock.detach()
+        writeFd = os.dup(readFd)
+
+        setNonBlocking(readFd)
+        setNonBlocking(writeFd)
+
+        self._pid = None
+        self._startCommunication(None, readFd, writeFd,
+                                 _PipeChannel(readFd, writeFd))
 
     def _pingPoller(self):
         try:
@@ -393,15 +1032,15 @@ class IOProcess(object):
                 raise Closed("Client %s was closed" % self.name)
             raise
 
-    def _startCommunication(self, proc, readPipe, writePipe):
+    def _startCommunication(self, proc, readPipe, writePipe, channel):
         _log.debug("(%s) Starting communication thread", self.name)
         self._started.clear()
 
-        args = (ref(self), proc, readPipe, writePipe)
+        args = (ref(self), proc, readPipe, writePipe, channel)
         self._commthread = start_thread(
             _communicate,
             args,
-            name="ioprocess/%d" % (proc.pid,),
+            name="ioprocess/%d" % (proc.pid if proc else readPipe,),
         )
 
         if self._started.wait(self._wait_until_ready):
@@ -415,17 +1054,33 @@ class IOProcess(object):
         return self._reqId
 
     def _requestToBytes(self, cmd, reqId):
-        methodName, args = cmd
+        methodName, args, attachment, timeout, priority = cmd
         reqDict = {'id': reqId,
                    'methodName': methodName,
                    'args': args}
 
-        reqStr = json.dumps(reqDict)
+        if priority != PRIORITY_NORMAL:
+            reqDict['priority'] = priority
+
+        if timeout is not None:
+            # ioprocess drops the request if it is still queued when the
+            # timeout expires.
+            reqDict['timeout'] = timeout
+
+        if attachment is not None:
+            # Sent as raw bytes following the envelope.
+            reqDict['attachmentSize'] = len(attachment)
 
-        res = Size.pack(len(reqStr))
-        res += reqStr.encode('utf8')
+        if self._on_timing is not None:
+            reqDict['timing'] = True
 
-        return res
+        reqData = self._encode(reqDict)
+
+        res = [Size.pack(len(reqData)), reqData]
+        if attachment is not None:
+            res.append(attachment)
+
+        return b''.join(res)
 
     def _processLogs(self, data):
         if self._partialLogs:
@@ -455,14 +1110,59 @@ class IOProcess(object):
             elif level == "INFO":
                 self._sublog.info("(%s) %s", self.name, message)
 
-    def _sendCommand(self, cmdName, args, timeout=None):
+    def _sendStreamCommand(self, cmdName, args, timeout=None):
+        # Room for the window and the end of the stream.
+        res = CmdResult(chunks=queue.Queue(maxsize=_STREAM_WINDOW + 1))
+        args = dict(args, window=_STREAM_WINDOW)
+        self._commandQueue.put(
+            ((cmdName, args, None, timeout, self._priority), res))
+        self._pingPoller()
+        return self._iterChunks(res, timeout)
+
+    def _iterChunks(self, res, timeout):
+        try:
+            while True:
+                try:
+                    chunk = res.chunks.get(timeout=timeout)
+                except queue.Empty:
+                    raise Timeout(os.strerror(errno.ETIMEDOUT))
+
+                if chunk is None:
+                    break
+
+                # Lets ioprocess send the next chunk.
+                self._commandQueue.put(
+                    (("stream_ack", {"id": res.reqId}, None, None,
+                      PRIORITY_NORMAL), CmdResult()))
+                self._pingPoller()
+                yield chunk
+        except BaseException:
+            # Timed out, or the caller stopped iterating.
+            self._abandon(res)
+            raise
+
+        if res.result.get('errcode', 0) != 0:
+            errcode = res.result['errcode']
+            errstr = res.result.get('errstr', os.strerror(errcode))
+
+            raise OSError(errcode, errstr)
+
+    def _sendCommand(self, cmdName, args, timeout=None, attachment=None,
+                     priority=None):
+        if priority is None:
+            priority = self._priority
         res = CmdResult()
-        self._commandQueue.put(((cmdName, args), res))
+        self._commandQueue.put(
+            ((cmdName, args, attachment, timeout, priority), res))
         self._pingPoller()
         res.event.wait(timeout)
         if not res.event.isSet():
+            self._cancel(res)
             raise Timeout(os.strerror(errno.ETIMEDOUT))
 
+        if self._on_timing is not None and 'timing' in res.result:
+            self._on_timing(cmdName, _timing(res))
+
         if res.result.get('errcode', 0) != 0:
             errcode = res.result['errcode']
             errstr = res.result.get('errstr', os.strerror(errcode))
@@ -471,8 +1171,34 @@ class IOProcess(object):
 
         return res.result.get('result', None)
 
+    def _cancel(self, res):
+        """
+        Ask ioprocess to drop a request that timed out, if it is still
+        queued. The request is answered with ETIMEDOUT, or ECANCELED if it
+        had no timeout, removing it from the pending requests. If it was
+        not sent yet, ioprocess drops it when its timeout expires.
+        """
+        if res.reqId is None:
+            return
+
+        self._commandQueue.put(
+            (("cancel", {"id": res.reqId}, None, None, PRIORITY_NORMAL),
+             CmdResult()))
+        self._pingPoller()
+
+    def _abandon(self, res):
+        """
+        Stop waiting for a streamed response: cancel it in ioprocess and
+        drop the frames still arriving for it.
+        """
+        res.abandoned = True
+        self._abandonQueue.put(res)
+        self._cancel(res)
+        self._pingPoller()
+
     def ping(self):
-        return self._sendCommand("ping", {}, self.timeout)
+        return self._sendCommand("ping", {}, self.timeout,
+                                 priority=PRIORITY_HIGH)
 
     def echo(self, text, sleep=0):
         return self._sendCommand("echo",
@@ -560,25 +1286,155 @@ class IOProcess(object):
                                  {"path": path, "mode": mode}, self.timeout)
 
     def readfile(self, path, direct=False):
-        b64result = self._sendCommand("readfile",
-                                      {"path": path,
-                                       "direct": direct}, self.timeout)
-
-        return b64decode(b64result)
+        # The file contents are sent as a raw attachment, spliced into the
+        # response when possible. ioprocess reads the whole file into
+        # memory first, use readfile_stream() to bound its memory use.
+        return self._sendCommand("readfile",
+                                 {"path": path,
+                                  "direct": direct,
+                                  "binary": True,
+                                  "splice": True}, self.timeout)
 
     def writefile(self, path, data, direct=False):
         self._sendCommand("writefile",
                           {"path": path,
-                           "data": b64encode(data).decode('utf8'),
                            "direct": direct},
+                          self.timeout,
+                          attachment=data)
+
+    def writefile_stream(self, path, chunks, direct=False, fsync=True):
+        """
+        Write a file from an iterable of bytes chunks.
+
+        Every chunk is sent in its own request and written by ioprocess as
+        it arrives, so memory usage on both sides depends on the chunk size
+        and not on the file size. The next chunk is taken from chunks only
+        after the previous one was written.
+
+        With direct=True all chunks but the last must be a multiple of 4096
+        bytes.
+
+        If fsync is True, the file is synced before returning. If writing
+        fails, the file is left with the chunks written so far.
+        """
+        res = self._sendCommand("writefile_open",
+                                {"path": path, "direct": direct},
+                                self.timeout)
+        handle = res["handle"]
+        try:
+            offset = 0
+            for chunk in chunks:
+                if not chunk:
+                    continue
+                self._sendCommand("writefile_chunk",
+                                  {"handle": handle, "offset": offset},
+                                  self.timeout,
+                                  attachment=chunk)
+                offset += len(chunk)
+        except:
+            self._sendCommand("writefile_abort", {"handle": handle},
+                              self.timeout)
+            raise
+
+        self._sendCommand("writefile_commit",
+                          {"handle": handle, "fsync": fsync},
                           self.timeout)
 
+    def readfile_stream(self, path, direct=False, chunk_size=None):
+        """
+        Read a file as a sequence of chunks.
+
+        ioprocess sends the file in chunks of chunk_size bytes (1 MiB by
+        default, rounded up to the filesystem block size) and reads the next
+        chunk only after sending the previous one, so its memory usage does
+        not depend on the file size.
+
+        The request is sent immediately. At most 2 chunks are buffered in
+        this process, ioprocess sends more chunks only as they are consumed.
+        Closing the iterator early, or a timeout waiting for a chunk,
+        cancels the stream.
+
+        Return:
+            An iterator of bytes chunks.
+
+        Raises:
+            OSError when iterating, if reading the file failed. Chunks
+            already returned are valid.
+        """
+        args = {"path": path, "direct": direct}
+        if chunk_size is not None:
+            args["chunkSize"] = chunk_size
+
+        return self._sendStreamCommand("readfile_stream", args, self.timeout)
+
     def readlines(self, path, direct=False):
         return self.readfile(path, direct).splitlines()
 
     def memstat(self):
         return self._sendCommand("memstat", {}, self.timeout)
 
+    def stats(self):
+        """
+        Return ioprocess internal counters.
+
+        "reader" reports the number of reads done by the request reader,
+        the number of requests parsed and the bytes read into its buffer.
+
+        "writer" reports the number of writev calls done by the response
+        writer, including retried short writes, the number of responses
+        and bytes written, and the average number of responses sent per
+        write.
+
+        "dropped" reports the number of requests answered without running,
+        because their timeout expired or they were cancelled while queued.
+
+        "log" reports the number of log messages dropped because the log
+        writer could not keep up.
+
+        "methods" reports for each method called so far the number of
+        "calls", of "errors" and of errors by errno in "errnos", and the
+        "bytesIn" and "bytesOut" of its requests and responses. Histograms
+        of the "waitTime" in queue, "runTime" and response "encodeTime"
+        hold log2 "buckets" of microseconds and their "sum", see
+        percentile(). Batch items count as calls of their method, but the
+        bytes of a batch request and response are not attributed to any
+        method.
+
+        "mounts" reports the queued requests and running threads of each
+        mount pool, when using max_threads_per_mount.
+
+        "ioBackend" reports the backend running the requests.
+        """
+        return self._sendCommand("stats", {}, self.timeout)
+
+    def stuckRequests(self):
+        """
+        Return the requests running longer than stuck_timeout, as dicts
+        with the request "id", "methodName", "path", "age" in seconds, and
+        "compensated" if a thread was added to replace it. Sent with
+        PRIORITY_HIGH, so it can use the reserved threads.
+        """
+        return self._sendCommand("stuckRequests", {}, self.timeout,
+                                 priority=PRIORITY_HIGH)
+
+    def setLogLevel(self, level):
+        """
+        Change the most verbose level ioprocess logs, one of "DEBUG",
+        "INFO", "WARNING" or "ERROR". Messages above it are not formatted
+        nor sent.
+        """
+        return self._sendCommand("setLogLevel", {"level": level},
+                                 self.timeout, priority=PRIORITY_HIGH)
+
+    def methods(self):
+        """
+        Return the methods ioprocess serves, as dicts with the method
+        "name" and its attributes: "readOnly", "idempotent", "blocking" if
+        it may wait on storage, and "cost", one of "none", "metadata" or
+        "data".
+        """
+        return self._sendCommand("methods", {}, self.timeout)
+
     def glob(self, pattern):
         return self._sendCommand("glob", {"pattern": pattern}, self.timeout)
 
@@ -623,6 +1479,52 @@ class IOProcess(object):
         return self._sendCommand(
             "probe_block_size", {"dir": dir_path}, self.timeout)
 
+    def batch(self, requests):
+        """
+        Run several requests in a single round trip.
+
+        The requests are served in parallel by the ioprocess thread pool.
+
+        Arguments:
+            requests (list): (methodName, args) tuples.
+
+        Return:
+            A list with the raw result of each request, in request order. A
+            request that failed is returned as an OSError instance instead of
+            raising, so one failure does not hide the other results.
+        """
+        items = self._sendCommand(
+            "batch",
+            {"requests": [{"methodName": methodName, "args": args}
+                          for methodName, args in requests]},
+            self.timeout)
+
+        return [_batchResult(item) for item in items]
+
+    def compound(self, requests):
+        """
+        Run several requests in order on a single ioprocess worker, stopping
+        at the first failing request.
+
+        This is useful for sequences like writefile, fsyncPath, rename,
+        fsyncPath that should cost a single round trip.
+
+        Arguments:
+            requests (list): (methodName, args) tuples.
+
+        Return:
+            A list with the raw result of each request, in request order.
+
+        Raises:
+            OSError with the error of the first failing request. The message
+            is prefixed with the index of the failing request.
+        """
+        return self._sendCommand(
+            "compound",
+            {"requests": [{"methodName": methodName, "args": args}
+                          for methodName, args in requests]},
+            self.timeout)
+
     def close(self, sync=True):
         with self._lock:
             if not self._isRunning:
@@ -18,6 +18,7 @@
 # Refer to the README and COPYING files for full details of the license
 #
 
+import base64
 import errno
 import gc
 import io
@@ -28,6 +29,7 @@ import pprint
 import re
 import shutil
 import signal
+import socket
 import stat
 import sys
 import time
@@ -45,10 +47,21 @@ import pytest
 from ioprocess import (
     IOProcess,
     ERR_IOPROCESS_CRASH,
+    WIRE_FORMAT_JSON,
+    WIRE_FORMAT_BINARY,
+    TRANSPORT_SHM,
+    IO_BACKEND_THREADS,
+    IO_BACKEND_URING,
+    PRIORITY_LOW,
+    PRIORITY_NORMAL,
+    PRIORITY_HIGH,
     Closed,
     Timeout,
+    binaryDecode,
+    binaryEncode,
     config,
-    clear_cloexec
+    clear_cloexec,
+    percentile,
 )
 
 elapsed_time = lambda: os.times()[4]
@@ -70,6 +83,9 @@ logging.basicConfig(
 )
 
 
+requires_eventfd = pytest.mark.skipif(
+    not hasattr(os, "eventfd"), reason="Requires os.eventfd (python 3.10)")
+
 requires_unprivileged_user = pytest.mark.skipif(
     os.geteuid() == 0, reason="This test can not run as root")
 
@@ -602,6 +618,175 @@ def test_max_requests():
             t2.join()
 
 
+def block_worker(proc, seconds=2):
+    t = Thread(target=proc.echo, args=("hello", seconds))
+    t.start()
+    # Make sure the echo is running before sending more requests.
+    time.sleep(0.5)
+    return t
+
+
+def test_request_deadline_expired():
+    proc = IOProcess(timeout=10, max_threads=1)
+    with closing(proc):
+        t = block_worker(proc)
+        try:
+            # Cancelled when it times out, after its deadline passed.
+            with pytest.raises(Timeout):
+                proc._sendCommand("ping", {}, 0.5)
+        finally:
+            t.join()
+
+        # The worker drops the expired request instead of running it.
+        assert proc.ping() == "pong"
+        dropped = proc.stats()["dropped"]
+        assert dropped == {"expired": 1, "cancelled": 0}
+
+
+def test_cancel_queued_request():
+    proc = IOProcess(timeout=10, max_threads=1)
+    with closing(proc):
+        errors = []
+
+        def ping():
+            try:
+                # No timeout, waits until the request is answered.
+                proc._sendCommand("ping", {}, None)
+            except OSError as e:
+                errors.append(e.errno)
+
+        t = block_worker(proc)
+        try:
+            pinger = Thread(target=ping)
+            pinger.start()
+            # Make sure the ping is queued before cancelling it.
+            time.sleep(0.5)
+            assert proc._sendCommand("cancel", {"id": proc._reqId}, 10)
+        finally:
+            t.join()
+            pinger.join()
+
+        assert errors == [errno.ECANCELED]
+        dropped = proc.stats()["dropped"]
+        assert dropped == {"expired": 0, "cancelled": 1}
+
+
+def test_cancel_unknown_request():
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        assert proc._sendCommand("cancel", {"id": 12345}, 10) is False
+
+
+def test_priority_order():
+    proc = IOProcess(timeout=10, max_threads=1)
+    with closing(proc):
+        done = []
+
+        def echo(text, priority):
+            proc._sendCommand("echo", {"text": text, "sleep": 0}, 10,
+                              priority=priority)
+            done.append(text)
+
+        t = block_worker(proc)
+        try:
+            workers = []
+            for text, priority in [("low", PRIORITY_LOW),
+                                   ("normal", PRIORITY_NORMAL),
+                                   ("high", PRIORITY_HIGH)]:
+                w = Thread(target=echo, args=(text, priority))
+                w.start()
+                workers.append(w)
+                # Make sure the requests are queued in this order.
+                time.sleep(0.1)
+        finally:
+            t.join()
+            for w in workers:
+                w.join()
+
+        assert done == ["high", "normal", "low"]
+
+
+def test_reserved_threads():
+    proc = IOProcess(timeout=10, max_threads=1, reserved_threads=1)
+    with closing(proc):
+        t = block_worker(proc, seconds=3)
+        try:
+            # Served by the reserved thread while the worker is busy.
+            start = elapsed_time()
+            assert proc.ping() == "pong"
+            assert elapsed_time() - start < 1
+        finally:
+            t.join()
+
+
+def test_stuck_requests():
+    proc = IOProcess(timeout=10, max_threads=1, stuck_timeout=1,
+                     max_extra_threads=1)
+    with closing(proc):
+        assert proc.stuckRequests() == []
+        t = block_worker(proc, seconds=4)
+        try:
+            time.sleep(2)
+            stuck, = proc.stuckRequests()
+            assert stuck["methodName"] == "echo"
+            assert stuck["path"] is None
+            assert stuck["age"] >= 1
+            assert stuck["compensated"]
+
+            # Served by the extra thread while the worker is stuck.
+            start = elapsed_time()
+            assert proc.echo("hello") == "hello"
+            assert elapsed_time() - start < 1
+        finally:
+            t.join()
+
+        assert proc.stuckRequests() == []
+
+
+def mount_point(path):
+    path = os.path.realpath(path)
+    while not os.path.ismount(path):
+        path = os.path.dirname(path)
+    return path
+
+
+def test_mount_pools(tmpdir):
+    proc = IOProcess(timeout=10, max_threads=1, max_threads_per_mount=1)
+    with closing(proc):
+        path = os.path.realpath(str(tmpdir))
+        fifo = os.path.join(path, "fifo")
+        os.mkfifo(fifo)
+        # Occupies the only thread of the tmpdir mount pool, opening the
+        # fifo blocks until it is opened for writing.
+        t = Thread(target=proc._sendCommand,
+                   args=("readfile", {"path": fifo}, proc.timeout))
+        t.start()
+        time.sleep(0.5)
+        try:
+            # Requests without a path are not blocked by the busy mount.
+            start = elapsed_time()
+            assert proc.echo("hello") == "hello"
+            assert elapsed_time() - start < 1
+
+            mounts = proc.stats()["mounts"]
+            assert mounts[mount_point(path)]["threads"] == 1
+        finally:
+            with open(fifo, "wb"):
+                pass
+            t.join()
+
+
+def test_mount_pools_limit(tmpdir):
+    proc = IOProcess(timeout=10, max_threads=1, max_threads_per_mount=1,
+                     max_mount_threads=1)
+    with closing(proc):
+        path = os.path.realpath(str(tmpdir))
+        proc.stat(path)
+        # No pool is left for another mount, its requests use the main pool.
+        proc.stat("/proc")
+        assert list(proc.stats()["mounts"]) == [mount_point(path)]
+
+
 def test_fsyncpath_directory(tmpdir):
     proc = IOProcess(timeout=10, max_threads=1)
     with closing(proc):
@@ -705,6 +890,58 @@ def check_stat(mystat, pystat):
         assert getattr(mystat, f) == getattr(pystat, f)
 
 
+@pytest.mark.parametrize("io_backend", [IO_BACKEND_THREADS, IO_BACKEND_URING])
+def test_io_backend(tmpdir, io_backend):
+    proc = IOProcess(timeout=10, max_threads=5, io_backend=io_backend)
+    with closing(proc):
+        # Falls back to threads if io_uring is not available.
+        assert proc.stats()["ioBackend"] in (io_backend, IO_BACKEND_THREADS)
+
+        path = str(tmpdir.join("dir"))
+        proc.mkdir(path)
+        check_stat(proc.stat(path), os.stat(path))
+
+        link = str(tmpdir.join("link"))
+        proc.symlink(path, link)
+        check_stat(proc.lstat(link), os.lstat(link))
+
+        renamed = str(tmpdir.join("renamed"))
+        proc.rename(link, renamed)
+        assert os.path.islink(renamed)
+        proc.unlink(renamed)
+
+        proc.fsyncPath(path)
+        proc.rmdir(path)
+        assert not os.path.exists(path)
+
+        with pytest.raises(OSError) as e:
+            proc.stat(path)
+        assert e.value.errno == errno.ENOENT
+
+        with pytest.raises(OSError) as e:
+            proc.fsyncPath(path)
+        assert e.value.errno == errno.ENOENT
+
+
+@pytest.mark.parametrize("size", [0, 1, 4096, 1024**2 + 1])
+def test_uring_readfile_writefile(tmpdir, size):
+    data = bytes(bytearray(i % 251 for i in range(size)))
+    proc = IOProcess(timeout=10, max_threads=5, io_backend=IO_BACKEND_URING)
+    with closing(proc):
+        if proc.stats()["ioBackend"] == IO_BACKEND_THREADS:
+            pytest.skip("io_uring is not available")
+
+        path = str(tmpdir.join("file"))
+        proc.writefile(path, data)
+        with open(path, "rb") as f:
+            assert f.read() == data
+        assert proc.readfile(path) == data
+
+        with pytest.raises(OSError) as e:
+            proc.readfile(str(tmpdir.join("missing")))
+        assert e.value.errno == errno.ENOENT
+
+
 @pytest.mark.parametrize("size", [0, 1, 512, 4096, 1024**2 + 1])
 def test_writefile(tmpdir, size):
     data = b'x' * size
@@ -750,6 +987,57 @@ def test_writefile_direct_unaligned(tmpdir):
         assert e.value.errno == errno.EINVAL
 
 
+@pytest.mark.parametrize("direct", [
+    pytest.param(True, id="direct"),
+    pytest.param(False, id="buffered"),
+])
+@pytest.mark.parametrize("size", [0, 4096, 3 * 1024**2 + 4096])
+def test_writefile_stream(tmpdir, direct, size):
+    data = os.urandom(size)
+    chunk_size = 1024**2
+    chunks = (data[i:i + chunk_size] for i in range(0, size, chunk_size))
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        path = str(tmpdir.join("file"))
+        proc.writefile_stream(path, chunks, direct=direct)
+        with io.open(path, 'rb') as f:
+            written = f.read()
+        assert written == data
+
+
+def test_writefile_stream_error(tmpdir):
+    def chunks():
+        yield b'x' * 4096
+        raise RuntimeError("source failed")
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        path = str(tmpdir.join("file"))
+        with pytest.raises(RuntimeError):
+            proc.writefile_stream(path, chunks())
+
+        # The upload was aborted and its handle closed.
+        with pytest.raises(OSError) as e:
+            proc._sendCommand("writefile_commit", {"handle": 1},
+                              proc.timeout)
+        assert e.value.errno == errno.EBADF
+
+
+def test_writefile_stream_upload_timeout(tmpdir):
+    def chunks():
+        yield b'x' * 4096
+        # ioprocess closes the upload while waiting for this chunk.
+        time.sleep(3)
+        yield b'x' * 4096
+
+    proc = IOProcess(timeout=10, max_threads=5, upload_timeout=1)
+    with closing(proc):
+        path = str(tmpdir.join("file"))
+        with pytest.raises(OSError) as e:
+            proc.writefile_stream(path, chunks())
+        assert e.value.errno == errno.EBADF
+
+
 @pytest.mark.parametrize("size", [0, 1, 42, 512, 4096, 1024**2 + 1])
 def test_readfile(tmpdir, size):
     data = b'x' * size
@@ -777,6 +1065,100 @@ def test_readfile_direct(tmpdir, size):
         assert read == data
 
 
+@pytest.mark.parametrize("direct", [
+    pytest.param(True, id="direct"),
+    pytest.param(False, id="buffered"),
+])
+@pytest.mark.parametrize("size", [1, 4096, 8 * 1024**2 + 1])
+def test_readfile_spliced(tmpdir, direct, size):
+    data = os.urandom(size)
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+        os.fsync(f.fileno())
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        assert proc.readfile(path, direct=direct) == data
+        assert proc.stats()["writer"]["splicedBytes"] == size
+
+
+@pytest.mark.parametrize("direct", [
+    pytest.param(True, id="direct"),
+    pytest.param(False, id="buffered"),
+])
+@pytest.mark.parametrize("size", [0, 1, 4096, 3 * 1024**2 + 42])
+def test_readfile_stream(tmpdir, direct, size):
+    data = os.urandom(size)
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+        os.fsync(f.fileno())
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        chunks = list(proc.readfile_stream(path, direct=direct,
+                                           chunk_size=1024**2))
+        assert b"".join(chunks) == data
+        assert all(len(c) <= 1024**2 for c in chunks)
+
+
+def test_readfile_stream_interleaved(tmpdir):
+    data = os.urandom(1024**2)
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        chunks = []
+        for chunk in proc.readfile_stream(path, chunk_size=64 * 1024):
+            # Other requests are served while the stream is active.
+            assert proc.ping() == "pong"
+            chunks.append(chunk)
+
+        assert b"".join(chunks) == data
+
+
+def test_readfile_stream_abandoned(tmpdir):
+    data = os.urandom(1024**2)
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+
+    proc = IOProcess(timeout=10, max_threads=1)
+    with closing(proc):
+        chunks = proc.readfile_stream(path, chunk_size=64 * 1024)
+        assert next(chunks) == data[:64 * 1024]
+        # ioprocess waits for the client to consume the chunks, closing
+        # the iterator cancels the stream and frees the only thread.
+        chunks.close()
+        assert proc.echo("hello") == "hello"
+
+
+def test_readfile_stream_missing(tmpdir):
+    path = str(tmpdir.join("missing"))
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        with pytest.raises(OSError) as e:
+            list(proc.readfile_stream(path))
+        assert e.value.errno == errno.ENOENT
+
+
+def test_readfile_spliced_in_batch(tmpdir):
+    data = os.urandom(4096)
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+
+    proc = IOProcess(timeout=10, max_threads=5,
+                     wire_format=WIRE_FORMAT_BINARY)
+    with closing(proc):
+        args = {"path": path, "direct": False, "binary": True,
+                "splice": True}
+        assert proc.batch([("readfile", args)] * 2) == [data, data]
+
+
 @pytest.mark.parametrize("direct", [
     pytest.param(True, id="direct"),
     pytest.param(False, id="buffered"),
@@ -790,6 +1172,468 @@ def test_readfile_missing(tmpdir, direct):
         assert e.value.errno == errno.ENOENT
 
 
+def test_writefile_base64(tmpdir):
+    # Older clients send the file contents base64 encoded.
+    data = b'\0' * 42
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        path = str(tmpdir.join("file"))
+        proc._sendCommand("writefile",
+                          {"path": path,
+                           "data": base64.b64encode(data).decode('utf8'),
+                           "direct": False},
+                          proc.timeout)
+        with io.open(path, 'rb') as f:
+            assert f.read() == data
+
+
+def test_readfile_base64(tmpdir):
+    # Older clients expect the file contents base64 encoded.
+    data = b'\0' * 42
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        res = proc._sendCommand("readfile",
+                                {"path": path, "direct": False},
+                                proc.timeout)
+        assert base64.b64decode(res) == data
+
+
+def test_optional_arguments(tmpdir):
+    # Arguments with a default may be left out.
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        assert proc._sendCommand("echo", {"text": "hello"}, 10) == "hello"
+
+        dir = str(tmpdir.join("dir"))
+        proc._sendCommand("mkdir", {"path": dir}, 10)
+        assert os.path.isdir(dir)
+
+        file = str(tmpdir.join("file"))
+        proc._sendCommand("touch", {"path": file}, 10)
+        proc._sendCommand("truncate", {"path": file, "size": 42}, 10)
+        assert os.stat(file).st_size == 42
+
+        res = proc._sendCommand("readfile", {"path": file}, 10)
+        assert base64.b64decode(res) == b"\0" * 42
+
+
+@pytest.mark.parametrize("method,args", [
+    ("echo", {"text": 42}),
+    ("echo", {"text": "hello", "sleep": "1"}),
+    ("stat", {"path": None}),
+    ("mkdir", {"path": "/no/such/dir", "mode": "0755"}),
+])
+def test_argument_wrong_type(method, args):
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        with pytest.raises(OSError) as e:
+            proc._sendCommand(method, args, 10)
+        assert e.value.errno == errno.EINVAL
+
+
+def test_readfile_attachment_pipelined(tmpdir):
+    data = bytes(bytearray(range(256))) * 64
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(data)
+
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        results = []
+
+        def worker():
+            for i in range(20):
+                results.append(proc.readfile(path))
+
+        threads = [Thread(target=worker) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        assert len(results) == 80
+        assert all(r == data for r in results)
+
+
+def test_batch(tmpdir):
+    path = str(tmpdir.join("file"))
+    with io.open(path, "wb") as f:
+        f.write(b"data")
+
+    missing = str(tmpdir.join("missing"))
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        results = proc.batch([
+            ("echo", {"text": "hello", "sleep": 0}),
+            ("stat", {"path": missing}),
+            ("no_such_method", {}),
+            ("stat", {"path": path}),
+        ])
+
+        assert len(results) == 4
+        assert results[0] == "hello"
+        assert isinstance(results[1], OSError)
+        assert results[1].errno == errno.ENOENT
+        assert isinstance(results[2], OSError)
+        assert results[2].errno == errno.EINVAL
+        assert results[3]["st_size"] == 4
+
+
+def test_methods(tmpdir):
+    path = str(tmpdir)
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        methods = {m["name"]: m for m in proc.methods()}
+
+        assert methods["stat"]["readOnly"]
+        assert methods["stat"]["blocking"]
+        assert methods["stat"]["cost"] == "metadata"
+        assert not methods["unlink"]["readOnly"]
+        assert not methods["ping"]["blocking"]
+        assert not methods["echo"]["blocking"]
+        assert not methods["writefile_chunk"]["idempotent"]
+        assert "id" not in methods["stat"]
+
+        results = proc._sendCommand(
+            "batch",
+            {"requests": [
+                {"methodName": "stat", "args": {"path": path}},
+                {"methodId": 0, "args": {}},
+            ]},
+            proc.timeout)
+
+        assert results[0]["result"]["st_mode"] == os.stat(path).st_mode
+        assert results[1]["errcode"] == errno.EINVAL
+
+
+def test_batch_parallel():
+    proc = IOProcess(timeout=10, max_threads=5)
+    with closing(proc):
+        start = elapsed_time()
+        results = proc.batch([("echo", {"text": str(i), "sleep": 1})
+                              for i in range(5)])
+        elapsed = elapsed_time() - start
+
+        assert results == [str(i) for i in range(5)]
+        # Served in parallel, not one after the other.
+        assert elapsed < 4
+
+
+def test_batch_empty():
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        assert proc.batch([]) == []
+
+
+@pytest.mark.parametrize("wire_format", [WIRE_FORMAT_JSON,
+                                         WIRE_FORMAT_BINARY])
+def test_request_arena_concurrent(tmpdir, wire_format):
+    # Responses larger than an arena block, built by several workers while
+    # batches answer from the heap.
+    names = sorted("file-%04d" % i for i in range(500))
+    for name in names:
+        tmpdir.join(name).write("")
+
+    text = "x" * 10000
+    proc = IOProcess(timeout=10, max_threads=5, wire_format=wire_format)
+    results = []
+    with closing(proc):
+        def run():
+            for _ in range(20):
+                results.append((
+                    sorted(proc.listdir(str(tmpdir))),
+                    proc.echo(text),
+                    proc.batch([("echo", {"text": text, "sleep": 0}),
+                                ("ping", {})])))
+
+        threads = [Thread(target=run) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+    assert results == [(names, text, [text, "pong"])] * 80
+
+
+@pytest.mark.parametrize("wire_format", [WIRE_FORMAT_JSON,
+                                         WIRE_FORMAT_BINARY])
+def test_emitted_results(tmpdir, wire_format):
+    # These results are encoded while they are produced, without a DOM.
+    names = sorted("file-%04d" % i for i in range(2000))
+    for name in names:
+        tmpdir.join(name).write("")
+    file = str(tmpdir.join(names[0]))
+    missing = str(tmpdir.join("missing"))
+
+    proc = IOProcess(timeout=10, max_threads=5, wire_format=wire_format)
+    with closing(proc):
+        assert sorted(proc.listdir(str(tmpdir))) == names
+        assert sorted(proc.glob(str(tmpdir.join("file-00*")))) == [
+            str(tmpdir.join(name)) for name in names[:100]]
+        check_stat(proc.stat(file), os.stat(file))
+        check_stat(proc.lstat(file), os.lstat(file))
+
+        for method in (proc.listdir, proc.stat, proc.lstat):
+            with pytest.raises(OSError) as e:
+                method(missing)
+            assert e.value.errno == errno.ENOENT
+
+
+def test_compound(tmpdir):
+    tmp = str(tmpdir.join("file.tmp"))
+    path = str(tmpdir.join("file"))
+    data = base64.b64encode(b"data").decode("utf8")
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        results = proc.compound([
+            ("writefile", {"path": tmp, "data": data, "direct": False}),
+            ("fsyncPath", {"path": tmp}),
+            ("rename", {"oldpath": tmp, "newpath": path}),
+            ("fsyncPath", {"path": str(tmpdir)}),
+        ])
+
+        assert len(results) == 4
+        assert not os.path.exists(tmp)
+        with io.open(path, "rb") as f:
+            assert f.read() == b"data"
+
+
+def test_compound_stops_on_error(tmpdir):
+    missing = str(tmpdir.join("missing"))
+    path = str(tmpdir.join("file"))
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        with pytest.raises(OSError) as e:
+            proc.compound([
+                ("ping", {}),
+                ("rename", {"oldpath": missing, "newpath": path}),
+                ("touch", {"path": path, "flags": os.O_CREAT,
+                           "mode": 0o644}),
+            ])
+
+        assert e.value.errno == errno.ENOENT
+        assert "step 1" in e.value.strerror
+        assert not os.path.exists(path)
+
+
+def test_compound_nested():
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        with pytest.raises(OSError) as e:
+            proc.compound([("compound", {"requests": []})])
+
+        assert e.value.errno == errno.EINVAL
+        assert "Nested compound" in e.value.strerror
+
+
+def run_concurrent_echos(proc, threads=8, count=50):
+    def worker():
+        for i in range(count):
+            proc.echo("hello")
+
+    workers = [Thread(target=worker) for i in range(threads)]
+    for t in workers:
+        t.start()
+    for t in workers:
+        t.join()
+
+
+def test_stats_writer():
+    proc = IOProcess(timeout=10, max_threads=10)
+    with closing(proc):
+        run_concurrent_echos(proc)
+        writer = proc.stats()["writer"]
+
+        # The stats response itself may not be counted yet.
+        assert writer["frames"] >= 400
+        assert writer["writes"] <= writer["frames"]
+        assert writer["bytes"] > 0
+        assert writer["framesPerWrite"] >= 1
+
+
+def test_stats_reader():
+    proc = IOProcess(timeout=10, max_threads=10)
+    with closing(proc):
+        run_concurrent_echos(proc)
+        reader = proc.stats()["reader"]
+
+        # The stats request itself may not be counted yet.
+        assert reader["frames"] >= 400
+        assert 0 < reader["reads"] <= reader["frames"] + 1
+        assert reader["bytes"] > 0
+
+
+@pytest.mark.parametrize("size", [64 * 1024 - 200, 64 * 1024, 1024**2])
+def test_echo_large_request(size):
+    # Larger than the ioprocess request buffer.
+    text = "x" * size
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        for i in range(3):
+            assert proc.echo(text) == text
+
+
+def test_stats_writer_one_frame_per_write():
+    proc = IOProcess(timeout=10, max_threads=10, max_write_iovecs=3)
+    with closing(proc):
+        run_concurrent_echos(proc)
+        writer = proc.stats()["writer"]
+        assert writer["writes"] == writer["frames"]
+
+
+@requires_eventfd
+def test_shm_transport(tmpdir):
+    proc = IOProcess(timeout=10, max_threads=5, transport=TRANSPORT_SHM)
+    with closing(proc):
+        assert proc.ping() == "pong"
+        assert proc.echo("hello") == "hello"
+        assert proc.listdir(str(tmpdir)) == []
+        run_concurrent_echos(proc)
+
+
+@requires_eventfd
+@pytest.mark.parametrize("size", [0, 4096, 1024**2 + 1])
+def test_shm_transport_larger_than_ring(tmpdir, size):
+    data = os.urandom(size)
+    path = str(tmpdir.join("file"))
+    proc = IOProcess(timeout=10, transport=TRANSPORT_SHM,
+                     shm_ring_size=64 * 1024)
+    with closing(proc):
+        proc.writefile(path, data)
+        assert proc.readfile(path) == data
+        text = "x" * (256 * 1024)
+        assert proc.echo(text) == text
+
+
+@requires_eventfd
+def test_shm_transport_crash_recovery():
+    proc = IOProcess(timeout=10, transport=TRANSPORT_SHM)
+    with closing(proc):
+        assert proc.crash()
+        assert proc.ping() == "pong"
+
+
+def test_unknown_transport():
+    with pytest.raises(ValueError):
+        IOProcess(transport="carrier-pigeon")
+
+
+def test_socket_clients(tmpdir):
+    sock = str(tmpdir.join("sock"))
+    proc = IOProcess(timeout=10, max_threads=5, listen=sock)
+    with closing(proc):
+        clients = [IOProcess(timeout=10, connect=sock) for i in range(3)]
+        for client in clients:
+            with closing(client):
+                assert client.ping() == "pong"
+                assert client.echo("hello") == "hello"
+                run_concurrent_echos(client)
+
+        # The ioprocess outlives its socket clients.
+        assert proc.ping() == "pong"
+        data = os.urandom(1024**2 + 1)
+        path = str(tmpdir.join("file"))
+        proc.writefile(path, data)
+
+        client = IOProcess(timeout=10, connect=sock)
+        with closing(client):
+            assert client.readfile(path) == data
+            assert b"".join(client.readfile_stream(path)) == data
+
+    assert not os.path.exists(sock)
+
+
+def test_socket_clients_concurrent(tmpdir):
+    sock = str(tmpdir.join("sock"))
+    proc = IOProcess(timeout=10, max_threads=5, listen=sock)
+    with closing(proc):
+        clients = [IOProcess(timeout=10, connect=sock) for i in range(4)]
+        try:
+            # Every client uses the same request ids.
+            workers = [Thread(target=run_concurrent_echos, args=(client,))
+                       for client in clients + [proc]]
+            for t in workers:
+                t.start()
+            for t in workers:
+                t.join()
+
+            for i, client in enumerate(clients):
+                assert client.echo("client-%d" % i) == "client-%d" % i
+        finally:
+            for client in clients:
+                client.close()
+
+
+def test_socket_client_uploads(tmpdir):
+    sock = str(tmpdir.join("sock"))
+    path = str(tmpdir.join("file"))
+    proc = IOProcess(timeout=10, listen=sock)
+    with closing(proc):
+        proc_fd = "/proc/%d/fd" % proc.pid
+
+        def open_files():
+            return [os.readlink(os.path.join(proc_fd, fd))
+                    for fd in os.listdir(proc_fd)]
+
+        client = IOProcess(timeout=10, connect=sock)
+        with closing(client):
+            res = client._sendCommand("writefile_open", {"path": path},
+                                      client.timeout)
+
+            # Other clients can't use the upload.
+            with pytest.raises(OSError) as e:
+                proc._sendCommand("writefile_abort",
+                                  {"handle": res["handle"]}, proc.timeout)
+            assert e.value.errno == errno.EBADF
+            assert path in open_files()
+
+        # The upload is aborted once its client is gone.
+        for i in range(50):
+            if path not in open_files():
+                break
+            time.sleep(0.1)
+        assert path not in open_files()
+
+
+def test_socket_stale_path(tmpdir):
+    sock = str(tmpdir.join("sock"))
+    # Left behind by an ioprocess that was killed.
+    stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    stale.bind(sock)
+    stale.close()
+
+    proc = IOProcess(timeout=10, listen=sock)
+    with closing(proc):
+        assert stat.S_IMODE(os.stat(sock).st_mode) == 0o600
+        client = IOProcess(timeout=10, connect=sock)
+        with closing(client):
+            assert client.ping() == "pong"
+
+
+def test_socket_clients_disconnected(tmpdir):
+    sock = str(tmpdir.join("sock"))
+    proc = IOProcess(timeout=10, listen=sock)
+    try:
+        client = IOProcess(timeout=1, connect=sock)
+        with closing(client):
+            assert client.ping() == "pong"
+            proc.close()
+            # The ioprocess exits with its pipes client.
+            with pytest.raises(Timeout):
+                client.ping()
+    finally:
+        proc.close()
+
+
+def test_socket_connect_invalid():
+    with pytest.raises(ValueError):
+        IOProcess(connect="/no/such/socket", listen="/no/such/socket")
+
+
 ACCESS_PARAMS = [
     (0o755, os.R_OK, True),
     (0o300, os.R_OK, False),
@@ -911,6 +1755,83 @@ def test_probe_block_size_concurrent(tmpdir):
     assert tmpdir.listdir() == []
 
 
+@pytest.mark.parametrize("value", [
+    None,
+    True,
+    False,
+    0,
+    -1,
+    2**63 - 1,
+    1.5,
+    "",
+    u'\u05e9\u05dc\u05d5\u05dd',
+    [],
+    {},
+    {"id": 1, "methodName": "stat", "args": {"path": "/a", "l": [1, None]}},
+    {"args": {"path": "/a"}, "id": 2},
+])
+def test_binary_codec_roundtrip(value):
+    assert binaryDecode(binaryEncode(value)) == value
+
+
+def test_binary_codec_truncated():
+    data = binaryEncode({"path": "/a"})
+    with pytest.raises(Exception):
+        binaryDecode(data[:-1])
+
+    # Lengths pointing past the end of the buffer
+    with pytest.raises(ValueError):
+        binaryDecode(binaryEncode(u"/a")[:-1])
+    with pytest.raises(ValueError):
+        binaryDecode(binaryEncode(b"data")[:-1])
+    # Cuts the key, dropping the null tag and two key bytes
+    with pytest.raises(ValueError):
+        binaryDecode(binaryEncode({"path": None})[:-3])
+
+
+def test_binary_wire_format(tmpdir):
+    data = u'\u05e9\u05dc\u05d5\u05dd'
+    proc = IOProcess(timeout=10, max_threads=5,
+                     wire_format=WIRE_FORMAT_BINARY)
+    with closing(proc):
+        assert proc.ping() == "pong"
+        assert proc.echo(data) == data
+        path = str(tmpdir.join("file"))
+        proc.touch(path, 0, 0)
+        check_stat(proc.stat(path), os.stat(path))
+        assert proc.listdir(str(tmpdir)) == ["file"]
+        assert proc.lexists(path)
+        with pytest.raises(OSError) as e:
+            proc.stat("/no/such/file")
+        assert e.value.errno == errno.ENOENT
+
+
+def test_binary_wire_format_nested_map(tmpdir):
+    # The request key of the args map must survive decoding args itself
+    path = str(tmpdir.join("file"))
+    proc = IOProcess(timeout=10, max_threads=5,
+                     wire_format=WIRE_FORMAT_BINARY)
+    with closing(proc):
+        assert proc.echo("text", sleep=0) == "text"
+        proc.touch(path, os.O_CREAT, 0o644)
+        assert proc.stat(path).st_size == 0
+
+
+def test_binary_wire_format_readfile(tmpdir):
+    data = b'x' * (1024**2 + 1)
+    path = str(tmpdir.join("file"))
+    proc = IOProcess(timeout=10, max_threads=5,
+                     wire_format=WIRE_FORMAT_BINARY)
+    with closing(proc):
+        proc.writefile(path, data)
+        assert proc.readfile(path) == data
+
+
+def test_unknown_wire_format():
+    with pytest.raises(ValueError):
+        IOProcess(wire_format="xml")
+
+
 @contextmanager
 def chmod(path, mode):
     """Changes path permissions.
@@ -1009,3 +1930,80 @@ class LoggingTests(TestCase):
         for msg in proc._sublog.messages:
             self.assertFalse('DEBUG|' in msg,
                              "Raw log data in log message: %r" % msg)
+
+
+def test_method_stats(tmpdir):
+    missing = str(tmpdir.join("missing"))
+    proc = IOProcess(timeout=10)
+    with closing(proc):
+        first = proc._reqId + 1
+        for i in range(10):
+            proc.stat(__file__)
+        with pytest.raises(OSError):
+            proc.stat(missing)
+        proc.readfile(__file__)
+
+        methods = proc.stats()["methods"]
+
+        # The requests sent, with their size prefix.
+        sent = [proc._requestToBytes(
+                    ("stat", {"path": path}, None, proc.timeout,
+                     proc._priority), reqId)
+                for reqId, path in enumerate([__file__] * 10 + [missing],
+                                             first)]
+
+    stat = methods["stat"]
+    assert stat["calls"] == 11
+    assert stat["errors"] == 1
+    assert stat["errnos"] == {str(errno.ENOENT): 1}
+    assert stat["bytesIn"] == sum(len(req) for req in sent)
+    assert sum(stat["runTime"]["buckets"]) == 11
+    assert 0 < percentile(stat["runTime"], 50) <= \
+        percentile(stat["runTime"], 99)
+    assert methods["readfile"]["bytesOut"] > os.path.getsize(__file__)
+    assert percentile({"buckets": [], "sum": 0}, 50) is None
+
+
+def test_timing(tmpdir):
+    stages = ["queued", "sending", "received", "parsed", "scheduled",
+              "dequeued", "started", "finished", "encoding", "replied"]
+    timings = []
+
+    def on_timing(methodName, timing):
+        timings.append((methodName, timing))
+
+    proc = IOProcess(timeout=10, on_timing=on_timing)
+    with closing(proc):
+        # Encoded by the worker and by the response writer.
+        proc.stat(__file__)
+        proc.readfile(__file__)
+        with pytest.raises(OSError):
+            proc.stat(str(tmpdir.join("missing")))
+
+    timings = [t for t in timings if t[0] in ("stat", "readfile")]
+    assert len(timings) == 3
+    for methodName, timing in timings:
+        times = [timing[stage] for stage in stages]
+        assert times == sorted(times)
+
+
+def test_set_log_level():
+    proc = IOProcess(timeout=10)
+    proc._sublog = FakeLogger()
+    with closing(proc):
+        proc.setLogLevel("WARNING")
+        for i in range(5):
+            proc.stat(__file__)
+
+        proc.setLogLevel("DEBUG")
+        proc.stat(__file__)
+
+        with pytest.raises(OSError) as e:
+            proc.setLogLevel("VERBOSE")
+        assert e.value.errno == errno.EINVAL
+
+        assert proc.stats()["log"]["dropped"] == 0
+
+    started = [msg for msg in proc._sublog.messages
+               if "Start request for method 'stat'" in msg]
+    assert len(started) == 1
@@ -0,0 +1,70 @@
+"""
+Compare the pipe and shared memory transports.
+
+Runs the same workload with each transport and prints the request rate:
+
+    $ python transport_benchmark.py
+    workload=echo transport=pipe requests=40000 threads=8 elapsed=... rate=...
+    workload=echo transport=shm requests=40000 threads=8 elapsed=... rate=...
+    ...
+
+The shared memory transport requires python 3.10 or later.
+"""
+
+import argparse
+import os
+import tempfile
+import time
+
+from contextlib import closing
+from threading import Thread
+
+from ioprocess import IOProcess, TRANSPORT_PIPE, TRANSPORT_SHM
+
+
+def run(proc, func, requests, threads):
+    def worker():
+        for i in range(requests // threads):
+            func(proc)
+
+    workers = [Thread(target=worker) for i in range(threads)]
+    start = time.monotonic()
+    for t in workers:
+        t.start()
+    for t in workers:
+        t.join()
+    return time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--requests", type=int, default=40000)
+    parser.add_argument("--threads", type=int, default=8)
+    parser.add_argument("--read-size", type=int, default=1024**2,
+                        help="size of the file read by the readfile workload")
+    args = parser.parse_args()
+
+    with tempfile.NamedTemporaryFile() as f:
+        f.write(os.urandom(args.read_size))
+        f.flush()
+
+        workloads = [
+            ("echo", lambda proc: proc.echo("x" * 64)),
+            ("readfile", lambda proc: proc.readfile(f.name)),
+        ]
+
+        for name, func in workloads:
+            for transport in (TRANSPORT_PIPE, TRANSPORT_SHM):
+                proc = IOProcess(timeout=60, max_threads=args.threads,
+                                 transport=transport)
+                with closing(proc):
+                    elapsed = run(proc, func, args.requests, args.threads)
+
+                print("workload=%s transport=%s requests=%d threads=%d "
+                      "elapsed=%.3f rate=%.0f/s"
+                      % (name, transport, args.requests, args.threads,
+                         elapsed, args.requests / elapsed))
+
+
+if __name__ == "__main__":
+    main()
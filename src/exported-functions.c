@@ -1,7 +1,6 @@
 #include "exported-functions.h"
 
 #include <stdio.h>
-#include <stdarg.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,8 +11,10 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "utils.h"
 
@@ -27,6 +28,10 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Default and max chunk size of readfile_stream */
+#define READFILE_CHUNK_SIZE (1024 * 1024)
+#define READFILE_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
 static void set_error_from_errno(GError** err, GQuark domain, int errcode) {
     g_set_error(err, domain, errcode, "%s", iop_strerror(errcode));
 }
@@ -39,90 +44,153 @@ static JsonNode* stdApiWrapper(int rv, GError** err) {
     return JsonNode_newFromBoolean(TRUE);
 }
 
-static JsonNode* safeGetArg(const JsonNode *args, const char* argName,
-                            JsonNodeType argType, GError** err) {
-    JsonNode* tmp;
+static void bindArgSchema(ArgSchema* schema) {
+    const char* key;
+    int i;
 
-    if (!args) {
-        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL, "args is empty");
-        return NULL;
+    for (i = 0; i < schema->count; i++) {
+        key = JsonNode_internKey(schema->args[i].name);
+        schema->keys[i] = key ? key : schema->args[i].name;
     }
+}
 
-    if (JsonNode_getType(args) != JT_MAP) {
-        g_set_error(err, IOPROCESS_ARGUMENT_ERROR,
-                    EINVAL, "args must be a map");
-        return NULL;
-    }
+static int findArg(const ArgSchema* schema, const char* key) {
+    int i;
 
-    tmp = JsonNode_map_lookup(args, argName, err);
-    if (!tmp) {
-        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
-                    "arg '%s' was not found in list", argName);
-        return NULL;
+    /* Request keys are interned, so comparing pointers is usually enough */
+    for (i = 0; i < schema->count; i++) {
+        if (key == schema->keys[i]) {
+            return i;
+        }
     }
 
-    if (JsonNode_getType(tmp) != argType) {
-        g_set_error(err, IOPROCESS_ARGUMENT_ERROR,
-                    EINVAL, "Param '%s' has the wrong type", argName);
+    for (i = 0; i < schema->count; i++) {
+        if (strcmp(key, schema->keys[i]) == 0) {
+            return i;
+        }
     }
-    return tmp;
+
+    return -1;
 }
 
-void safeGetArgValue(const JsonNode *args, const char* argName,
-                     JsonNodeType argType, void* out, GError** err) {
-    GError* tmpError = NULL;
-    JsonNode* tmp;
+int getArgs(const JsonNode* args, ArgSchema* schema, void* out,
+            GError** err) {
+    const ArgSpec* spec;
+    JsonMapIter iter;
+    const char* key;
+    JsonNode* value;
+    char* field;
+    guint found = 0;
+    int i;
 
-    tmp = safeGetArg(args, argName, argType, &tmpError);
-    if (!tmp) {
-        g_propagate_error(err, tmpError);
-        return;
+    if (g_once_init_enter(&schema->bound)) {
+        bindArgSchema(schema);
+        g_once_init_leave(&schema->bound, 1);
     }
 
-    JsonNode_getValue(tmp, out);
-}
+    if (args) {
+        if (JsonNode_getType(args) != JT_MAP) {
+            g_set_error(err, IOPROCESS_ARGUMENT_ERROR,
+                        EINVAL, "args must be a map");
+            return -1;
+        }
 
-void safeGetArgValues(const JsonNode *args, GError** err,
-                      int argn, ...) {
-    int i;
-    char* argName;
-    JsonNodeType argType;
-    GError* tmpError = NULL;
-    void* out;
-    va_list argp;
-    va_start(argp, argn);
+        JsonNode_map_iterInit(&iter, args);
+        while (JsonNode_map_iterNext(&iter, &key, &value)) {
+            i = findArg(schema, key);
+            if (i < 0) {
+                continue;
+            }
 
-    for (i = 0; i < argn; i++) {
-        argName = va_arg(argp, char*);
-        argType = va_arg(argp, JsonNodeType);
-        out = va_arg(argp, void*);
+            spec = &schema->args[i];
+            if (JsonNode_getType(value) != spec->type) {
+                g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                            "Param '%s' has the wrong type", spec->name);
+                return -1;
+            }
 
-        safeGetArgValue(args, argName, argType, out, &tmpError);
-        if(tmpError) {
-            g_propagate_error(err, tmpError);
-            goto end;
+            JsonNode_getValue(value, (char*) out + spec->offset);
+            found |= 1u << i;
         }
     }
-end:
-    va_end(argp);
+
+    for (i = 0; i < schema->count; i++) {
+        if (found & (1u << i)) {
+            continue;
+        }
+
+        spec = &schema->args[i];
+        if (!spec->optional) {
+            if (!args) {
+                g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                            "args is empty");
+            } else {
+                g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                            "arg '%s' was not found in list", spec->name);
+            }
+            return -1;
+        }
+
+        field = (char*) out + spec->offset;
+        switch (spec->type) {
+        case JT_LONG:
+            *((long*) field) = spec->defValue;
+            break;
+        case JT_BOOLEAN:
+            *((int*) field) = (int) spec->defValue;
+            break;
+        default:
+            *((void**) field) = NULL;
+            break;
+        }
+    }
+
+    return 0;
 }
 
-JsonNode* exp_rename(const JsonNode* args, GError** err) {
+struct PathArgs {
+    GString* path;
+};
+
+static const ArgSpec pathArgs[] = {
+    ARG(JT_STRING, "path", struct PathArgs, path),
+};
+
+static ArgSchema pathSchema = ARG_SCHEMA(pathArgs);
+
+struct PathModeArgs {
+    GString* path;
+    long mode;
+};
+
+static const ArgSpec pathModeArgs[] = {
+    ARG(JT_STRING, "path", struct PathModeArgs, path),
+    ARG(JT_LONG, "mode", struct PathModeArgs, mode),
+};
+
+static ArgSchema pathModeSchema = ARG_SCHEMA(pathModeArgs);
+
+/* rename, link and symlink */
+struct TwoPathArgs {
     GString* oldpath;
     GString* newpath;
-    GError* tmpError = NULL;
+};
 
-    safeGetArgValues(args, &tmpError, 2,
-                     "oldpath", JT_STRING, &oldpath,
-                     "newpath", JT_STRING, &newpath
-                    );
+static const ArgSpec twoPathArgs[] = {
+    ARG(JT_STRING, "oldpath", struct TwoPathArgs, oldpath),
+    ARG(JT_STRING, "newpath", struct TwoPathArgs, newpath),
+};
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+static ArgSchema twoPathSchema = ARG_SCHEMA(twoPathArgs);
+
+JsonNode* exp_rename(const JsonNode* args, GError** err) {
+    struct TwoPathArgs arg;
+
+    if (getArgs(args, &twoPathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(rename(oldpath->str, newpath->str), err);
+    return stdApiWrapper(rename(arg.oldpath->str, arg.newpath->str), err);
 }
 
 /* Used for testing, simply responds "pong" */
@@ -171,107 +239,92 @@ JsonNode* exp_crash(
     return NULL;
 }
 
+struct EchoArgs {
+    GString* text;
+    long sleep;
+};
+
+static const ArgSpec echoArgs[] = {
+    ARG(JT_STRING, "text", struct EchoArgs, text),
+    ARG_OPTIONAL(JT_LONG, "sleep", struct EchoArgs, sleep, 0),
+};
+
+static ArgSchema echoSchema = ARG_SCHEMA(echoArgs);
+
 /* Used for testing, will return contents of args "text" and will sleep */
 JsonNode* exp_echo(const JsonNode* args, GError** err) {
-    long sleep_sec = 0;
-    GError *tmpError = NULL;
-    GString* text;
+    struct EchoArgs arg;
     JsonNode* res;
-    safeGetArgValues(args, &tmpError, 2,
-                     "text", JT_STRING, &text,
-                     "sleep", JT_LONG, &sleep_sec
-                    );
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &echoSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    if (sleep_sec > 0) {
-        sleep(sleep_sec);
+    if (arg.sleep > 0) {
+        sleep(arg.sleep);
     }
 
-    res = JsonNode_newFromString(text->str);
+    res = JsonNode_newFromString(arg.text->str);
     return res;
 }
 
 JsonNode* exp_unlink(const JsonNode* args, GError** err) {
-    GString* path;
-    GError* tmpError = NULL;
+    struct PathArgs arg;
 
-    safeGetArgValue(args, "path", JT_STRING, (void*)&path, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(unlink(path->str), err);
+    return stdApiWrapper(unlink(arg.path->str), err);
 }
 
 JsonNode* exp_rmdir(const JsonNode* args, GError** err) {
-    GString* path;
-    GError* tmpError = NULL;
+    struct PathArgs arg;
 
-    safeGetArgValue(args, "path", JT_STRING, (void*)&path, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(rmdir(path->str), err);
+    return stdApiWrapper(rmdir(arg.path->str), err);
 }
 
-JsonNode* exp_mkdir(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
-    GString* path;
-    long mode;
+static const ArgSpec mkdirArgs[] = {
+    ARG(JT_STRING, "path", struct PathModeArgs, path),
+    ARG_OPTIONAL(JT_LONG, "mode", struct PathModeArgs, mode,
+                 DEFAULT_MKDIR_MODE),
+};
 
-    safeGetArgValues(args, &tmpError, 2,
-                     "path", JT_STRING, &path,
-                     "mode", JT_LONG, &mode
-                    );
+static ArgSchema mkdirSchema = ARG_SCHEMA(mkdirArgs);
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+JsonNode* exp_mkdir(const JsonNode* args, GError** err) {
+    struct PathModeArgs arg;
+
+    if (getArgs(args, &mkdirSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(mkdir(path->str, mode), err);
+    return stdApiWrapper(mkdir(arg.path->str, arg.mode), err);
 }
 
 JsonNode* exp_chmod(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
-    GString* path;
-    long mode;
+    struct PathModeArgs arg;
 
-    safeGetArgValues(args, &tmpError, 2,
-                     "path", JT_STRING, &path,
-                     "mode", JT_LONG, &mode
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathModeSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(chmod(path->str, mode), err);
+    return stdApiWrapper(chmod(arg.path->str, arg.mode), err);
 }
 
 JsonNode* exp_lexists(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
-    GString* path;
+    struct PathArgs arg;
     struct stat st;
 
-    safeGetArgValues(args, &tmpError, 1,
-                     "path", JT_STRING, &path
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    if (lstat(path->str, &st) < 0) {
+    if (lstat(arg.path->str, &st) < 0) {
         return JsonNode_newFromBoolean(FALSE);
     }
 
@@ -280,52 +333,49 @@ JsonNode* exp_lexists(const JsonNode* args, GError** err) {
 
 /* Checks if a path exists with some trick to bypass nfs stale handles */
 JsonNode* exp_access(const JsonNode* args, GError** err) {
-    GString* path;
-    long mode;
-    GError* tmpError = NULL;
-
-    safeGetArgValues(args, &tmpError, 2,
-                     "path", JT_STRING, &path,
-                     "mode", JT_LONG, &mode
-                    );
+    struct PathModeArgs arg;
 
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathModeSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(access(path->str, mode), err);
+    return stdApiWrapper(access(arg.path->str, arg.mode), err);
 }
 
+struct TouchArgs {
+    GString* path;
+    long flags;
+    long mode;
+};
+
+/* A mode of 0 means the default mode */
+static const ArgSpec touchArgs[] = {
+    ARG(JT_STRING, "path", struct TouchArgs, path),
+    ARG_OPTIONAL(JT_LONG, "flags", struct TouchArgs, flags, 0),
+    ARG_OPTIONAL(JT_LONG, "mode", struct TouchArgs, mode, 0),
+};
+
+static ArgSchema touchSchema = ARG_SCHEMA(touchArgs);
+
 JsonNode* exp_touch(const JsonNode* args, GError** err){
-    GString* path = NULL;
+    struct TouchArgs arg;
     int fd = -1, rv = 0;
-    long mode;
-    long flags;
     long defMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
     long allFlags = O_WRONLY | O_CREAT;
-    GError* tmpError = NULL;
-
-    safeGetArgValues(args, &tmpError, 3,
-                     "path", JT_STRING, &path,
-                     "flags", JT_LONG, &flags,
-                     "mode", JT_LONG, &mode
-                    );
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &touchSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    if (!mode) {
-        mode = defMode;
+    if (!arg.mode) {
+        arg.mode = defMode;
     }
 
-    if (flags) {
-        allFlags |= flags;
+    if (arg.flags) {
+        allFlags |= arg.flags;
     }
 
-    fd = open(path->str, allFlags, mode);
+    fd = open(arg.path->str, allFlags, arg.mode);
     if (fd == -1) {
         rv = fd;
         goto clean;
@@ -343,44 +393,49 @@ clean:
     return stdApiWrapper(rv ,err);
 }
 
-JsonNode* exp_truncate(const JsonNode* args, GError** err){
-    GString* path = NULL;
+struct TruncateArgs {
+    GString* path;
+    long size;
     long mode;
+    int excl;
+};
+
+/* A mode of 0 means the default mode */
+static const ArgSpec truncateArgs[] = {
+    ARG(JT_STRING, "path", struct TruncateArgs, path),
+    ARG(JT_LONG, "size", struct TruncateArgs, size),
+    ARG_OPTIONAL(JT_LONG, "mode", struct TruncateArgs, mode, 0),
+    ARG_OPTIONAL(JT_BOOLEAN, "excl", struct TruncateArgs, excl, FALSE),
+};
+
+static ArgSchema truncateSchema = ARG_SCHEMA(truncateArgs);
+
+JsonNode* exp_truncate(const JsonNode* args, GError** err){
+    struct TruncateArgs arg;
     long defMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-    long size;
     int fd = -1;
-    int excl = 0;
     int flags = O_CREAT | O_WRONLY;
     int rv = 0;
-    GError* tmpError = NULL;
 
-    safeGetArgValues(args, &tmpError, 4,
-                     "path", JT_STRING, &path,
-                     "size", JT_LONG, &size,
-                     "mode", JT_LONG, &mode,
-                     "excl", JT_BOOLEAN, &excl
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &truncateSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    if (!mode) {
-        mode = defMode;
+    if (!arg.mode) {
+        arg.mode = defMode;
     }
 
-    if (excl) {
+    if (arg.excl) {
         flags |= O_EXCL;
     }
 
-    fd = open(path->str, flags, mode);
+    fd = open(arg.path->str, flags, arg.mode);
     if (fd == -1) {
         rv = fd;
         goto clean;
     }
 
-    rv = ftruncate(fd, size);
+    rv = ftruncate(fd, arg.size);
     if (rv < 0) {
         goto clean;
     }
@@ -393,38 +448,24 @@ clean:
 }
 
 JsonNode* exp_link(const JsonNode* args, GError** err) {
-    GString* oldpath;
-    GString* newpath;
-    GError* tmpError = NULL;
-
-    safeGetArgValues(args, &tmpError, 2,
-                     "oldpath", JT_STRING, &oldpath,
-                     "newpath", JT_STRING, &newpath
-                    );
+    struct TwoPathArgs arg;
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &twoPathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    return stdApiWrapper(link(oldpath->str, newpath->str), err);
+    return stdApiWrapper(link(arg.oldpath->str, arg.newpath->str), err);
 }
 
 JsonNode* exp_fsyncPath(const JsonNode* args, GError** err) {
-    GString* path;
-    GError* tmpError = NULL;
+    struct PathArgs arg;
     int fd;
 
-    safeGetArgValues(args, &tmpError, 1,
-                     "path", JT_STRING, &path
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
         return NULL;
     }
 
-    fd = open(path->str, O_RDONLY);
+    fd = open(arg.path->str, O_RDONLY);
     if (fd == -1) {
         set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
         return NULL;
@@ -439,47 +480,60 @@ JsonNode* exp_fsyncPath(const JsonNode* args, GError** err) {
 }
 
 JsonNode* exp_symlink(const JsonNode* args, GError** err) {
-    GString* oldpath;
-    GString* newpath;
+    struct TwoPathArgs arg;
+
+    if (getArgs(args, &twoPathSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    return stdApiWrapper(symlink(arg.oldpath->str, arg.newpath->str), err);
+}
+
+/* Runs an emitting method for callers that need a tree */
+static JsonNode* emitDom(EmitFunction emit, const JsonNode* args,
+                         GError** err) {
     GError* tmpError = NULL;
+    JsonEmitter* out;
+    JsonNode* result;
 
-    safeGetArgValues(args, &tmpError, 2,
-                     "oldpath", JT_STRING, &oldpath,
-                     "newpath", JT_STRING, &newpath
-                    );
+    out = JsonEmitter_newDom();
+    if (!out) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, ENOMEM);
+        return NULL;
+    }
 
-    if(tmpError) {
+    emit(args, out, &tmpError);
+    if (tmpError) {
+        JsonEmitter_free(out);
         g_propagate_error(err, tmpError);
         return NULL;
     }
 
-    return stdApiWrapper(symlink(oldpath->str, newpath->str), err);
+    result = JsonEmitter_finishDom(out);
+    if (!result) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, ENOMEM);
+    }
+
+    return result;
 }
 
-JsonNode* exp_listdir(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
-    GString* path;
-    JsonNode* result = NULL;
+void exp_listdir_emit(const JsonNode* args, JsonEmitter* out, GError** err) {
+    struct PathArgs arg;
     DIR *dp;
     char* fname;
     struct dirent *ep;
 
-    safeGetArgValues(args, &tmpError, 1,
-                     "path", JT_STRING, &path
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
-        return NULL;
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
+        return;
     }
 
-    dp = opendir(path->str);
+    dp = opendir(arg.path->str);
     if (!dp) {
         set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
-        return NULL;
+        return;
     }
 
-    result = JsonNode_newArray();
+    JsonEmitter_openArray(out);
 
     while ((ep = readdir(dp))) {
         fname = ep->d_name;
@@ -492,34 +546,39 @@ JsonNode* exp_listdir(const JsonNode* args, GError** err) {
             continue;
         }
 
-        JsonNode_array_append(result,
-                              JsonNode_newFromString(fname), NULL);
+        JsonEmitter_string(out, fname);
     }
 
+    JsonEmitter_closeArray(out);
     closedir(dp);
-    return result;
 }
 
-JsonNode* exp_glob(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
+JsonNode* exp_listdir(const JsonNode* args, GError** err) {
+    return emitDom(exp_listdir_emit, args, err);
+}
+
+struct GlobArgs {
     GString* pattern;
-    JsonNode* result = NULL;
+};
+
+static const ArgSpec globArgs[] = {
+    ARG(JT_STRING, "pattern", struct GlobArgs, pattern),
+};
+
+static ArgSchema globSchema = ARG_SCHEMA(globArgs);
+
+void exp_glob_emit(const JsonNode* args, JsonEmitter* out, GError** err) {
+    struct GlobArgs arg;
     glob_t globbuf;
     int rv;
     size_t i;
 
-    safeGetArgValues(args, &tmpError, 1,
-                     "pattern", JT_STRING, &pattern
-                    );
-
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
-        return NULL;
+    if (getArgs(args, &globSchema, &arg, err) < 0) {
+        return;
     }
 
-    result = JsonNode_newArray();
     memset(&globbuf, 0, sizeof(glob_t));
-    rv = glob(pattern->str, GLOB_DOOFFS, NULL, &globbuf);
+    rv = glob(arg.pattern->str, GLOB_DOOFFS, NULL, &globbuf);
     switch (rv) {
     case GLOB_NOSPACE:
         set_error_from_errno(err, IOPROCESS_GENERAL_ERROR,
@@ -529,49 +588,73 @@ JsonNode* exp_glob(const JsonNode* args, GError** err) {
         set_error_from_errno(err, IOPROCESS_GENERAL_ERROR,
                              EIO);
         goto clean;
-    case GLOB_NOMATCH:
-        goto clean;
     }
 
+    JsonEmitter_openArray(out);
     for (i = 0; i < globbuf.gl_pathc; i++) {
-        JsonNode_array_append(result,
-                              JsonNode_newFromString(globbuf.gl_pathv[i]), NULL);
+        JsonEmitter_string(out, globbuf.gl_pathv[i]);
     }
+    JsonEmitter_closeArray(out);
 
 clean:
     globfree(&globbuf);
-    return result;
 }
 
-JsonNode* exp_writefile(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
+JsonNode* exp_glob(const JsonNode* args, GError** err) {
+    return emitDom(exp_glob_emit, args, err);
+}
+
+struct WritefileArgs {
     GString* path;
-    GString* dataStr;
-    char* data = NULL;
-    char* tmpBuff = NULL;
     int direct;
+    GByteArray* attachment;
+    GString* data;
+};
+
+/* The contents are raw bytes sent after the request envelope, older
+ * clients send them base64 encoded in "data" */
+static const ArgSpec writefileArgs[] = {
+    ARG(JT_STRING, "path", struct WritefileArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct WritefileArgs, direct, FALSE),
+    ARG_OPTIONAL(JT_BINARY, "attachment", struct WritefileArgs, attachment,
+                 0),
+    ARG_OPTIONAL(JT_STRING, "data", struct WritefileArgs, data, 0),
+};
+
+static ArgSchema writefileSchema = ARG_SCHEMA(writefileArgs);
+
+JsonNode* exp_writefile(const JsonNode* args, GError** err) {
+    struct WritefileArgs arg;
+    const char* data = NULL;
+    char* decoded = NULL;
+    char* tmpBuff = NULL;
     gsize dataLen;
     int fd = -1;
     int flags = O_WRONLY | O_CREAT | O_TRUNC;
     int rv;
     gsize bwritten;
 
-    safeGetArgValues(args, &tmpError, 3,
-                     "path", JT_STRING, &path,
-                     "data", JT_STRING, &dataStr,
-                     "direct", JT_BOOLEAN, &direct
-                    );
+    if (getArgs(args, &writefileSchema, &arg, err) < 0) {
+        return NULL;
+    }
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
+    if (arg.attachment) {
+        data = (const char*) arg.attachment->data;
+        dataLen = arg.attachment->len;
+    } else if (arg.data) {
+        decoded = (char*) g_base64_decode(arg.data->str, &dataLen);
+        data = decoded;
+    } else {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "arg 'data' was not found in list");
         return NULL;
     }
 
-    if (direct) {
+    if (arg.direct) {
         flags |= O_DIRECT;
     }
 
-    fd = open(path->str, flags,
+    fd = open(arg.path->str, flags,
               S_IRUSR | S_IWUSR |
               S_IRGRP | S_IWGRP |
               S_IROTH);
@@ -580,18 +663,15 @@ JsonNode* exp_writefile(const JsonNode* args, GError** err) {
         goto clean;
     }
 
-    data = (char*) g_base64_decode(dataStr->str, &dataLen);
-    if (direct) {
+    if (arg.direct) {
         rv = posix_memalign((void**) &tmpBuff, SAFE_ALIGN, dataLen);
         if (rv != 0) {
-            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, rv);
             goto clean;
         }
 
         memcpy(tmpBuff, data, dataLen);
-        free(data);
         data = tmpBuff;
-        tmpBuff = NULL;
     }
 
     bwritten = 0;
@@ -610,8 +690,8 @@ JsonNode* exp_writefile(const JsonNode* args, GError** err) {
     }
 
 clean:
-    if (data) {
-        free(data);
+    if (decoded) {
+        free(decoded);
     }
 
     if (tmpBuff) {
@@ -625,104 +705,635 @@ clean:
     return NULL;
 }
 
-JsonNode* exp_readfile(const JsonNode* args, GError** err) {
-    int rv;
-    int convertedLen;
-    int rd;
-    int total_rd = 0;
-    GString* path;
-    JsonNode* result = NULL;
-    GString* b64str = NULL;
-    GError* tmpError = NULL;
-    int direct = 0;
-    int fd = -1;
-    char* buff = NULL;
-    int flags = O_RDONLY;
-    unsigned long buffsize = 0;
-    int b64buffsize = 0;
-    char* b64buff = NULL;
-    int b64State = 0;
-    int b64Save = 0;
-    struct statvfs svfs;
-    struct stat st;
+/* A file opened by writefile_open, written by writefile_chunk requests
+ * until writefile_commit or writefile_abort closes it. Only requests of the
+ * owner that opened it may use it. */
+struct Upload {
+    int fd;
+    int direct;
+    void* owner;
+    /* One held by the uploads table, one by every request using it */
+    int refs;
+    /* When a request last used it, in monotonic time */
+    gint64 lastUsed;
+    /* Aligned buffer for direct writes, taken by the chunk using it so
+     * concurrent chunks don't share it */
+    char* staging;
+    size_t stagingLen;
+};
 
+G_LOCK_DEFINE_STATIC(uploads);
+static GHashTable* uploads = NULL;
+static int lastUploadId = 0;
 
-    safeGetArgValues(args, &tmpError, 2,
-                     "path", JT_STRING, &path,
-                     "direct", JT_BOOLEAN, &direct
-                    );
+/* Owner of the uploads used by the requests running on this thread */
+static GPrivate currentOwner = G_PRIVATE_INIT(NULL);
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
-        return NULL;
-    }
+void* setUploadOwner(void* owner) {
+    void* prev = g_private_get(&currentOwner);
 
-    if (direct) {
-        flags |= O_DIRECT;
-    }
+    g_private_set(&currentOwner, owner);
+    return prev;
+}
 
-    fd = open(path->str, flags);
-    if (fd == -1) {
-        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
-        goto clean;
+static void unrefUpload(struct Upload* upload) {
+    int refs;
+
+    G_LOCK(uploads);
+    refs = --upload->refs;
+    G_UNLOCK(uploads);
+
+    if (refs > 0) {
+        return;
     }
 
-    if (fstat(fd, &st) < 0) {
-        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
-        goto clean;
+    close(upload->fd);
+    free(upload->staging);
+    free(upload);
+}
+
+/* Returns the upload of handle with a reference held by the caller. If
+ * steal is set the upload is also removed from the table, handing the
+ * caller the table's reference. The uploads of other owners are not
+ * found. */
+static struct Upload* getUpload(long handle, int steal, GError** err) {
+    struct Upload* upload;
+
+    G_LOCK(uploads);
+    upload = NULL;
+    if (uploads) {
+        upload = g_hash_table_lookup(uploads, GINT_TO_POINTER(handle));
     }
 
-    if (fstatvfs(fd, &svfs) < 0) {
-        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
-        goto clean;
+    if (upload && upload->owner != g_private_get(&currentOwner)) {
+        upload = NULL;
     }
-    buffsize = svfs.f_bsize;
-    b64buffsize = (buffsize / 3 + 1) * 4 + 4;
 
-    /* This is only important for direct reads but it doesn't matter if we have
-     * it for regular reads as well */
-    rv = posix_memalign((void**) &buff, SAFE_ALIGN, buffsize);
-    if (rv != 0) {
-        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, rv);
-        goto clean;
+    if (upload) {
+        if (steal) {
+            g_hash_table_remove(uploads, GINT_TO_POINTER(handle));
+        } else {
+            upload->refs++;
+            upload->lastUsed = g_get_monotonic_time();
+        }
     }
+    G_UNLOCK(uploads);
 
-    b64buff = malloc(b64buffsize);
-    if (!b64buff) {
-        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
-        goto clean;
+    if (!upload) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, EBADF);
     }
 
-    /* We convert to base64 because json strings don't like some chars and I
-     * don't blame them */
-    b64str = g_string_new(NULL);
+    return upload;
+}
 
-    /*
-     * If the file size is not aligned to block size (likely) and when using
-     * direct I/O, the last read will be short, returing the last bytes of the
-     * file. Once we reached to the end of an unaligned file, the next read
-     * will fail with EINVAL.
-     */
-    while (total_rd < st.st_size) {
-        rd = read(fd, buff, buffsize);
+/* Drops the table's reference of the uploads of owner, or of all owners
+ * if owner is NULL, that were not used for idleTime microseconds */
+static void closeUploads(void* owner, gint64 idleTime) {
+    struct Upload* upload;
+    GHashTableIter iter;
+    GPtrArray* closed;
+    gpointer handle;
+    gint64 now = g_get_monotonic_time();
+    guint i;
+
+    closed = g_ptr_array_new();
+
+    G_LOCK(uploads);
+    if (uploads) {
+        g_hash_table_iter_init(&iter, uploads);
+        while (g_hash_table_iter_next(&iter, &handle, (void**) &upload)) {
+            if (owner && upload->owner != owner) {
+                continue;
+            }
 
-        if (rd < 0) {
-            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            /* Chunks being written keep their upload */
+            if (idleTime &&
+                (upload->refs > 1 || now - upload->lastUsed < idleTime)) {
+                continue;
+            }
+
+            if (idleTime) {
+                g_warning("Closing upload %i, not used for %" PRId64
+                          " seconds", GPOINTER_TO_INT(handle),
+                          (now - upload->lastUsed) / G_USEC_PER_SEC);
+            } else {
+                g_warning("Aborting upload %i, its client is gone",
+                          GPOINTER_TO_INT(handle));
+            }
+
+            g_hash_table_iter_remove(&iter);
+            g_ptr_array_add(closed, upload);
+        }
+    }
+    G_UNLOCK(uploads);
+
+    /* The table's references, closed outside of the lock */
+    for (i = 0; i < closed->len; i++) {
+        unrefUpload(g_ptr_array_index(closed, i));
+    }
+
+    g_ptr_array_free(closed, TRUE);
+}
+
+void closeIdleUploads(gint64 idleTime) {
+    closeUploads(NULL, idleTime);
+}
+
+void abortUploads(void* owner) {
+    closeUploads(owner, 0);
+}
+
+/* Takes the staging buffer of the upload, or allocates one if it is in use
+ * by another chunk or is too small */
+static char* takeStaging(struct Upload* upload, size_t len, size_t* outLen,
+                         GError** err) {
+    char* staging;
+    size_t stagingLen;
+    int rv;
+
+    G_LOCK(uploads);
+    staging = upload->staging;
+    stagingLen = upload->stagingLen;
+    upload->staging = NULL;
+    upload->stagingLen = 0;
+    G_UNLOCK(uploads);
+
+    if (staging && stagingLen >= len) {
+        *outLen = stagingLen;
+        return staging;
+    }
+
+    free(staging);
+
+    stagingLen = ((len + SAFE_ALIGN - 1) / SAFE_ALIGN) * SAFE_ALIGN;
+    rv = posix_memalign((void**) &staging, SAFE_ALIGN, stagingLen);
+    if (rv != 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, rv);
+        return NULL;
+    }
+
+    *outLen = stagingLen;
+    return staging;
+}
+
+/* Returns the staging buffer for the next chunk, keeping the larger buffer
+ * if another chunk returned one meanwhile */
+static void putStaging(struct Upload* upload, char* staging,
+                       size_t stagingLen) {
+    G_LOCK(uploads);
+    if (upload->stagingLen < stagingLen) {
+        free(upload->staging);
+        upload->staging = staging;
+        upload->stagingLen = stagingLen;
+        staging = NULL;
+    }
+    G_UNLOCK(uploads);
+
+    free(staging);
+}
+
+/* Opens a file for a chunked upload, returns the handle used by the other
+ * writefile_* requests */
+struct PathDirectArgs {
+    GString* path;
+    int direct;
+};
+
+static const ArgSpec pathDirectArgs[] = {
+    ARG(JT_STRING, "path", struct PathDirectArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct PathDirectArgs, direct, FALSE),
+};
+
+static ArgSchema pathDirectSchema = ARG_SCHEMA(pathDirectArgs);
+
+JsonNode* exp_writefile_open(const JsonNode* args, GError** err) {
+    struct PathDirectArgs arg;
+    JsonNode* result;
+    struct Upload* upload;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd;
+    int handle;
+
+    if (getArgs(args, &pathDirectSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    if (arg.direct) {
+        flags |= O_DIRECT;
+    }
+
+    fd = open(arg.path->str, flags,
+              S_IRUSR | S_IWUSR |
+              S_IRGRP | S_IWGRP |
+              S_IROTH);
+    if (fd == -1) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        return NULL;
+    }
+
+    upload = calloc(1, sizeof(struct Upload));
+    if (!upload) {
+        close(fd);
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, ENOMEM);
+        return NULL;
+    }
+
+    upload->fd = fd;
+    upload->direct = arg.direct;
+    upload->owner = g_private_get(&currentOwner);
+    upload->refs = 1;
+    upload->lastUsed = g_get_monotonic_time();
+
+    G_LOCK(uploads);
+    if (!uploads) {
+        uploads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    do {
+        lastUploadId = (lastUploadId + 1) & G_MAXINT;
+    } while (lastUploadId == 0 ||
+             g_hash_table_lookup(uploads, GINT_TO_POINTER(lastUploadId)));
+
+    handle = lastUploadId;
+    g_hash_table_insert(uploads, GINT_TO_POINTER(handle), upload);
+    G_UNLOCK(uploads);
+
+    result = JsonNode_newMap();
+    JsonNode_map_insert(result, "handle", JsonNode_newFromLong(handle), NULL);
+    return result;
+}
+
+/* Writes the attachment at "offset" as soon as it arrives, so memory use
+ * does not depend on the file size. Chunks carry their offset and may be
+ * written in any order. With direct I/O the offset must be aligned, and the
+ * chunk is staged in an aligned buffer reused by the next chunk. */
+struct ChunkArgs {
+    long handle;
+    long offset;
+    GByteArray* attachment;
+};
+
+static const ArgSpec chunkArgs[] = {
+    ARG(JT_LONG, "handle", struct ChunkArgs, handle),
+    ARG(JT_LONG, "offset", struct ChunkArgs, offset),
+    ARG_OPTIONAL(JT_BINARY, "attachment", struct ChunkArgs, attachment, 0),
+};
+
+static ArgSchema chunkSchema = ARG_SCHEMA(chunkArgs);
+
+JsonNode* exp_writefile_chunk(const JsonNode* args, GError** err) {
+    struct ChunkArgs arg;
+    struct Upload* upload;
+    GByteArray* bytes;
+    const char* data;
+    char* staging = NULL;
+    size_t stagingLen = 0;
+    gsize bwritten;
+    ssize_t rv;
+
+    if (getArgs(args, &chunkSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    if (!arg.attachment) {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "chunk data must be sent as an attachment");
+        return NULL;
+    }
+
+    if (arg.offset < 0) {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "Param 'offset' is out of range");
+        return NULL;
+    }
+
+    upload = getUpload(arg.handle, FALSE, err);
+    if (!upload) {
+        return NULL;
+    }
+
+    bytes = arg.attachment;
+    data = (const char*) bytes->data;
+
+    if (upload->direct) {
+        staging = takeStaging(upload, bytes->len, &stagingLen, err);
+        if (!staging) {
+            goto clean;
+        }
+
+        memcpy(staging, data, bytes->len);
+        data = staging;
+    }
+
+    bwritten = 0;
+    while (bwritten < bytes->len) {
+        rv = pwrite(upload->fd, data + bwritten, bytes->len - bwritten,
+                    arg.offset + bwritten);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            goto clean;
+        }
+        bwritten += rv;
+    }
+
+clean:
+    if (staging) {
+        putStaging(upload, staging, stagingLen);
+    }
+
+    unrefUpload(upload);
+    return NULL;
+}
+
+struct CommitArgs {
+    long handle;
+    int fsync;
+};
+
+static const ArgSpec commitArgs[] = {
+    ARG(JT_LONG, "handle", struct CommitArgs, handle),
+    ARG_OPTIONAL(JT_BOOLEAN, "fsync", struct CommitArgs, fsync, TRUE),
+};
+
+static ArgSchema commitSchema = ARG_SCHEMA(commitArgs);
+
+/* Closes the upload, syncing the file first unless "fsync" is false */
+JsonNode* exp_writefile_commit(const JsonNode* args, GError** err) {
+    struct CommitArgs arg;
+    struct Upload* upload;
+
+    if (getArgs(args, &commitSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    upload = getUpload(arg.handle, TRUE, err);
+    if (!upload) {
+        return NULL;
+    }
+
+    if (arg.fsync && fsync(upload->fd) != 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+    }
+
+    unrefUpload(upload);
+    return NULL;
+}
+
+struct HandleArgs {
+    long handle;
+};
+
+static const ArgSpec abortArgs[] = {
+    ARG(JT_LONG, "handle", struct HandleArgs, handle),
+};
+
+static ArgSchema abortSchema = ARG_SCHEMA(abortArgs);
+
+/* Closes the upload without syncing, the file is left with the chunks
+ * written so far */
+JsonNode* exp_writefile_abort(const JsonNode* args, GError** err) {
+    struct HandleArgs arg;
+    struct Upload* upload;
+
+    if (getArgs(args, &abortSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    upload = getUpload(arg.handle, TRUE, err);
+    if (!upload) {
+        return NULL;
+    }
+
+    unrefUpload(upload);
+    return NULL;
+}
+
+/* Reads the file for splicing it into the response. Buffered reads of files
+ * that fit in a pipe are spliced into a private pipe without copying, other
+ * reads go to an anonymous mapping that the response writer vmsplices. */
+static JsonNode* readfileForSplice(int fd, uint64_t size, int direct,
+                                   unsigned long blockSize, GError** err) {
+    JsonNode* result = NULL;
+    int pipeFds[2] = {-1, -1};
+    char* map = MAP_FAILED;
+    size_t mapLen = 0;
+    uint64_t total = 0;
+    ssize_t n;
+
+    if (!direct && size <= INT_MAX && pipe2(pipeFds, O_CLOEXEC) == 0 &&
+        fcntl(pipeFds[1], F_SETPIPE_SZ, (int) size) >= (int) size) {
+        /* The pipe can hold the whole file, splice never blocks */
+        while (total < size) {
+            n = splice(fd, NULL, pipeFds[1], NULL, size - total,
+                       SPLICE_F_MOVE);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+                goto clean;
+            } else if (n == 0) {
+                break;
+            }
+
+            total += n;
+        }
+
+        result = JsonNode_newFromPipe(pipeFds[0], total);
+        if (result) {
+            pipeFds[0] = -1;
+        }
+
+        goto clean;
+    }
+
+    /* Aligned for direct I/O */
+    mapLen = ((size + blockSize - 1) / blockSize) * blockSize;
+    map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+
+    /* Direct reads of unaligned files end with a short read */
+    while (total < size) {
+        n = read(fd, map + total, mapLen - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            goto clean;
+        } else if (n == 0) {
+            break;
+        }
+
+        total += n;
+    }
+
+    result = JsonNode_newFromMapping(map, mapLen, total);
+    if (result) {
+        map = MAP_FAILED;
+    }
+
+clean:
+    if (!result && !(err && *err)) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, ENOMEM);
+    }
+
+    if (pipeFds[0] != -1) {
+        close(pipeFds[0]);
+    }
+
+    if (pipeFds[1] != -1) {
+        close(pipeFds[1]);
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, mapLen);
+    }
+
+    return result;
+}
+
+struct ReadfileArgs {
+    GString* path;
+    int direct;
+    int binary;
+    int splice;
+};
+
+/* With "binary" the raw bytes are sent as an attachment instead of base64,
+ * with "splice" as well the response writer moves them with splice */
+static const ArgSpec readfileArgs[] = {
+    ARG(JT_STRING, "path", struct ReadfileArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct ReadfileArgs, direct, FALSE),
+    ARG_OPTIONAL(JT_BOOLEAN, "binary", struct ReadfileArgs, binary, FALSE),
+    ARG_OPTIONAL(JT_BOOLEAN, "splice", struct ReadfileArgs, splice, FALSE),
+};
+
+static ArgSchema readfileSchema = ARG_SCHEMA(readfileArgs);
+
+JsonNode* exp_readfile(const JsonNode* args, GError** err) {
+    struct ReadfileArgs arg;
+    int rv;
+    int convertedLen;
+    int rd;
+    int total_rd = 0;
+    JsonNode* result = NULL;
+    GString* b64str = NULL;
+    GByteArray* bytes = NULL;
+    int fd = -1;
+    char* buff = NULL;
+    int flags = O_RDONLY;
+    unsigned long buffsize = 0;
+    int b64buffsize = 0;
+    char* b64buff = NULL;
+    int b64State = 0;
+    int b64Save = 0;
+    struct statvfs svfs;
+    struct stat st;
+
+    if (getArgs(args, &readfileSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    if (arg.direct) {
+        flags |= O_DIRECT;
+    }
+
+    fd = open(arg.path->str, flags);
+    if (fd == -1) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+
+    if (fstatvfs(fd, &svfs) < 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+    buffsize = svfs.f_bsize;
+    b64buffsize = (buffsize / 3 + 1) * 4 + 4;
+
+    /* Let the response writer move the contents with splice */
+    if (arg.binary && arg.splice && st.st_size > 0) {
+        result = readfileForSplice(fd, st.st_size, arg.direct, buffsize, err);
+        goto clean;
+    }
+
+    /* This is only important for direct reads but it doesn't matter if we have
+     * it for regular reads as well */
+    rv = posix_memalign((void**) &buff, SAFE_ALIGN, buffsize);
+    if (rv != 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, rv);
+        goto clean;
+    }
+
+    if (arg.binary) {
+        bytes = g_byte_array_sized_new(st.st_size);
+    } else {
+        b64buff = malloc(b64buffsize);
+        if (!b64buff) {
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            goto clean;
+        }
+
+        /* We convert to base64 because json strings don't like some chars
+         * and I don't blame them */
+        b64str = g_string_new(NULL);
+    }
+
+    /*
+     * If the file size is not aligned to block size (likely) and when using
+     * direct I/O, the last read will be short, returing the last bytes of the
+     * file. Once we reached to the end of an unaligned file, the next read
+     * will fail with EINVAL.
+     */
+    while (total_rd < st.st_size) {
+        rd = read(fd, buff, buffsize);
+
+        if (rd < 0) {
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
 
             /* Drop possible 4 bytes at end since we return NULL on errors. */
-            g_base64_encode_close(FALSE, b64buff, &b64State, &b64Save);
+            if (!arg.binary) {
+                g_base64_encode_close(FALSE, b64buff, &b64State, &b64Save);
+            }
 
             goto clean;
         }
 
         total_rd += rd;
 
+        if (arg.binary) {
+            g_byte_array_append(bytes, (guint8*) buff, rd);
+            continue;
+        }
+
         convertedLen = g_base64_encode_step((guchar*) buff, rd, FALSE, b64buff,
                                             &b64State, &b64Save);
 
         g_string_append_len(b64str, b64buff, convertedLen);
     }
 
+    if (arg.binary) {
+        result = JsonNode_newFromByteArray(bytes);
+        bytes = NULL;
+        goto clean;
+    }
+
     /* Add up to 4 final bytes at end if we read some data. */
     if (total_rd > 0) {
         convertedLen = g_base64_encode_close(FALSE, b64buff, &b64State, &b64Save);
@@ -743,6 +1354,10 @@ clean:
         g_string_free(b64str, TRUE);
     }
 
+    if (bytes) {
+        g_byte_array_free(bytes, TRUE);
+    }
+
     if (buff) {
         free(buff);
     }
@@ -750,20 +1365,144 @@ clean:
     return result;
 }
 
+struct ReadfileStreamArgs {
+    GString* path;
+    int direct;
+    long chunkSize;
+};
+
+static const ArgSpec readfileStreamArgs[] = {
+    ARG(JT_STRING, "path", struct ReadfileStreamArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct ReadfileStreamArgs, direct,
+                 FALSE),
+    ARG_OPTIONAL(JT_LONG, "chunkSize", struct ReadfileStreamArgs, chunkSize,
+                 READFILE_CHUNK_SIZE),
+};
+
+static ArgSchema readfileStreamSchema = ARG_SCHEMA(readfileStreamArgs);
+
+/* Sends the file as a sequence of chunks. Every chunk is read into its own
+ * anonymous mapping, which the response writer splices into the response,
+ * and the next chunk is not read before sendChunk returns. Returns the
+ * file size. */
+JsonNode* exp_readfile_stream(const JsonNode* args, ChunkSender sendChunk,
+                              void* sendCtx, GError** err) {
+    struct ReadfileStreamArgs arg;
+    GError* tmpError = NULL;
+    JsonNode* result = NULL;
+    JsonNode* chunk;
+    int flags = O_RDONLY;
+    int fd = -1;
+    int eof = FALSE;
+    size_t chunkLen;
+    char* map;
+    uint64_t sent = 0;
+    uint64_t total;
+    ssize_t n;
+    struct statvfs svfs;
+
+    if (getArgs(args, &readfileStreamSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    if (arg.chunkSize <= 0 || arg.chunkSize > READFILE_MAX_CHUNK_SIZE) {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "Param 'chunkSize' is out of range");
+        return NULL;
+    }
+
+    if (arg.direct) {
+        flags |= O_DIRECT;
+    }
+
+    fd = open(arg.path->str, flags);
+    if (fd == -1) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+
+    if (fstatvfs(fd, &svfs) < 0) {
+        set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+        goto clean;
+    }
+
+    /* Aligned for direct I/O */
+    chunkLen = ((arg.chunkSize + svfs.f_bsize - 1) / svfs.f_bsize) *
+        svfs.f_bsize;
+
+    while (!eof) {
+        map = mmap(NULL, chunkLen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+            goto clean;
+        }
+
+        total = 0;
+        while (total < chunkLen) {
+            n = read(fd, map + total, chunkLen - total);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, errno);
+                munmap(map, chunkLen);
+                goto clean;
+            }
+
+            total += n;
+
+            /* A direct read of an unaligned file ends with a short read,
+             * reading again would fail with EINVAL. */
+            if (n == 0 || (arg.direct && total % svfs.f_bsize != 0)) {
+                eof = TRUE;
+                break;
+            }
+        }
+
+        if (total == 0) {
+            munmap(map, chunkLen);
+            break;
+        }
+
+        chunk = JsonNode_newFromMapping(map, chunkLen, total);
+        if (!chunk) {
+            munmap(map, chunkLen);
+            set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, ENOMEM);
+            goto clean;
+        }
+
+        if (sendChunk(sendCtx, chunk, &tmpError) < 0) {
+            g_propagate_error(err, tmpError);
+            goto clean;
+        }
+
+        sent += total;
+    }
+
+    result = JsonNode_newMap();
+    JsonNode_map_insert(result, "size", JsonNode_newFromLong(sent), NULL);
+
+clean:
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return result;
+}
+
 JsonNode* exp_statvfs(const JsonNode* args, GError** err) {
+    struct PathArgs arg;
     struct statvfs st;
-    GError* tmpError = NULL;
-    GString* path = NULL;
     JsonNode* res = NULL;
 
-    safeGetArgValue(args, "path", JT_STRING, &path, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
         return NULL;
     }
 
     memset(&st, 0, sizeof(struct statvfs));
-    if (statvfs(path->str, &st) < 0) {
+    if (statvfs(arg.path->str, &st) < 0) {
         set_error_from_errno(err, IOPROCESS_STDAPI_ERROR, errno);
         goto end;
     }
@@ -784,61 +1523,81 @@ end:
     return res;
 }
 
-static JsonNode* stat_map(struct stat *st) {
-    JsonNode* res = NULL;
+void stat_emit(struct stat *st, JsonEmitter* out) {
+    JsonEmitter_openMap(out);
+    JsonEmitter_key(out, "st_ino");
+    JsonEmitter_long(out, st->st_ino);
+    JsonEmitter_key(out, "st_dev");
+    JsonEmitter_long(out, st->st_dev);
+    JsonEmitter_key(out, "st_mode");
+    JsonEmitter_long(out, st->st_mode);
+    JsonEmitter_key(out, "st_nlink");
+    JsonEmitter_long(out, st->st_nlink);
+    JsonEmitter_key(out, "st_uid");
+    JsonEmitter_long(out, st->st_uid);
+    JsonEmitter_key(out, "st_gid");
+    JsonEmitter_long(out, st->st_gid);
+    JsonEmitter_key(out, "st_size");
+    JsonEmitter_long(out, st->st_size);
+    JsonEmitter_key(out, "st_atime");
+    JsonEmitter_double(out, st->st_atime);
+    JsonEmitter_key(out, "st_mtime");
+    JsonEmitter_double(out, st->st_mtime);
+    JsonEmitter_key(out, "st_ctime");
+    JsonEmitter_double(out, st->st_ctime);
+    JsonEmitter_key(out, "st_blocks");
+    JsonEmitter_long(out, st->st_blocks);
+    JsonEmitter_closeMap(out);
+}
 
-    res = JsonNode_newMap();
-    JsonNode_map_insert(res, "st_ino", JsonNode_newFromLong(st->st_ino), NULL);
-    JsonNode_map_insert(res, "st_dev", JsonNode_newFromLong(st->st_dev), NULL);
-    JsonNode_map_insert(res, "st_mode", JsonNode_newFromLong(st->st_mode), NULL);
-    JsonNode_map_insert(res, "st_nlink", JsonNode_newFromLong(st->st_nlink), NULL);
-    JsonNode_map_insert(res, "st_uid", JsonNode_newFromLong(st->st_uid), NULL);
-    JsonNode_map_insert(res, "st_gid", JsonNode_newFromLong(st->st_gid), NULL);
-    JsonNode_map_insert(res, "st_size", JsonNode_newFromLong(st->st_size), NULL);
-    JsonNode_map_insert(res, "st_atime", JsonNode_newFromDouble(st->st_atime), NULL);
-    JsonNode_map_insert(res, "st_mtime", JsonNode_newFromDouble(st->st_mtime), NULL);
-    JsonNode_map_insert(res, "st_ctime", JsonNode_newFromDouble(st->st_ctime), NULL);
-    JsonNode_map_insert(res, "st_blocks", JsonNode_newFromLong(st->st_blocks), NULL);
+JsonNode* stat_map(struct stat *st) {
+    JsonEmitter* out = JsonEmitter_newDom();
+    if (!out) {
+        return NULL;
+    }
 
-    return res;
+    stat_emit(st, out);
+    return JsonEmitter_finishDom(out);
 }
 
-JsonNode* exp_stat(const JsonNode* args, GError** err) {
+void exp_stat_emit(const JsonNode* args, JsonEmitter* out, GError** err) {
+    struct PathArgs arg;
     struct stat st;
-    GError* tmpError = NULL;
-    GString* path = NULL;
 
-    safeGetArgValue(args, "path", JT_STRING, &path, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
-        return NULL;
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
+        return;
     }
 
-    if (stat(path->str, &st) < 0) {
+    if (stat(arg.path->str, &st) < 0) {
         set_error_from_errno(err, IOPROCESS_STDAPI_ERROR, errno);
-        return NULL;
+        return;
     }
 
-    return stat_map(&st);
+    stat_emit(&st, out);
 }
 
-JsonNode* exp_lstat(const JsonNode* args, GError** err) {
+JsonNode* exp_stat(const JsonNode* args, GError** err) {
+    return emitDom(exp_stat_emit, args, err);
+}
+
+void exp_lstat_emit(const JsonNode* args, JsonEmitter* out, GError** err) {
+    struct PathArgs arg;
     struct stat st;
-    GError* tmpError = NULL;
-    GString* path = NULL;
 
-    safeGetArgValue(args, "path", JT_STRING, &path, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
-        return NULL;
+    if (getArgs(args, &pathSchema, &arg, err) < 0) {
+        return;
     }
 
-    if (lstat(path->str, &st) < 0) {
+    if (lstat(arg.path->str, &st) < 0) {
         set_error_from_errno(err, IOPROCESS_STDAPI_ERROR, errno);
-        return NULL;
+        return;
     }
 
-    return stat_map(&st);
+    stat_emit(&st, out);
+}
+
+JsonNode* exp_lstat(const JsonNode* args, GError** err) {
+    return emitDom(exp_lstat_emit, args, err);
 }
 
 struct probe {
@@ -910,24 +1669,31 @@ static int delete_probe(struct probe *probe)
     return err;
 }
 
+struct ProbeArgs {
+    GString* dir;
+};
+
+static const ArgSpec probeArgs[] = {
+    ARG(JT_STRING, "dir", struct ProbeArgs, dir),
+};
+
+static ArgSchema probeSchema = ARG_SCHEMA(probeArgs);
+
 JsonNode* exp_probe_block_size(const JsonNode* args, GError** err) {
-    GError* tmpError = NULL;
-    GString* dir = NULL;
+    struct ProbeArgs arg;
     struct probe probe = {-1};
     int sizes[] = {1, 512, 4096};
     int rv;
     void *buf = NULL;
     int block_size = -1;
 
-    safeGetArgValue(args, "dir", JT_STRING, &dir, &tmpError);
-    if (tmpError) {
-        g_propagate_error(err, tmpError);
+    if (getArgs(args, &probeSchema, &arg, err) < 0) {
         return NULL;
     }
 
     /* O_DSYNC is required to enforce strict direct I/O if Gluster is
      * configured without performance.strict-o-direct. */
-    rv = create_probe(&probe, dir, O_WRONLY | O_DIRECT | O_DSYNC);
+    rv = create_probe(&probe, arg.dir, O_WRONLY | O_DIRECT | O_DSYNC);
     if (rv != 0) {
         set_error_from_errno(err, IOPROCESS_GENERAL_ERROR, -rv);
         return NULL;
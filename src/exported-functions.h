@@ -2,8 +2,11 @@
 #define __EXPORTED_FUNCTIONS_h__
 
 #include <glib.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 #include "json-dom.h"
+#include "json-emitter.h"
 
 #define IOPROCESS_ARGUMENT_ERROR \
    g_quark_from_static_string("ioprocess-argument-error")
@@ -17,16 +20,93 @@
 
 typedef JsonNode* (*ExportedFunction) (const JsonNode* args, GError**);
 
-struct ExportedFunctionEntry_t {
+/* Sends a chunk of a streamed response, taking ownership of the chunk.
+ * Returns 0, or -1 and sets err if the response can't be sent. */
+typedef int (*ChunkSender) (void* ctx, JsonNode* chunk, GError** err);
+
+/* Methods sending their result as a sequence of chunks before returning */
+typedef JsonNode* (*StreamFunction) (const JsonNode* args,
+                                     ChunkSender sendChunk, void* sendCtx,
+                                     GError**);
+
+/* Methods writing their result into an emitter, so the response can be
+ * encoded without building a tree. On failure they set err, and whatever
+ * was written is dropped. */
+typedef void (*EmitFunction) (const JsonNode* args, JsonEmitter* out,
+                              GError**);
+
+/* Method attributes */
+/* Does not change the file system */
+#define METHOD_READ_ONLY (1 << 0)
+/* Running it again has the same effect as running it once */
+#define METHOD_IDEMPOTENT (1 << 1)
+/* May wait for storage */
+#define METHOD_BLOCKING (1 << 2)
+
+enum MethodCost {
+    /* No file system access */
+    METHOD_COST_NONE,
+    /* A few metadata operations */
+    METHOD_COST_METADATA,
+    /* File contents or whole directories */
+    METHOD_COST_DATA,
+};
+
+struct MethodEntry_t {
     const char* name;
+    /* Exactly one of callback and streamCallback is set */
     ExportedFunction callback;
+    StreamFunction streamCallback;
+    /* Optional, writes the result of callback into the encoded response */
+    EmitFunction emitCallback;
+    int flags;
+    enum MethodCost cost;
+};
+typedef struct MethodEntry_t MethodEntry;
+
+/* An argument of a method and where it is stored in the method's argument
+ * struct: JT_STRING as GString*, JT_BINARY as GByteArray*, JT_LONG as long
+ * and JT_BOOLEAN as int. An optional argument that was not sent is set to
+ * defValue, or to NULL for pointers. */
+struct ArgSpec_t {
+    const char* name;
+    JsonNodeType type;
+    size_t offset;
+    int optional;
+    long defValue;
 };
-typedef struct ExportedFunctionEntry_t ExportedFunctionEntry;
+typedef struct ArgSpec_t ArgSpec;
 
-void safeGetArgValues(const JsonNode *args, GError** err,
-                      int argn, ...);
-void safeGetArgValue(const JsonNode *args, const char* argName,
-                     JsonNodeType argType, void* out, GError** err);
+#define ARG_SCHEMA_MAX 8
+
+/* Mode of mkdir when the request has none, as in the python binding */
+#define DEFAULT_MKDIR_MODE (S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)
+
+/* The arguments of a method, at most ARG_SCHEMA_MAX */
+struct ArgSchema_t {
+    const ArgSpec* args;
+    int count;
+    /* The names as interned by json-dom, bound on first use */
+    const char* keys[ARG_SCHEMA_MAX];
+    gsize bound;
+};
+typedef struct ArgSchema_t ArgSchema;
+
+#define ARG(type, name, argStruct, field) \
+    {name, type, offsetof(argStruct, field), FALSE, 0}
+#define ARG_OPTIONAL(type, name, argStruct, field, defValue) \
+    {name, type, offsetof(argStruct, field), TRUE, defValue}
+#define ARG_SCHEMA(specs) {specs, G_N_ELEMENTS(specs), {NULL}, 0}
+
+/* Fills out from the args map in one pass. Returns 0, or -1 and sets err
+ * if an argument is missing or has the wrong type. Values point into args
+ * and are valid as long as it is. */
+int getArgs(const JsonNode* args, ArgSchema* schema, void* out,
+            GError** err);
+
+/* Builds the result of stat and lstat */
+JsonNode* stat_map(struct stat *st);
+void stat_emit(struct stat *st, JsonEmitter* out);
 
 JsonNode* exp_stat(const JsonNode* args, GError** err);
 JsonNode* exp_lstat(const JsonNode* args, GError** err);
@@ -44,6 +124,10 @@ JsonNode* exp_rename(const JsonNode* args, GError** err);
 JsonNode* exp_readfile(const JsonNode* args, GError** err);
 JsonNode* exp_glob(const JsonNode* args, GError** err);
 JsonNode* exp_writefile(const JsonNode* args, GError** err);
+JsonNode* exp_writefile_open(const JsonNode* args, GError** err);
+JsonNode* exp_writefile_chunk(const JsonNode* args, GError** err);
+JsonNode* exp_writefile_commit(const JsonNode* args, GError** err);
+JsonNode* exp_writefile_abort(const JsonNode* args, GError** err);
 JsonNode* exp_rmdir(const JsonNode* args, GError** err);
 JsonNode* exp_statvfs(const JsonNode* args, GError** err);
 JsonNode* exp_lexists(const JsonNode* args, GError** err);
@@ -52,4 +136,22 @@ JsonNode* exp_mkdir(const JsonNode* args, GError** err);
 JsonNode* exp_touch(const JsonNode* args, GError** err);
 JsonNode* exp_fsyncPath(const JsonNode* args, GError** err);
 JsonNode* exp_probe_block_size(const JsonNode* args, GError** err);
+
+/* Sets the owner of the chunked uploads opened or used by the requests
+ * running on this thread, usually their connection. Returns the previous
+ * owner. */
+void* setUploadOwner(void* owner);
+/* Closes the chunked uploads not used for idleTime microseconds, their
+ * handles are invalid after that */
+void closeIdleUploads(gint64 idleTime);
+/* Closes the chunked uploads of owner, once it sends no more requests */
+void abortUploads(void* owner);
+
+JsonNode* exp_readfile_stream(const JsonNode* args, ChunkSender sendChunk,
+                              void* sendCtx, GError** err);
+
+void exp_stat_emit(const JsonNode* args, JsonEmitter* out, GError** err);
+void exp_lstat_emit(const JsonNode* args, JsonEmitter* out, GError** err);
+void exp_glob_emit(const JsonNode* args, JsonEmitter* out, GError** err);
+void exp_listdir_emit(const JsonNode* args, JsonEmitter* out, GError** err);
 #endif
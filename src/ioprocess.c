@@ -1,5 +1,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <dirent.h>
 #include <glib.h>
 #include <errno.h>
@@ -17,10 +21,21 @@
 #include "json-dom.h"
 #include "json-dom-generator.h"
 #include "json-dom-parser.h"
+#include "json-dom-binary.h"
+#include "shm-ring.h"
+#include "mount-table.h"
+#include "uring-backend.h"
+#include "mpsc-queue.h"
+#include "log-ring.h"
+#include "method-stats.h"
 
 #include "exported-functions.h"
 #include <limits.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define IOPROCESS_COMMUNICATION_ERROR \
     g_quark_from_static_string("ioprocess-general-error")
 
@@ -28,14 +43,147 @@ static int READ_PIPE_FD = -1;
 static int WRITE_PIPE_FD = -1;
 static int MAX_THREADS = 0;
 static int MAX_QUEUED_REQUESTS = -1;
+static int RESERVED_THREADS = 0;
+static int MAX_THREADS_PER_MOUNT = 0;
+static int MAX_MOUNT_THREADS = 64;
+static int STUCK_TIMEOUT = 0;
+static int MAX_EXTRA_THREADS = 0;
+static int UPLOAD_TIMEOUT = 600;
 static gboolean KEEP_FDS = FALSE;
+static gchar *WIRE_FORMAT_NAME = NULL;
+static gchar *IO_BACKEND = NULL;
+static int MAX_WRITE_BYTES = 1024 * 1024;
+static int MAX_WRITE_IOVECS = IOV_MAX;
+static int SHM_FD = -1;
+static int SHM_REQUEST_FD = -1;
+static int SHM_REQUEST_SPACE_FD = -1;
+static int SHM_RESPONSE_FD = -1;
+static int SHM_RESPONSE_SPACE_FD = -1;
+static gchar *SOCKET_PATH = NULL;
+static gchar *LOG_LEVEL_NAME = NULL;
 gboolean TRACE_ENABLED = FALSE;
+gint LOG_LEVEL = G_LOG_LEVEL_DEBUG;
+
+struct WireFormat_t {
+    const char *name;
+    char *(*generate)(const JsonNode *node, uint64_t *resLen);
+    JsonNode *(*buildDom)(const char *buffer, uint64_t bufflen, GError **err);
+    JsonEmitter *(*newEmitter)(void);
+};
+typedef struct WireFormat_t WireFormat;
+
+static const WireFormat wireFormats[] = {
+    { "json", jdGenerator_generate, jdParser_buildDom,
+      jdGenerator_newEmitter },
+    { "binary", jdBinary_generate, jdBinary_buildDom, jdBinary_newEmitter },
+    { NULL, NULL, NULL, NULL }
+};
+
+/* Encoding of requests and responses, json unless --wire-format says
+ * otherwise */
+static const WireFormat *WIRE_FORMAT = &wireFormats[0];
+
+/* Written by the response writers with atomic adds, as every connection
+ * has its own writer, reported by the stats method */
+struct WriterStats_t {
+    /* writev calls, or shm ring writes */
+    gsize writes;
+    gsize frames;
+    gsize bytes;
+    /* Attachments moved with splice or vmsplice, included in bytes */
+    gsize splicedBytes;
+};
+static struct WriterStats_t writerStats;
+
+#define STAT_ADD(counter, n) g_atomic_pointer_add((counter), (gssize) (n))
+#define STAT_GET(counter) ((gsize) g_atomic_pointer_get(&(counter)))
+
+/* Updated by requestReader, reported by the stats method. bytes only
+ * counts what went through the request buffer. */
+struct ReaderStats_t {
+    uint64_t reads;
+    uint64_t frames;
+    uint64_t bytes;
+};
+static struct ReaderStats_t readerStats;
+G_LOCK_DEFINE_STATIC(readerStats);
+
+/* Requests answered without running because they were cancelled or their
+ * deadline passed while they were queued, reported by the stats method */
+struct DroppedStats_t {
+    uint64_t expired;
+    uint64_t cancelled;
+};
+static struct DroppedStats_t droppedStats;
+G_LOCK_DEFINE_STATIC(droppedStats);
+
+/* Guards the pending table of all the connections */
+G_LOCK_DEFINE_STATIC(pendingRequests);
+
+/* A thread pool serving the requests for paths under one mount, so a hung
+ * mount only blocks its own threads and queue slots */
+struct MountPool {
+    const char *mountPoint;
+    GThreadPool *pool;
+    /* idleSlots when no request holds a slot of the pool */
+    gint queueSlotsLeft;
+    gint idleSlots;
+};
+
+/* MountPool by interned mount point, added by the request handler and read
+ * by the stats method. NULL without --max-threads-per-mount. */
+static GHashTable *mountPools = NULL;
+G_LOCK_DEFINE_STATIC(mountPools);
+
+/* How long the mount table is cached, in microseconds */
+#define MOUNT_TABLE_TTL (5 * G_USEC_PER_SEC)
+
+/* A request running on a pool thread, checked by the watchdog */
+struct RunningRequest {
+    long reqId;
+    char *methodName;
+    char *path;
+    gint64 startTime;
+    GThreadPool *pool;
+    gboolean stuck;
+    /* An extra thread was added to the pool for this request */
+    gboolean compensated;
+};
+
+/* The RunningRequest set, NULL without --stuck-timeout. While compensating
+ * is set the pools are alive and extraThreads may be added to them. */
+static GHashTable *runningRequests = NULL;
+static gboolean compensating = FALSE;
+static int extraThreads = 0;
+G_LOCK_DEFINE_STATIC(runningRequests);
+
+/* How often the watchdog checks the running requests, in microseconds */
+#define WATCHDOG_INTERVAL G_USEC_PER_SEC
+
+/* How long socket clients get to read their last responses once the pipes
+ * client exited, in microseconds */
+#define SOCKET_CLOSE_GRACE (5 * G_USEC_PER_SEC)
+
+/* Requests in flight on the io_uring backend, more run on the pools */
+#define URING_ENTRIES 256
+
+/* Set by the request handler if the io_uring backend is used */
+static gint uringEnabled = FALSE;
+
+/* Responses held in the ring of the response queue of a connection, more
+ * wait in its overflow list */
+#define RESPONSE_QUEUE_SIZE 4096
 
-/* Because g_async_queue_push can't take null */
+/* Log lines waiting for their writer thread, more are dropped */
+#define LOG_RING_SIZE 2048
+/* Bytes written to stderr at once */
+#define LOG_WRITE_SIZE (64 * 1024)
+
+/* Because queues can't take null */
 static int stop_value;
 #define STOP_PTR ((gpointer) &stop_value)
 
-static GAsyncQueue *logger_queue;
+static LogRing *logRing;
 
 static inline void stop_request_reader(void) {
     if (READ_PIPE_FD != -1) {
@@ -53,6 +201,42 @@ static GOptionEntry entries[] = {
         "write-pipe-fd", 'w', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
         &WRITE_PIPE_FD, "The pipe FD used to send results back to VDSM", "OUT_FD"
     },
+    {
+        "wire-format", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+        &WIRE_FORMAT_NAME, "Encoding used on the pipes (json, binary)",
+        "FORMAT"
+    },
+    {
+        "shm-fd", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &SHM_FD, "Shared memory holding the request and response rings, "
+        "the pipes are then only used to detect hangups", "SHM_FD"
+    },
+    {
+        "shm-request-fd", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &SHM_REQUEST_FD, "Eventfd signalled when requests are written to "
+        "the shared memory", "EVENT_FD"
+    },
+    {
+        "shm-request-space-fd", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &SHM_REQUEST_SPACE_FD, "Eventfd signalled when requests are read "
+        "from the shared memory", "EVENT_FD"
+    },
+    {
+        "shm-response-fd", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &SHM_RESPONSE_FD, "Eventfd signalled when responses are written to "
+        "the shared memory", "EVENT_FD"
+    },
+    {
+        "shm-response-space-fd", '\0', G_OPTION_FLAG_IN_MAIN,
+        G_OPTION_ARG_INT, &SHM_RESPONSE_SPACE_FD, "Eventfd signalled when "
+        "responses are read from the shared memory", "EVENT_FD"
+    },
+    {
+        "socket", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+        &SOCKET_PATH, "Also serve clients connecting to this unix socket, "
+        "sharing the thread pool with the pipes client. They are "
+        "disconnected when the pipes client exits", "PATH"
+    },
     {
         "max-threads", 't', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
         &MAX_THREADS, "Max threads to be used, 0 for unlimited", "MAX_THREADS"
@@ -61,10 +245,62 @@ static GOptionEntry entries[] = {
         "max-queued-requests", 'q', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
         &MAX_QUEUED_REQUESTS, "Max requests to be queued, -1 for unlimited", "MAX_QUEUED_REQUESTS"
     },
+    {
+        "reserved-threads", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &RESERVED_THREADS, "Threads serving only high priority requests "
+        "when their pool is busy, in addition to max-threads", "THREADS"
+    },
+    {
+        "max-threads-per-mount", '\0', G_OPTION_FLAG_IN_MAIN,
+        G_OPTION_ARG_INT, &MAX_THREADS_PER_MOUNT, "Run requests for paths "
+        "under each mount on a separate pool of this many threads, 0 to use "
+        "one pool for all", "THREADS"
+    },
+    {
+        "max-mount-threads", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &MAX_MOUNT_THREADS, "Max threads of all the mount pools, requests "
+        "for more mounts run on the main pool, 0 for unlimited", "THREADS"
+    },
+    {
+        "stuck-timeout", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &STUCK_TIMEOUT, "Report requests running longer than this many "
+        "seconds as stuck, 0 to disable", "SECONDS"
+    },
+    {
+        "max-extra-threads", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &MAX_EXTRA_THREADS, "Max threads added to replace the threads of "
+        "stuck requests", "THREADS"
+    },
+    {
+        "upload-timeout", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &UPLOAD_TIMEOUT, "Close chunked uploads not used for this many "
+        "seconds, 0 to keep them open until committed or aborted", "SECONDS"
+    },
+    {
+        "io-backend", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+        &IO_BACKEND, "Run simple filesystem requests with 'uring' if the "
+        "kernel supports it, or on the thread pools with 'threads' (default)",
+        "BACKEND"
+    },
+    {
+        "max-write-bytes", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &MAX_WRITE_BYTES, "Stop coalescing responses into one write after "
+        "this many bytes", "BYTES"
+    },
+    {
+        "max-write-iovecs", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+        &MAX_WRITE_IOVECS, "Max buffers in one write, each response takes up "
+        "to 3", "IOVECS"
+    },
     {
         "keep-fds", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
         &KEEP_FDS, "Don't close inherited file discriptors when starting", NULL
     },
+    {
+        "log-level", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+        &LOG_LEVEL_NAME, "Most verbose level logged (DEBUG, INFO, WARNING, "
+        "ERROR), DEBUG by default", "LEVEL"
+    },
     {
         "trace-enabled", '\0', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
         &TRACE_ENABLED, "Enable trace debugging", NULL
@@ -96,14 +332,44 @@ static GThread *create_thread(__attribute__((unused)) const gchar *name,
 #endif
 }
 
+static int writevAll(int fd, struct iovec *iov, int iovcnt,
+                     gboolean countWrites);
+
+/* Levels by name, as written in the log */
+static const struct {
+    const char *name;
+    GLogLevelFlags level;
+} logLevels[] = {
+    { "DEBUG", G_LOG_LEVEL_DEBUG },
+    { "INFO", G_LOG_LEVEL_INFO },
+    { "WARNING", G_LOG_LEVEL_WARNING },
+    { "ERROR", G_LOG_LEVEL_CRITICAL },
+    { NULL }
+};
+
+/* Returns -1 for an unknown level */
+static gint getLogLevel(const char *name) {
+    int i;
+    for (i = 0; logLevels[i].name != NULL; i++) {
+        if (strcmp(logLevels[i].name, name) == 0) {
+            return logLevels[i].level;
+        }
+    }
+
+    return -1;
+}
+
 /* A log function that makes output easy to parse */
 static void logfunc(const gchar *log_domain, GLogLevelFlags log_level,
                     const gchar *message, gpointer user_data) {
-    static const char *format = "%s|%s|%s\n";
-    GAsyncQueue *queue = (GAsyncQueue *) user_data;
+    LogRing *ring = (LogRing *) user_data;
+    const char *parts[5];
     const char *levelStr = NULL;
-    size_t buff_size = -1;
-    char *buff = NULL;
+
+    if (!log_enabled(log_level & G_LOG_LEVEL_MASK)) {
+        return;
+    }
+
     switch(log_level) {
     case G_LOG_LEVEL_WARNING:
         levelStr = "WARNING";
@@ -119,79 +385,140 @@ static void logfunc(const gchar *log_domain, GLogLevelFlags log_level,
         levelStr = "ERROR";
     }
 
-    buff_size = snprintf(NULL, 0, format, levelStr, log_domain, message);
-    buff = malloc(buff_size + 1);
-    if (buff) {
-        // if we can't allocated the buffer we can't really log
-        snprintf(buff, buff_size + 1, format, levelStr, log_domain, message);
-        g_async_queue_push(queue, buff);
-    }
+    parts[0] = levelStr;
+    parts[1] = "|";
+    /* As printf formatted it */
+    parts[2] = log_domain ? log_domain : "(null)";
+    parts[3] = "|";
+    parts[4] = message;
+
+    /* Counted by the ring if it is full */
+    logRing_push(ring, parts, 5);
 }
 
+/* Writes the lines in batches until the ring is closed */
 static void *logWriter(void *data) {
-    FILE *stream = (FILE *) data;
-    size_t nchars = -1;
-    size_t n_written = -1;
-    char *text = NULL;
-
-    while (!feof(stream) && !ferror(stream)) {
-        if (n_written == nchars) {
-            if (text) {
-                free(text);
-                text = NULL;
-            }
-            text = (char*) g_async_queue_pop(logger_queue);
-            n_written = 0;
-            nchars = strlen(text);
-        } else {
-            n_written += fwrite(
-                text + n_written,
-                sizeof(char),
-                nchars - n_written,
-                stream
-            );
+    LogRing *ring = (LogRing *) data;
+    char buffer[LOG_WRITE_SIZE];
+    struct iovec iov;
+    guint reported = 0;
+    guint dropped;
+    size_t len;
+
+    while ((len = logRing_read(ring, buffer, sizeof(buffer))) > 0) {
+        iov.iov_base = buffer;
+        iov.iov_len = len;
+        if (writevAll(STDERR_FILENO, &iov, 1, FALSE) != 0) {
+            /* Nobody is reading, the lines are dropped from now on */
+            break;
         }
-    }
 
-    if (text) {
-        free(text);
+        dropped = logRing_dropped(ring);
+        if (dropped != reported) {
+            g_warning("Dropped %u log messages", dropped - reported);
+            reported = dropped;
+        }
     }
 
     return NULL;
 }
 
+static JsonNode *exp_compound(const JsonNode *args, GError **err);
+static JsonNode *exp_stats(const JsonNode *args, GError **err);
+static JsonNode *exp_stuckRequests(const JsonNode *args, GError **err);
+static JsonNode *exp_methods(const JsonNode *args, GError **err);
+static JsonNode *exp_setLogLevel(const JsonNode *args, GError **err);
 
-
-static ExportedFunctionEntry exportedFunctions[] = {
+static const MethodEntry methods[] = {
     /* testing commands */
-    { "ping", exp_ping },
-    { "echo", exp_echo },
-    { "memstat", exp_memstat },
-    { "crash", exp_crash },
+    { "ping", exp_ping, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    /* May sleep */
+    { "echo", exp_echo, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "memstat", exp_memstat, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "stats", exp_stats, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "methods", exp_methods, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "stuckRequests", exp_stuckRequests, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "setLogLevel", exp_setLogLevel, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT, METHOD_COST_NONE },
+    { "crash", exp_crash, NULL, NULL,
+      0, METHOD_COST_NONE },
     /* exported commands */
-    { "stat", exp_stat },
-    { "lstat", exp_lstat },
-    { "statvfs", exp_statvfs },
-    { "access", exp_access },
-    { "rename", exp_rename },
-    { "unlink", exp_unlink },
-    { "rmdir", exp_rmdir },
-    { "link", exp_link },
-    { "symlink", exp_symlink },
-    { "chmod", exp_chmod },
-    { "readfile", exp_readfile },
-    { "glob", exp_glob },
-    { "listdir", exp_listdir },
-    { "writefile", exp_writefile },
-    { "lexists", exp_lexists },
-    { "truncate", exp_truncate },
-    { "mkdir", exp_mkdir },
-    { "fsyncPath", exp_fsyncPath },
-    { "touch", exp_touch },
-    { "probe_block_size", exp_probe_block_size },
-    { NULL, NULL }
+    { "stat", exp_stat, NULL, exp_stat_emit,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_METADATA },
+    { "lstat", exp_lstat, NULL, exp_lstat_emit,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_METADATA },
+    { "statvfs", exp_statvfs, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_METADATA },
+    { "access", exp_access, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_METADATA },
+    { "rename", exp_rename, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "unlink", exp_unlink, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "rmdir", exp_rmdir, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "link", exp_link, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "symlink", exp_symlink, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "chmod", exp_chmod, NULL, NULL,
+      METHOD_IDEMPOTENT | METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "readfile", exp_readfile, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_DATA },
+    { "readfile_stream", NULL, exp_readfile_stream, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_DATA },
+    { "glob", exp_glob, NULL, exp_glob_emit,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_DATA },
+    { "listdir", exp_listdir, NULL, exp_listdir_emit,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_DATA },
+    { "writefile", exp_writefile, NULL, NULL,
+      METHOD_IDEMPOTENT | METHOD_BLOCKING, METHOD_COST_DATA },
+    { "writefile_open", exp_writefile_open, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "writefile_chunk", exp_writefile_chunk, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_DATA },
+    { "writefile_commit", exp_writefile_commit, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_DATA },
+    { "writefile_abort", exp_writefile_abort, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "lexists", exp_lexists, NULL, NULL,
+      METHOD_READ_ONLY | METHOD_IDEMPOTENT | METHOD_BLOCKING,
+      METHOD_COST_METADATA },
+    { "truncate", exp_truncate, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "mkdir", exp_mkdir, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "fsyncPath", exp_fsyncPath, NULL, NULL,
+      METHOD_IDEMPOTENT | METHOD_BLOCKING, METHOD_COST_DATA },
+    { "touch", exp_touch, NULL, NULL,
+      METHOD_IDEMPOTENT | METHOD_BLOCKING, METHOD_COST_METADATA },
+    { "probe_block_size", exp_probe_block_size, NULL, NULL,
+      METHOD_IDEMPOTENT | METHOD_BLOCKING, METHOD_COST_DATA },
+    { "compound", exp_compound, NULL, NULL,
+      METHOD_BLOCKING, METHOD_COST_DATA },
+    { NULL }
 };
 
+/* Methods by name, built at startup and read only after that */
+static GHashTable *methodRegistry = NULL;
+static int methodCount = 0;
+/* Indexed by method id */
+static MethodStats *methodStats = NULL;
+
 /* Close FDs that you got from fork but you don't need.
  * whitelist is an array that ends with a -1 */
 static int closeUnrelatedFDs(int whitelist[]) {
@@ -283,6 +610,17 @@ static int closeUnrelatedFDs(int whitelist[]) {
     return 0;
 }
 
+static const WireFormat *getWireFormat(const char *name) {
+    int i;
+    for (i = 0; wireFormats[i].name != NULL; i++) {
+        if (strcmp(wireFormats[i].name, name) == 0) {
+            return &wireFormats[i];
+        }
+    }
+
+    return NULL;
+}
+
 static int parseCmdLine(int argc, char *argv[]) {
     GError *error = NULL;
     GOptionContext *context;
@@ -309,6 +647,32 @@ static int parseCmdLine(int argc, char *argv[]) {
       goto clean;
     }
 
+    if (MAX_THREADS_PER_MOUNT < 0 || MAX_MOUNT_THREADS < 0) {
+      g_print("options 'max-threads-per-mount' and 'max-mount-threads' "
+              "cannot be negative\n");
+      rv = -1;
+      goto clean;
+    }
+
+    if (STUCK_TIMEOUT < 0 || MAX_EXTRA_THREADS < 0) {
+      g_print("options 'stuck-timeout' and 'max-extra-threads' cannot be "
+              "negative\n");
+      rv = -1;
+      goto clean;
+    }
+
+    if (UPLOAD_TIMEOUT < 0) {
+      g_print("option 'upload-timeout' cannot be negative\n");
+      rv = -1;
+      goto clean;
+    }
+
+    if (RESERVED_THREADS < 0) {
+      g_print("option 'reserved-threads' cannot be negative\n");
+      rv = -1;
+      goto clean;
+    }
+
     if (MAX_QUEUED_REQUESTS >=0 && MAX_THREADS == 0) {
       g_print("option 'max-queued-requests' only works when a the thread pool "
               "has been capped\n");
@@ -316,404 +680,3385 @@ static int parseCmdLine(int argc, char *argv[]) {
       goto clean;
     }
 
+    if (SHM_FD >= 0 && (SHM_REQUEST_FD < 0 || SHM_REQUEST_SPACE_FD < 0 ||
+                        SHM_RESPONSE_FD < 0 || SHM_RESPONSE_SPACE_FD < 0)) {
+        g_print("option 'shm-fd' requires all the shm eventfd options\n");
+        rv = -1;
+        goto clean;
+    }
+
+    if (MAX_WRITE_BYTES <= 0) {
+      g_print("option 'max-write-bytes' must be positive\n");
+      rv = -1;
+      goto clean;
+    }
+
+    if (MAX_WRITE_IOVECS < 3 || MAX_WRITE_IOVECS > IOV_MAX) {
+      g_print("option 'max-write-iovecs' must be between 3 and %d\n",
+              IOV_MAX);
+      rv = -1;
+      goto clean;
+    }
+
+    if (IO_BACKEND && strcmp(IO_BACKEND, "threads") != 0 &&
+        strcmp(IO_BACKEND, "uring") != 0) {
+        g_print("unknown io backend '%s'\n", IO_BACKEND);
+        rv = -1;
+        goto clean;
+    }
+
+    if (LOG_LEVEL_NAME) {
+        LOG_LEVEL = getLogLevel(LOG_LEVEL_NAME);
+        if (LOG_LEVEL < 0) {
+            g_print("unknown log level '%s'\n", LOG_LEVEL_NAME);
+            rv = -1;
+            goto clean;
+        }
+    }
+
+    if (WIRE_FORMAT_NAME) {
+        WIRE_FORMAT = getWireFormat(WIRE_FORMAT_NAME);
+        if (!WIRE_FORMAT) {
+            g_print("unknown wire format '%s'\n", WIRE_FORMAT_NAME);
+            rv = -1;
+            goto clean;
+        }
+    }
+
 clean:
     g_option_context_free(context);
 
     return rv;
 }
 
-static ExportedFunction getCallback(const char *methodName) {
+static void initMethodRegistry(void) {
     int i;
-    for (i = 0; exportedFunctions[i].name != NULL; i++) {
-        if (strcmp(exportedFunctions[i].name, methodName) != 0) {
-            continue;
-        }
 
-        return exportedFunctions[i].callback;
+    methodRegistry = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; methods[i].name != NULL; i++) {
+        g_hash_table_insert(methodRegistry, (gpointer) methods[i].name,
+                            (gpointer) &methods[i]);
     }
 
-    return NULL;
+    methodCount = i;
+    methodStats = g_new0(MethodStats, methodCount);
 }
 
-static void extractRequestInfo(const JsonNode *reqInfo, char **methodName,
-                               long *reqId, JsonNode **args, GError **err) {
-    GError *tmpError = NULL;
-    GString *methodNameStr;
+static void freeMethodRegistry(void) {
+    g_hash_table_destroy(methodRegistry);
+    methodRegistry = NULL;
+    g_free(methodStats);
+    methodStats = NULL;
+}
 
-    safeGetArgValues(reqInfo, &tmpError, 2,
-                     "id", JT_LONG, reqId,
-                     "methodName", JT_STRING, &methodNameStr
-                    );
+static MethodStats *getMethodStats(const MethodEntry *method) {
+    return &methodStats[method - methods];
+}
 
-    if(tmpError) {
-        g_propagate_error(err, tmpError);
-        return;
-    }
+static const MethodEntry *lookupMethod(const char *methodName) {
+    return g_hash_table_lookup(methodRegistry, methodName);
+}
 
-    *methodName = g_strdup(methodNameStr->str);
+/* Fields of a request, or of a step or item of compound and batch
+ * requests */
+struct RequestInfo {
+    long id;
+    GString *methodName;
+};
 
-    *args = JsonNode_map_lookup(reqInfo, "args", NULL);
+static const ArgSpec requestIdArgs[] = {
+    ARG(JT_LONG, "id", struct RequestInfo, id),
+};
 
-    return;
-}
+static const ArgSpec requestMethodArgs[] = {
+    ARG(JT_STRING, "methodName", struct RequestInfo, methodName),
+};
 
-static JsonNode *buildResponse(long id, const GError *err, JsonNode *result) {
-    int errcode = 0;
-    const char *errstr = "SUCCESS";
-    JsonNode *resp;
+static ArgSchema requestIdSchema = ARG_SCHEMA(requestIdArgs);
+static ArgSchema requestMethodSchema = ARG_SCHEMA(requestMethodArgs);
 
-    if (err) {
-        errcode = err->code;
-        errstr = err->message;
-    }
-    if (result == NULL) {
-        result = JsonNode_newMap();
-    }
+/* Arguments of compound and batch */
+struct RequestsArgs {
+    GArray *requests;
+};
 
-    resp = JsonNode_newMap();
-    JsonNode_map_insert(resp, "id", JsonNode_newFromLong(id), NULL);
-    JsonNode_map_insert(resp, "errcode", JsonNode_newFromLong(errcode), NULL);
-    JsonNode_map_insert(resp, "errstr", JsonNode_newFromString(errstr), NULL);
-    JsonNode_map_insert(resp, "result", result, NULL);
-    return resp;
-}
+static const ArgSpec requestsArgs[] = {
+    ARG(JT_ARRAY, "requests", struct RequestsArgs, requests),
+};
 
-struct IOProcessCtx_t {
-    GAsyncQueue *requestQueue;
-    GAsyncQueue *responseQueue;
-    int readPipe;
-    int writePipe;
+static ArgSchema requestsSchema = ARG_SCHEMA(requestsArgs);
+
+/* Arguments of streaming methods handled by ioprocess itself */
+struct StreamArgs {
+    long window;
 };
-typedef struct IOProcessCtx_t IOProcessCtx;
 
-struct RequestParams {
-    gint64 reqTime;
-    JsonNode *reqObj;
-    GAsyncQueue *responseQueue;
+static const ArgSpec streamArgs[] = {
+    ARG_OPTIONAL(JT_LONG, "window", struct StreamArgs, window, 0),
 };
 
-static void servQueueFull(struct RequestParams *params) {
-    GError *gerr = NULL;
-    JsonNode *response = NULL;
-    long reqId = -1;
-    GAsyncQueue *responseQueue = params->responseQueue;
-    safeGetArgValues(params->reqObj, NULL, 1,
-         "id", JT_LONG, &reqId
-    );
+static ArgSchema streamSchema = ARG_SCHEMA(streamArgs);
 
-    g_warning("(%li) Request queue full", reqId);
-    g_set_error(&gerr,
-        IOPROCESS_GENERAL_ERROR,
-        EAGAIN, "%s", iop_strerror(EAGAIN)
-    );
+/* Returns the method called by a request, a batch item or a compound
+ * step, or NULL and sets err */
+static const MethodEntry *requestMethod(const JsonNode *reqObj,
+                                        GError **err) {
+    struct RequestInfo info;
+    const MethodEntry *method;
 
-    response = buildResponse(reqId, gerr, NULL);
-    if (!response) {
-        g_warning("(%li) Could not build response object", reqId);
-        goto clean;
+    if (getArgs(reqObj, &requestMethodSchema, &info, err) < 0) {
+        return NULL;
     }
 
-    g_async_queue_push(responseQueue, response);
-clean:
-    if (gerr) {
-        g_error_free(gerr);
+    method = lookupMethod(info.methodName->str);
+    if (!method) {
+        g_set_error(err, 0, EINVAL, "No such method '%s'",
+                    info.methodName->str);
     }
+
+    return method;
 }
 
-static void servRequest(void *data, void *queueSlotsLeft) {
-    ExportedFunction callback;
-    struct RequestParams *params = (struct RequestParams *) data;
-    char *methodName = NULL;
-    GError *err = NULL;
-    long reqId = -1;
-    JsonNode *reqInfo = params->reqObj;
-    GAsyncQueue *responseQueue = params->responseQueue;
-    JsonNode *args = NULL;
-    JsonNode *response;
-    JsonNode *result = NULL;
-    gint64 startTime;
+static void extractRequestInfo(const JsonNode *reqInfo, long *reqId,
+                               JsonNode **args, GError **err) {
+    struct RequestInfo info;
 
-    g_trace("Extracting request information...");
-    extractRequestInfo(reqInfo, &methodName, &reqId, &args, &err);
-    if (err) {
-        g_warning("Could not extract params: %s", err->message);
-        goto clean;
+    if (getArgs(reqInfo, &requestIdSchema, &info, err) < 0) {
+        return;
     }
 
+    *reqId = info.id;
+    *args = JsonNode_map_lookup(reqInfo, "args", NULL);
+}
 
-    g_trace("(%li) Finding callback '%s'...", reqId, methodName);
-    callback = getCallback(methodName);
-    if (!callback) {
-        err = g_error_new(0, EINVAL,
-                          "No such method '%s'", methodName);
-        goto respond;
-    }
+/* Read exactly len bytes from fd, returns 0 or the errno value */
+static int readFd(int fd, void *buffer, uint64_t len) {
+    uint64_t bytesRead = 0;
+    ssize_t n;
 
-    startTime = g_get_monotonic_time();
+    while (bytesRead < len) {
+        n = read(fd, (char *) buffer + bytesRead, len - bytesRead);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-    g_debug("(%li) Start request for method '%s' (waitTime=%" PRId64 ")",
-            reqId, methodName, startTime - params->reqTime);
+            return errno;
+        } else if (n == 0) {
+            return EPIPE;
+        }
 
-    result = callback(args, &err);
+        bytesRead += n;
+    }
 
-    g_debug("(%li) Finished request for method '%s' (runTime=%" PRId64 ")",
-            reqId, methodName, g_get_monotonic_time() - startTime);
+    return 0;
+}
 
-respond:
-    g_trace("(%li) Building response", reqId);
+/* Only a top level result can be spliced into the response, nested ones are
+ * turned into plain binary nodes */
+static JsonNode *unsplice(JsonNode *node) {
+    JsonSplice *splice;
+    GByteArray *bytes;
+    int rv = 0;
 
-    if (!result) {
-        result = JsonNode_newMap();
+    if (!node || JsonNode_getType(node) != JT_SPLICE) {
+        return node;
     }
 
-    response = buildResponse(reqId, err, result);
-    if (!response) {
-        g_warning("(%li) Could not build response object", reqId);
-        goto clean;
+    splice = JsonNode_getSplice(node);
+    bytes = g_byte_array_sized_new(splice->size);
+    g_byte_array_set_size(bytes, splice->size);
+    if (splice->pipeFd != -1) {
+        rv = readFd(splice->pipeFd, bytes->data, splice->size);
+    } else {
+        memcpy(bytes->data, splice->map, splice->size);
     }
 
-    g_trace("(%li) Queuing response", reqId);
-    g_async_queue_push(responseQueue, response);
-
-clean:
-    free(params);
-
-    if (methodName) {
-        free(methodName);
-    }
+    JsonNode_free(node);
 
-    if (err) {
-        g_error_free(err);
+    if (rv != 0) {
+        g_warning("Could not read spliced data: %s", iop_strerror(rv));
+        g_byte_array_set_size(bytes, 0);
     }
 
-    JsonNode_free(reqInfo);
-    if (MAX_QUEUED_REQUESTS >= 0) {
-        g_atomic_int_inc((gint*) queueSlotsLeft);
-        g_debug("(%li) Dequeuing request (slotsLeft=%i)", reqId,
-                *(gint*)queueSlotsLeft);
-    }
+    return JsonNode_newFromByteArray(bytes);
 }
 
-static void *requestHandler(void *data) {
-    gint queueSlotsLeft = MAX_THREADS + MAX_QUEUED_REQUESTS + 1;
-    IOProcessCtx *ctx = (IOProcessCtx *) data;
-    GAsyncQueue *requestQueue = ctx->requestQueue;
-    GAsyncQueue *responseQueue = ctx->responseQueue;
-    JsonNode *reqObj;
-    GError *gerr = NULL;
-    GThreadPool *threadPool;
-    struct RequestParams *reqParams;
-    int err = 0;
-
-    threadPool = g_thread_pool_new(servRequest, /* entry point */
-                                   /* pool specific user data */
-                                   &queueSlotsLeft,
-                                   /* max threads, -1 for unlimited */
-                                   (!MAX_THREADS) ? -1 : MAX_THREADS,
-                                   /* don't create immediately,
-                                      share with others */
-                                   FALSE,
-                                   &gerr);
-    if (gerr) {
-      g_warning("%s", gerr->message);
-      err = gerr->code;
-      g_error_free(gerr);
-      gerr = NULL;
-      return new_thread_result(err);
+/* Runs a list of {methodName, args} steps in order on the calling worker,
+ * stopping at the first failing step. Returns the results of the steps that
+ * ran; on failure err holds the error of the failing step. */
+static JsonNode *exp_compound(const JsonNode *args, GError **err) {
+    GError *tmpError = NULL;
+    struct RequestsArgs arg;
+    const MethodEntry *method;
+    JsonNode *results;
+    JsonNode *step;
+    JsonNode *stepArgs;
+    JsonNode *result;
+    unsigned int i;
+
+    if (getArgs(args, &requestsSchema, &arg, err) < 0) {
+        return NULL;
     }
 
-    while (TRUE) {
-        GError *gerr = NULL;
-        reqObj = (JsonNode *) g_async_queue_pop(requestQueue);
-        /* Check if we're stopping */
-        if (reqObj == STOP_PTR) {
-            err = 0;
-            break;
+    results = JsonNode_newArray();
+    for (i = 0; i < arg.requests->len; i++) {
+        step = g_array_index(arg.requests, JsonNode *, i);
+
+        method = requestMethod(step, &tmpError);
+        if (!method) {
+            goto fail;
         }
 
-        reqParams = malloc(sizeof(struct RequestParams));
-        if (!reqParams) {
-            g_warning("Could not allocate request params");
-            err = ENOMEM;
-            break;
+        if (method->callback == exp_compound) {
+            g_set_error(&tmpError, 0, EINVAL,
+                        "Nested compound requests are not supported");
+            goto fail;
         }
-        reqParams->reqTime = g_get_monotonic_time();
-        reqParams->reqObj = reqObj;
-        reqParams->responseQueue = responseQueue;
 
-        if (MAX_QUEUED_REQUESTS >= 0 &&
-            g_atomic_int_dec_and_test(&queueSlotsLeft)) {
-            servQueueFull(reqParams);
-            g_atomic_int_inc(&queueSlotsLeft);
-        } else {
-            /* TODO: log request id */
-            g_debug("Queuing request (slotsLeft=%i)", queueSlotsLeft);
+        if (!method->callback) {
+            g_set_error(&tmpError, 0, EINVAL,
+                        "Streaming method '%s' can't be a compound step",
+                        method->name);
+            goto fail;
+        }
 
-            g_thread_pool_push(threadPool, reqParams, &gerr);
-            if (gerr) {
-                    g_warning("%s", gerr->message);
-                    err = gerr->code;
-                    g_error_free(gerr);
-                    gerr = NULL;
-                    break;
-            }
+        stepArgs = JsonNode_map_lookup(step, "args", NULL);
+        result = method->callback(stepArgs, &tmpError);
+        if (tmpError) {
+            JsonNode_free(result);
+            goto fail;
         }
+
+        JsonNode_array_append(results,
+                              result ? unsplice(result) : JsonNode_newMap(),
+                              NULL);
     }
 
-    /* Initiate shutdown by not accepting any more requests. */
-    stop_request_reader();
+    return results;
 
-    /* Flush the thread pool */
-    g_thread_pool_free(threadPool, FALSE, TRUE);
+fail:
+    g_propagate_prefixed_error(err, tmpError, "step %u: ", i);
+    return results;
+}
 
-    /* Push null to responseQueue to signal we're done */
-    g_async_queue_push(responseQueue, STOP_PTR);
+static JsonNode *exp_stats(__attribute__((unused)) const JsonNode *args,
+                           __attribute__((unused)) GError **err) {
+    struct WriterStats_t writer;
+    struct ReaderStats_t reader;
+    struct DroppedStats_t dropped;
+    JsonNode *writerNode;
+    JsonNode *readerNode;
+    JsonNode *droppedNode;
+    JsonNode *logNode;
+    JsonNode *methodsNode;
+    JsonNode *mountsNode;
+    JsonNode *mountNode;
+    struct MountPool *mountPool;
+    GHashTableIter iter;
+    JsonNode *result;
+    int i;
+
+    writer.writes = STAT_GET(writerStats.writes);
+    writer.frames = STAT_GET(writerStats.frames);
+    writer.bytes = STAT_GET(writerStats.bytes);
+    writer.splicedBytes = STAT_GET(writerStats.splicedBytes);
+
+    G_LOCK(readerStats);
+    reader = readerStats;
+    G_UNLOCK(readerStats);
+
+    G_LOCK(droppedStats);
+    dropped = droppedStats;
+    G_UNLOCK(droppedStats);
+
+    readerNode = JsonNode_newMap();
+    JsonNode_map_insert(readerNode, "reads",
+                        JsonNode_newFromLong(reader.reads), NULL);
+    JsonNode_map_insert(readerNode, "frames",
+                        JsonNode_newFromLong(reader.frames), NULL);
+    JsonNode_map_insert(readerNode, "bytes",
+                        JsonNode_newFromLong(reader.bytes), NULL);
+
+    writerNode = JsonNode_newMap();
+    JsonNode_map_insert(writerNode, "writes",
+                        JsonNode_newFromLong(writer.writes), NULL);
+    JsonNode_map_insert(writerNode, "frames",
+                        JsonNode_newFromLong(writer.frames), NULL);
+    JsonNode_map_insert(writerNode, "bytes",
+                        JsonNode_newFromLong(writer.bytes), NULL);
+    JsonNode_map_insert(writerNode, "splicedBytes",
+                        JsonNode_newFromLong(writer.splicedBytes), NULL);
+    JsonNode_map_insert(writerNode, "framesPerWrite",
+                        JsonNode_newFromDouble(writer.writes ?
+                            (double) writer.frames / writer.writes : 0),
+                        NULL);
+
+    droppedNode = JsonNode_newMap();
+    JsonNode_map_insert(droppedNode, "expired",
+                        JsonNode_newFromLong(dropped.expired), NULL);
+    JsonNode_map_insert(droppedNode, "cancelled",
+                        JsonNode_newFromLong(dropped.cancelled), NULL);
+
+    logNode = JsonNode_newMap();
+    JsonNode_map_insert(logNode, "dropped",
+                        JsonNode_newFromLong(logRing_dropped(logRing)), NULL);
+
+    /* Only the methods called so far */
+    methodsNode = JsonNode_newMap();
+    for (i = 0; i < methodCount; i++) {
+        if (g_atomic_pointer_get(&methodStats[i].calls)) {
+            JsonNode_map_insert(methodsNode, methods[i].name,
+                                methodStats_toJson(&methodStats[i]), NULL);
+        }
+    }
+
+    mountsNode = JsonNode_newMap();
+    G_LOCK(mountPools);
+    if (mountPools) {
+        g_hash_table_iter_init(&iter, mountPools);
+        while (g_hash_table_iter_next(&iter, NULL, (void **) &mountPool)) {
+            mountNode = JsonNode_newMap();
+            JsonNode_map_insert(mountNode, "queued", JsonNode_newFromLong(
+                g_thread_pool_unprocessed(mountPool->pool)), NULL);
+            JsonNode_map_insert(mountNode, "threads", JsonNode_newFromLong(
+                g_thread_pool_get_num_threads(mountPool->pool)), NULL);
+            JsonNode_map_insert(mountsNode, mountPool->mountPoint, mountNode,
+                                NULL);
+        }
+    }
+    G_UNLOCK(mountPools);
+
+    result = JsonNode_newMap();
+    JsonNode_map_insert(result, "reader", readerNode, NULL);
+    JsonNode_map_insert(result, "writer", writerNode, NULL);
+    JsonNode_map_insert(result, "dropped", droppedNode, NULL);
+    JsonNode_map_insert(result, "log", logNode, NULL);
+    JsonNode_map_insert(result, "methods", methodsNode, NULL);
+    JsonNode_map_insert(result, "mounts", mountsNode, NULL);
+    JsonNode_map_insert(result, "ioBackend", JsonNode_newFromString(
+        g_atomic_int_get(&uringEnabled) ? "uring" : "threads"), NULL);
+    return result;
+}
+
+/* Lists the requests the watchdog marked as stuck, with their age in
+ * seconds */
+static JsonNode *exp_stuckRequests(
+        __attribute__((unused)) const JsonNode *args,
+        __attribute__((unused)) GError **err) {
+    struct RunningRequest *running;
+    GHashTableIter iter;
+    JsonNode *requests = JsonNode_newArray();
+    JsonNode *entry;
+    gint64 now = g_get_monotonic_time();
+
+    G_LOCK(runningRequests);
+    if (runningRequests) {
+        g_hash_table_iter_init(&iter, runningRequests);
+        while (g_hash_table_iter_next(&iter, NULL, (void **) &running)) {
+            if (!running->stuck) {
+                continue;
+            }
+
+            entry = JsonNode_newMap();
+            JsonNode_map_insert(entry, "id",
+                                JsonNode_newFromLong(running->reqId), NULL);
+            JsonNode_map_insert(entry, "methodName",
+                                JsonNode_newFromString(running->methodName),
+                                NULL);
+            JsonNode_map_insert(entry, "path", running->path ?
+                                JsonNode_newFromString(running->path) :
+                                JsonNode_newNull(), NULL);
+            JsonNode_map_insert(entry, "age", JsonNode_newFromDouble(
+                (double) (now - running->startTime) / G_USEC_PER_SEC), NULL);
+            JsonNode_map_insert(entry, "compensated",
+                                JsonNode_newFromBoolean(running->compensated),
+                                NULL);
+            JsonNode_array_append(requests, entry, NULL);
+        }
+    }
+    G_UNLOCK(runningRequests);
+
+    return requests;
+}
+
+static const char *methodCostNames[] = {
+    [METHOD_COST_NONE] = "none",
+    [METHOD_COST_METADATA] = "metadata",
+    [METHOD_COST_DATA] = "data",
+};
+
+/* Lists the methods with their attributes */
+static JsonNode *exp_methods(__attribute__((unused)) const JsonNode *args,
+                             __attribute__((unused)) GError **err) {
+    JsonNode *result = JsonNode_newArray();
+    JsonNode *entry;
+    int i;
+
+    for (i = 0; i < methodCount; i++) {
+        entry = JsonNode_newMap();
+        JsonNode_map_insert(entry, "name",
+                            JsonNode_newFromString(methods[i].name), NULL);
+        JsonNode_map_insert(entry, "readOnly", JsonNode_newFromBoolean(
+            (methods[i].flags & METHOD_READ_ONLY) != 0), NULL);
+        JsonNode_map_insert(entry, "idempotent", JsonNode_newFromBoolean(
+            (methods[i].flags & METHOD_IDEMPOTENT) != 0), NULL);
+        JsonNode_map_insert(entry, "blocking", JsonNode_newFromBoolean(
+            (methods[i].flags & METHOD_BLOCKING) != 0), NULL);
+        JsonNode_map_insert(entry, "cost", JsonNode_newFromString(
+            methodCostNames[methods[i].cost]), NULL);
+        JsonNode_array_append(result, entry, NULL);
+    }
+
+    return result;
+}
+
+struct LogLevelArgs {
+    GString *level;
+};
+
+static const ArgSpec logLevelArgs[] = {
+    ARG(JT_STRING, "level", struct LogLevelArgs, level),
+};
+
+static ArgSchema logLevelSchema = ARG_SCHEMA(logLevelArgs);
+
+/* Changes the most verbose level logged */
+static JsonNode *exp_setLogLevel(const JsonNode *args, GError **err) {
+    struct LogLevelArgs arg;
+    gint level;
+
+    if (getArgs(args, &logLevelSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    level = getLogLevel(arg.level->str);
+    if (level < 0) {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "Unknown log level '%s'", arg.level->str);
+        return NULL;
+    }
+
+    g_atomic_int_set(&LOG_LEVEL, level);
+    return NULL;
+}
+
+/* Writes the fields every response starts with, into an open map */
+static void emitEnvelope(JsonEmitter *out, long id, const GError *err) {
+    JsonEmitter_key(out, "id");
+    JsonEmitter_long(out, id);
+    JsonEmitter_key(out, "errcode");
+    JsonEmitter_long(out, err ? err->code : 0);
+    JsonEmitter_key(out, "errstr");
+    JsonEmitter_string(out, err ? err->message : "SUCCESS");
+}
+
+static JsonNode *buildResponse(long id, const GError *err, JsonNode *result) {
+    JsonEmitter *out;
+    JsonNode *resp = NULL;
+
+    out = JsonEmitter_newDom();
+    if (out) {
+        JsonEmitter_openMap(out);
+        emitEnvelope(out, id, err);
+        JsonEmitter_closeMap(out);
+        resp = JsonEmitter_finishDom(out);
+    }
+
+    if (!resp) {
+        JsonNode_free(result);
+        return NULL;
+    }
+
+    if (result == NULL) {
+        result = JsonNode_newMap();
+    }
+
+    if (JsonNode_getType(result) == JT_BINARY) {
+        /* Raw bytes are sent as an attachment following the envelope */
+        JsonNode_map_insert(resp, "attachmentSize",
+            JsonNode_newFromLong(JsonNode_getByteArray(result)->len), NULL);
+        JsonNode_map_insert(resp, "attachment", result, NULL);
+        result = JsonNode_newNull();
+    } else if (JsonNode_getType(result) == JT_SPLICE) {
+        JsonNode_map_insert(resp, "attachmentSize",
+            JsonNode_newFromLong(JsonNode_getSplice(result)->size), NULL);
+        JsonNode_map_insert(resp, "attachment", result, NULL);
+        result = JsonNode_newNull();
+    }
+
+    JsonNode_map_insert(resp, "result", result, NULL);
+    return resp;
+}
+
+struct Transport_t;
+
+/* The listening socket and the socket connections, which are shut down
+ * when the pipes client goes away */
+struct SocketServer {
+    int fd;
+    GAsyncQueue *requestQueue;
+    GMutex lock;
+    GCond cond;
+    /* Connections not freed yet */
+    GHashTable *conns;
+    /* Connections whose request reader is still running */
+    guint readers;
+};
+
+/* A client connection, the pipes client or a socket client. All the
+ * connections share requestQueue and the thread pool, each has its own
+ * request reader, response writer and responseQueue. */
+struct IOProcessCtx_t {
+    GAsyncQueue *requestQueue;
+    MpscQueue *responseQueue;
+    int readPipe;
+    int writePipe;
+    const struct Transport_t *transport;
+    /* Only used by the shm transport */
+    ShmRing requestRing;
+    ShmRing responseRing;
+    /* One held by the request reader and one by every request of this
+     * connection, the response writer stops when the last is dropped */
+    gint refs;
+    /* Set when the response writer can't write anymore, streams waiting
+     * for it give up */
+    gint writerStopped;
+    /* Socket connections are freed by their response writer, which joins
+     * the request reader */
+    gboolean isSocket;
+    GThread *readerThread;
+    struct SocketServer *server;
+    /* Requests waiting in the thread pool queue by id, so they can be
+     * cancelled */
+    GHashTable *pending;
+    /* Streams being sent by id, so the client can acknowledge their chunks
+     * and cancel them */
+    GHashTable *streams;
+};
+typedef struct IOProcessCtx_t IOProcessCtx;
+
+static void refConnection(IOProcessCtx *conn) {
+    g_atomic_int_inc(&conn->refs);
+}
+
+static void unrefConnection(IOProcessCtx *conn) {
+    if (g_atomic_int_dec_and_test(&conn->refs)) {
+        /* No more requests can use the uploads of this connection */
+        abortUploads(conn);
+        /* No more responses for this connection */
+        mpscQueue_push(conn->responseQueue, STOP_PTR);
+    }
+}
+
+static void addSocketConnection(IOProcessCtx *conn) {
+    struct SocketServer *server = conn->server;
+
+    g_mutex_lock(&server->lock);
+    g_hash_table_insert(server->conns, conn, conn);
+    server->readers++;
+    g_mutex_unlock(&server->lock);
+}
+
+static void socketReaderDone(IOProcessCtx *conn) {
+    struct SocketServer *server = conn->server;
+
+    g_mutex_lock(&server->lock);
+    server->readers--;
+    g_cond_broadcast(&server->cond);
+    g_mutex_unlock(&server->lock);
+}
+
+static void removeSocketConnection(IOProcessCtx *conn) {
+    struct SocketServer *server = conn->server;
+
+    g_mutex_lock(&server->lock);
+    g_hash_table_remove(server->conns, conn);
+    g_cond_broadcast(&server->cond);
+    g_mutex_unlock(&server->lock);
+}
+
+/* How requests and responses move between the client and ioprocess */
+struct Transport_t {
+    const char *name;
+    /* Like read(2) */
+    ssize_t (*read)(IOProcessCtx *ctx, void *buffer, size_t len);
+    /* Writes all the iovecs, returns 0 or the errno value */
+    int (*writev)(IOProcessCtx *ctx, struct iovec *iov, int iovcnt);
+    /* Writes the data of a JT_SPLICE node, returns 0 or the errno value */
+    int (*splice)(IOProcessCtx *ctx, JsonSplice *data);
+};
+typedef struct Transport_t Transport;
+
+/* A response sent as a sequence of chunk frames followed by a final
+ * response. Only one chunk is held at a time: the worker waits until the
+ * writer has sent it before reading the next one. */
+struct ResponseStream {
+    gint64 reqId;
+    IOProcessCtx *conn;
+    const MethodEntry *method;
+    GMutex lock;
+    GCond cond;
+    /* Set while the last chunk waits for the writer */
+    gboolean writing;
+    /* The client acknowledges the chunks it consumed and buffers up to
+     * window chunks, it does not acknowledge them if window is 0 */
+    long window;
+    guint64 sent;
+    guint64 acked;
+    /* The stream fails if the client acknowledges nothing for this long,
+     * the timeout of the request, or 0 to wait forever */
+    gint64 ackTimeout;
+    gboolean cancelled;
+    gint refs;
+};
+
+/* Queued on responseQueue */
+struct Response {
+    JsonNode *obj;
+    /* Set instead of obj if the response was encoded by the worker */
+    char *buffer;
+    uint64_t size;
+    /* Set for the chunks of a streamed response */
+    struct ResponseStream *stream;
+    /* The arena obj was built in, released once obj is sent */
+    JsonArena *arena;
+    /* Counts the response in its stats, NULL for other responses */
+    const MethodEntry *method;
+};
+
+static void queueResponse(MpscQueue *responseQueue, JsonNode *obj,
+                          struct ResponseStream *stream,
+                          const MethodEntry *method) {
+    struct Response *response = malloc(sizeof(struct Response));
+    if (!response) {
+        g_warning("Could not allocate response");
+        JsonNode_free(obj);
+        return;
+    }
+
+    response->obj = obj;
+    response->buffer = NULL;
+    response->size = 0;
+    response->stream = stream;
+    response->arena = JsonArena_ref(JsonArena_getCurrent());
+    response->method = method;
+    mpscQueue_push(responseQueue, response);
+}
+
+/* Queues a response encoded in the wire format, taking ownership of
+ * buffer */
+static void queueEncodedResponse(MpscQueue *responseQueue, char *buffer,
+                                 uint64_t size, const MethodEntry *method) {
+    struct Response *response = malloc(sizeof(struct Response));
+    if (!response) {
+        g_warning("Could not allocate response");
+        free(buffer);
+        return;
+    }
+
+    response->obj = NULL;
+    response->buffer = buffer;
+    response->size = size;
+    response->stream = NULL;
+    response->arena = NULL;
+    response->method = method;
+    mpscQueue_push(responseQueue, response);
+}
+
+static struct ResponseStream *newResponseStream(long reqId,
+                                                IOProcessCtx *conn,
+                                                const MethodEntry *method,
+                                                long window) {
+    struct ResponseStream *stream = calloc(1, sizeof(struct ResponseStream));
+    if (!stream) {
+        return NULL;
+    }
+
+    stream->reqId = reqId;
+    stream->conn = conn;
+    stream->method = method;
+    g_mutex_init(&stream->lock);
+    g_cond_init(&stream->cond);
+    stream->window = window;
+    stream->refs = 1;
+    return stream;
+}
+
+static void unrefResponseStream(struct ResponseStream *stream) {
+    if (g_atomic_int_dec_and_test(&stream->refs)) {
+        g_cond_clear(&stream->cond);
+        g_mutex_clear(&stream->lock);
+        free(stream);
+    }
+}
+
+/* Called by the writer once a chunk was sent */
+static void releaseStreamChunk(struct ResponseStream *stream) {
+    g_mutex_lock(&stream->lock);
+    stream->writing = FALSE;
+    g_cond_signal(&stream->cond);
+    g_mutex_unlock(&stream->lock);
+    unrefResponseStream(stream);
+}
+
+/* Waits until the writer sent the last chunk and the client has room for
+ * the next one. Returns 0 or the errno value. */
+static int waitStreamCredit(struct ResponseStream *stream) {
+    gint64 giveUp = 0;
+    int rv = 0;
+
+    if (stream->ackTimeout) {
+        giveUp = g_get_monotonic_time() + stream->ackTimeout;
+    }
+
+    g_mutex_lock(&stream->lock);
+    while (TRUE) {
+        if (stream->cancelled) {
+            rv = ECANCELED;
+            break;
+        }
+
+        if (!stream->writing &&
+            (stream->window == 0 ||
+             stream->sent - stream->acked < (guint64) stream->window)) {
+            break;
+        }
+
+        if (g_atomic_int_get(&stream->conn->writerStopped)) {
+            rv = EPIPE;
+            break;
+        }
+
+        if (!stream->writing && giveUp && g_get_monotonic_time() > giveUp) {
+            rv = ETIMEDOUT;
+            break;
+        }
+
+        g_cond_wait_until(&stream->cond, &stream->lock,
+                          g_get_monotonic_time() + G_USEC_PER_SEC);
+    }
+    g_mutex_unlock(&stream->lock);
+
+    return rv;
+}
+
+/* ChunkSender queuing chunk frames, {id, chunk: true} envelopes followed by
+ * the chunk as an attachment. Returns once the chunk was sent, so the
+ * worker reads the next one only then. */
+static int sendStreamChunk(void *ctx, JsonNode *chunk, GError **err) {
+    struct ResponseStream *stream = (struct ResponseStream *) ctx;
+    JsonNode *response;
+    int rv;
+
+    response = buildResponse(stream->reqId, NULL, chunk);
+    JsonNode_map_insert(response, "chunk", JsonNode_newFromBoolean(TRUE),
+                        NULL);
+
+    g_mutex_lock(&stream->lock);
+    stream->writing = TRUE;
+    stream->sent++;
+    g_mutex_unlock(&stream->lock);
+
+    g_atomic_int_inc(&stream->refs);
+    g_trace("(%li) Queuing response chunk", (long) stream->reqId);
+    queueResponse(stream->conn->responseQueue, response, stream,
+                  stream->method);
+
+    rv = waitStreamCredit(stream);
+    if (rv != 0) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, rv, "%s", iop_strerror(rv));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Looks up a stream of the connection, the caller holds the
+ * pendingRequests lock */
+static struct ResponseStream *lookupStream(IOProcessCtx *conn, gint64 id) {
+    return (struct ResponseStream *) g_hash_table_lookup(conn->streams, &id);
+}
+
+/* A batch request, answered once all of its sub-requests are done */
+struct BatchCtx {
+    long reqId;
+    /* Owns the sub-requests */
+    JsonNode *reqObj;
+    JsonArena *arena;
+    /* Per sub-request result, in request order */
+    JsonNode **results;
+    int count;
+    gint pending;
+    IOProcessCtx *conn;
+};
+
+/* Priority classes, from the optional "priority" of the request envelope.
+ * Queued requests run in class order, and in arrival order within a
+ * class. */
+#define PRIORITY_LOW 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_HIGH 2
+
+/* Monotonic times of a request in microseconds, 0 if not reached. Sent
+ * back in the "timing" of the response if the request asks for it. */
+struct RequestTiming {
+    gboolean send;
+    /* First byte read by the request reader */
+    gint64 received;
+    gint64 parsed;
+    /* Handed to a thread pool */
+    gint64 scheduled;
+    /* Taken by a worker */
+    gint64 dequeued;
+    /* Calling the method */
+    gint64 started;
+    gint64 finished;
+    /* Started encoding the response */
+    gint64 encoding;
+};
+
+static JsonNode *timingToJson(const struct RequestTiming *timing) {
+    JsonNode *result = JsonNode_newMap();
+    const struct {
+        const char *name;
+        gint64 time;
+    } times[] = {
+        { "received", timing->received },
+        { "parsed", timing->parsed },
+        { "scheduled", timing->scheduled },
+        { "dequeued", timing->dequeued },
+        { "started", timing->started },
+        { "finished", timing->finished },
+        { "encoding", timing->encoding },
+    };
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(times); i++) {
+        if (times[i].time) {
+            JsonNode_map_insert(result, times[i].name,
+                                JsonNode_newFromLong(times[i].time), NULL);
+        }
+    }
+
+    return result;
+}
+
+/* Queued on requestQueue by the request reader, holds a reference to the
+ * connection the response goes to */
+struct RequestParams {
+    /* timing.parsed is the time the request was queued */
+    struct RequestTiming timing;
+    JsonNode *reqObj;
+    IOProcessCtx *conn;
+    /* Set when queued, NULL if the request calls no known method */
+    const MethodEntry *method;
+    /* Bytes read for the request, 0 for sub-requests of a batch */
+    uint64_t reqSize;
+    int priority;
+    /* Set when queued, orders requests of the same class */
+    guint64 seq;
+    /* Counted in the --max-queued-requests budget */
+    gboolean holdsSlot;
+    /* The budget the slot was taken from, released by the pool running
+     * the request or by uringRequestDone */
+    gint *slotsLeft;
+    /* Set while the request runs on the io_uring backend */
+    struct RunningRequest *running;
+    /* The pool running the request, set when queued */
+    GThreadPool *pool;
+    /* Monotonic time after which the request is dropped, or 0 */
+    gint64 deadline;
+    /* Key in conn->pending, set while the request is pending */
+    gint64 reqId;
+    gboolean isPending;
+    gboolean cancelled;
+    /* Set for sub-requests of a batch, reqObj is then owned by the batch */
+    struct BatchCtx *batch;
+    int batchIndex;
+    /* Holds reqObj and the response built by the worker, NULL for
+     * sub-requests of a batch */
+    JsonArena *arena;
+};
+
+static struct RequestParams *newRequestParams(JsonNode *reqObj,
+                                              IOProcessCtx *conn,
+                                              struct BatchCtx *batch,
+                                              int batchIndex) {
+    struct RequestParams *params = malloc(sizeof(struct RequestParams));
+    if (!params) {
+        return NULL;
+    }
+
+    memset(&params->timing, 0, sizeof(params->timing));
+    params->timing.parsed = g_get_monotonic_time();
+    params->reqObj = reqObj;
+    params->conn = conn;
+    params->method = NULL;
+    params->reqSize = 0;
+    params->batch = batch;
+    params->batchIndex = batchIndex;
+    params->deadline = 0;
+    params->priority = PRIORITY_NORMAL;
+    params->seq = 0;
+    params->holdsSlot = FALSE;
+    params->slotsLeft = NULL;
+    params->running = NULL;
+    params->pool = NULL;
+    params->reqId = -1;
+    params->isPending = FALSE;
+    params->cancelled = FALSE;
+    params->arena = NULL;
+    refConnection(conn);
+    return params;
+}
+
+/* Makes a queued request cancellable by its id */
+static void registerPending(struct RequestParams *params) {
+    JsonNode *idNode;
+
+    idNode = JsonNode_map_lookup(params->reqObj, "id", NULL);
+    if (!idNode || JsonNode_getType(idNode) != JT_LONG) {
+        return;
+    }
+
+    params->reqId = JsonNode_getLong(idNode);
+
+    G_LOCK(pendingRequests);
+    g_hash_table_replace(params->conn->pending, &params->reqId, params);
+    params->isPending = TRUE;
+    G_UNLOCK(pendingRequests);
+}
+
+/* Called once the request leaves the queue, it can't be cancelled after
+ * that */
+static void unregisterPending(struct RequestParams *params) {
+    /* Only changed by the thread owning the request */
+    if (!params->isPending) {
+        return;
+    }
+
+    G_LOCK(pendingRequests);
+    if (params->isPending &&
+        g_hash_table_lookup(params->conn->pending, &params->reqId) ==
+            params) {
+        g_hash_table_remove(params->conn->pending, &params->reqId);
+    }
+    params->isPending = FALSE;
+    G_UNLOCK(pendingRequests);
+}
+
+static void freeRequestParams(struct RequestParams *params) {
+    unregisterPending(params);
+
+    if (!params->batch) {
+        JsonNode_free(params->reqObj);
+    }
+
+    JsonArena_unref(params->arena);
+    unrefConnection(params->conn);
+    free(params);
+}
+
+static JsonNode *buildBatchItem(const GError *err, JsonNode *result) {
+    JsonNode *item;
+
+    item = JsonNode_newMap();
+    JsonNode_map_insert(item, "errcode",
+                        JsonNode_newFromLong(err ? err->code : 0), NULL);
+    JsonNode_map_insert(item, "errstr",
+                        JsonNode_newFromString(err ? err->message : "SUCCESS"),
+                        NULL);
+    JsonNode_map_insert(item, "result",
+                        result ? result : JsonNode_newMap(), NULL);
+    return item;
+}
+
+static void finishBatch(struct BatchCtx *batch) {
+    JsonNode *results;
+    int i;
+
+    results = JsonNode_newArray();
+    for (i = 0; i < batch->count; i++) {
+        JsonNode_array_append(results, batch->results[i], NULL);
+    }
+
+    g_debug("(%li) Finished batch of %d requests", batch->reqId, batch->count);
+    queueResponse(batch->conn->responseQueue,
+                  buildResponse(batch->reqId, NULL, results), NULL, NULL);
+
+    JsonNode_free(batch->reqObj);
+    JsonArena_unref(batch->arena);
+    free(batch->results);
+    free(batch);
+}
+
+/* Stores the result of a sub-request, the last one answers the batch */
+static void completeBatchItem(struct BatchCtx *batch, int index,
+                              const GError *err, JsonNode *result) {
+    batch->results[index] = buildBatchItem(err, unsplice(result));
+
+    if (g_atomic_int_dec_and_test(&batch->pending)) {
+        finishBatch(batch);
+    }
+}
+
+static void servQueueFull(struct RequestParams *params) {
+    GError *gerr = NULL;
+    JsonNode *response = NULL;
+    struct RequestInfo info = {-1, NULL};
+    MpscQueue *responseQueue = params->conn->responseQueue;
+
+    g_set_error(&gerr,
+        IOPROCESS_GENERAL_ERROR,
+        EAGAIN, "%s", iop_strerror(EAGAIN)
+    );
+
+    if (params->method) {
+        methodStats_addCall(getMethodStats(params->method), EAGAIN);
+        methodStats_addBytesIn(getMethodStats(params->method),
+                               params->reqSize);
+    }
+
+    if (params->batch) {
+        g_warning("(%li) Request queue full", params->batch->reqId);
+        completeBatchItem(params->batch, params->batchIndex, gerr, NULL);
+        goto clean;
+    }
+
+    getArgs(params->reqObj, &requestIdSchema, &info, NULL);
+
+    g_warning("(%li) Request queue full", info.id);
+
+    response = buildResponse(info.id, gerr, NULL);
+    if (!response) {
+        g_warning("(%li) Could not build response object", info.id);
+        goto clean;
+    }
+
+    queueResponse(responseQueue, response, NULL, params->method);
+clean:
+    if (gerr) {
+        g_error_free(gerr);
+    }
+
+    freeRequestParams(params);
+}
+
+/* Returns TRUE and sets err if the request was cancelled or its deadline
+ * passed while it was queued. A client cancels a request when it times
+ * out, so a request past its deadline counts as expired even if it was
+ * cancelled too. */
+static int isDropped(struct RequestParams *params, long reqId,
+                     GError **err) {
+    int errcode;
+
+    if (params->deadline && g_get_monotonic_time() > params->deadline) {
+        errcode = ETIMEDOUT;
+    } else if (params->cancelled) {
+        errcode = ECANCELED;
+    } else {
+        return FALSE;
+    }
+
+    g_debug("(%li) Dropping request: %s", reqId, iop_strerror(errcode));
+    g_set_error(err, IOPROCESS_GENERAL_ERROR, errcode, "%s",
+                iop_strerror(errcode));
+
+    G_LOCK(droppedStats);
+    if (errcode == ECANCELED) {
+        droppedStats.cancelled++;
+    } else {
+        droppedStats.expired++;
+    }
+    G_UNLOCK(droppedStats);
+
+    return TRUE;
+}
+
+/* Returns the path argument of a request, used to pick its mount pool and
+ * to report stuck requests */
+static const char *requestPath(const JsonNode *reqObj) {
+    static const char *pathArgs[] = {"path", "oldpath", "pattern", "dir",
+                                     NULL};
+    JsonNode *args;
+    JsonNode *arg;
+    int i;
+
+    if (JsonNode_getType(reqObj) != JT_MAP) {
+        return NULL;
+    }
+
+    args = JsonNode_map_lookup(reqObj, "args", NULL);
+    if (!args || JsonNode_getType(args) != JT_MAP) {
+        return NULL;
+    }
+
+    for (i = 0; pathArgs[i]; i++) {
+        arg = JsonNode_map_lookup(args, pathArgs[i], NULL);
+        if (arg && JsonNode_getType(arg) == JT_STRING) {
+            return JsonNode_getString(arg)->str;
+        }
+    }
+
+    return NULL;
+}
+
+/* Makes a request visible to the watchdog while it runs */
+static struct RunningRequest *trackRequest(struct RequestParams *params,
+                                           long reqId,
+                                           const char *methodName) {
+    struct RunningRequest *running;
+    const char *path;
+
+    if (!runningRequests) {
+        return NULL;
+    }
+
+    path = requestPath(params->reqObj);
+
+    running = g_new0(struct RunningRequest, 1);
+    running->reqId = reqId;
+    running->methodName = g_strdup(methodName);
+    running->path = path ? g_strdup(path) : NULL;
+    running->startTime = g_get_monotonic_time();
+    running->pool = params->pool;
+
+    G_LOCK(runningRequests);
+    g_hash_table_insert(runningRequests, running, running);
+    G_UNLOCK(runningRequests);
+
+    return running;
+}
+
+static void untrackRequest(struct RunningRequest *running) {
+    gint maxThreads;
+
+    if (!running) {
+        return;
+    }
+
+    G_LOCK(runningRequests);
+    g_hash_table_remove(runningRequests, running);
+
+    if (running->stuck) {
+        g_message("(%li) Stuck request for method '%s' finished after "
+                  "%" PRId64 " seconds", running->reqId, running->methodName,
+                  (g_get_monotonic_time() - running->startTime) /
+                  G_USEC_PER_SEC);
+    }
+
+    if (running->compensated) {
+        extraThreads--;
+        if (compensating) {
+            maxThreads = g_thread_pool_get_max_threads(running->pool);
+            g_thread_pool_set_max_threads(running->pool, maxThreads - 1,
+                                          NULL);
+        }
+    }
+    G_UNLOCK(runningRequests);
+
+    g_free(running->methodName);
+    g_free(running->path);
+    g_free(running);
+}
+
+/* Records the time a method waited and ran in its stats, around the call
+ * of its callback */
+static void startRun(long reqId, const MethodEntry *method,
+                     struct RequestTiming *timing) {
+    MethodStats *stats = getMethodStats(method);
+    gint64 waitTime;
+
+    timing->started = g_get_monotonic_time();
+    waitTime = timing->started - timing->parsed;
+    histogram_add(&stats->waitTime, waitTime);
+
+    g_debug("(%li) Start request for method '%s' (waitTime=%" PRId64 ")",
+            reqId, method->name, waitTime);
+}
+
+static void finishRun(long reqId, const MethodEntry *method,
+                      struct RequestTiming *timing) {
+    MethodStats *stats = getMethodStats(method);
+    gint64 runTime;
+
+    timing->finished = g_get_monotonic_time();
+    runTime = timing->finished - timing->started;
+    histogram_add(&stats->runTime, runTime);
+
+    g_debug("(%li) Finished request for method '%s' (runTime=%" PRId64 ")",
+            reqId, method->name, runTime);
+}
+
+static JsonNode *runMethod(long reqId, const MethodEntry *method,
+                           const JsonNode *args, struct RequestTiming *timing,
+                           GError **err) {
+    JsonNode *result;
+
+    if (!method->callback) {
+        g_set_error(err, 0, EINVAL, "No such method '%s'", method->name);
+        return NULL;
+    }
+
+    startRun(reqId, method, timing);
+    result = method->callback(args, err);
+    finishRun(reqId, method, timing);
+
+    return result;
+}
+
+/* Runs a method writing its result straight into the encoded response,
+ * without building a DOM. Returns the response, or NULL and sets err. */
+static char *runEmit(long reqId, const MethodEntry *method,
+                     const JsonNode *args, struct RequestTiming *timing,
+                     uint64_t *size, GError **err) {
+    MethodStats *stats = getMethodStats(method);
+    GError *tmpError = NULL;
+    JsonEmitter *out;
+    JsonNode *timingNode;
+    char *buffer;
+
+    out = WIRE_FORMAT->newEmitter();
+    if (!out) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, ENOMEM, "%s",
+                    iop_strerror(ENOMEM));
+        return NULL;
+    }
+
+    /* Errors are answered by buildResponse, the result goes last */
+    JsonEmitter_openMap(out);
+    emitEnvelope(out, reqId, NULL);
+    JsonEmitter_key(out, "result");
+
+    /* Includes encoding the result, which can't be told apart */
+    startRun(reqId, method, timing);
+    method->emitCallback(args, out, &tmpError);
+    finishRun(reqId, method, timing);
+
+    if (tmpError) {
+        JsonEmitter_free(out);
+        g_propagate_error(err, tmpError);
+        return NULL;
+    }
+
+    timing->encoding = g_get_monotonic_time();
+    if (timing->send) {
+        timingNode = timingToJson(timing);
+        JsonEmitter_key(out, "timing");
+        JsonEmitter_node(out, timingNode);
+        JsonNode_free(timingNode);
+    }
+
+    JsonEmitter_closeMap(out);
+    buffer = JsonEmitter_finish(out, size);
+    histogram_add(&stats->encodeTime,
+                  g_get_monotonic_time() - timing->encoding);
+    if (!buffer) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, ENOMEM, "%s",
+                    iop_strerror(ENOMEM));
+    }
+
+    return buffer;
+}
+
+/* Runs a method sending chunks of its result before returning the final
+ * result */
+static JsonNode *runStream(long reqId, const MethodEntry *method,
+                           const JsonNode *args, struct RequestTiming *timing,
+                           gint64 deadline, IOProcessCtx *conn,
+                           GError **err) {
+    struct ResponseStream *stream;
+    struct StreamArgs arg;
+    JsonArena *prevArena;
+    JsonNode *result;
+
+    if (getArgs(args, &streamSchema, &arg, err) < 0) {
+        return NULL;
+    }
+
+    if (arg.window < 0) {
+        g_set_error(err, IOPROCESS_ARGUMENT_ERROR, EINVAL,
+                    "Param 'window' is out of range");
+        return NULL;
+    }
+
+    stream = newResponseStream(reqId, conn, method, arg.window);
+    if (!stream) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, ENOMEM, "%s",
+                    iop_strerror(ENOMEM));
+        return NULL;
+    }
+
+    if (deadline) {
+        stream->ackTimeout = deadline - timing->parsed;
+    }
+
+    G_LOCK(pendingRequests);
+    g_hash_table_replace(conn->streams, &stream->reqId, stream);
+    G_UNLOCK(pendingRequests);
+
+    /* Chunks are freed as they are sent, not with the request */
+    prevArena = JsonArena_setCurrent(NULL);
+
+    /* Includes waiting for the client to take the chunks */
+    startRun(reqId, method, timing);
+    result = method->streamCallback(args, sendStreamChunk, stream, err);
+    finishRun(reqId, method, timing);
+    JsonArena_setCurrent(prevArena);
+
+    G_LOCK(pendingRequests);
+    if (lookupStream(conn, stream->reqId) == stream) {
+        g_hash_table_remove(conn->streams, &stream->reqId);
+    }
+    G_UNLOCK(pendingRequests);
+
+    unrefResponseStream(stream);
+    return result;
+}
+
+static void servRequest(void *data, void *queueSlotsLeft) {
+    struct RequestParams *params = (struct RequestParams *) data;
+    struct BatchCtx *batch = params->batch;
+    const MethodEntry *method = params->method;
+    GError *err = NULL;
+    long reqId = -1;
+    JsonNode *reqInfo = params->reqObj;
+    MpscQueue *responseQueue = params->conn->responseQueue;
+    JsonNode *args = NULL;
+    JsonNode *response;
+    JsonNode *result = NULL;
+    char *encoded = NULL;
+    uint64_t encodedSize = 0;
+    struct RunningRequest *running;
+    gboolean holdsSlot = params->holdsSlot;
+    JsonArena *prevArena;
+    void *prevOwner;
+
+    unregisterPending(params);
+
+    if (params->timing.send) {
+        params->timing.dequeued = g_get_monotonic_time();
+    }
+
+    /* The response comes from the request arena, sub-requests of a batch
+     * run concurrently and use the heap */
+    prevArena = JsonArena_setCurrent(params->arena);
+    /* Chunked uploads belong to the connection that opened them */
+    prevOwner = setUploadOwner(params->conn);
+
+    if (batch) {
+        /* Resolved when queued, looked up again only for the error */
+        if (!method) {
+            method = requestMethod(reqInfo, &err);
+        }
+
+        reqId = batch->reqId;
+        if (method && !isDropped(params, reqId, &err)) {
+            args = JsonNode_map_lookup(reqInfo, "args", NULL);
+            running = trackRequest(params, reqId, method->name);
+            result = runMethod(reqId, method, args, &params->timing, &err);
+            untrackRequest(running);
+        }
+
+        if (method) {
+            methodStats_addCall(getMethodStats(method),
+                                err ? err->code : 0);
+        }
+
+        completeBatchItem(batch, params->batchIndex, err, result);
+        goto clean;
+    }
+
+    g_trace("Extracting request information...");
+    extractRequestInfo(reqInfo, &reqId, &args, &err);
+    if (err) {
+        g_warning("Could not extract params: %s", err->message);
+        goto clean;
+    }
+
+    if (!method) {
+        method = requestMethod(reqInfo, &err);
+    }
+
+    if (!method || isDropped(params, reqId, &err)) {
+        result = NULL;
+    } else {
+        running = trackRequest(params, reqId, method->name);
+        if (method->streamCallback) {
+            result = runStream(reqId, method, args, &params->timing,
+                               params->deadline, params->conn, &err);
+        } else if (method->emitCallback) {
+            encoded = runEmit(reqId, method, args, &params->timing,
+                              &encodedSize, &err);
+        } else {
+            result = runMethod(reqId, method, args, &params->timing, &err);
+        }
+        untrackRequest(running);
+    }
+
+    if (method) {
+        methodStats_addCall(getMethodStats(method), err ? err->code : 0);
+        methodStats_addBytesIn(getMethodStats(method), params->reqSize);
+    }
+
+    if (encoded) {
+        g_trace("(%li) Queuing encoded response", reqId);
+        queueEncodedResponse(responseQueue, encoded, encodedSize, method);
+        goto clean;
+    }
+
+    g_trace("(%li) Building response", reqId);
+
+    if (!result) {
+        result = JsonNode_newMap();
+    }
+
+    response = buildResponse(reqId, err, result);
+    if (!response) {
+        g_warning("(%li) Could not build response object", reqId);
+        goto clean;
+    }
+
+    /* The response writer adds the time it starts encoding */
+    if (params->timing.send) {
+        JsonNode_map_insert(response, "timing",
+                            timingToJson(&params->timing), NULL);
+    }
+
+    g_trace("(%li) Queuing response", reqId);
+    queueResponse(responseQueue, response, NULL, method);
+
+clean:
+    JsonArena_setCurrent(prevArena);
+    setUploadOwner(prevOwner);
+    freeRequestParams(params);
+
+    if (err) {
+        g_error_free(err);
+    }
+
+    if (holdsSlot) {
+        g_atomic_int_inc((gint*) queueSlotsLeft);
+        g_debug("(%li) Dequeuing request (slotsLeft=%i)", reqId,
+                *(gint*)queueSlotsLeft);
+    }
+}
+
+/* The thread pools of the request handler */
+struct Scheduler {
+    GThreadPool *threadPool;
+    /* Only serves PRIORITY_HIGH requests when the pool they would run on
+     * has no free thread. NULL without --reserved-threads. */
+    GThreadPool *reservedPool;
+    /* Requests always hold a slot of their pool, so slots tell how many
+     * are queued or running */
+    gint queueSlotsLeft;
+    gint idleSlots;
+    gint reservedSlotsLeft;
+    guint64 nextSeq;
+    /* Picks the mount pool of a request, NULL without
+     * --max-threads-per-mount */
+    MountTable *mounts;
+    /* Pools of unmounted mounts, freed once their requests are done */
+    GPtrArray *retiredPools;
+    /* Pools in mountPools and retiredPools */
+    guint mountPoolCount;
+    gint64 mountPoolsChecked;
+    /* Runs the requests it supports, NULL unless --io-backend=uring */
+    UringBackend *uring;
+};
+
+/* Orders the queue of a thread pool by priority class, then by arrival */
+static gint compareRequests(gconstpointer a, gconstpointer b,
+                            __attribute__((unused)) gpointer data) {
+    const struct RequestParams *pa = (const struct RequestParams *) a;
+    const struct RequestParams *pb = (const struct RequestParams *) b;
+
+    if (pa->priority != pb->priority) {
+        return pa->priority > pb->priority ? -1 : 1;
+    }
+
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+/* Returns the pool of a mount, creating it on first use. Returns NULL
+ * without setting err if another pool would exceed --max-mount-threads. */
+static struct MountPool *getMountPool(struct Scheduler *scheduler,
+                                      const char *mountPoint, GError **err) {
+    struct MountPool *mountPool;
+
+    /* Only the request handler adds pools */
+    mountPool = g_hash_table_lookup(mountPools, mountPoint);
+    if (mountPool) {
+        return mountPool;
+    }
+
+    if (MAX_MOUNT_THREADS > 0 &&
+        (scheduler->mountPoolCount + 1) * MAX_THREADS_PER_MOUNT >
+        (guint) MAX_MOUNT_THREADS) {
+        g_debug("No thread pool for mount '%s', %u pools exist",
+                mountPoint, scheduler->mountPoolCount);
+        return NULL;
+    }
+
+    mountPool = g_new0(struct MountPool, 1);
+    mountPool->mountPoint = mountPoint;
+    mountPool->idleSlots = MAX_THREADS_PER_MOUNT + MAX_QUEUED_REQUESTS + 1;
+    mountPool->queueSlotsLeft = mountPool->idleSlots;
+    mountPool->pool = g_thread_pool_new(servRequest,
+                                        &mountPool->queueSlotsLeft,
+                                        MAX_THREADS_PER_MOUNT, FALSE, err);
+    if (!mountPool->pool) {
+        g_free(mountPool);
+        return NULL;
+    }
+
+    g_thread_pool_set_sort_function(mountPool->pool, compareRequests, NULL);
+
+    G_LOCK(mountPools);
+    g_hash_table_insert(mountPools, (gpointer) mountPoint, mountPool);
+    G_UNLOCK(mountPools);
+    scheduler->mountPoolCount++;
+
+    g_debug("Created thread pool for mount '%s'", mountPoint);
+    return mountPool;
+}
+
+static void freeMountPool(struct MountPool *mountPool) {
+    g_thread_pool_free(mountPool->pool, FALSE, TRUE);
+    g_free(mountPool);
+}
+
+/* Retires the pools of mounts that are gone, and frees the retired pools
+ * with no request left. A pool stuck on a hung mount that was lazily
+ * unmounted is kept until its requests return. */
+static void retireMountPools(struct Scheduler *scheduler) {
+    struct MountPool *mountPool;
+    GHashTableIter iter;
+    guint i;
+
+    scheduler->mountPoolsChecked = g_get_monotonic_time();
+
+    G_LOCK(mountPools);
+    g_hash_table_iter_init(&iter, mountPools);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &mountPool)) {
+        if (!mountTable_contains(scheduler->mounts, mountPool->mountPoint)) {
+            g_debug("Retiring thread pool for mount '%s'",
+                    mountPool->mountPoint);
+            g_hash_table_iter_remove(&iter);
+            g_ptr_array_add(scheduler->retiredPools, mountPool);
+        }
+    }
+    G_UNLOCK(mountPools);
+
+    for (i = scheduler->retiredPools->len; i > 0; i--) {
+        mountPool = g_ptr_array_index(scheduler->retiredPools, i - 1);
+
+        /* Slots are given back last, the pool threads only have to
+         * return */
+        if (g_atomic_int_get(&mountPool->queueSlotsLeft) !=
+            mountPool->idleSlots) {
+            continue;
+        }
+
+        g_debug("Freeing thread pool for mount '%s'", mountPool->mountPoint);
+        g_ptr_array_remove_index_fast(scheduler->retiredPools, i - 1);
+        scheduler->mountPoolCount--;
+        freeMountPool(mountPool);
+    }
+}
+
+static void freeMountPools(struct Scheduler *scheduler) {
+    struct MountPool *mountPool;
+    GHashTableIter iter;
+    guint i;
+
+    if (!mountPools) {
+        return;
+    }
+
+    /* Running requests may still read the stats */
+    g_hash_table_iter_init(&iter, mountPools);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &mountPool)) {
+        g_thread_pool_free(mountPool->pool, FALSE, TRUE);
+    }
+
+    for (i = 0; i < scheduler->retiredPools->len; i++) {
+        freeMountPool(g_ptr_array_index(scheduler->retiredPools, i));
+    }
+    g_ptr_array_free(scheduler->retiredPools, TRUE);
+    scheduler->retiredPools = NULL;
+
+    G_LOCK(mountPools);
+    g_hash_table_iter_init(&iter, mountPools);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &mountPool)) {
+        g_free(mountPool);
+    }
+    g_hash_table_destroy(mountPools);
+    mountPools = NULL;
+    G_UNLOCK(mountPools);
+}
+
+static void uringRequestDone(void *data, JsonNode *result, GError *err) {
+    struct RequestParams *params = (struct RequestParams *) data;
+    MethodStats *stats = getMethodStats(params->method);
+    gint *slotsLeft = params->holdsSlot ? params->slotsLeft : NULL;
+    JsonNode *response;
+
+    untrackRequest(params->running);
+
+    /* Waiting and running are not told apart here */
+    methodStats_addCall(stats, err ? err->code : 0);
+    methodStats_addBytesIn(stats, params->reqSize);
+
+    if (params->batch) {
+        completeBatchItem(params->batch, params->batchIndex, err, result);
+    } else {
+        response = buildResponse(params->reqId, err, result);
+        if (response && params->timing.send) {
+            params->timing.finished = g_get_monotonic_time();
+            JsonNode_map_insert(response, "timing",
+                                timingToJson(&params->timing), NULL);
+        }
+
+        if (response) {
+            queueResponse(params->conn->responseQueue, response, NULL,
+                          params->method);
+        } else {
+            g_warning("(%" PRId64 ") Could not build response object",
+                      params->reqId);
+        }
+    }
+
+    if (err) {
+        g_error_free(err);
+    }
+
+    freeRequestParams(params);
+
+    if (slotsLeft) {
+        g_atomic_int_inc(slotsLeft);
+    }
+}
+
+/* Runs a request admitted to a pool on the io_uring backend instead, if it
+ * supports the method. The request keeps its queue slot until it is done
+ * and is watched like a request running on a thread. Returns FALSE if the
+ * request should run on the pool. */
+static int submitUring(struct Scheduler *scheduler,
+                       struct RequestParams *reqParams) {
+    JsonNode *reqObj = reqParams->reqObj;
+    JsonNode *idNode;
+    long reqId;
+
+    if (!scheduler->uring || !reqParams->method) {
+        return FALSE;
+    }
+
+    /* Dropped requests are answered by servRequest */
+    if (reqParams->cancelled || (reqParams->deadline &&
+                                 g_get_monotonic_time() > reqParams->deadline)) {
+        return FALSE;
+    }
+
+    if (reqParams->batch) {
+        reqId = reqParams->batch->reqId;
+    } else {
+        idNode = JsonNode_map_lookup(reqObj, "id", NULL);
+        if (!idNode || JsonNode_getType(idNode) != JT_LONG) {
+            return FALSE;
+        }
+        reqParams->reqId = JsonNode_getLong(idNode);
+        reqId = reqParams->reqId;
+    }
+
+    /* Completed requests can't be cancelled */
+    unregisterPending(reqParams);
+
+    reqParams->running = trackRequest(reqParams, reqId,
+                                      reqParams->method->name);
+
+    if (!uringBackend_submit(scheduler->uring, reqParams->method->name,
+                             JsonNode_map_lookup(reqObj, "args", NULL),
+                             uringRequestDone, reqParams)) {
+        untrackRequest(reqParams->running);
+        reqParams->running = NULL;
+        return FALSE;
+    }
+
+    g_debug("(%li) Submitted request to io_uring", reqId);
+    return TRUE;
+}
+
+/* Returns TRUE if a request was given to every thread of a pool, from the
+ * slots held by its requests */
+static gboolean poolSaturated(gint *slotsLeft, gint idleSlots, int threads) {
+    return threads > 0 && idleSlots - g_atomic_int_get(slotsLeft) >= threads;
+}
+
+/* Hands the request to the thread pool, or answers it with EAGAIN if the
+ * request queue is full. Blocking requests for a path go to the pool of
+ * its mount, which has its own queue limit. High priority requests go to
+ * the reserved pool if there is one and their pool has no free thread,
+ * the reserved pool has its own queue limit. Admitted requests run on the
+ * io_uring backend if it supports them. */
+static void queueRequest(struct Scheduler *scheduler,
+                         struct RequestParams *reqParams, GError **err) {
+    GThreadPool *threadPool = scheduler->threadPool;
+    gint *queueSlotsLeft = &scheduler->queueSlotsLeft;
+    gint idleSlots = scheduler->idleSlots;
+    int threads = MAX_THREADS;
+    struct MountPool *mountPool = NULL;
+    const char *mountPoint;
+    GError *poolErr = NULL;
+
+    reqParams->seq = scheduler->nextSeq++;
+    reqParams->method = requestMethod(reqParams->reqObj, NULL);
+    if (reqParams->timing.send) {
+        reqParams->timing.scheduled = g_get_monotonic_time();
+    }
+
+    if (scheduler->mounts && g_get_monotonic_time() -
+        scheduler->mountPoolsChecked > MOUNT_TABLE_TTL) {
+        retireMountPools(scheduler);
+    }
+
+    if (scheduler->mounts && reqParams->method &&
+        (reqParams->method->flags & METHOD_BLOCKING)) {
+        mountPoint = mountTable_lookup(scheduler->mounts,
+                                       requestPath(reqParams->reqObj));
+        if (mountPoint) {
+            mountPool = getMountPool(scheduler, mountPoint, &poolErr);
+            if (poolErr) {
+                g_propagate_error(err, poolErr);
+                return;
+            }
+        }
+
+        if (mountPool) {
+            threadPool = mountPool->pool;
+            queueSlotsLeft = &mountPool->queueSlotsLeft;
+            idleSlots = mountPool->idleSlots;
+            threads = MAX_THREADS_PER_MOUNT;
+        }
+    }
+
+    if (scheduler->reservedPool && reqParams->priority == PRIORITY_HIGH &&
+        poolSaturated(queueSlotsLeft, idleSlots, threads)) {
+        g_debug("Queuing request in the reserved pool");
+        threadPool = scheduler->reservedPool;
+        queueSlotsLeft = &scheduler->reservedSlotsLeft;
+    }
+
+    /* Unlimited queues only count the slots */
+    if (g_atomic_int_dec_and_test(queueSlotsLeft) &&
+        MAX_QUEUED_REQUESTS >= 0) {
+        servQueueFull(reqParams);
+        g_atomic_int_inc(queueSlotsLeft);
+        return;
+    }
+
+    reqParams->holdsSlot = TRUE;
+    reqParams->slotsLeft = queueSlotsLeft;
+
+    if (submitUring(scheduler, reqParams)) {
+        return;
+    }
+
+    reqParams->pool = threadPool;
+
+    /* TODO: log request id */
+    g_debug("Queuing request (slotsLeft=%i)", *queueSlotsLeft);
+
+    g_thread_pool_push(threadPool, reqParams, err);
+}
+
+/* Returns TRUE if the request calls a method handled by the request
+ * handler itself */
+static int isMethodCall(const JsonNode *reqObj, const char *name) {
+    JsonNode *methodName;
+
+    if (JsonNode_getType(reqObj) != JT_MAP) {
+        return FALSE;
+    }
+
+    methodName = JsonNode_map_lookup(reqObj, "methodName", NULL);
+    return methodName && JsonNode_getType(methodName) == JT_STRING &&
+           strcmp(JsonNode_getString(methodName)->str, name) == 0;
+}
+
+/* Marks a request of the same connection waiting in the queue, or a stream
+ * being sent, as cancelled. The worker answers it with ECANCELED, or
+ * ETIMEDOUT if its deadline passed too. Answered right away, so it does
+ * not wait behind the request it cancels. The response is false if the
+ * request is not queued or streaming anymore. */
+static void cancelRequest(struct RequestParams *params) {
+    IOProcessCtx *conn = params->conn;
+    struct RequestParams *target = NULL;
+    struct ResponseStream *stream = NULL;
+    GError *tmpError = NULL;
+    struct RequestInfo info = {-1, NULL};
+    struct RequestInfo targetInfo;
+    gint64 targetId = -1;
+
+    /* The arguments hold the id of the request to cancel */
+    if (getArgs(params->reqObj, &requestIdSchema, &info, &tmpError) == 0 &&
+        getArgs(JsonNode_map_lookup(params->reqObj, "args", NULL),
+                &requestIdSchema, &targetInfo, &tmpError) == 0) {
+        targetId = targetInfo.id;
+
+        G_LOCK(pendingRequests);
+        target = g_hash_table_lookup(conn->pending, &targetId);
+        if (target) {
+            target->cancelled = TRUE;
+        } else {
+            stream = lookupStream(conn, targetId);
+            if (stream) {
+                g_mutex_lock(&stream->lock);
+                stream->cancelled = TRUE;
+                g_cond_signal(&stream->cond);
+                g_mutex_unlock(&stream->lock);
+            }
+        }
+        G_UNLOCK(pendingRequests);
+
+        g_debug("(%li) Cancel request %" PRId64 ": %s", info.id, targetId,
+                target || stream ? "cancelled" : "not queued");
+    }
+
+    queueResponse(conn->responseQueue,
+                  buildResponse(info.id, tmpError,
+                                tmpError ? NULL :
+                                JsonNode_newFromBoolean(target || stream)),
+                  NULL, NULL);
+
+    if (tmpError) {
+        g_error_free(tmpError);
+    }
+
+    freeRequestParams(params);
+}
+
+/* Lets a stream send one more chunk, once the client consumed one. Answered
+ * right away, the result is false if the stream is not being sent
+ * anymore. */
+static void ackStream(struct RequestParams *params) {
+    IOProcessCtx *conn = params->conn;
+    struct ResponseStream *stream = NULL;
+    GError *tmpError = NULL;
+    struct RequestInfo info = {-1, NULL};
+    struct RequestInfo targetInfo;
+
+    /* The arguments hold the id of the stream */
+    if (getArgs(params->reqObj, &requestIdSchema, &info, &tmpError) == 0 &&
+        getArgs(JsonNode_map_lookup(params->reqObj, "args", NULL),
+                &requestIdSchema, &targetInfo, &tmpError) == 0) {
+        G_LOCK(pendingRequests);
+        stream = lookupStream(conn, targetInfo.id);
+        if (stream) {
+            g_mutex_lock(&stream->lock);
+            stream->acked++;
+            g_cond_signal(&stream->cond);
+            g_mutex_unlock(&stream->lock);
+        }
+        G_UNLOCK(pendingRequests);
+    }
+
+    queueResponse(conn->responseQueue,
+                  buildResponse(info.id, tmpError,
+                                tmpError ? NULL :
+                                JsonNode_newFromBoolean(stream != NULL)),
+                  NULL, NULL);
+
+    if (tmpError) {
+        g_error_free(tmpError);
+    }
+
+    freeRequestParams(params);
+}
+
+/* Fans the sub-requests of a batch out to the thread pool. The batch is
+ * answered with an array of {errcode, errstr, result} items once the last
+ * sub-request is done. */
+static void queueBatch(struct Scheduler *scheduler,
+                       struct RequestParams *batchParams, GError **err) {
+    JsonNode *reqObj = batchParams->reqObj;
+    IOProcessCtx *conn = batchParams->conn;
+    struct BatchCtx *batch = NULL;
+    struct RequestParams *params;
+    GError *tmpError = NULL;
+    struct RequestInfo info = {-1, NULL};
+    struct RequestsArgs arg;
+    GArray *requests = NULL;
+    JsonNode *item;
+    long reqId;
+    int count;
+    int i;
+
+    if (getArgs(reqObj, &requestIdSchema, &info, &tmpError) == 0 &&
+        getArgs(JsonNode_map_lookup(reqObj, "args", NULL), &requestsSchema,
+                &arg, &tmpError) == 0) {
+        requests = arg.requests;
+    }
+
+    reqId = info.id;
+    if (!tmpError) {
+        batch = malloc(sizeof(struct BatchCtx));
+        if (batch) {
+            batch->results = calloc(requests->len + 1, sizeof(JsonNode *));
+        }
+        if (!batch || !batch->results) {
+            free(batch);
+            g_set_error(&tmpError, IOPROCESS_GENERAL_ERROR, ENOMEM, "%s",
+                        iop_strerror(ENOMEM));
+        }
+    }
+
+    if (tmpError) {
+        g_warning("(%li) Invalid batch request: %s", reqId,
+                  tmpError->message);
+        queueResponse(conn->responseQueue,
+                      buildResponse(reqId, tmpError, NULL), NULL, NULL);
+        g_error_free(tmpError);
+        freeRequestParams(batchParams);
+        return;
+    }
+
+    /* The batch owns the request now, the sub-requests keep the connection
+     * alive */
+    count = requests->len;
+    batch->reqId = reqId;
+    batch->reqObj = reqObj;
+    batch->arena = batchParams->arena;
+    batch->count = count;
+    batch->pending = count;
+    batch->conn = conn;
+    batchParams->reqObj = NULL;
+    batchParams->arena = NULL;
+
+    g_debug("(%li) Queuing batch of %d requests", reqId, count);
+
+    if (count == 0) {
+        finishBatch(batch);
+        freeRequestParams(batchParams);
+        return;
+    }
+
+    /* The batch may be finished, and freed, as soon as the last sub-request
+     * is queued, don't touch it after that. */
+    for (i = 0; i < count; i++) {
+        item = g_array_index(requests, JsonNode *, i);
+
+        params = newRequestParams(item, conn, batch, i);
+        if (!params) {
+            g_set_error(&tmpError, IOPROCESS_GENERAL_ERROR, ENOMEM, "%s",
+                        iop_strerror(ENOMEM));
+            completeBatchItem(batch, i, tmpError, NULL);
+            g_clear_error(&tmpError);
+            continue;
+        }
+
+        params->deadline = batchParams->deadline;
+        params->priority = batchParams->priority;
+
+        queueRequest(scheduler, params, &tmpError);
+        if (tmpError) {
+            freeRequestParams(params);
+            /* The items left are not queued, failing them finishes and
+             * frees the batch */
+            for (; i < count; i++) {
+                completeBatchItem(batch, i, tmpError, NULL);
+            }
+            g_propagate_error(err, tmpError);
+            break;
+        }
+    }
+
+    freeRequestParams(batchParams);
+}
+
+/* Checks the running requests and the uploads every WATCHDOG_INTERVAL
+ * until stopped */
+struct Watchdog {
+    GMutex lock;
+    GCond cond;
+    gboolean stop;
+};
+
+/* Marks requests running longer than --stuck-timeout as stuck, and lets
+ * their pool start another thread instead, up to --max-extra-threads */
+static void checkRunningRequests(void) {
+    struct RunningRequest *running;
+    GHashTableIter iter;
+    gint maxThreads;
+    gint64 now = g_get_monotonic_time();
+
+    G_LOCK(runningRequests);
+    g_hash_table_iter_init(&iter, runningRequests);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &running)) {
+        if (running->stuck ||
+            now - running->startTime < STUCK_TIMEOUT * G_USEC_PER_SEC) {
+            continue;
+        }
+
+        running->stuck = TRUE;
+        g_warning("(%li) Request for method '%s' (path=%s) is stuck for "
+                  "%" PRId64 " seconds", running->reqId, running->methodName,
+                  running->path ? running->path : "none",
+                  (now - running->startTime) / G_USEC_PER_SEC);
+
+        /* Requests on io_uring hold no thread, unlimited pools start a
+         * thread for every request anyway */
+        if (!running->pool) {
+            continue;
+        }
+
+        maxThreads = g_thread_pool_get_max_threads(running->pool);
+        if (maxThreads == -1 || extraThreads >= MAX_EXTRA_THREADS) {
+            continue;
+        }
+
+        if (g_thread_pool_set_max_threads(running->pool, maxThreads + 1,
+                                          NULL)) {
+            running->compensated = TRUE;
+            extraThreads++;
+            g_message("Added a thread to replace stuck request %li "
+                      "(extraThreads=%i)", running->reqId, extraThreads);
+        }
+    }
+    G_UNLOCK(runningRequests);
+}
+
+static void *watchdog(void *data) {
+    struct Watchdog *wd = (struct Watchdog *) data;
+
+    g_mutex_lock(&wd->lock);
+    while (!wd->stop) {
+        g_cond_wait_until(&wd->cond, &wd->lock,
+                          g_get_monotonic_time() + WATCHDOG_INTERVAL);
+        if (wd->stop) {
+            break;
+        }
+
+        if (STUCK_TIMEOUT > 0) {
+            checkRunningRequests();
+        }
+
+        if (UPLOAD_TIMEOUT > 0) {
+            closeIdleUploads((gint64) UPLOAD_TIMEOUT * G_USEC_PER_SEC);
+        }
+    }
+    g_mutex_unlock(&wd->lock);
+
+    return NULL;
+}
+
+static void stopWatchdog(struct Watchdog *wd, GThread *thread) {
+    g_mutex_lock(&wd->lock);
+    wd->stop = TRUE;
+    g_cond_signal(&wd->cond);
+    g_mutex_unlock(&wd->lock);
+
+    g_thread_join(thread);
+
+    /* The pools are freed next, running requests must not resize them */
+    G_LOCK(runningRequests);
+    compensating = FALSE;
+    G_UNLOCK(runningRequests);
+}
+
+/* Serves the requests of all the connections */
+static void *requestHandler(void *data) {
+    struct Scheduler scheduler;
+    GAsyncQueue *requestQueue = (GAsyncQueue *) data;
+    GError *gerr = NULL;
+    struct RequestParams *reqParams;
+    struct Watchdog wd;
+    GThread *watchdogThread = NULL;
+    int err = 0;
+
+    scheduler.idleSlots = MAX_THREADS + MAX_QUEUED_REQUESTS + 1;
+    scheduler.queueSlotsLeft = scheduler.idleSlots;
+    scheduler.reservedSlotsLeft = RESERVED_THREADS + MAX_QUEUED_REQUESTS + 1;
+    scheduler.nextSeq = 0;
+    scheduler.reservedPool = NULL;
+    scheduler.mounts = NULL;
+    scheduler.uring = NULL;
+    scheduler.threadPool = g_thread_pool_new(
+        servRequest, /* entry point */
+        /* pool specific user data */
+        &scheduler.queueSlotsLeft,
+        /* max threads, -1 for unlimited */
+        (!MAX_THREADS) ? -1 : MAX_THREADS,
+        /* don't create immediately, share with others */
+        FALSE,
+        &gerr);
+    if (gerr) {
+      g_warning("%s", gerr->message);
+      err = gerr->code;
+      g_error_free(gerr);
+      gerr = NULL;
+      return new_thread_result(err);
+    }
+
+    g_thread_pool_set_sort_function(scheduler.threadPool, compareRequests,
+                                    NULL);
+
+    if (RESERVED_THREADS > 0) {
+        scheduler.reservedPool = g_thread_pool_new(
+            servRequest, &scheduler.reservedSlotsLeft, RESERVED_THREADS,
+            FALSE, &gerr);
+        if (gerr) {
+            g_warning("%s", gerr->message);
+            err = gerr->code;
+            g_error_free(gerr);
+            g_thread_pool_free(scheduler.threadPool, FALSE, TRUE);
+            return new_thread_result(err);
+        }
+
+        g_thread_pool_set_sort_function(scheduler.reservedPool,
+                                        compareRequests, NULL);
+    }
+
+    if (MAX_THREADS_PER_MOUNT > 0) {
+        scheduler.mounts = mountTable_new("/proc/self/mountinfo",
+                                          MOUNT_TABLE_TTL);
+        G_LOCK(mountPools);
+        mountPools = g_hash_table_new(g_direct_hash, g_direct_equal);
+        G_UNLOCK(mountPools);
+        scheduler.retiredPools = g_ptr_array_new();
+    }
+
+    if (IO_BACKEND && strcmp(IO_BACKEND, "uring") == 0) {
+        scheduler.uring = uringBackend_new(URING_ENTRIES, &gerr);
+        if (scheduler.uring) {
+            g_atomic_int_set(&uringEnabled, TRUE);
+        } else {
+            g_message("io_uring is not available, running all requests on "
+                      "threads: %s", gerr->message);
+            g_error_free(gerr);
+            gerr = NULL;
+        }
+    }
+
+    if (STUCK_TIMEOUT > 0) {
+        G_LOCK(runningRequests);
+        runningRequests = g_hash_table_new(g_direct_hash, g_direct_equal);
+        compensating = TRUE;
+        G_UNLOCK(runningRequests);
+    }
+
+    if (STUCK_TIMEOUT > 0 || UPLOAD_TIMEOUT > 0) {
+        g_mutex_init(&wd.lock);
+        g_cond_init(&wd.cond);
+        wd.stop = FALSE;
+        watchdogThread = create_thread("watchdog", watchdog, &wd, TRUE);
+    }
+
+    while (TRUE) {
+        GError *gerr = NULL;
+        reqParams = (struct RequestParams *) g_async_queue_pop(requestQueue);
+        /* Check if we're stopping */
+        if ((gpointer) reqParams == STOP_PTR) {
+            err = 0;
+            break;
+        }
+
+        if (isMethodCall(reqParams->reqObj, "batch")) {
+            queueBatch(&scheduler, reqParams, &gerr);
+        } else if (isMethodCall(reqParams->reqObj, "cancel")) {
+            cancelRequest(reqParams);
+        } else if (isMethodCall(reqParams->reqObj, "stream_ack")) {
+            ackStream(reqParams);
+        } else {
+            registerPending(reqParams);
+            queueRequest(&scheduler, reqParams, &gerr);
+            if (gerr) {
+                freeRequestParams(reqParams);
+            }
+        }
+
+        if (gerr) {
+                g_warning("%s", gerr->message);
+                err = gerr->code;
+                g_error_free(gerr);
+                gerr = NULL;
+                break;
+        }
+    }
+
+    /* Initiate shutdown by not accepting any more requests. */
+    stop_request_reader();
+
+    if (watchdogThread) {
+        stopWatchdog(&wd, watchdogThread);
+        g_mutex_clear(&wd.lock);
+        g_cond_clear(&wd.cond);
+    }
+
+    /* Flush the thread pools, the response writers stop once the requests
+     * of their connection are answered */
+    g_thread_pool_free(scheduler.threadPool, FALSE, TRUE);
+    if (scheduler.reservedPool) {
+        g_thread_pool_free(scheduler.reservedPool, FALSE, TRUE);
+    }
+    /* Requests still running on io_uring release slots of mount pools */
+    uringBackend_free(scheduler.uring);
+    freeMountPools(&scheduler);
+    mountTable_free(scheduler.mounts);
+
+    if (runningRequests) {
+        G_LOCK(runningRequests);
+        g_hash_table_destroy(runningRequests);
+        runningRequests = NULL;
+        G_UNLOCK(runningRequests);
+    }
 
     return new_thread_result(err);
 }
 
-static void *responseWriter(void *data) {
-    IOProcessCtx *ctx = (IOProcessCtx *) data;
-    int writePipe = ctx->writePipe;
-    GAsyncQueue *responseQueue = ctx->responseQueue;
-    uint64_t bytesWritten = 0;
-    uint64_t bufflen = 0;
-    JsonNode *responseObj;
-    int n;
-    char *buffer = NULL;
-    void *ret = NULL;
+static void countWrite(void) {
+    STAT_ADD(&writerStats.writes, 1);
+}
+
+/* Write the whole iovec array, retrying short writes. The iovecs are
+ * modified in place. Response writes count every writev call in the
+ * writer stats. */
+static int writevAll(int fd, struct iovec *iov, int iovcnt,
+                     gboolean countWrites) {
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (countWrites) {
+            countWrite();
+        }
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t pipeRead(IOProcessCtx *ctx, void *buffer, size_t len) {
+    return read(ctx->readPipe, buffer, len);
+}
+
+static int pipeWritev(IOProcessCtx *ctx, struct iovec *iov, int iovcnt) {
+    return writevAll(ctx->writePipe, iov, iovcnt, TRUE);
+}
+
+/* Moves the data to the pipe without copying it. Mapped data may be
+ * unmapped once vmsplice returns, the pipe keeps references to the pages. */
+static int pipeSplice(IOProcessCtx *ctx, JsonSplice *data) {
+    struct iovec iov;
+    uint64_t done = 0;
+    ssize_t n;
+
+    while (done < data->size) {
+        if (data->pipeFd != -1) {
+            n = splice(data->pipeFd, NULL, ctx->writePipe, NULL,
+                       data->size - done, SPLICE_F_MOVE);
+        } else {
+            iov.iov_base = (char *) data->map + done;
+            iov.iov_len = data->size - done;
+            n = vmsplice(ctx->writePipe, &iov, 1, 0);
+        }
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        } else if (n == 0) {
+            return EPIPE;
+        }
+
+        done += n;
+    }
+
+    return 0;
+}
+
+/* The shm transport still watches the pipes to notice the client going
+ * away */
+static ssize_t shmRead(IOProcessCtx *ctx, void *buffer, size_t len) {
+    return shmRing_read(&ctx->requestRing, buffer, len, ctx->readPipe);
+}
+
+/* A ring write counts as one write */
+static int shmWritev(IOProcessCtx *ctx, struct iovec *iov, int iovcnt) {
+    countWrite();
+    return shmRing_writev(&ctx->responseRing, iov, iovcnt, ctx->writePipe);
+}
+
+/* There is nothing to splice into, copy the data to the ring */
+static int shmSplice(IOProcessCtx *ctx, JsonSplice *data) {
+    char buffer[64 * 1024];
+    struct iovec iov;
+    uint64_t done = 0;
+    int rv;
+
+    if (data->pipeFd == -1) {
+        iov.iov_base = data->map;
+        iov.iov_len = data->size;
+        return shmWritev(ctx, &iov, 1);
+    }
+
+    while (done < data->size) {
+        iov.iov_base = buffer;
+        iov.iov_len = MIN(sizeof(buffer), data->size - done);
+        rv = readFd(data->pipeFd, buffer, iov.iov_len);
+        if (rv == 0) {
+            rv = shmWritev(ctx, &iov, 1);
+        }
+
+        if (rv != 0) {
+            return rv;
+        }
+
+        done += iov.iov_len;
+    }
+
+    return 0;
+}
+
+/* vmsplice needs a pipe, mapped data is written to sockets instead */
+static int socketSplice(IOProcessCtx *ctx, JsonSplice *data) {
+    struct iovec iov;
+
+    if (data->pipeFd != -1) {
+        return pipeSplice(ctx, data);
+    }
+
+    iov.iov_base = data->map;
+    iov.iov_len = data->size;
+    return writevAll(ctx->writePipe, &iov, 1, TRUE);
+}
+
+static const Transport pipeTransport = {
+    "pipe", pipeRead, pipeWritev, pipeSplice
+};
+static const Transport socketTransport = {
+    "socket", pipeRead, pipeWritev, socketSplice
+};
+static const Transport shmTransport = {
+    "shm", shmRead, shmWritev, shmSplice
+};
+
+/* A serialized response waiting to be written */
+struct OutFrame {
+    uint64_t size;
+    char *buffer;
+    JsonNode *attachment;
+    struct ResponseStream *stream;
+    JsonArena *arena;
+};
+
+static void freeOutFrames(struct OutFrame *frames, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(frames[i].buffer);
+        JsonNode_free(frames[i].attachment);
+        JsonArena_unref(frames[i].arena);
+        if (frames[i].stream) {
+            releaseStreamChunk(frames[i].stream);
+        }
+    }
+}
+
+/* Serializes a response to frame, adding its iovecs to iov. Returns the
+ * number of iovecs added, or -1 on error. */
+static int prepareOutFrame(struct Response *response, struct OutFrame *frame,
+                           struct iovec *iov) {
+    JsonNode *responseObj = response->obj;
+    const MethodEntry *method = response->method;
+    MethodStats *stats = method ? getMethodStats(method) : NULL;
+    GByteArray *bytes;
+    JsonNode *timing;
+    JsonArena *prevArena;
+    uint64_t wireSize;
+    gint64 startTime;
+    int iovcnt = 0;
+
+    frame->stream = response->stream;
+    frame->arena = response->arena;
+    frame->buffer = response->buffer;
+    frame->size = response->size;
+    frame->attachment = NULL;
+    free(response);
+
+    if (responseObj) {
+        /* Raw bytes are sent after the envelope instead of inside it */
+        frame->attachment = JsonNode_map_steal(responseObj, "attachment");
+
+        g_trace("Generating %s response...", WIRE_FORMAT->name);
+        startTime = g_get_monotonic_time();
+
+        timing = JsonNode_map_lookup(responseObj, "timing", NULL);
+        if (timing) {
+            /* The worker is done with the arena of the response */
+            prevArena = JsonArena_setCurrent(frame->arena);
+            JsonNode_map_insert(timing, "encoding",
+                                JsonNode_newFromLong(startTime), NULL);
+            JsonArena_setCurrent(prevArena);
+        }
+
+        frame->buffer = WIRE_FORMAT->generate(responseObj, &frame->size);
+        if (stats) {
+            histogram_add(&stats->encodeTime,
+                          g_get_monotonic_time() - startTime);
+        }
+        JsonNode_free(responseObj);
+    }
+
+    if (!frame->buffer) {
+        JsonNode_free(frame->attachment);
+        frame->attachment = NULL;
+        JsonArena_unref(frame->arena);
+        frame->arena = NULL;
+        return -1;
+    }
+
+    g_trace("Queuing response sized %" PRIu64 " for writing", frame->size);
+
+    iov[iovcnt].iov_base = &frame->size;
+    iov[iovcnt].iov_len = sizeof(uint64_t);
+    iovcnt++;
+    iov[iovcnt].iov_base = frame->buffer;
+    iov[iovcnt].iov_len = frame->size;
+    iovcnt++;
+
+    if (frame->attachment &&
+        JsonNode_getType(frame->attachment) == JT_BINARY) {
+        bytes = JsonNode_getByteArray(frame->attachment);
+        g_trace("Queuing attachment sized %u for writing", bytes->len);
+        iov[iovcnt].iov_base = bytes->data;
+        iov[iovcnt].iov_len = bytes->len;
+        iovcnt++;
+    }
+
+    if (stats) {
+        wireSize = sizeof(uint64_t) + frame->size;
+        if (frame->attachment &&
+            JsonNode_getType(frame->attachment) == JT_BINARY) {
+            wireSize += JsonNode_getByteArray(frame->attachment)->len;
+        } else if (frame->attachment &&
+                   JsonNode_getType(frame->attachment) == JT_SPLICE) {
+            wireSize += JsonNode_getSplice(frame->attachment)->size;
+        }
+        methodStats_addBytesOut(stats, wireSize);
+    }
+
+
+    return iovcnt;
+}
+
+/* Drains all the responses pending in responseQueue, within the
+ * --max-write-bytes and --max-write-iovecs budget, and writes them with a
+ * single writev. A response with a JT_SPLICE attachment ends the batch, its
+ * attachment is spliced after the writev. */
+static void *responseWriter(void *data) {
+    IOProcessCtx *ctx = (IOProcessCtx *) data;
+    MpscQueue *responseQueue = ctx->responseQueue;
+    struct Response *response;
+    struct OutFrame *frames;
+    struct iovec *iov;
+    uint64_t batchBytes;
+    uint64_t splicedBytes;
+    JsonSplice *splice;
+    int frameCount;
+    int iovcnt;
+    int i;
+    int n;
+    gboolean stopping = FALSE;
+    void *ret = NULL;
+    void *readerRet;
+    int rv;
+
+    /* Every frame takes at most 3 iovecs */
+    frames = malloc(sizeof(struct OutFrame) * MAX_WRITE_IOVECS / 3);
+    iov = malloc(sizeof(struct iovec) * MAX_WRITE_IOVECS);
+    if (!frames || !iov) {
+        g_warning("Could not allocate write buffers");
+        ret = new_thread_result(ENOMEM);
+        goto clean;
+    }
+
+    while (!stopping) {
+        frameCount = 0;
+        iovcnt = 0;
+        batchBytes = 0;
+        splicedBytes = 0;
+        splice = NULL;
+
+        response = (struct Response *) mpscQueue_pop(responseQueue);
+        while (response) {
+            if (response == STOP_PTR) {
+                g_message("responseWriter received stop request, "
+                        "terminating\n");
+                stopping = TRUE;
+                break;
+            }
+
+            n = prepareOutFrame(response, &frames[frameCount],
+                                &iov[iovcnt]);
+            if (n < 0) {
+                if (frames[frameCount].stream) {
+                    releaseStreamChunk(frames[frameCount].stream);
+                }
+                g_warning("Could not allocate response buffer");
+                ret = new_thread_result(EINVAL);
+                break;
+            }
+
+            for (i = iovcnt; i < iovcnt + n; i++) {
+                batchBytes += iov[i].iov_len;
+            }
+            iovcnt += n;
+            frameCount++;
+
+            if (frames[frameCount - 1].attachment &&
+                JsonNode_getType(frames[frameCount - 1].attachment) ==
+                    JT_SPLICE) {
+                splice = JsonNode_getSplice(frames[frameCount - 1].attachment);
+                break;
+            }
+
+            if (iovcnt + 3 > MAX_WRITE_IOVECS ||
+                batchBytes >= (uint64_t) MAX_WRITE_BYTES) {
+                break;
+            }
+
+            response = (struct Response *) mpscQueue_tryPop(responseQueue);
+        }
+
+        rv = 0;
+        if (iovcnt > 0) {
+            g_trace("Sending %d responses sized %" PRIu64, frameCount,
+                    batchBytes);
+            rv = ctx->transport->writev(ctx, iov, iovcnt);
+        }
+
+        if (rv == 0 && splice) {
+            g_trace("Splicing attachment sized %" PRIu64, splice->size);
+            rv = ctx->transport->splice(ctx, splice);
+            splicedBytes = splice->size;
+            batchBytes += splicedBytes;
+        }
+
+        freeOutFrames(frames, frameCount);
+
+        if (ret) {
+            break;
+        }
+
+        if (rv != 0) {
+            g_warning("Could not write response: %s", iop_strerror(rv));
+            ret = new_thread_result(rv);
+            break;
+        }
+
+        if (frameCount > 0) {
+            STAT_ADD(&writerStats.frames, frameCount);
+            STAT_ADD(&writerStats.bytes, batchBytes);
+            STAT_ADD(&writerStats.splicedBytes, splicedBytes);
+        }
+    }
+
+clean:
+    g_atomic_int_set(&ctx->writerStopped, TRUE);
+    free(frames);
+    free(iov);
+
+    /* Stop request reading, and close the pipe as we won't use it anymore
+     * anyway */
+    if (ctx->isSocket) {
+        shutdown(ctx->readPipe, SHUT_RDWR);
+    } else {
+        if (ret) {
+            stop_request_reader();
+        }
+        close(WRITE_PIPE_FD);
+    }
+
+    /* Requests still running answer to this connection until the last one
+     * drops its reference */
+    while (!stopping) {
+        response = (struct Response *) mpscQueue_pop(responseQueue);
+        if (response == STOP_PTR) {
+            break;
+        }
+
+        if (response->stream) {
+            releaseStreamChunk(response->stream);
+        }
+        JsonNode_free(response->obj);
+        free(response->buffer);
+        JsonArena_unref(response->arena);
+        free(response);
+    }
+
+    if (ctx->isSocket) {
+        if (ret) {
+            g_error_free((GError *) ret);
+            ret = NULL;
+        }
+
+        if (ctx->readerThread) {
+            readerRet = g_thread_join(ctx->readerThread);
+            if (readerRet) {
+                g_error_free((GError *) readerRet);
+            }
+        }
+
+        /* Removed before closing, waitSocketConnections may shut down the
+         * socket of the connections it finds */
+        removeSocketConnection(ctx);
+        g_debug("Closing socket connection %d", ctx->readPipe);
+        close(ctx->readPipe);
+        g_hash_table_destroy(ctx->pending);
+        g_hash_table_destroy(ctx->streams);
+        mpscQueue_free(ctx->responseQueue);
+        g_async_queue_unref(ctx->requestQueue);
+        free(ctx);
+    }
+
+    return ret;
+}
+
+/* Read exactly len bytes, returns 0 or the errno value */
+static int readAll(IOProcessCtx *ctx, void *buffer, uint64_t len) {
+    uint64_t bytesRead = 0;
+    ssize_t n;
+
+    while (bytesRead < len) {
+        n = ctx->transport->read(ctx, (char *) buffer + bytesRead,
+                                 len - bytesRead);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        } else if (n == 0) {
+            return EPIPE;
+        }
+
+        bytesRead += n;
+    }
+
+    return 0;
+}
+
+/* Requests are read into a fixed buffer, as many as the pipe holds per
+ * read, and parsed in place. Requests that don't fit in it are read into a
+ * buffer taken from bufferPool. */
+#define READ_BUFFER_SIZE (64 * 1024)
+#define BUFFER_POOL_SIZE 4
+#define BUFFER_POOL_MAX_BUFFER (4 * 1024 * 1024)
 
-    while (TRUE) {
-            if (bytesWritten == bufflen) {
-                if (buffer) {
-                    free(buffer);
-                }
+struct PooledBuffer {
+    char *data;
+    uint64_t size;
+};
 
-                responseObj = (JsonNode *) g_async_queue_pop(responseQueue);
-                if (responseObj == STOP_PTR) {
-                    g_message("responseWriter received stop request, "
-                            "terminating\n");
-                    break;
-                }
-                g_trace("Generating json...");
-                buffer = jdGenerator_generate(responseObj, &bufflen);
-                JsonNode_free(responseObj);
-                if (!buffer) {
-                    g_warning("Could not allocate response buffer");
-                    ret = new_thread_result(EINVAL);
-                    break;
-            }
+/* Owned by the request reader of a connection */
+struct RequestBuffer {
+    char *data;
+    /* Unparsed bytes are data[start:end] */
+    uint64_t start;
+    uint64_t end;
+    /* When data[start], the first byte of the next request, was read */
+    gint64 received;
+    struct PooledBuffer bufferPool[BUFFER_POOL_SIZE];
+};
 
-            g_trace("Sending response sized %" PRIu64, bufflen);
+/* Returns the smallest pooled buffer of at least size bytes, or a new
+ * one */
+static char *bufferPoolGet(struct PooledBuffer *bufferPool, uint64_t size,
+                           uint64_t *capacity) {
+    struct PooledBuffer *best = NULL;
+    char *data;
+    int i;
 
-            if (write(writePipe, &bufflen, sizeof(uint64_t)) < 0) {
-                g_warning("Could not write to pipe: %s", iop_strerror(errno));
-                ret = new_thread_result(errno);
-                break;
-            }
-            bytesWritten = 0;
+    for (i = 0; i < BUFFER_POOL_SIZE; i++) {
+        if (bufferPool[i].data && bufferPool[i].size >= size &&
+            (!best || bufferPool[i].size < best->size)) {
+            best = &bufferPool[i];
         }
+    }
 
-        n = write(writePipe, buffer + bytesWritten, bufflen - bytesWritten);
-        if (n <= 0) {
-            if (errno == EAGAIN) {
-                continue;
+    if (best) {
+        data = best->data;
+        *capacity = best->size;
+        best->data = NULL;
+        return data;
+    }
+
+    *capacity = size;
+    return malloc(size);
+}
+
+/* Returns a buffer to the pool, replacing a smaller one if the pool is
+ * full. Huge buffers are not kept. */
+static void bufferPoolPut(struct PooledBuffer *bufferPool, char *data,
+                          uint64_t capacity) {
+    struct PooledBuffer *slot = NULL;
+    int i;
+
+    if (capacity <= BUFFER_POOL_MAX_BUFFER) {
+        for (i = 0; i < BUFFER_POOL_SIZE; i++) {
+            if (!bufferPool[i].data) {
+                slot = &bufferPool[i];
+                break;
             }
 
-            g_warning("Could not write to pipe: %s", iop_strerror(errno));
-            ret = new_thread_result(errno);
-            break;
+            if (bufferPool[i].size < capacity &&
+                (!slot || bufferPool[i].size < slot->size)) {
+                slot = &bufferPool[i];
+            }
         }
+    }
 
-        bytesWritten += n;
+    if (!slot) {
+        free(data);
+        return;
     }
 
-    /* Stop request reading, and close the pipe as we won't use it anymore
-     * anyway */
-    if (ret) {
-        stop_request_reader();
+    free(slot->data);
+    slot->data = data;
+    slot->size = capacity;
+}
+
+static void bufferPoolClear(struct PooledBuffer *bufferPool) {
+    int i;
+
+    for (i = 0; i < BUFFER_POOL_SIZE; i++) {
+        free(bufferPool[i].data);
+        bufferPool[i].data = NULL;
     }
-    close(WRITE_PIPE_FD);
+}
 
-    return ret;
+/* Read exactly len bytes, buffered bytes first, returns 0 or the errno
+ * value */
+static int readBuffered(struct RequestBuffer *reqBuffer, IOProcessCtx *ctx,
+                        void *buffer, uint64_t len) {
+    uint64_t buffered = reqBuffer->end - reqBuffer->start;
+
+    if (buffered > len) {
+        buffered = len;
+    }
+
+    memcpy(buffer, reqBuffer->data + reqBuffer->start, buffered);
+    reqBuffer->start += buffered;
+
+    return readAll(ctx, (char *) buffer + buffered, len - buffered);
+}
+
+/* Read the raw bytes following the request envelope, if any, and pass them
+ * to the method as the "attachment" argument */
+/* Sets attachmentSize to the bytes read */
+static int readAttachment(struct RequestBuffer *reqBuffer,
+                          IOProcessCtx *ctx, JsonNode *requestObj,
+                          uint64_t *attachmentSize) {
+    JsonNode *sizeNode;
+    JsonNode *args;
+    GByteArray *bytes;
+    long size;
+    int rv;
+
+    sizeNode = JsonNode_map_lookup(requestObj, "attachmentSize", NULL);
+    if (!sizeNode) {
+        return 0;
+    }
+
+    if (JsonNode_getType(sizeNode) != JT_LONG ||
+        (size = JsonNode_getLong(sizeNode)) < 0 || size > G_MAXUINT) {
+        g_warning("Invalid attachment size");
+        return EINVAL;
+    }
+
+    g_trace("Attachment size is %li", size);
+    bytes = g_byte_array_sized_new(size);
+    g_byte_array_set_size(bytes, size);
+    rv = readBuffered(reqBuffer, ctx, bytes->data, size);
+    if (rv != 0) {
+        g_byte_array_free(bytes, TRUE);
+        return rv;
+    }
+
+    args = JsonNode_map_lookup(requestObj, "args", NULL);
+    if (!args || JsonNode_getType(args) != JT_MAP) {
+        args = JsonNode_newMap();
+        JsonNode_map_insert(requestObj, "args", args, NULL);
+    }
+
+    JsonNode_map_insert(args, "attachment",
+                        JsonNode_newFromByteArray(bytes), NULL);
+    *attachmentSize = size;
+    return 0;
+}
+
+/* Returns the deadline of the request, from the optional "timeout" of the
+ * envelope in seconds, or 0 if it has none */
+static gint64 getDeadline(const JsonNode *requestObj, gint64 reqTime) {
+    JsonNode *timeout;
+    double seconds;
+
+    if (JsonNode_getType(requestObj) != JT_MAP) {
+        return 0;
+    }
+
+    timeout = JsonNode_map_lookup(requestObj, "timeout", NULL);
+    if (!timeout) {
+        return 0;
+    }
+
+    switch (JsonNode_getType(timeout)) {
+    case JT_LONG:
+        seconds = JsonNode_getLong(timeout);
+        break;
+    case JT_DOUBLE:
+        seconds = JsonNode_getDouble(timeout);
+        break;
+    default:
+        return 0;
+    }
+
+    if (seconds <= 0) {
+        return 0;
+    }
+
+    return reqTime + (gint64) (seconds * G_USEC_PER_SEC);
+}
+
+/* Returns the priority class of the request, from the optional "priority"
+ * of the envelope */
+static int getPriority(const JsonNode *requestObj) {
+    JsonNode *priority;
+    long value;
+
+    if (JsonNode_getType(requestObj) != JT_MAP) {
+        return PRIORITY_NORMAL;
+    }
+
+    priority = JsonNode_map_lookup(requestObj, "priority", NULL);
+    if (!priority || JsonNode_getType(priority) != JT_LONG) {
+        return PRIORITY_NORMAL;
+    }
+
+    value = JsonNode_getLong(priority);
+    return CLAMP(value, PRIORITY_LOW, PRIORITY_HIGH);
+}
+
+/* Returns TRUE if the optional "timing" of the envelope is set */
+static gboolean wantsTiming(const JsonNode *requestObj) {
+    JsonNode *timing;
+
+    if (JsonNode_getType(requestObj) != JT_MAP) {
+        return FALSE;
+    }
+
+    timing = JsonNode_map_lookup(requestObj, "timing", NULL);
+    return timing && JsonNode_getType(timing) == JT_BOOLEAN &&
+           JsonNode_getBoolean(timing);
+}
+
+/* Parses a request and queues it, reading its attachment if it has one */
+static int queueRequestFrame(struct RequestBuffer *reqBuffer,
+                             IOProcessCtx *ctx, const char *frame,
+                             uint64_t reqSize) {
+    struct RequestParams *params;
+    JsonNode *requestObj;
+    JsonArena *arena;
+    JsonArena *prevArena;
+    GError *err = NULL;
+    uint64_t attachmentSize = 0;
+    int rv;
+
+    arena = JsonArena_new();
+    if (!arena) {
+        g_warning("Could not allocate request arena");
+        return ENOMEM;
+    }
+
+    g_trace("Marshaling message...");
+    prevArena = JsonArena_setCurrent(arena);
+    requestObj = WIRE_FORMAT->buildDom(frame, reqSize, &err);
+    JsonArena_setCurrent(prevArena);
+    if (!requestObj) {
+        g_warning("Could not parse %s request '%.*s': %s",
+                  WIRE_FORMAT->name, (int) reqSize, frame, err->message);
+        g_error_free(err);
+        JsonArena_unref(arena);
+        return EINVAL;
+    }
+
+    rv = readAttachment(reqBuffer, ctx, requestObj, &attachmentSize);
+    if (rv != 0) {
+        g_warning("Could not read attachment: %s", iop_strerror(rv));
+        JsonNode_free(requestObj);
+        JsonArena_unref(arena);
+        return rv;
+    }
+
+    params = newRequestParams(requestObj, ctx, NULL, 0);
+    if (!params) {
+        g_warning("Could not allocate request params");
+        JsonNode_free(requestObj);
+        JsonArena_unref(arena);
+        return ENOMEM;
+    }
+
+    params->arena = arena;
+    params->reqSize = sizeof(uint64_t) + reqSize + attachmentSize;
+
+    params->deadline = getDeadline(requestObj, params->timing.parsed);
+    params->priority = getPriority(requestObj);
+    params->timing.send = wantsTiming(requestObj);
+    params->timing.received = reqBuffer->received;
+
+    g_trace("Queuing request...");
+    g_async_queue_push(ctx->requestQueue, params);
+    return 0;
+}
+
+/* Reads a request too large for the request buffer into a pooled buffer */
+static int readLargeRequest(struct RequestBuffer *reqBuffer,
+                            IOProcessCtx *ctx, uint64_t reqSize) {
+    uint64_t capacity;
+    char *buffer;
+    int rv;
+
+    g_trace("Reading large request sized %" PRIu64, reqSize);
+    buffer = bufferPoolGet(reqBuffer->bufferPool, reqSize, &capacity);
+    if (!buffer) {
+        g_warning("Could not allocate request buffer: %s",
+                  iop_strerror(ENOMEM));
+        return ENOMEM;
+    }
+
+    rv = readBuffered(reqBuffer, ctx, buffer, reqSize);
+    if (rv == 0) {
+        rv = queueRequestFrame(reqBuffer, ctx, buffer, reqSize);
+    }
+
+    bufferPoolPut(reqBuffer->bufferPool, buffer, capacity);
+    return rv;
 }
 
 static void *requestReader(void *data) {
     IOProcessCtx *ctx = (IOProcessCtx *) data;
-    int readPipe = ctx->readPipe;
-    GAsyncQueue *requestQueue = ctx->requestQueue;
-    uint64_t bytesPending = 0;
+    struct RequestBuffer reqBuffer;
     uint64_t reqSize = 0;
+    uint64_t available;
+    uint64_t frames;
+    gint64 lastRead = 0;
+    ssize_t n;
     int rv = 0;
-    char *buffer = NULL;
-    JsonNode *requestObj = NULL;
-    GError *err = NULL;
+
+    memset(&reqBuffer, 0, sizeof(reqBuffer));
+    reqBuffer.data = malloc(READ_BUFFER_SIZE);
+    if (!reqBuffer.data) {
+        g_warning("Could not allocate request buffer: %s",
+                  iop_strerror(ENOMEM));
+        rv = ENOMEM;
+        goto done;
+    }
 
     while (TRUE) {
-        if (bytesPending == 0) {
-            g_trace("Waiting for next request...");
-            rv = read(readPipe, &reqSize, sizeof(reqSize));
-            g_trace("Receiving request...");
-            if (rv < 0) {
-                g_warning("Could not read request size: %s", iop_strerror(errno));
-                rv = errno;
-                goto done;
+        /* Parse every complete request we have */
+        frames = 0;
+        while (TRUE) {
+            available = reqBuffer.end - reqBuffer.start;
+            if (available < sizeof(uint64_t)) {
+                break;
             }
 
+            memcpy(&reqSize, reqBuffer.data + reqBuffer.start,
+                   sizeof(uint64_t));
             g_trace("Message size is %" PRIu64, reqSize);
-            buffer = malloc(reqSize + 1);
-            if (!buffer) {
-                g_warning("Could not allocate request buffer: %s",
-                          iop_strerror(errno));
 
-                rv = errno;
+            if (reqSize > READ_BUFFER_SIZE - sizeof(uint64_t)) {
+                reqBuffer.start += sizeof(uint64_t);
+                rv = readLargeRequest(&reqBuffer, ctx, reqSize);
+            } else if (reqSize <= available - sizeof(uint64_t)) {
+                reqBuffer.start += sizeof(uint64_t) + reqSize;
+                rv = queueRequestFrame(
+                    &reqBuffer, ctx,
+                    reqBuffer.data + reqBuffer.start - reqSize, reqSize);
+            } else {
+                break;
+            }
+
+            if (rv != 0) {
                 goto done;
             }
 
-            memset(buffer, 0, reqSize + 1);
-            bytesPending = reqSize;
+            /* Any request left in the buffer starts in the last read */
+            reqBuffer.received = lastRead;
+            frames++;
         }
 
-        rv = read(readPipe, buffer + (reqSize - bytesPending),
-                  bytesPending);
-        if (rv < 0) {
-            g_warning("Could not read from pipe: %s", iop_strerror(errno));
+        if (frames > 0) {
+            G_LOCK(readerStats);
+            readerStats.frames += frames;
+            G_UNLOCK(readerStats);
+        }
+
+        /* Move the partial request to the start of the buffer */
+        if (reqBuffer.start > 0) {
+            memmove(reqBuffer.data, reqBuffer.data + reqBuffer.start,
+                    reqBuffer.end - reqBuffer.start);
+            reqBuffer.end -= reqBuffer.start;
+            reqBuffer.start = 0;
+        }
+
+        g_trace("Waiting for next request...");
+        n = ctx->transport->read(ctx, reqBuffer.data + reqBuffer.end,
+                                 READ_BUFFER_SIZE - reqBuffer.end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g_warning("Could not read request: %s", iop_strerror(errno));
             rv = errno;
             goto done;
-        } else if (rv == 0) {
-            g_warning("Pipe closed");
+        } else if (n == 0) {
+            if (ctx->isSocket) {
+                g_debug("Socket connection %d closed", ctx->readPipe);
+            } else {
+                g_warning("Pipe closed");
+            }
             rv = EPIPE;
             goto done;
         }
 
-        bytesPending -= rv;
-        if (bytesPending == 0) {
-            g_trace("Marshaling message...");
-            err = NULL;
-            requestObj = jdParser_buildDom(buffer, reqSize, &err);
-            if (!requestObj) {
-                g_warning("Could not parse request '%s': %s", buffer, err->message);
-                g_error_free(err);
-                rv = EINVAL;
-                goto done;
+        g_trace("Received %zd bytes", n);
+        lastRead = g_get_monotonic_time();
+        if (reqBuffer.start == reqBuffer.end) {
+            reqBuffer.received = lastRead;
+        }
+        reqBuffer.end += n;
+
+        G_LOCK(readerStats);
+        readerStats.reads++;
+        readerStats.bytes += n;
+        G_UNLOCK(readerStats);
+    }
+done:
+    free(reqBuffer.data);
+    bufferPoolClear(reqBuffer.bufferPool);
+
+    if (ctx->isSocket) {
+        socketReaderDone(ctx);
+    }
+
+    /* No more requests from this connection */
+    unrefConnection(ctx);
+
+    return new_thread_result(rv);
+}
+
+/* Maps the request and response rings, the request ring is the first half
+ * of the shared memory */
+static int setupShm(IOProcessCtx *ctx, char **shm, uint64_t *shmSize) {
+    const int eventFds[] = {SHM_REQUEST_FD, SHM_REQUEST_SPACE_FD,
+                            SHM_RESPONSE_FD, SHM_RESPONSE_SPACE_FD};
+    struct stat st;
+    uint64_t ringSize;
+    int flags;
+    int i;
+
+    /* The rings read the eventfds without waiting, whatever the client
+     * created them with */
+    for (i = 0; i < (int) G_N_ELEMENTS(eventFds); i++) {
+        flags = fcntl(eventFds[i], F_GETFL);
+        if (flags < 0 ||
+            fcntl(eventFds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            g_warning("Could not make eventfd %d non-blocking: %s",
+                      eventFds[i], iop_strerror(errno));
+            return errno;
+        }
+    }
+
+    if (fstat(SHM_FD, &st) < 0) {
+        g_warning("Could not stat shared memory: %s", iop_strerror(errno));
+        return errno;
+    }
+
+    ringSize = st.st_size / 2;
+    if (ringSize == 0) {
+        g_warning("Shared memory is too small");
+        return EINVAL;
+    }
+
+    *shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                SHM_FD, 0);
+    if (*shm == MAP_FAILED) {
+        *shm = NULL;
+        g_warning("Could not map shared memory: %s", iop_strerror(errno));
+        return errno;
+    }
+
+    *shmSize = st.st_size;
+    close(SHM_FD);
+
+    shmRing_initConsumer(&ctx->requestRing, *shm, ringSize,
+                         SHM_REQUEST_FD, SHM_REQUEST_SPACE_FD);
+    shmRing_initProducer(&ctx->responseRing, *shm + ringSize, ringSize,
+                         SHM_RESPONSE_FD, SHM_RESPONSE_SPACE_FD);
+
+    g_debug("Using shared memory rings sized %" PRIu64, ringSize);
+    return 0;
+}
+
+/* Starts a thread that is never joined */
+static GThread *create_detached_thread(const gchar *name, GThreadFunc func,
+                                       gpointer data) {
+    GThread *thread = create_thread(name, func, data, FALSE);
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    if (thread) {
+        g_thread_unref(thread);
+    }
+#endif
+    return thread;
+}
+
+/* Removes the socket left by an ioprocess that did not exit cleanly, fails
+ * if another ioprocess is still listening on it */
+static int removeStaleSocket(const struct sockaddr_un *addr) {
+    struct stat st;
+    int fd;
+    int rv;
+
+    if (lstat(addr->sun_path, &st) < 0) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    if (!S_ISSOCK(st.st_mode)) {
+        return -EADDRINUSE;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    rv = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+    close(fd);
+    if (rv == 0) {
+        return -EADDRINUSE;
+    }
+
+    if (errno != ECONNREFUSED) {
+        return -errno;
+    }
+
+    g_debug("Removing stale socket '%s'", addr->sun_path);
+    if (unlink(addr->sun_path) < 0 && errno != ENOENT) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int openSocket(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    int rv;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_warning("Socket path '%s' is too long", path);
+        return -ENAMETOOLONG;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        rv = -errno;
+        g_warning("Could not create socket: %s", iop_strerror(-rv));
+        return rv;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    rv = removeStaleSocket(&addr);
+    if (rv < 0) {
+        g_warning("Could not use '%s': %s", path, iop_strerror(-rv));
+        close(fd);
+        return rv;
+    }
+
+    /* Only processes running as our user may connect, no client can connect
+     * before listen() so there is no window with the default mode */
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        rv = -errno;
+        g_warning("Could not listen on '%s': %s", path, iop_strerror(-rv));
+        close(fd);
+        return rv;
+    }
+
+    g_message("Listening on '%s'", path);
+    return fd;
+}
+
+/* Serves a socket client with its own request reader and response writer.
+ * The writer frees the connection once the client is gone and all its
+ * requests are answered. */
+static void startSocketConnection(int fd, struct SocketServer *server) {
+    IOProcessCtx *conn;
+
+    conn = calloc(1, sizeof(IOProcessCtx));
+    if (!conn) {
+        g_warning("Could not allocate connection");
+        close(fd);
+        return;
+    }
+
+    conn->requestQueue = g_async_queue_ref(server->requestQueue);
+    conn->responseQueue = mpscQueue_new(RESPONSE_QUEUE_SIZE);
+    conn->pending = g_hash_table_new(g_int64_hash, g_int64_equal);
+    conn->streams = g_hash_table_new(g_int64_hash, g_int64_equal);
+    conn->readPipe = fd;
+    conn->writePipe = fd;
+    conn->transport = &socketTransport;
+    conn->refs = 1;
+    conn->isSocket = TRUE;
+    conn->server = server;
+    addSocketConnection(conn);
+
+    if (!create_detached_thread("socket writer", responseWriter, conn)) {
+        g_warning("Could not allocate socket writer thread");
+        socketReaderDone(conn);
+        removeSocketConnection(conn);
+        close(fd);
+        g_hash_table_destroy(conn->pending);
+        g_hash_table_destroy(conn->streams);
+        mpscQueue_free(conn->responseQueue);
+        g_async_queue_unref(conn->requestQueue);
+        free(conn);
+        return;
+    }
+
+    /* Keeps the writer from freeing the connection before readerThread is
+     * set */
+    refConnection(conn);
+
+    conn->readerThread = create_thread("socket reader", requestReader, conn,
+                                       TRUE);
+    if (!conn->readerThread) {
+        g_warning("Could not allocate socket reader thread");
+        socketReaderDone(conn);
+        unrefConnection(conn);
+    } else {
+        g_debug("Accepted socket connection %d", fd);
+    }
+
+    unrefConnection(conn);
+}
+
+/* Accepts socket clients until the socket is shut down */
+static void *socketListener(void *data) {
+    struct SocketServer *server = (struct SocketServer *) data;
+    int fd;
+
+    while (TRUE) {
+        fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
 
-            free(buffer);
-            buffer = NULL;
+            if (errno == EINVAL || errno == EBADF) {
+                break;
+            }
 
-            g_trace("Queuing request...");
-            g_async_queue_push(requestQueue, requestObj);
+            g_warning("Could not accept connection: %s",
+                      iop_strerror(errno));
+            g_usleep(G_USEC_PER_SEC / 10);
+            continue;
         }
+
+        startSocketConnection(fd, server);
     }
-done:
-    if (buffer) {
-        free(buffer);
+
+    return NULL;
+}
+
+/* Stops reading requests from the socket clients. Requests they already
+ * sent are still served. */
+static void stopSocketReaders(struct SocketServer *server) {
+    GHashTableIter iter;
+    gpointer key;
+
+    g_mutex_lock(&server->lock);
+    g_hash_table_iter_init(&iter, server->conns);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        shutdown(((IOProcessCtx *) key)->readPipe, SHUT_RD);
     }
 
-    /* End of requests to requestHandler */
-    g_async_queue_push(requestQueue, STOP_PTR);
+    while (server->readers > 0) {
+        g_cond_wait(&server->cond, &server->lock);
+    }
+    g_mutex_unlock(&server->lock);
+}
 
-    return new_thread_result(rv);
+/* Waits until the socket connections sent all their responses. A client
+ * that stops reading would block its response writer forever, so the
+ * connections left after SOCKET_CLOSE_GRACE are shut down, failing their
+ * writes. */
+static void waitSocketConnections(struct SocketServer *server) {
+    GHashTableIter iter;
+    gpointer key;
+    gint64 giveUp = g_get_monotonic_time() + SOCKET_CLOSE_GRACE;
+
+    g_mutex_lock(&server->lock);
+    while (g_hash_table_size(server->conns) > 0) {
+        if (!g_cond_wait_until(&server->cond, &server->lock, giveUp)) {
+            break;
+        }
+    }
+
+    if (g_hash_table_size(server->conns) > 0) {
+        g_warning("Disconnecting %u socket clients not reading responses",
+                  g_hash_table_size(server->conns));
+        g_hash_table_iter_init(&iter, server->conns);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            shutdown(((IOProcessCtx *) key)->writePipe, SHUT_RDWR);
+        }
+    }
+
+    while (g_hash_table_size(server->conns) > 0) {
+        g_cond_wait(&server->cond, &server->lock);
+    }
+    g_mutex_unlock(&server->lock);
 }
 
 static int communicate(int readPipe, int writePipe) {
@@ -721,17 +4066,53 @@ static int communicate(int readPipe, int writePipe) {
     GThread *requestReaderThread = NULL;
     GThread *responseWriterThread = NULL;
     GThread *requestHandlerThread = NULL;
+    GThread *socketListenerThread = NULL;
+    struct RequestParams *params;
+    struct SocketServer server;
     IOProcessCtx ctx;
+    char *shm = NULL;
+    uint64_t shmSize = 0;
 
+    memset(&ctx, 0, sizeof(ctx));
     ctx.readPipe = readPipe;
     ctx.writePipe = writePipe;
+    ctx.transport = &pipeTransport;
     ctx.requestQueue = g_async_queue_new();
-    ctx.responseQueue = g_async_queue_new();
+    ctx.responseQueue = mpscQueue_new(RESPONSE_QUEUE_SIZE);
+    ctx.pending = g_hash_table_new(g_int64_hash, g_int64_equal);
+    ctx.streams = g_hash_table_new(g_int64_hash, g_int64_equal);
+    /* Dropped by the request reader */
+    ctx.refs = 1;
+
+    memset(&server, 0, sizeof(server));
+    server.fd = -1;
+    server.requestQueue = ctx.requestQueue;
+    g_mutex_init(&server.lock);
+    g_cond_init(&server.cond);
+    server.conns = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (SHM_FD >= 0) {
+        rv = setupShm(&ctx, &shm, &shmSize);
+        if (rv != 0) {
+            rv = -rv;
+            goto clean;
+        }
 
-    requestReaderThread = create_thread("request reader", requestReader, &ctx,
-                                        TRUE);
-    if (!requestReaderThread) {
-        g_warning("Could not allocate request reader thread");
+        ctx.transport = &shmTransport;
+    }
+
+    if (SOCKET_PATH) {
+        server.fd = openSocket(SOCKET_PATH);
+        if (server.fd < 0) {
+            rv = server.fd;
+            goto clean;
+        }
+    }
+
+    requestHandlerThread = create_thread("request handler", requestHandler,
+                                         ctx.requestQueue, TRUE);
+    if (!requestHandlerThread) {
+        g_warning("Could not allocate request handler thread");
         rv = -ENOMEM;
         goto clean;
     }
@@ -744,40 +4125,84 @@ static int communicate(int readPipe, int writePipe) {
         goto clean;
     }
 
-    requestHandlerThread = create_thread("request handler", requestHandler,
-                                         &ctx, TRUE);
-    if (!requestHandlerThread) {
-        g_warning("Could not allocate request handler thread");
+    if (server.fd >= 0) {
+        socketListenerThread = create_thread("socket listener",
+                                             socketListener, &server, TRUE);
+        if (!socketListenerThread) {
+            g_warning("Could not allocate socket listener thread");
+            unrefConnection(&ctx);
+            rv = -ENOMEM;
+            goto clean;
+        }
+    }
+
+    requestReaderThread = create_thread("request reader", requestReader, &ctx,
+                                        TRUE);
+    if (!requestReaderThread) {
+        g_warning("Could not allocate request reader thread");
+        unrefConnection(&ctx);
         rv = -ENOMEM;
         goto clean;
     }
 
-
+    /* The process lives as long as the pipes client */
     g_thread_join(requestReaderThread);
     requestReaderThread = NULL;
     rv = 0;
 clean:
+    if (socketListenerThread) {
+        shutdown(server.fd, SHUT_RDWR);
+        g_thread_join(socketListenerThread);
+    }
+    if (server.fd >= 0) {
+        close(server.fd);
+        unlink(SOCKET_PATH);
+    }
+    /* Socket clients are disconnected with the pipes client, requests they
+     * sent before are answered first */
+    stopSocketReaders(&server);
     if (requestHandlerThread) {
+        g_async_queue_push(ctx.requestQueue, STOP_PTR);
         g_thread_join(requestHandlerThread);
     }
+    /* Requests the handler did not take, dropping their connection
+     * references */
+    while ((params = g_async_queue_try_pop(ctx.requestQueue))) {
+        if ((gpointer) params != STOP_PTR) {
+            freeRequestParams(params);
+        }
+    }
+    waitSocketConnections(&server);
+    g_hash_table_destroy(server.conns);
+    g_cond_clear(&server.cond);
+    g_mutex_clear(&server.lock);
     if (responseWriterThread) {
         g_thread_join(responseWriterThread);
     }
     close(ctx.readPipe);
     close(ctx.writePipe);
+    if (shm) {
+        munmap(shm, shmSize);
+        close(SHM_REQUEST_FD);
+        close(SHM_REQUEST_SPACE_FD);
+        close(SHM_RESPONSE_FD);
+        close(SHM_RESPONSE_SPACE_FD);
+    }
+    g_hash_table_destroy(ctx.pending);
+    g_hash_table_destroy(ctx.streams);
     g_async_queue_unref(ctx.requestQueue);
-    g_async_queue_unref(ctx.responseQueue);
+    mpscQueue_free(ctx.responseQueue);
     return rv;
 }
 
 GThread *log_writer = NULL;
 
 static int setup_logging() {
-    logger_queue = g_async_queue_new();
+    logRing = logRing_new(LOG_RING_SIZE);
 
-    g_log_set_handler(NULL, G_LOG_LEVEL_MASK, logfunc, logger_queue);
+    g_log_set_handler(NULL, G_LOG_LEVEL_MASK, logfunc, logRing);
 
-    log_writer = create_thread("log writer", logWriter, stderr, TRUE);
+    log_writer = create_thread("log writer", logWriter, logRing, TRUE);
     if (!log_writer) {
         g_print("Could not allocate request reader thread");
         return - ENOMEM;
@@ -786,19 +4211,20 @@ static int setup_logging() {
     return 0;
 }
 
+/* Lines logged after this are dropped, the ring is not freed since other
+ * threads may still log */
 static void stop_logging() {
-    fclose(stderr);
-    g_message("CLOSE"); // Push a message so that the log thread shuts down;
+    logRing_close(logRing);
 
     if (log_writer) {
         g_thread_join(log_writer);
     }
-
 }
 
 int main(int argc, char *argv[]) {
     int rv = 0;
-    int whitelist[] = {STDOUT_FILENO, STDERR_FILENO, -1, -1, -1};
+    int whitelist[] = {STDOUT_FILENO, STDERR_FILENO, -1, -1, -1, -1, -1, -1,
+                       -1, -1};
 
     if (parseCmdLine(argc, argv) < 0) {
         return -1;
@@ -806,6 +4232,13 @@ int main(int argc, char *argv[]) {
 
     whitelist[2] = READ_PIPE_FD;
     whitelist[3] = WRITE_PIPE_FD;
+    if (SHM_FD >= 0) {
+        whitelist[4] = SHM_FD;
+        whitelist[5] = SHM_REQUEST_FD;
+        whitelist[6] = SHM_REQUEST_SPACE_FD;
+        whitelist[7] = SHM_RESPONSE_FD;
+        whitelist[8] = SHM_RESPONSE_SPACE_FD;
+    }
 
 #if !GLIB_CHECK_VERSION(2, 32, 0)
     g_thread_init(NULL);
@@ -828,9 +4261,13 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    initMethodRegistry();
+
     g_debug("Opening communication channels...");
     rv = communicate(READ_PIPE_FD, WRITE_PIPE_FD);
 
+    freeMethodRegistry();
+
     g_message("Shutting down ioprocess");
     stop_logging();
 
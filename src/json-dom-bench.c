@@ -0,0 +1,122 @@
+/*
+ * Count the allocations made for one stat request: parsing it, building the
+ * response and generating it, with the DOM on the heap and in an arena.
+ *
+ *   $ make json-dom-bench
+ *   $ ./json-dom-bench [REQUESTS]
+ *   dom=heap requests=100000 mallocs/request=... elapsed=... rate=...
+ *   dom=arena requests=100000 mallocs/request=... elapsed=... rate=...
+ *
+ * Build it at an older revision for the counts before a DOM change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "json-dom.h"
+#include "json-dom-parser.h"
+#include "json-dom-generator.h"
+#include "exported-functions.h"
+
+#define DEFAULT_REQUESTS 100000
+
+static const char request[] =
+    "{\"id\": 42, \"methodName\": \"stat\", "
+    "\"args\": {\"path\": \"/var/tmp\"}}";
+
+static gint mallocs;
+
+/* Count every allocation, including the ones made inside glib and yajl */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    g_atomic_int_inc(&mallocs);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    g_atomic_int_inc(&mallocs);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    g_atomic_int_inc(&mallocs);
+    return __libc_realloc(ptr, size);
+}
+
+static void serve(struct stat *st) {
+    JsonNode *reqObj;
+    JsonNode *response;
+    uint64_t size;
+    char *buffer;
+
+    reqObj = jdParser_buildDom(request, sizeof(request) - 1, NULL);
+
+    response = JsonNode_newMap();
+    JsonNode_map_insert(response, "id",
+                        JsonNode_newFromLong(JsonNode_getLong(
+                            JsonNode_map_lookup(reqObj, "id", NULL))),
+                        NULL);
+    JsonNode_map_insert(response, "errcode", JsonNode_newFromLong(0), NULL);
+    JsonNode_map_insert(response, "errstr", JsonNode_newFromString(""),
+                        NULL);
+    JsonNode_map_insert(response, "result", stat_map(st), NULL);
+
+    buffer = jdGenerator_generate(response, &size);
+    free(buffer);
+
+    JsonNode_free(response);
+    JsonNode_free(reqObj);
+}
+
+static void run(const char *name, gboolean useArena, long requests) {
+    JsonArena *arena;
+    struct stat st;
+    gint64 start;
+    double elapsed;
+    gint before;
+    long i;
+
+    stat("/", &st);
+
+    before = g_atomic_int_get(&mallocs);
+    start = g_get_monotonic_time();
+    for (i = 0; i < requests; i++) {
+        arena = NULL;
+        if (useArena) {
+            arena = JsonArena_new();
+            JsonArena_setCurrent(arena);
+        }
+
+        serve(&st);
+
+        if (arena) {
+            JsonArena_setCurrent(NULL);
+            JsonArena_unref(arena);
+        }
+    }
+    elapsed = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+    printf("dom=%s requests=%ld mallocs/request=%.1f elapsed=%.3f "
+           "rate=%.0f/s\n", name, requests,
+           (double) (g_atomic_int_get(&mallocs) - before) / requests,
+           elapsed, requests / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    long requests = DEFAULT_REQUESTS;
+
+    if (argc > 1) {
+        requests = atol(argv[1]);
+    }
+
+    run("heap", FALSE, requests);
+    run("arena", TRUE, requests);
+    return 0;
+}
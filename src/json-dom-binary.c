@@ -0,0 +1,486 @@
+#include "json-dom-binary.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/*
+ * Compact binary encoding of a JsonNode tree.
+ *
+ * Every value starts with a one byte tag holding its JsonNodeType, followed
+ * by the payload in native byte order:
+ *
+ *   JT_NULL     nothing
+ *   JT_BOOLEAN  uint8_t
+ *   JT_LONG     int64_t
+ *   JT_DOUBLE   double
+ *   JT_STRING   uint32_t length, bytes
+ *   JT_BINARY   uint32_t length, bytes
+ *   JT_ARRAY    uint32_t count, values
+ *   JT_MAP      uint32_t count, (uint32_t key length, key bytes, value) pairs
+ *
+ * Both ends of the pipe run on the same host, so there is no need to convert
+ * to network byte order; the frame size header is native as well.
+ */
+
+#define MAX_DEPTH 64
+
+struct BinaryReader_t {
+    const char* buffer;
+    uint64_t len;
+    uint64_t pos;
+    GString* tmpMapKey;
+};
+
+typedef struct BinaryReader_t BinaryReader;
+
+static uint64_t jdBinary_size(const JsonNode* node) {
+    JsonMapIter iter;
+    GArray* array;
+    const char* key;
+    JsonNode* value;
+    uint64_t size = sizeof(uint8_t);
+    int i;
+
+    switch (JsonNode_getType(node)) {
+    case JT_BOOLEAN:
+        size += sizeof(uint8_t);
+        break;
+    case JT_LONG:
+        size += sizeof(int64_t);
+        break;
+    case JT_DOUBLE:
+        size += sizeof(double);
+        break;
+    case JT_STRING:
+        size += sizeof(uint32_t) + JsonNode_getString(node)->len;
+        break;
+    case JT_BINARY:
+        size += sizeof(uint32_t) + JsonNode_getByteArray(node)->len;
+        break;
+    case JT_MAP:
+        size += sizeof(uint32_t);
+        JsonNode_map_iterInit(&iter, node);
+        while (JsonNode_map_iterNext(&iter, &key, &value)) {
+            size += sizeof(uint32_t) + strlen(key) + jdBinary_size(value);
+        }
+        break;
+    case JT_ARRAY:
+        size += sizeof(uint32_t);
+        array = JsonNode_getArray(node);
+        for (i = 0; ; i++) {
+            value = g_array_index(array, JsonNode*, i);
+            if (!value) {
+                break;
+            }
+            size += jdBinary_size(value);
+        }
+        break;
+    }
+
+    return size;
+}
+
+static int jdBinary_get(BinaryReader* reader, void* out, uint64_t len,
+                        GError** err) {
+    if (reader->len - reader->pos < len) {
+        g_set_error(err, 0, EINVAL,
+                    "Truncated binary message at offset %" G_GUINT64_FORMAT,
+                    reader->pos);
+        return -1;
+    }
+
+    memcpy(out, reader->buffer + reader->pos, len);
+    reader->pos += len;
+    return 0;
+}
+
+static int jdBinary_getLen(BinaryReader* reader, uint32_t* len,
+                           GError** err) {
+    if (jdBinary_get(reader, len, sizeof(*len), err) < 0) {
+        return -1;
+    }
+
+    if (reader->len - reader->pos < *len) {
+        g_set_error(err, 0, EINVAL,
+                    "Invalid length %u at offset %" G_GUINT64_FORMAT,
+                    *len, reader->pos);
+        return -1;
+    }
+
+    return 0;
+}
+
+static JsonNode* jdBinary_buildNode(BinaryReader* reader, int depth,
+                                    GError** err) {
+    JsonNode* node = NULL;
+    JsonNode* child;
+    GError* tmpError = NULL;
+    uint8_t tag;
+    uint8_t boolean;
+    int64_t l;
+    double d;
+    uint32_t len;
+    uint32_t keyLen;
+    uint64_t keyPos;
+    uint32_t i;
+
+    if (depth > MAX_DEPTH) {
+        g_set_error(err, 0, EINVAL, "Binary message is nested too deeply");
+        return NULL;
+    }
+
+    if (jdBinary_get(reader, &tag, sizeof(tag), err) < 0) {
+        return NULL;
+    }
+
+    switch (tag) {
+    case JT_NULL:
+        node = JsonNode_newNull();
+        break;
+    case JT_BOOLEAN:
+        if (jdBinary_get(reader, &boolean, sizeof(boolean), err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newFromBoolean(boolean);
+        break;
+    case JT_LONG:
+        if (jdBinary_get(reader, &l, sizeof(l), err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newFromLong(l);
+        break;
+    case JT_DOUBLE:
+        if (jdBinary_get(reader, &d, sizeof(d), err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newFromDouble(d);
+        break;
+    case JT_STRING:
+        if (jdBinary_getLen(reader, &len, err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newFromStringLen(reader->buffer + reader->pos, len);
+        reader->pos += len;
+        break;
+    case JT_BINARY:
+        if (jdBinary_getLen(reader, &len, err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newFromByteArray(g_byte_array_append(
+            g_byte_array_sized_new(len),
+            (const guint8*) reader->buffer + reader->pos, len));
+        reader->pos += len;
+        break;
+    case JT_MAP:
+        if (jdBinary_get(reader, &len, sizeof(len), err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newMap();
+        if (!node) {
+            break;
+        }
+        for (i = 0; i < len; i++) {
+            if (jdBinary_getLen(reader, &keyLen, &tmpError) < 0) {
+                goto fail;
+            }
+            keyPos = reader->pos;
+            reader->pos += keyLen;
+
+            child = jdBinary_buildNode(reader, depth + 1, &tmpError);
+            if (!child) {
+                goto fail;
+            }
+            /* Copied after the value, nested maps reuse tmpMapKey */
+            g_string_truncate(reader->tmpMapKey, 0);
+            g_string_append_len(reader->tmpMapKey,
+                                reader->buffer + keyPos, keyLen);
+            JsonNode_map_insert(node, reader->tmpMapKey->str, child, NULL);
+        }
+        break;
+    case JT_ARRAY:
+        if (jdBinary_get(reader, &len, sizeof(len), err) < 0) {
+            return NULL;
+        }
+        node = JsonNode_newArray();
+        if (!node) {
+            break;
+        }
+        for (i = 0; i < len; i++) {
+            child = jdBinary_buildNode(reader, depth + 1, &tmpError);
+            if (!child) {
+                goto fail;
+            }
+            JsonNode_array_append(node, child, NULL);
+        }
+        break;
+    default:
+        g_set_error(err, 0, EINVAL, "Unknown binary type tag %u", tag);
+        return NULL;
+    }
+
+    if (!node) {
+        g_set_error(err, 0, ENOMEM, "%s", iop_strerror(ENOMEM));
+    }
+
+    return node;
+
+fail:
+    JsonNode_free(node);
+    g_propagate_error(err, tmpError);
+    return NULL;
+}
+
+JsonNode* jdBinary_buildDom(const char* buffer, uint64_t bufflen,
+                            GError** err) {
+    BinaryReader reader;
+    JsonNode* result;
+
+    reader.buffer = buffer;
+    reader.len = bufflen;
+    reader.pos = 0;
+    reader.tmpMapKey = g_string_new(NULL);
+
+    result = jdBinary_buildNode(&reader, 0, err);
+    if (result && reader.pos != reader.len) {
+        g_set_error(err, 0, EINVAL,
+                    "Trailing data in binary message at offset %"
+                    G_GUINT64_FORMAT, reader.pos);
+        JsonNode_free(result);
+        result = NULL;
+    }
+
+    g_string_free(reader.tmpMapKey, TRUE);
+    return result;
+}
+
+#define EMITTER_INITIAL_SIZE 4096
+
+/* Counts are unknown while a container is open, a placeholder is patched
+ * when it is closed */
+struct BinaryContainer {
+    size_t countPos;
+    uint32_t count;
+    int isMap;
+};
+
+struct BinaryEmitter_t {
+    JsonEmitter base;
+    char* buffer;
+    size_t len;
+    size_t size;
+    struct BinaryContainer stack[MAX_DEPTH];
+    int depth;
+};
+
+typedef struct BinaryEmitter_t BinaryEmitter;
+
+static void BinaryEmitter_put(BinaryEmitter* e, const void* data,
+                              size_t len) {
+    size_t size = e->size ? e->size : EMITTER_INITIAL_SIZE;
+    char* buffer;
+
+    if (e->base.failed) {
+        return;
+    }
+
+    if (e->size - e->len < len) {
+        while (size - e->len < len) {
+            size *= 2;
+        }
+
+        buffer = realloc(e->buffer, size);
+        if (!buffer) {
+            e->base.failed = TRUE;
+            return;
+        }
+
+        e->buffer = buffer;
+        e->size = size;
+    }
+
+    memcpy(e->buffer + e->len, data, len);
+    e->len += len;
+}
+
+static void BinaryEmitter_putLen(BinaryEmitter* e, size_t len) {
+    uint32_t len32 = (uint32_t) len;
+    BinaryEmitter_put(e, &len32, sizeof(len32));
+}
+
+/* Starts a value, counting it in the enclosing array */
+static void BinaryEmitter_putTag(BinaryEmitter* e, JsonNodeType type) {
+    uint8_t tag = (uint8_t) type;
+
+    if (e->depth > 0 && e->depth <= MAX_DEPTH &&
+        !e->stack[e->depth - 1].isMap) {
+        e->stack[e->depth - 1].count++;
+    }
+
+    BinaryEmitter_put(e, &tag, sizeof(tag));
+}
+
+static void BinaryEmitter_open(BinaryEmitter* e, JsonNodeType type) {
+    BinaryEmitter_putTag(e, type);
+    if (e->depth >= MAX_DEPTH) {
+        e->base.failed = TRUE;
+        e->depth++;
+        return;
+    }
+
+    e->stack[e->depth].countPos = e->len;
+    e->stack[e->depth].count = 0;
+    e->stack[e->depth].isMap = type == JT_MAP;
+    e->depth++;
+    BinaryEmitter_putLen(e, 0);
+}
+
+static void BinaryEmitter_close(JsonEmitter* out) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+    struct BinaryContainer* container;
+
+    if (e->depth == 0) {
+        return;
+    }
+
+    e->depth--;
+    if (e->depth >= MAX_DEPTH || out->failed) {
+        return;
+    }
+
+    container = &e->stack[e->depth];
+    memcpy(e->buffer + container->countPos, &container->count,
+           sizeof(container->count));
+}
+
+static void BinaryEmitter_openMap(JsonEmitter* out) {
+    BinaryEmitter_open((BinaryEmitter*) out, JT_MAP);
+}
+
+static void BinaryEmitter_openArray(JsonEmitter* out) {
+    BinaryEmitter_open((BinaryEmitter*) out, JT_ARRAY);
+}
+
+static void BinaryEmitter_key(JsonEmitter* out, const char* key) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+    size_t keyLen = strlen(key);
+
+    if (e->depth > 0 && e->depth <= MAX_DEPTH) {
+        e->stack[e->depth - 1].count++;
+    }
+
+    BinaryEmitter_putLen(e, keyLen);
+    BinaryEmitter_put(e, key, keyLen);
+}
+
+static void BinaryEmitter_string(JsonEmitter* out, const char* s,
+                                 size_t len) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+
+    BinaryEmitter_putTag(e, JT_STRING);
+    BinaryEmitter_putLen(e, len);
+    BinaryEmitter_put(e, s, len);
+}
+
+static void BinaryEmitter_integer(JsonEmitter* out, long l) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+    int64_t l64 = l;
+
+    BinaryEmitter_putTag(e, JT_LONG);
+    BinaryEmitter_put(e, &l64, sizeof(l64));
+}
+
+static void BinaryEmitter_number(JsonEmitter* out, double d) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+
+    BinaryEmitter_putTag(e, JT_DOUBLE);
+    BinaryEmitter_put(e, &d, sizeof(d));
+}
+
+static void BinaryEmitter_boolean(JsonEmitter* out, int boolean) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+    uint8_t b = boolean ? 1 : 0;
+
+    BinaryEmitter_putTag(e, JT_BOOLEAN);
+    BinaryEmitter_put(e, &b, sizeof(b));
+}
+
+static void BinaryEmitter_null(JsonEmitter* out) {
+    BinaryEmitter_putTag((BinaryEmitter*) out, JT_NULL);
+}
+
+static void BinaryEmitter_bytes(JsonEmitter* out, const guint8* data,
+                                size_t len) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+
+    BinaryEmitter_putTag(e, JT_BINARY);
+    BinaryEmitter_putLen(e, len);
+    BinaryEmitter_put(e, data, len);
+}
+
+static void BinaryEmitter_free(JsonEmitter* out) {
+    free(((BinaryEmitter*) out)->buffer);
+    free(out);
+}
+
+static char* BinaryEmitter_finish(JsonEmitter* out, uint64_t* resLen) {
+    BinaryEmitter* e = (BinaryEmitter*) out;
+    char* res = NULL;
+
+    if (!out->failed && e->depth == 0) {
+        res = e->buffer;
+        *resLen = e->len;
+        e->buffer = NULL;
+    }
+
+    BinaryEmitter_free(out);
+    return res;
+}
+
+static const JsonEmitterOps binaryEmitterOps = {
+    BinaryEmitter_openMap,
+    BinaryEmitter_close,
+    BinaryEmitter_openArray,
+    BinaryEmitter_close,
+    BinaryEmitter_key,
+    BinaryEmitter_string,
+    BinaryEmitter_integer,
+    BinaryEmitter_number,
+    BinaryEmitter_boolean,
+    BinaryEmitter_null,
+    BinaryEmitter_bytes,
+    BinaryEmitter_finish,
+    BinaryEmitter_free
+};
+
+JsonEmitter* jdBinary_newEmitter() {
+    BinaryEmitter* e = calloc(1, sizeof(BinaryEmitter));
+    if (!e) {
+        return NULL;
+    }
+
+    e->base.ops = &binaryEmitterOps;
+    return &e->base;
+}
+
+char* jdBinary_generate(const JsonNode* node, uint64_t* resLen) {
+    BinaryEmitter* e = (BinaryEmitter*) jdBinary_newEmitter();
+    if (!e) {
+        return NULL;
+    }
+
+    /* Sized up front, so the buffer is allocated once */
+    e->size = jdBinary_size(node);
+    e->buffer = malloc(e->size);
+    if (!e->buffer) {
+        JsonEmitter_free(&e->base);
+        return NULL;
+    }
+
+    JsonEmitter_node(&e->base, node);
+    return JsonEmitter_finish(&e->base, resLen);
+}
@@ -0,0 +1,14 @@
+#ifndef __JSON_DOM_BINARY_H__
+#define __JSON_DOM_BINARY_H__
+
+#include "json-dom.h"
+#include "json-emitter.h"
+
+#include <stdint.h>
+
+char* jdBinary_generate(const JsonNode* node, uint64_t* resLen);
+JsonNode* jdBinary_buildDom(const char* buffer, uint64_t bufflen, GError** err);
+/* Encodes a value as it is written, without building a tree */
+JsonEmitter* jdBinary_newEmitter();
+
+#endif
@@ -5,8 +5,6 @@
 #include <stdlib.h>
 #include <yajl/yajl_gen.h>
 
-static void jdGenerator_generate_node(yajl_gen gen, const JsonNode* node);
-
 static yajl_gen create_yajl_gen() {
 #if YAJL_VERSION == 2
     return yajl_gen_alloc(NULL);
@@ -16,77 +14,132 @@ static yajl_gen create_yajl_gen() {
 #endif
 }
 
-char* jdGenerator_generate(const JsonNode* node, uint64_t* resLen) {
-    char* res;
+struct YajlEmitter_t {
+    JsonEmitter base;
+    yajl_gen gen;
+};
+
+typedef struct YajlEmitter_t YajlEmitter;
+
+static yajl_gen jdGenerator_gen(JsonEmitter* out) {
+    return ((YajlEmitter*) out)->gen;
+}
+
+static void YajlEmitter_openMap(JsonEmitter* out) {
+    yajl_gen_map_open(jdGenerator_gen(out));
+}
+
+static void YajlEmitter_closeMap(JsonEmitter* out) {
+    yajl_gen_map_close(jdGenerator_gen(out));
+}
+
+static void YajlEmitter_openArray(JsonEmitter* out) {
+    yajl_gen_array_open(jdGenerator_gen(out));
+}
+
+static void YajlEmitter_closeArray(JsonEmitter* out) {
+    yajl_gen_array_close(jdGenerator_gen(out));
+}
+
+static void YajlEmitter_string(JsonEmitter* out, const char* s, size_t len) {
+    yajl_gen_string(jdGenerator_gen(out), (const unsigned char*) s,
+                    (unsigned int) len);
+}
+
+static void YajlEmitter_key(JsonEmitter* out, const char* key) {
+    YajlEmitter_string(out, key, strlen(key));
+}
+
+static void YajlEmitter_integer(JsonEmitter* out, long l) {
+    yajl_gen_integer(jdGenerator_gen(out), l);
+}
+
+static void YajlEmitter_number(JsonEmitter* out, double d) {
+    yajl_gen_double(jdGenerator_gen(out), d);
+}
+
+static void YajlEmitter_boolean(JsonEmitter* out, int boolean) {
+    yajl_gen_bool(jdGenerator_gen(out), boolean);
+}
+
+static void YajlEmitter_null(JsonEmitter* out) {
+    yajl_gen_null(jdGenerator_gen(out));
+}
+
+/* Encoded as base64 like binary nodes */
+static void YajlEmitter_bytes(JsonEmitter* out, const guint8* data,
+                              size_t len) {
+    char* b64Str = g_base64_encode(data, len);
+
+    YajlEmitter_string(out, b64Str, strlen(b64Str));
+    g_free(b64Str);
+}
+
+static void YajlEmitter_free(JsonEmitter* out) {
+    yajl_gen_free(jdGenerator_gen(out));
+    free(out);
+}
+
+static char* YajlEmitter_finish(JsonEmitter* out, uint64_t* resLen) {
+    char* res = NULL;
     const unsigned char* buf;
 #if YAJL_VERSION == 2
     size_t len;
 #else
     unsigned int len;
 #endif
-    yajl_gen g = create_yajl_gen();
-    jdGenerator_generate_node(g, node);
-    yajl_gen_get_buf(g, &buf, &len);
-    res = (char*) calloc(len, sizeof(char*));
-    memcpy(res, buf, (int) len);
-    *resLen = len;
-    yajl_gen_clear(g);
-    yajl_gen_free(g);
+
+    if (!out->failed) {
+        yajl_gen_get_buf(jdGenerator_gen(out), &buf, &len);
+        res = malloc(len);
+        if (res) {
+            memcpy(res, buf, len);
+            *resLen = len;
+        }
+    }
+
+    YajlEmitter_free(out);
     return res;
 }
 
-static void jdGenerator_generate_node(yajl_gen gen, const JsonNode* node) {
-    GString* tmpStr;
-    GHashTable* tmpHashTable;
-    GArray* tmpArray;
-    GHashTableIter iter;
-    int i;
-    char* key;
-    const JsonNode* value;
-    switch(node->type) {
-    case JT_NULL:
-        yajl_gen_null(gen);
-        break;
-    case JT_BOOLEAN:
-        yajl_gen_bool(gen, JsonNode_getBoolean(node));
-        break;
-    case JT_LONG:
-        yajl_gen_integer(gen, JsonNode_getLong(node));
-        break;
-    case JT_DOUBLE:
-        yajl_gen_double(gen, JsonNode_getDouble(node));
-        break;
-    case JT_STRING:
-        tmpStr = JsonNode_getString(node);
-        yajl_gen_string(gen,
-                        (const unsigned char*) tmpStr->str,
-                        (unsigned int) tmpStr->len);
-        break;
-    case JT_MAP:
-        tmpHashTable = JsonNode_getMap(node);
-        g_hash_table_iter_init(&iter, tmpHashTable);
-        yajl_gen_map_open(gen);
-        while (g_hash_table_iter_next(&iter, (void**) &key, (void**)
-                                      &value)) {
-            yajl_gen_string(gen,
-                            (const unsigned char*) key,
-                            (unsigned int) strlen(key));
-            jdGenerator_generate_node(gen, value);
-        }
-        yajl_gen_map_close(gen);
-        break;
-    case JT_ARRAY:
-        yajl_gen_array_open(gen);
-        tmpArray = JsonNode_getArray(node);
-        for (i = 0; ; i++) {
-            value = g_array_index(tmpArray, JsonNode*, i);
-            if (!value) {
-                break;
-            }
-            jdGenerator_generate_node(gen, value);
-        }
-        yajl_gen_array_close(gen);
-        break;
+static const JsonEmitterOps yajlEmitterOps = {
+    YajlEmitter_openMap,
+    YajlEmitter_closeMap,
+    YajlEmitter_openArray,
+    YajlEmitter_closeArray,
+    YajlEmitter_key,
+    YajlEmitter_string,
+    YajlEmitter_integer,
+    YajlEmitter_number,
+    YajlEmitter_boolean,
+    YajlEmitter_null,
+    YajlEmitter_bytes,
+    YajlEmitter_finish,
+    YajlEmitter_free
+};
+
+JsonEmitter* jdGenerator_newEmitter() {
+    YajlEmitter* e = calloc(1, sizeof(YajlEmitter));
+    if (!e) {
+        return NULL;
+    }
+
+    e->gen = create_yajl_gen();
+    if (!e->gen) {
+        free(e);
+        return NULL;
     }
+
+    e->base.ops = &yajlEmitterOps;
+    return &e->base;
 }
 
+char* jdGenerator_generate(const JsonNode* node, uint64_t* resLen) {
+    JsonEmitter* out = jdGenerator_newEmitter();
+    if (!out) {
+        return NULL;
+    }
+
+    JsonEmitter_node(out, node);
+    return JsonEmitter_finish(out, resLen);
+}
@@ -2,8 +2,11 @@
 #define __JSON_DOM_GENERATOR_H__
 
 #include "json-dom.h"
+#include "json-emitter.h"
 #include <stdint.h>
 
 char* jdGenerator_generate(const JsonNode* node, uint64_t* resLen);
+/* Encodes a value as it is written, without building a tree */
+JsonEmitter* jdGenerator_newEmitter();
 
 #endif
@@ -6,48 +6,254 @@
 #include <errno.h>
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "utils.h"
 
+/* Blocks are chained newest first, allocations come from the first one */
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 8
+
+/* Maps up to JSON_MAP_FLAT_MAX entries are a vector searched linearly,
+ * larger ones move to a GHashTable */
+#define JSON_MAP_FLAT_MAX 16
+#define JSON_MAP_INITIAL_CAPACITY 4
+
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/* Maps and arrays may hold heap nodes, freed with the arena */
+struct ArenaContainer {
+    struct ArenaContainer* next;
+    JsonNode* node;
+};
+
+struct JsonArena_t {
+    gint refs;
+    struct ArenaBlock* blocks;
+    struct ArenaContainer* containers;
+};
+
+struct JsonMapEntry {
+    char* key;
+    JsonNode* value;
+    /* Interned and arena keys are not freed with the map */
+    gboolean ownsKey;
+};
+
+/* Allocated right after its node */
+struct JsonMap_t {
+    struct JsonMapEntry* entries;
+    int count;
+    int capacity;
+    /* Replaces entries once the map grows past JSON_MAP_FLAT_MAX, owns its
+     * keys unless the map lives in an arena */
+    GHashTable* table;
+    /* Built by JsonNode_getMap() for a flat map, then kept in sync by
+     * inserts and steals until the map is freed. Owns nothing. */
+    GHashTable* view;
+};
+
+/* Serializes building the views of maps read concurrently */
+G_LOCK_DEFINE_STATIC(mapViews);
+
+/* Keys of requests and responses, shared instead of copied into every
+ * map. Keep sorted for bsearch(). */
+static const char* const internedKeys[] = {
+    "args", "attachment", "attachmentSize", "binary", "chunk", "chunkSize",
+    "data", "deadline", "dir", "direct", "errcode", "errstr", "excl",
+    "f_bavail", "f_bfree", "f_blocks", "f_bsize", "f_favail", "f_ffree",
+    "f_files", "f_flag", "f_frsize", "f_fsid", "f_namemax", "flags", "fsync",
+    "handle", "id", "level", "methodName", "mode", "newpath",
+    "offset", "oldpath", "path", "pattern", "priority", "requests", "result",
+    "size", "sleep", "splice", "st_atime", "st_blocks", "st_ctime", "st_dev",
+    "st_gid", "st_ino", "st_mode", "st_mtime", "st_nlink", "st_size", "st_uid",
+    "text", "timeout", "timing", "writable",
+};
+
+static GPrivate currentArena = G_PRIVATE_INIT(NULL);
+
+static void JsonNode_freeData(JsonNode* node);
+
 static void JsonNode_free_cb(void* node) {
     JsonNode_free((JsonNode*) node);
 }
 
+JsonArena* JsonArena_new() {
+    JsonArena* arena = malloc(sizeof(JsonArena));
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->refs = 1;
+    arena->blocks = NULL;
+    arena->containers = NULL;
+    return arena;
+}
+
+JsonArena* JsonArena_ref(JsonArena* arena) {
+    if (arena) {
+        g_atomic_int_inc(&arena->refs);
+    }
+
+    return arena;
+}
+
+void JsonArena_unref(JsonArena* arena) {
+    struct ArenaContainer* container;
+    struct ArenaBlock* block;
+
+    if (!arena || !g_atomic_int_dec_and_test(&arena->refs)) {
+        return;
+    }
+
+    /* Frees the heap nodes held by arena containers too */
+    for (container = arena->containers; container;
+         container = container->next) {
+        JsonNode_freeData(container->node);
+    }
+
+    while (arena->blocks) {
+        block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+
+    free(arena);
+}
+
+JsonArena* JsonArena_setCurrent(JsonArena* arena) {
+    JsonArena* prev = (JsonArena*) g_private_get(&currentArena);
+
+    g_private_set(&currentArena, arena);
+    return prev;
+}
+
+JsonArena* JsonArena_getCurrent() {
+    return (JsonArena*) g_private_get(&currentArena);
+}
+
+static void* JsonArena_alloc(JsonArena* arena, size_t size) {
+    struct ArenaBlock* block = arena->blocks;
+    size_t blockSize;
+    void* p;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (!block || block->size - block->used < size) {
+        blockSize = MAX(size, ARENA_BLOCK_SIZE);
+        block = malloc(sizeof(struct ArenaBlock) + blockSize);
+        if (!block) {
+            return NULL;
+        }
+
+        block->used = 0;
+        block->size = blockSize;
+
+        /* A large allocation gets its own block, keep filling the current
+         * one */
+        if (blockSize > ARENA_BLOCK_SIZE && arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+static int JsonArena_addContainer(JsonArena* arena, JsonNode* node) {
+    struct ArenaContainer* container;
+
+    container = JsonArena_alloc(arena, sizeof(struct ArenaContainer));
+    if (!container) {
+        return -1;
+    }
+
+    container->node = node;
+    container->next = arena->containers;
+    arena->containers = container;
+    return 0;
+}
+
+/* Allocates a node followed by extra bytes for its data, from the arena if
+ * there is one */
+static JsonNode* JsonNode_alloc(JsonArena* arena, JsonNodeType type,
+                                size_t extra) {
+    JsonNode* node;
+
+    if (arena) {
+        node = JsonArena_alloc(arena, sizeof(JsonNode) + extra);
+    } else {
+        node = malloc(sizeof(JsonNode) + extra);
+    }
+
+    if (!node) {
+        return NULL;
+    }
+
+    node->type = type;
+    node->arena = arena;
+    memset(&node->v, 0, sizeof(node->v));
+    return node;
+}
+
 JsonNodeType JsonNode_getType(const JsonNode* node) {
     return node->type;
 }
 
 
-/* Creates a new json node, the new object takes ownership of there data */
+/* Creates a new json node, the new object takes ownership of there data.
+ * Scalars are stored in the node, their data is copied and freed. */
 JsonNode* JsonNode_new(void* data, JsonNodeType type) {
-    JsonNode* node = malloc(sizeof(JsonNode));
+    JsonNode* node = JsonNode_alloc(NULL, type, 0);
     if (!node) {
         return NULL;
     }
 
-    node->type = type;
-    node->data = data;
+    switch (type) {
+    case JT_NULL:
+        break;
+    case JT_BOOLEAN:
+        node->v.b = *((int*) data);
+        free(data);
+        break;
+    case JT_LONG:
+        node->v.l = *((long*) data);
+        free(data);
+        break;
+    case JT_DOUBLE:
+        node->v.d = *((double*) data);
+        free(data);
+        break;
+    default:
+        node->v.data = data;
+        break;
+    }
 
     return node;
 }
 
 /* Creates a new json node, the new object does not takes ownership of there data */
 JsonNode* JsonNode_newFromData(void* data, int dataLen, JsonNodeType type) {
-    JsonNode* result = NULL;
-    void* dataCopy = NULL;
-    if (type != JT_NULL) {
-        dataCopy = malloc(dataLen);
-        if (!dataCopy) {
-            return NULL;
-        }
-        memcpy(dataCopy, data, dataLen);
+    JsonNode* node = JsonNode_alloc(JsonArena_getCurrent(), type, 0);
+    if (!node) {
+        return NULL;
     }
 
-    result = JsonNode_new(dataCopy, type);
-    if (!result) {
-        free(dataCopy);
+    if (type != JT_NULL) {
+        memcpy(&node->v, data, MIN((size_t) dataLen, sizeof(node->v)));
     }
-    return result;
+
+    return node;
 }
 
 JsonNode* JsonNode_newNull() {
@@ -63,28 +269,107 @@ JsonNode* JsonNode_newFromLong(long l) {
 }
 
 JsonNode* JsonNode_newFromDouble(double d) {
-    return JsonNode_newFromData(&d, sizeof(long), JT_DOUBLE);
+    return JsonNode_newFromData(&d, sizeof(double), JT_DOUBLE);
+}
+
+/* The GString and its characters follow the node in one allocation, so
+ * the string is read only */
+static JsonNode* JsonNode_newStringLen(const char* s, size_t len) {
+    JsonNode* node;
+    GString* str;
+
+    node = JsonNode_alloc(JsonArena_getCurrent(), JT_STRING,
+                          sizeof(GString) + len + 1);
+    if (!node) {
+        return NULL;
+    }
+
+    str = (GString*) (node + 1);
+    str->str = (gchar*) (str + 1);
+    if (len > 0) {
+        memcpy(str->str, s, len);
+    }
+    str->str[len] = '\0';
+    str->len = len;
+    str->allocated_len = len + 1;
+    node->v.data = str;
+    return node;
 }
 
 JsonNode* JsonNode_newFromString(const char* s) {
-    GString* sCopy = g_string_new(s);
-    return JsonNode_new(sCopy, JT_STRING);
+    return JsonNode_newStringLen(s, s ? strlen(s) : 0);
 }
 
 JsonNode* JsonNode_newFromStringLen(const char* s, int len) {
-    GString* sCopy = g_string_new_len(s, len);
-    return JsonNode_new(sCopy, JT_STRING);
+    return JsonNode_newStringLen(s, len < 0 ? strlen(s) : (size_t) len);
+}
+
+/* Creates a new binary node, the new object takes ownership of the array */
+JsonNode* JsonNode_newFromByteArray(GByteArray* bytes) {
+    return JsonNode_new(bytes, JT_BINARY);
+}
+
+static JsonNode* JsonNode_newSplice(int pipeFd, void* map, size_t mapLen,
+                                    uint64_t size) {
+    JsonSplice* splice = malloc(sizeof(JsonSplice));
+    if (!splice) {
+        return NULL;
+    }
+
+    splice->size = size;
+    splice->pipeFd = pipeFd;
+    splice->map = map;
+    splice->mapLen = mapLen;
+    return JsonNode_new(splice, JT_SPLICE);
+}
+
+/* Creates a new splice node for size bytes waiting in a pipe, the new
+ * object takes ownership of the pipe */
+JsonNode* JsonNode_newFromPipe(int pipeFd, uint64_t size) {
+    return JsonNode_newSplice(pipeFd, NULL, 0, size);
+}
+
+/* Creates a new splice node for the first size bytes of an anonymous
+ * mapping, the new object takes ownership of the mapping */
+JsonNode* JsonNode_newFromMapping(void* map, size_t mapLen, uint64_t size) {
+    return JsonNode_newSplice(-1, map, mapLen, size);
 }
 
 JsonNode* JsonNode_newArray() {
+    JsonArena* arena = JsonArena_getCurrent();
     GArray* array = g_array_new(TRUE, TRUE, sizeof(JsonNode*));
-    return JsonNode_new(array, JT_ARRAY);
+    JsonNode* node;
+
+    node = JsonNode_alloc(arena, JT_ARRAY, 0);
+    if (!node) {
+        g_array_free(array, TRUE);
+        return NULL;
+    }
+
+    node->v.data = array;
+    if (arena && JsonArena_addContainer(arena, node) < 0) {
+        g_array_free(array, TRUE);
+        return NULL;
+    }
+
+    return node;
 }
 
 JsonNode* JsonNode_newMap() {
-    GHashTable* map = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                            free, JsonNode_free_cb);
-    return JsonNode_new(map, JT_MAP);
+    JsonArena* arena = JsonArena_getCurrent();
+    JsonNode* node;
+
+    node = JsonNode_alloc(arena, JT_MAP, sizeof(JsonMap));
+    if (!node) {
+        return NULL;
+    }
+
+    node->v.data = memset(node + 1, 0, sizeof(JsonMap));
+    if (arena && JsonArena_addContainer(arena, node) < 0) {
+        return NULL;
+    }
+
+    return node;
 }
 
 void JsonNode_array_append(JsonNode* parent, JsonNode* node, GError** err) {
@@ -93,59 +378,348 @@ void JsonNode_array_append(JsonNode* parent, JsonNode* node, GError** err) {
         g_set_error(err, 0, EINVAL, "Invalid type");
     }
 
-    array = (GArray*) parent->data;
+    array = (GArray*) parent->v.data;
     g_array_append_val(array, node);
 }
 
+static int JsonMap_compareKeys(const void* key, const void* interned) {
+    return strcmp((const char*) key, *((const char* const*) interned));
+}
+
+/* Returns the shared copy of a well known key, or NULL */
+static const char* JsonMap_internKey(const char* key) {
+    const char* const* found;
+
+    found = bsearch(key, internedKeys, G_N_ELEMENTS(internedKeys),
+                    sizeof(internedKeys[0]), JsonMap_compareKeys);
+    return found ? *found : NULL;
+}
+
+const char* JsonNode_internKey(const char* key) {
+    return JsonMap_internKey(key);
+}
+
+/* Copies key into the map's storage, ownsKey is set if the map must free
+ * it */
+static char* JsonMap_copyKey(JsonArena* arena, const char* key,
+                             gboolean* ownsKey) {
+    const char* interned = JsonMap_internKey(key);
+    size_t keySize;
+    char* keyCopy;
+
+    *ownsKey = FALSE;
+    if (interned) {
+        return (char*) interned;
+    }
+
+    if (!arena) {
+        *ownsKey = TRUE;
+        return g_strdup(key);
+    }
+
+    keySize = strlen(key) + 1;
+    keyCopy = JsonArena_alloc(arena, keySize);
+    if (keyCopy) {
+        memcpy(keyCopy, key, keySize);
+    }
+    return keyCopy;
+}
+
+static int JsonMap_find(const JsonMap* map, const char* key) {
+    int i;
+
+    for (i = 0; i < map->count; i++) {
+        if (map->entries[i].key == key ||
+            strcmp(map->entries[i].key, key) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int JsonMap_grow(JsonArena* arena, JsonMap* map) {
+    struct JsonMapEntry* entries;
+    int capacity;
+
+    capacity = map->capacity ? map->capacity * 2 : JSON_MAP_INITIAL_CAPACITY;
+    if (arena) {
+        entries = JsonArena_alloc(arena, capacity * sizeof(*entries));
+        if (entries && map->count > 0) {
+            memcpy(entries, map->entries, map->count * sizeof(*entries));
+        }
+    } else {
+        entries = realloc(map->entries, capacity * sizeof(*entries));
+    }
+
+    if (!entries) {
+        return -1;
+    }
+
+    map->entries = entries;
+    map->capacity = capacity;
+    return 0;
+}
+
+static void JsonMap_toTable(JsonArena* arena, JsonMap* map) {
+    GHashTable* table;
+    char* key;
+    int i;
+
+    table = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                  arena ? NULL : free, JsonNode_free_cb);
+    for (i = 0; i < map->count; i++) {
+        key = map->entries[i].key;
+        if (!arena && !map->entries[i].ownsKey) {
+            key = g_strdup(key);
+        }
+        g_hash_table_insert(table, key, map->entries[i].value);
+    }
+
+    if (!arena) {
+        free(map->entries);
+    }
+
+    map->entries = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->table = table;
+}
+
 void JsonNode_map_insert(JsonNode* parent, const char* key, JsonNode* node, GError** err) {
-    GHashTable* map;
+    struct JsonMapEntry* entry;
+    JsonMap* map;
     char* keyCopy;
+    gboolean ownsKey;
+    int i;
     if (parent->type != JT_MAP) {
         g_set_error(err, 0, EINVAL, "Invalid type");
         return;
     }
 
-    map = (GHashTable*) parent->data;
-    keyCopy = g_strdup(key);
+    map = (JsonMap*) parent->v.data;
+    if (!map->table) {
+        i = JsonMap_find(map, key);
+        if (i >= 0) {
+            JsonNode_free(map->entries[i].value);
+            map->entries[i].value = node;
+            if (map->view) {
+                g_hash_table_insert(map->view, map->entries[i].key, node);
+            }
+            return;
+        }
+
+        if (map->count == JSON_MAP_FLAT_MAX) {
+            JsonMap_toTable(parent->arena, map);
+        } else if (map->count == map->capacity &&
+                   JsonMap_grow(parent->arena, map) < 0) {
+            g_set_error(err, 0, ENOMEM, "%s", iop_strerror(ENOMEM));
+            return;
+        }
+    }
+
+    if (map->table && !parent->arena) {
+        keyCopy = g_strdup(key);
+        ownsKey = TRUE;
+    } else {
+        keyCopy = JsonMap_copyKey(parent->arena, key, &ownsKey);
+    }
+
     if (!keyCopy) {
         g_set_error(err, 0, ENOMEM, "%s", iop_strerror(ENOMEM));
         return;
     }
 
-    g_hash_table_insert(map, keyCopy, node);
+    if (map->table) {
+        /* The table frees keyCopy if it already has the key */
+        if (map->view) {
+            g_hash_table_insert(map->view, keyCopy, node);
+        }
+        g_hash_table_insert(map->table, keyCopy, node);
+        return;
+    }
+
+    entry = &map->entries[map->count++];
+    entry->key = keyCopy;
+    entry->value = node;
+    entry->ownsKey = ownsKey;
+    if (map->view) {
+        g_hash_table_insert(map->view, keyCopy, node);
+    }
 }
 
 JsonNode* JsonNode_map_lookup(const JsonNode* node, const char* key, GError** err) {
+    const JsonMap* map;
+    int i;
     if (node->type != JT_MAP) {
         g_set_error(err, 0, EINVAL, "Invalid type");
         return NULL;
     }
 
-    return (JsonNode*) g_hash_table_lookup((GHashTable*) node->data, key);
+    map = (const JsonMap*) node->v.data;
+    if (map->table) {
+        return (JsonNode*) g_hash_table_lookup(map->table, key);
+    }
+
+    i = JsonMap_find(map, key);
+    return i >= 0 ? map->entries[i].value : NULL;
+}
+
+/* Removes the node from the map without freeing it, the caller owns the
+ * returned node */
+JsonNode* JsonNode_map_steal(JsonNode* parent, const char* key) {
+    JsonMap* map;
+    gpointer origKey;
+    gpointer node;
+    int i;
+
+    if (parent->type != JT_MAP) {
+        return NULL;
+    }
+
+    map = (JsonMap*) parent->v.data;
+    if (map->table) {
+        if (!g_hash_table_lookup_extended(map->table, key, &origKey,
+                                          &node)) {
+            return NULL;
+        }
+
+        if (map->view) {
+            g_hash_table_remove(map->view, key);
+        }
+
+        g_hash_table_steal(map->table, key);
+        if (!parent->arena) {
+            free(origKey);
+        }
+        return (JsonNode*) node;
+    }
+
+    i = JsonMap_find(map, key);
+    if (i < 0) {
+        return NULL;
+    }
+
+    if (map->view) {
+        g_hash_table_remove(map->view, key);
+    }
+
+    node = map->entries[i].value;
+    if (map->entries[i].ownsKey) {
+        free(map->entries[i].key);
+    }
+
+    /* Keep insertion order */
+    map->count--;
+    memmove(&map->entries[i], &map->entries[i + 1],
+            (map->count - i) * sizeof(struct JsonMapEntry));
+    return (JsonNode*) node;
+}
+
+int JsonNode_map_size(const JsonNode* node) {
+    const JsonMap* map = (const JsonMap*) node->v.data;
+
+    if (map->table) {
+        return g_hash_table_size(map->table);
+    }
+
+    return map->count;
+}
+
+void JsonNode_map_iterInit(JsonMapIter* iter, const JsonNode* node) {
+    iter->map = (JsonMap*) node->v.data;
+    iter->index = 0;
+    if (iter->map->table) {
+        g_hash_table_iter_init(&iter->tableIter, iter->map->table);
+    }
+}
+
+/* Returns FALSE after the last entry. Small maps are iterated in insertion
+ * order. */
+int JsonNode_map_iterNext(JsonMapIter* iter, const char** key,
+                          JsonNode** value) {
+    gpointer tableKey;
+    gpointer tableValue;
+
+    if (iter->map->table) {
+        if (!g_hash_table_iter_next(&iter->tableIter, &tableKey,
+                                    &tableValue)) {
+            return FALSE;
+        }
+
+        *key = (const char*) tableKey;
+        *value = (JsonNode*) tableValue;
+        return TRUE;
+    }
+
+    if (iter->index >= iter->map->count) {
+        return FALSE;
+    }
+
+    *key = iter->map->entries[iter->index].key;
+    *value = iter->map->entries[iter->index].value;
+    iter->index++;
+    return TRUE;
 }
 
 int JsonNode_getBoolean(const JsonNode* node) {
-    return *((int*) node->data);
+    return node->v.b;
 }
 
 long JsonNode_getLong(const JsonNode* node) {
-    return *((long*) node->data);
+    return node->v.l;
 }
 
 double JsonNode_getDouble(const JsonNode* node) {
-    return *((double*) node->data);
+    return node->v.d;
 }
 
 GString* JsonNode_getString(const JsonNode* node) {
-    return (GString*) node->data;
+    return (GString*) node->v.data;
 }
 
+/* Returns the map as a hash table that must not be modified, use
+ * JsonNode_map_iterInit() to walk a map. A flat map is not converted, a
+ * table indexing its entries is built on the first call and reused. */
 GHashTable* JsonNode_getMap(const JsonNode* node) {
-    return (GHashTable*) node->data;
+    JsonMap* map = (JsonMap*) node->v.data;
+    GHashTable* view;
+    int i;
+
+    view = g_atomic_pointer_get(&map->view);
+    if (view) {
+        return view;
+    }
+
+    if (map->table) {
+        return map->table;
+    }
+
+    G_LOCK(mapViews);
+    view = map->view;
+    if (!view) {
+        view = g_hash_table_new(g_str_hash, g_str_equal);
+        for (i = 0; i < map->count; i++) {
+            g_hash_table_insert(view, map->entries[i].key,
+                                map->entries[i].value);
+        }
+        g_atomic_pointer_set(&map->view, view);
+    }
+    G_UNLOCK(mapViews);
+
+    return view;
 }
 
 GArray* JsonNode_getArray(const JsonNode* node) {
-    return (GArray*) node->data;
+    return (GArray*) node->v.data;
+}
+
+GByteArray* JsonNode_getByteArray(const JsonNode* node) {
+    return (GByteArray*) node->v.data;
+}
+
+JsonSplice* JsonNode_getSplice(const JsonNode* node) {
+    return (JsonSplice*) node->v.data;
 }
 
 int JsonNode_isContainer(const JsonNode* node) {
@@ -158,41 +732,84 @@ int JsonNode_isContainer(const JsonNode* node) {
     return FALSE;
 }
 
+/* Nodes living in an arena are freed with the arena */
 void JsonNode_free(JsonNode* node) {
+    if (!node || node->arena) {
+        return;
+    }
+
+    JsonNode_freeData(node);
+    free(node);
+}
+
+static void JsonNode_freeData(JsonNode* node) {
     int i;
     GArray* array;
+    JsonMap* map;
     JsonNode* child;
-    if (!node) {
-        return;
-    }
+    JsonSplice* splice;
+
+    switch(node->type) {
+    case JT_MAP:
+        map = (JsonMap*) node->v.data;
+        if (map->view) {
+            g_hash_table_destroy(map->view);
+        }
 
-    if (node->data) {
-        switch(node->type) {
-        case JT_MAP:
-            g_hash_table_remove_all((GHashTable*) node->data);
-            g_hash_table_destroy((GHashTable*) node->data);
+        if (map->table) {
+            g_hash_table_destroy(map->table);
             break;
-        case JT_ARRAY:
-            array = (GArray*) node->data;
-            for (i = 0; ; i++) {
-                child = g_array_index(array, JsonNode*, i);
-                if (!child) {
-                    break;
-                }
-                JsonNode_free(child);
+        }
+
+        for (i = 0; i < map->count; i++) {
+            if (map->entries[i].ownsKey) {
+                free(map->entries[i].key);
             }
-            g_array_free(array, TRUE);
-            break;
-        case JT_STRING:
-            g_string_free(node->data, TRUE);
+            JsonNode_free(map->entries[i].value);
+        }
+
+        if (!node->arena) {
+            free(map->entries);
+        }
+        break;
+    case JT_ARRAY:
+        array = (GArray*) node->v.data;
+        if (!array) {
             break;
-        default:
-            free(node->data);
+        }
+        for (i = 0; ; i++) {
+            child = g_array_index(array, JsonNode*, i);
+            if (!child) {
+                break;
+            }
+            JsonNode_free(child);
+        }
+        g_array_free(array, TRUE);
+        break;
+    case JT_STRING:
+        /* Strings adopted by JsonNode_new() are not part of the node */
+        if (node->v.data && node->v.data != (void*) (node + 1)) {
+            g_string_free(node->v.data, TRUE);
+        }
+        break;
+    case JT_BINARY:
+        if (node->v.data) {
+            g_byte_array_free(node->v.data, TRUE);
+        }
+        break;
+    case JT_SPLICE:
+        splice = (JsonSplice*) node->v.data;
+        if (!splice) {
             break;
         }
+        if (splice->pipeFd != -1) {
+            close(splice->pipeFd);
+        } else if (splice->map) {
+            munmap(splice->map, splice->mapLen);
+        }
+        free(splice);
+        break;
     }
-
-    free(node);
 }
 
 /* Auto extract the value, use if you know that the type of the node already */
@@ -216,5 +833,11 @@ void JsonNode_getValue(const JsonNode *node, void* out) {
     case JT_ARRAY:
         *((GArray**)out) = JsonNode_getArray(node);
         break;
+    case JT_BINARY:
+        *((GByteArray**)out) = JsonNode_getByteArray(node);
+        break;
+    case JT_SPLICE:
+        *((JsonSplice**)out) = JsonNode_getSplice(node);
+        break;
     }
 }
@@ -2,6 +2,7 @@
 #define __JSON_DOM_H__
 
 #include <glib.h>
+#include <stdint.h>
 
 #define JT_LONG      1
 #define JT_STRING    2
@@ -10,16 +11,67 @@
 #define JT_NULL      5
 #define JT_BOOLEAN   6
 #define JT_DOUBLE    7
+#define JT_BINARY    8
+/* Raw bytes handed to the response writer to be spliced into the response,
+ * never encoded */
+#define JT_SPLICE    9
 
 typedef int JsonNodeType;
 
+/* Bump allocator holding the nodes of a request and its response, see
+ * JsonArena_setCurrent() */
+typedef struct JsonArena_t JsonArena;
+
+/* Small maps are a flat vector, moved to a hash table by the insert that
+ * outgrows it. Reading a map never moves its entries, JsonNode_getMap()
+ * indexes a flat map in a separate table. */
+typedef struct JsonMap_t JsonMap;
+
 struct JsonNode_t {
     JsonNodeType type;
-    void* data;
+    /* Set if the node lives in an arena, it is then freed with the arena */
+    JsonArena* arena;
+    /* Scalars are stored in the node, other types point to their data */
+    union {
+        int b;
+        long l;
+        double d;
+        void* data;
+    } v;
 };
 
 typedef struct JsonNode_t JsonNode;
 
+/* Walks the entries of a map, see JsonNode_map_iterNext() */
+struct JsonMapIter_t {
+    JsonMap* map;
+    int index;
+    GHashTableIter tableIter;
+};
+
+typedef struct JsonMapIter_t JsonMapIter;
+
+/* Data of a JT_SPLICE node, either waiting in a pipe or held in an anonymous
+ * mapping */
+struct JsonSplice_t {
+    uint64_t size;
+    /* Read end of a pipe holding size bytes, or -1 */
+    int pipeFd;
+    /* Used if pipeFd is -1, unmapped when the node is freed */
+    void* map;
+    size_t mapLen;
+};
+
+typedef struct JsonSplice_t JsonSplice;
+
+JsonArena* JsonArena_new();
+JsonArena* JsonArena_ref(JsonArena* arena);
+void JsonArena_unref(JsonArena* arena);
+/* Nodes created by the calling thread come from arena, or from the heap if
+ * NULL, until the next call. Returns the previous arena. Binary and splice
+ * nodes always come from the heap. */
+JsonArena* JsonArena_setCurrent(JsonArena* arena);
+JsonArena* JsonArena_getCurrent();
 
 JsonNode* JsonNode_new(void* data, JsonNodeType type);
 void JsonNode_free(JsonNode* node);
@@ -38,6 +90,9 @@ JsonNode* JsonNode_newFromStringLen(const char* s, int len);
 JsonNode* JsonNode_newMap();
 JsonNode* JsonNode_newArray();
 JsonNode* JsonNode_newFromDouble(double d);
+JsonNode* JsonNode_newFromByteArray(GByteArray* bytes);
+JsonNode* JsonNode_newFromPipe(int pipeFd, uint64_t size);
+JsonNode* JsonNode_newFromMapping(void* map, size_t mapLen, uint64_t size);
 
 int JsonNode_getBoolean(const JsonNode* node);
 long JsonNode_getLong(const JsonNode* node);
@@ -45,9 +100,19 @@ double JsonNode_getDouble(const JsonNode* node);
 GString* JsonNode_getString(const JsonNode* node);
 GHashTable* JsonNode_getMap(const JsonNode* node);
 GArray* JsonNode_getArray(const JsonNode* node);
+GByteArray* JsonNode_getByteArray(const JsonNode* node);
+JsonSplice* JsonNode_getSplice(const JsonNode* node);
 
 JsonNode* JsonNode_map_lookup(const JsonNode* node, const char* key, GError** err);
 void JsonNode_map_insert(JsonNode* parent, const char* key, JsonNode* node, GError** err);
+JsonNode* JsonNode_map_steal(JsonNode* parent, const char* key);
+int JsonNode_map_size(const JsonNode* node);
+void JsonNode_map_iterInit(JsonMapIter* iter, const JsonNode* node);
+int JsonNode_map_iterNext(JsonMapIter* iter, const char** key,
+                          JsonNode** value);
+/* Returns the copy of key shared by all maps, or NULL if it is not a well
+ * known key. Keys of such entries compare equal by pointer. */
+const char* JsonNode_internKey(const char* key);
 
 void JsonNode_getValue(const JsonNode *node, void* out);
 
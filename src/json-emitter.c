@@ -0,0 +1,285 @@
+#include "json-emitter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct DomEmitter_t {
+    JsonEmitter base;
+    JsonNode* root;
+    /* Open containers, the innermost last. NULL if it could not be
+     * allocated, its values are then dropped. */
+    JsonNode* stack[JSON_EMITTER_MAX_DEPTH];
+    int depth;
+    const char* key;
+};
+
+typedef struct DomEmitter_t DomEmitter;
+
+/* Returns FALSE if the node was dropped */
+static gboolean DomEmitter_add(DomEmitter* e, JsonNode* node) {
+    JsonNode* parent;
+
+    if (!node) {
+        e->base.failed = TRUE;
+        return FALSE;
+    }
+
+    if (e->depth == 0) {
+        if (e->root) {
+            /* Only one value is expected */
+            e->base.failed = TRUE;
+            JsonNode_free(node);
+            return FALSE;
+        }
+
+        e->root = node;
+        return TRUE;
+    }
+
+    parent = NULL;
+    if (e->depth <= JSON_EMITTER_MAX_DEPTH) {
+        parent = e->stack[e->depth - 1];
+    }
+
+    if (!parent) {
+        JsonNode_free(node);
+        return FALSE;
+    }
+
+    if (JsonNode_getType(parent) == JT_ARRAY) {
+        JsonNode_array_append(parent, node, NULL);
+    } else {
+        JsonNode_map_insert(parent, e->key, node, NULL);
+    }
+
+    return TRUE;
+}
+
+static void DomEmitter_open(DomEmitter* e, JsonNode* node) {
+    if (e->depth >= JSON_EMITTER_MAX_DEPTH) {
+        /* Counted so closing stays balanced, the values are dropped */
+        e->base.failed = TRUE;
+        JsonNode_free(node);
+        e->depth++;
+        return;
+    }
+
+    /* Owned by its parent, or by root */
+    if (!DomEmitter_add(e, node)) {
+        node = NULL;
+    }
+    e->stack[e->depth++] = node;
+}
+
+static void DomEmitter_openMap(JsonEmitter* out) {
+    DomEmitter_open((DomEmitter*) out, JsonNode_newMap());
+}
+
+static void DomEmitter_openArray(JsonEmitter* out) {
+    DomEmitter_open((DomEmitter*) out, JsonNode_newArray());
+}
+
+static void DomEmitter_close(JsonEmitter* out) {
+    DomEmitter* e = (DomEmitter*) out;
+
+    if (e->depth > 0) {
+        e->depth--;
+    }
+}
+
+static void DomEmitter_key(JsonEmitter* out, const char* key) {
+    ((DomEmitter*) out)->key = key;
+}
+
+static void DomEmitter_string(JsonEmitter* out, const char* s, size_t len) {
+    DomEmitter_add((DomEmitter*) out, JsonNode_newFromStringLen(s, len));
+}
+
+static void DomEmitter_integer(JsonEmitter* out, long l) {
+    DomEmitter_add((DomEmitter*) out, JsonNode_newFromLong(l));
+}
+
+static void DomEmitter_number(JsonEmitter* out, double d) {
+    DomEmitter_add((DomEmitter*) out, JsonNode_newFromDouble(d));
+}
+
+static void DomEmitter_boolean(JsonEmitter* out, int boolean) {
+    DomEmitter_add((DomEmitter*) out, JsonNode_newFromBoolean(boolean));
+}
+
+static void DomEmitter_null(JsonEmitter* out) {
+    DomEmitter_add((DomEmitter*) out, JsonNode_newNull());
+}
+
+static void DomEmitter_bytes(JsonEmitter* out, const guint8* data,
+                             size_t len) {
+    GByteArray* bytes = g_byte_array_sized_new(len);
+
+    g_byte_array_append(bytes, data, len);
+    DomEmitter_add((DomEmitter*) out, JsonNode_newFromByteArray(bytes));
+}
+
+static char* DomEmitter_finish(JsonEmitter* out,
+                               __attribute__((unused)) uint64_t* len) {
+    JsonNode_free(JsonEmitter_finishDom(out));
+    return NULL;
+}
+
+static void DomEmitter_free(JsonEmitter* out) {
+    DomEmitter* e = (DomEmitter*) out;
+
+    JsonNode_free(e->root);
+    free(e);
+}
+
+static const JsonEmitterOps domEmitterOps = {
+    DomEmitter_openMap,
+    DomEmitter_close,
+    DomEmitter_openArray,
+    DomEmitter_close,
+    DomEmitter_key,
+    DomEmitter_string,
+    DomEmitter_integer,
+    DomEmitter_number,
+    DomEmitter_boolean,
+    DomEmitter_null,
+    DomEmitter_bytes,
+    DomEmitter_finish,
+    DomEmitter_free
+};
+
+JsonEmitter* JsonEmitter_newDom() {
+    DomEmitter* e = calloc(1, sizeof(DomEmitter));
+    if (!e) {
+        return NULL;
+    }
+
+    e->base.ops = &domEmitterOps;
+    return &e->base;
+}
+
+JsonNode* JsonEmitter_finishDom(JsonEmitter* out) {
+    DomEmitter* e = (DomEmitter*) out;
+    JsonNode* root = e->root;
+
+    if (out->failed || e->depth != 0) {
+        JsonEmitter_free(out);
+        return NULL;
+    }
+
+    e->root = NULL;
+    JsonEmitter_free(out);
+    return root;
+}
+
+char* JsonEmitter_finish(JsonEmitter* out, uint64_t* len) {
+    return out->ops->finish(out, len);
+}
+
+void JsonEmitter_free(JsonEmitter* out) {
+    if (out) {
+        out->ops->free(out);
+    }
+}
+
+void JsonEmitter_openMap(JsonEmitter* out) {
+    out->ops->openMap(out);
+}
+
+void JsonEmitter_closeMap(JsonEmitter* out) {
+    out->ops->closeMap(out);
+}
+
+void JsonEmitter_openArray(JsonEmitter* out) {
+    out->ops->openArray(out);
+}
+
+void JsonEmitter_closeArray(JsonEmitter* out) {
+    out->ops->closeArray(out);
+}
+
+void JsonEmitter_key(JsonEmitter* out, const char* key) {
+    out->ops->key(out, key);
+}
+
+void JsonEmitter_string(JsonEmitter* out, const char* s) {
+    out->ops->string(out, s, strlen(s));
+}
+
+void JsonEmitter_stringLen(JsonEmitter* out, const char* s, size_t len) {
+    out->ops->string(out, s, len);
+}
+
+void JsonEmitter_long(JsonEmitter* out, long l) {
+    out->ops->integer(out, l);
+}
+
+void JsonEmitter_double(JsonEmitter* out, double d) {
+    out->ops->number(out, d);
+}
+
+void JsonEmitter_boolean(JsonEmitter* out, int boolean) {
+    out->ops->boolean(out, boolean);
+}
+
+void JsonEmitter_null(JsonEmitter* out) {
+    out->ops->null(out);
+}
+
+void JsonEmitter_bytes(JsonEmitter* out, const guint8* data, size_t len) {
+    out->ops->bytes(out, data, len);
+}
+
+void JsonEmitter_node(JsonEmitter* out, const JsonNode* node) {
+    JsonMapIter iter;
+    GArray* array;
+    GString* str;
+    GByteArray* bytes;
+    const char* key;
+    JsonNode* value;
+    int i;
+
+    switch (JsonNode_getType(node)) {
+    case JT_BOOLEAN:
+        JsonEmitter_boolean(out, JsonNode_getBoolean(node));
+        break;
+    case JT_LONG:
+        JsonEmitter_long(out, JsonNode_getLong(node));
+        break;
+    case JT_DOUBLE:
+        JsonEmitter_double(out, JsonNode_getDouble(node));
+        break;
+    case JT_STRING:
+        str = JsonNode_getString(node);
+        JsonEmitter_stringLen(out, str->str, str->len);
+        break;
+    case JT_BINARY:
+        bytes = JsonNode_getByteArray(node);
+        JsonEmitter_bytes(out, bytes->data, bytes->len);
+        break;
+    case JT_MAP:
+        JsonEmitter_openMap(out);
+        JsonNode_map_iterInit(&iter, node);
+        while (JsonNode_map_iterNext(&iter, &key, &value)) {
+            JsonEmitter_key(out, key);
+            JsonEmitter_node(out, value);
+        }
+        JsonEmitter_closeMap(out);
+        break;
+    case JT_ARRAY:
+        JsonEmitter_openArray(out);
+        array = JsonNode_getArray(node);
+        for (i = 0; ; i++) {
+            value = g_array_index(array, JsonNode*, i);
+            if (!value) {
+                break;
+            }
+            JsonEmitter_node(out, value);
+        }
+        JsonEmitter_closeArray(out);
+        break;
+    default:
+        JsonEmitter_null(out);
+        break;
+    }
+}
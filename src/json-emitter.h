@@ -0,0 +1,67 @@
+#ifndef __JSON_EMITTER_H__
+#define __JSON_EMITTER_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "json-dom.h"
+
+#define JSON_EMITTER_MAX_DEPTH 64
+
+/* Writes a value piece by piece, either encoded for the wire or as a
+ * JsonNode tree. Every value in a map follows its key. */
+typedef struct JsonEmitter_t JsonEmitter;
+
+struct JsonEmitterOps_t {
+    void (*openMap)(JsonEmitter* out);
+    void (*closeMap)(JsonEmitter* out);
+    void (*openArray)(JsonEmitter* out);
+    void (*closeArray)(JsonEmitter* out);
+    void (*key)(JsonEmitter* out, const char* key);
+    void (*string)(JsonEmitter* out, const char* s, size_t len);
+    void (*integer)(JsonEmitter* out, long l);
+    void (*number)(JsonEmitter* out, double d);
+    void (*boolean)(JsonEmitter* out, int boolean);
+    void (*null)(JsonEmitter* out);
+    void (*bytes)(JsonEmitter* out, const guint8* data, size_t len);
+    /* Returns the encoded value, NULL for a tree */
+    char* (*finish)(JsonEmitter* out, uint64_t* len);
+    void (*free)(JsonEmitter* out);
+};
+
+typedef struct JsonEmitterOps_t JsonEmitterOps;
+
+/* The first member of every emitter */
+struct JsonEmitter_t {
+    const JsonEmitterOps* ops;
+    /* Set if an allocation failed, the value is then lost */
+    int failed;
+};
+
+/* Builds a tree of nodes, allocated like any other node */
+JsonEmitter* JsonEmitter_newDom();
+/* Frees the emitter, returns the tree or NULL if it failed */
+JsonNode* JsonEmitter_finishDom(JsonEmitter* out);
+
+/* Frees the emitter, returns the encoded value or NULL if it failed */
+char* JsonEmitter_finish(JsonEmitter* out, uint64_t* len);
+/* Drops the value */
+void JsonEmitter_free(JsonEmitter* out);
+
+void JsonEmitter_openMap(JsonEmitter* out);
+void JsonEmitter_closeMap(JsonEmitter* out);
+void JsonEmitter_openArray(JsonEmitter* out);
+void JsonEmitter_closeArray(JsonEmitter* out);
+/* key must stay valid until its value is written */
+void JsonEmitter_key(JsonEmitter* out, const char* key);
+void JsonEmitter_string(JsonEmitter* out, const char* s);
+void JsonEmitter_stringLen(JsonEmitter* out, const char* s, size_t len);
+void JsonEmitter_long(JsonEmitter* out, long l);
+void JsonEmitter_double(JsonEmitter* out, double d);
+void JsonEmitter_boolean(JsonEmitter* out, int boolean);
+void JsonEmitter_null(JsonEmitter* out);
+void JsonEmitter_bytes(JsonEmitter* out, const guint8* data, size_t len);
+/* Writes an existing tree, splice nodes are written as null */
+void JsonEmitter_node(JsonEmitter* out, const JsonNode* node);
+
+#endif
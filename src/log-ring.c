@@ -0,0 +1,163 @@
+#include "log-ring.h"
+
+#include <string.h>
+
+#include "ring-sync.h"
+
+/*
+ * Slots follow the protocol of MpscQueue: the sequence number of the slot
+ * at position pos (modulo the capacity) is pos when it is free, pos + 1
+ * when it holds a line and pos + capacity once the line was read.
+ *
+ * Writers going to the slot of a line not read yet drop their line
+ * instead of waiting. The reader sets its waiting flag, checks the ring
+ * again and waits on the pushes futex word unless it was bumped since.
+ */
+
+struct LogSlot {
+    gint seq;
+    gint len;
+    char line[LOG_RING_LINE_SIZE];
+};
+
+struct LogRing_t {
+    struct LogSlot *slots;
+    guint mask;
+    gint tail;
+    gint head;
+    /* Futex word bumped when a line is pushed */
+    gint pushes;
+    gint readerWaiting;
+    gint closed;
+    gint dropped;
+};
+
+LogRing *logRing_new(guint capacity) {
+    LogRing *ring = g_new0(LogRing, 1);
+    guint size = 2;
+    guint i;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring->slots = g_new0(struct LogSlot, size);
+    ring->mask = size - 1;
+    for (i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+    }
+
+    return ring;
+}
+
+void logRing_free(LogRing *ring) {
+    if (!ring) {
+        return;
+    }
+
+    g_free(ring->slots);
+    g_free(ring);
+}
+
+static void wakeReader(LogRing *ring) {
+    if (g_atomic_int_get(&ring->readerWaiting)) {
+        g_atomic_int_inc(&ring->pushes);
+        futexWake(&ring->pushes, 1);
+    }
+}
+
+gboolean logRing_push(LogRing *ring, const char *const *parts, int count) {
+    struct LogSlot *slot;
+    size_t len = 0;
+    size_t n;
+    gint pos;
+    gint diff;
+    int i;
+
+    pos = g_atomic_int_get(&ring->tail);
+    while (TRUE) {
+        slot = &ring->slots[pos & ring->mask];
+        diff = POS_DIFF(g_atomic_int_get(&slot->seq), pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&ring->tail, pos,
+                                                  POS_ADD(pos, 1))) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The reader is behind */
+            g_atomic_int_inc(&ring->dropped);
+            return FALSE;
+        }
+
+        pos = g_atomic_int_get(&ring->tail);
+    }
+
+    /* Leave room for the newline */
+    for (i = 0; i < count; i++) {
+        n = strnlen(parts[i], LOG_RING_LINE_SIZE - 1 - len);
+        memcpy(slot->line + len, parts[i], n);
+        len += n;
+    }
+    slot->line[len++] = '\n';
+    slot->len = len;
+
+    g_atomic_int_set(&slot->seq, POS_ADD(pos, 1));
+    wakeReader(ring);
+    return TRUE;
+}
+
+/* Returns the number of bytes copied, 0 if the ring is empty */
+static size_t takeLines(LogRing *ring, char *buf, size_t size) {
+    struct LogSlot *slot;
+    size_t len = 0;
+    gint pos = ring->head;
+
+    while (len + LOG_RING_LINE_SIZE <= size) {
+        slot = &ring->slots[pos & ring->mask];
+        if (g_atomic_int_get(&slot->seq) != POS_ADD(pos, 1)) {
+            break;
+        }
+
+        memcpy(buf + len, slot->line, slot->len);
+        len += slot->len;
+        g_atomic_int_set(&slot->seq, POS_ADD(pos, ring->mask + 1));
+        pos = POS_ADD(pos, 1);
+    }
+
+    ring->head = pos;
+    return len;
+}
+
+size_t logRing_read(LogRing *ring, char *buf, size_t size) {
+    size_t len;
+    gint pushes;
+
+    while (TRUE) {
+        len = takeLines(ring, buf, size);
+        if (len > 0 || g_atomic_int_get(&ring->closed)) {
+            return len;
+        }
+
+        pushes = g_atomic_int_get(&ring->pushes);
+        g_atomic_int_set(&ring->readerWaiting, TRUE);
+        len = takeLines(ring, buf, size);
+        if (len == 0 && !g_atomic_int_get(&ring->closed)) {
+            futexWait(&ring->pushes, pushes);
+        }
+        g_atomic_int_set(&ring->readerWaiting, FALSE);
+
+        if (len > 0) {
+            return len;
+        }
+    }
+}
+
+void logRing_close(LogRing *ring) {
+    g_atomic_int_set(&ring->closed, TRUE);
+    g_atomic_int_inc(&ring->pushes);
+    futexWake(&ring->pushes, 1);
+}
+
+guint logRing_dropped(LogRing *ring) {
+    return (guint) g_atomic_int_get(&ring->dropped);
+}
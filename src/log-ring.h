@@ -0,0 +1,35 @@
+#ifndef __LOG_RING_H__
+#define __LOG_RING_H__
+
+#include <glib.h>
+
+/* Longest line kept, including its newline, longer lines are cut */
+#define LOG_RING_LINE_SIZE 512
+
+/* A bounded ring of log lines with many writers and one reader. Lines
+ * are copied straight into preallocated slots claimed with a compare and
+ * swap. Writers never wait: a line finding the ring full is dropped and
+ * counted. The reader sleeps on a futex while the ring is empty. */
+typedef struct LogRing_t LogRing;
+
+/* capacity is rounded up to a power of 2 */
+LogRing *logRing_new(guint capacity);
+void logRing_free(LogRing *ring);
+
+/* Joins count strings into one line ending with a newline. Returns FALSE
+ * if the line was dropped. */
+gboolean logRing_push(LogRing *ring, const char *const *parts, int count);
+
+/* Copies as many whole lines as fit into buf, which holds at least
+ * LOG_RING_LINE_SIZE bytes, waiting while the ring is empty. Returns the
+ * number of bytes, 0 once the ring is closed and empty. Only one thread
+ * may read. */
+size_t logRing_read(LogRing *ring, char *buf, size_t size);
+
+/* Wakes the reader, which stops once the ring is empty */
+void logRing_close(LogRing *ring);
+
+/* Lines dropped so far */
+guint logRing_dropped(LogRing *ring);
+
+#endif
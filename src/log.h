@@ -5,8 +5,34 @@
 
 extern gboolean TRACE_ENABLED;
 
+/* The most verbose GLogLevelFlags level logged, changed by setLogLevel */
+extern gint LOG_LEVEL;
+
+#define log_enabled(level) ((gint) (level) <= g_atomic_int_get(&LOG_LEVEL))
+
+/* Levels up to warnings are checked before the message is formatted,
+ * criticals and errors are always logged */
+#define log_if_enabled(level, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            g_log(G_LOG_DOMAIN, level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#undef g_warning
+#define g_warning(...) log_if_enabled(G_LOG_LEVEL_WARNING, __VA_ARGS__)
+#undef g_message
+#define g_message(...) log_if_enabled(G_LOG_LEVEL_MESSAGE, __VA_ARGS__)
+#undef g_info
+#define g_info(...) log_if_enabled(G_LOG_LEVEL_INFO, __VA_ARGS__)
+#undef g_debug
+#define g_debug(...) log_if_enabled(G_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 #define g_trace(...) \
-    if (TRACE_ENABLED) { g_debug(__VA_ARGS__); }
+    do { \
+        if (TRACE_ENABLED) { \
+            g_debug(__VA_ARGS__); \
+        } \
+    } while (0)
 
 #endif
-
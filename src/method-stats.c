@@ -0,0 +1,102 @@
+#include "method-stats.h"
+
+#include <stdio.h>
+
+#define STAT_ADD(counter, n) g_atomic_pointer_add((counter), (gssize) (n))
+#define STAT_GET(counter) ((gsize) g_atomic_pointer_get(&(counter)))
+
+void methodStats_addCall(MethodStats *stats, int errcode) {
+    STAT_ADD(&stats->calls, 1);
+    if (errcode == 0) {
+        return;
+    }
+
+    STAT_ADD(&stats->errors, 1);
+    if (errcode > 0 && errcode < METHOD_STATS_ERRNOS) {
+        STAT_ADD(&stats->errnos[errcode], 1);
+    }
+}
+
+void methodStats_addBytesIn(MethodStats *stats, uint64_t bytes) {
+    STAT_ADD(&stats->bytesIn, bytes);
+}
+
+void methodStats_addBytesOut(MethodStats *stats, uint64_t bytes) {
+    STAT_ADD(&stats->bytesOut, bytes);
+}
+
+void histogram_add(Histogram *histogram, gint64 usec) {
+    guint bucket;
+
+    if (usec < 0) {
+        usec = 0;
+    }
+
+    bucket = g_bit_storage(usec) - 1;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+
+    STAT_ADD(&histogram->buckets[bucket], 1);
+    STAT_ADD(&histogram->sum, usec);
+}
+
+/* Trailing empty buckets are left out */
+static JsonNode *histogramToJson(const Histogram *histogram) {
+    JsonNode *result = JsonNode_newMap();
+    JsonNode *buckets = JsonNode_newArray();
+    gsize counts[HISTOGRAM_BUCKETS];
+    int used = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = STAT_GET(histogram->buckets[i]);
+        if (counts[i]) {
+            used = i + 1;
+        }
+    }
+
+    for (i = 0; i < used; i++) {
+        JsonNode_array_append(buckets, JsonNode_newFromLong(counts[i]), NULL);
+    }
+
+    JsonNode_map_insert(result, "buckets", buckets, NULL);
+    JsonNode_map_insert(result, "sum",
+                        JsonNode_newFromLong(STAT_GET(histogram->sum)), NULL);
+    return result;
+}
+
+JsonNode *methodStats_toJson(const MethodStats *stats) {
+    JsonNode *result = JsonNode_newMap();
+    JsonNode *errnos = JsonNode_newMap();
+    char key[16];
+    gsize count;
+    int i;
+
+    for (i = 1; i < METHOD_STATS_ERRNOS; i++) {
+        count = STAT_GET(stats->errnos[i]);
+        if (count) {
+            snprintf(key, sizeof(key), "%d", i);
+            JsonNode_map_insert(errnos, key, JsonNode_newFromLong(count),
+                                NULL);
+        }
+    }
+
+    JsonNode_map_insert(result, "calls",
+                        JsonNode_newFromLong(STAT_GET(stats->calls)), NULL);
+    JsonNode_map_insert(result, "errors",
+                        JsonNode_newFromLong(STAT_GET(stats->errors)), NULL);
+    JsonNode_map_insert(result, "errnos", errnos, NULL);
+    JsonNode_map_insert(result, "bytesIn",
+                        JsonNode_newFromLong(STAT_GET(stats->bytesIn)), NULL);
+    JsonNode_map_insert(result, "bytesOut",
+                        JsonNode_newFromLong(STAT_GET(stats->bytesOut)),
+                        NULL);
+    JsonNode_map_insert(result, "waitTime",
+                        histogramToJson(&stats->waitTime), NULL);
+    JsonNode_map_insert(result, "runTime",
+                        histogramToJson(&stats->runTime), NULL);
+    JsonNode_map_insert(result, "encodeTime",
+                        histogramToJson(&stats->encodeTime), NULL);
+    return result;
+}
@@ -0,0 +1,50 @@
+#ifndef __METHOD_STATS_H__
+#define __METHOD_STATS_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "json-dom.h"
+
+/* Durations are counted in log2 buckets of microseconds: bucket 0 holds
+ * durations under 2us, bucket i those in [2^i, 2^(i+1)) us and the last
+ * bucket everything longer */
+#define HISTOGRAM_BUCKETS 32
+
+/* errno values counted one by one, larger ones only in the total */
+#define METHOD_STATS_ERRNOS 135
+
+struct Histogram_t {
+    gsize buckets[HISTOGRAM_BUCKETS];
+    /* Microseconds */
+    gsize sum;
+};
+typedef struct Histogram_t Histogram;
+
+/* Counters of one method. Any thread updates them with atomic adds, so
+ * a snapshot may be off by the calls in progress. */
+struct MethodStats_t {
+    gsize calls;
+    gsize errors;
+    gsize errnos[METHOD_STATS_ERRNOS];
+    /* Requests and responses on the wire, including attachments */
+    gsize bytesIn;
+    gsize bytesOut;
+    /* From receiving the request to starting the method */
+    Histogram waitTime;
+    Histogram runTime;
+    /* Encoding the response */
+    Histogram encodeTime;
+};
+typedef struct MethodStats_t MethodStats;
+
+/* errcode is 0 for a successful call */
+void methodStats_addCall(MethodStats *stats, int errcode);
+void methodStats_addBytesIn(MethodStats *stats, uint64_t bytes);
+void methodStats_addBytesOut(MethodStats *stats, uint64_t bytes);
+void histogram_add(Histogram *histogram, gint64 usec);
+
+/* Returns a map of the counters, errors keyed by errno */
+JsonNode *methodStats_toJson(const MethodStats *stats);
+
+#endif
@@ -0,0 +1,277 @@
+#include "mount-table.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#ifdef HAVE_OPENAT2
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+/*
+ * Mount points and devices are parsed from the 5th and 3rd fields of
+ * mountinfo lines:
+ *
+ *   36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw
+ *
+ * Spaces and other special characters in the mount point are escaped as
+ * octal sequences, like "\040".
+ *
+ * A path is resolved with openat2(RESOLVE_CACHED), which fails instead of
+ * doing I/O, so a hung filesystem can't block the lookup. Its device picks
+ * the mount. Paths the cache can't resolve are matched by prefix on
+ * component boundaries, after removing "." and ".." components without
+ * resolving symlinks.
+ */
+
+struct MountEntry {
+    /* Interned */
+    const char *mountPoint;
+    dev_t dev;
+};
+
+struct MountTable_t {
+    char *mountinfoPath;
+    gint64 ttl;
+    gint64 loadTime;
+    /* MountEntry, in mount order */
+    GArray *mounts;
+};
+
+MountTable *mountTable_new(const char *mountinfoPath, gint64 ttl) {
+    MountTable *table = g_new0(MountTable, 1);
+
+    table->mountinfoPath = g_strdup(mountinfoPath);
+    table->ttl = ttl;
+    table->mounts = g_array_new(FALSE, FALSE, sizeof(struct MountEntry));
+    return table;
+}
+
+void mountTable_free(MountTable *table) {
+    if (!table) {
+        return;
+    }
+
+    g_array_free(table->mounts, TRUE);
+    g_free(table->mountinfoPath);
+    g_free(table);
+}
+
+static void load(MountTable *table) {
+    GError *err = NULL;
+    struct MountEntry entry;
+    unsigned int major;
+    unsigned int minor;
+    char *contents;
+    char **lines;
+    char **fields;
+    char *mountPoint;
+    int i;
+
+    table->loadTime = g_get_monotonic_time();
+
+    if (!g_file_get_contents(table->mountinfoPath, &contents, NULL, &err)) {
+        g_warning("Could not read mount table: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    g_array_set_size(table->mounts, 0);
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        fields = g_strsplit(lines[i], " ", 6);
+        if (g_strv_length(fields) >= 5 &&
+            sscanf(fields[2], "%u:%u", &major, &minor) == 2) {
+            mountPoint = g_strcompress(fields[4]);
+            entry.mountPoint = g_intern_string(mountPoint);
+            entry.dev = makedev(major, minor);
+            g_array_append_val(table->mounts, entry);
+            g_free(mountPoint);
+        }
+        g_strfreev(fields);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+
+    g_debug("Loaded %u mounts", table->mounts->len);
+}
+
+static void refresh(MountTable *table) {
+    if (table->loadTime == 0 ||
+        g_get_monotonic_time() - table->loadTime > table->ttl) {
+        load(table);
+    }
+}
+
+/* Removes empty, "." and ".." components of an absolute path */
+static char *normalizePath(const char *path) {
+    GString *normalized = g_string_sized_new(strlen(path));
+    char **components = g_strsplit(path, "/", -1);
+    char *last;
+    int i;
+
+    for (i = 0; components[i]; i++) {
+        if (components[i][0] == '\0' || strcmp(components[i], ".") == 0) {
+            continue;
+        }
+
+        if (strcmp(components[i], "..") == 0) {
+            last = strrchr(normalized->str, '/');
+            if (last) {
+                g_string_truncate(normalized, last - normalized->str);
+            }
+            continue;
+        }
+
+        g_string_append_c(normalized, '/');
+        g_string_append(normalized, components[i]);
+    }
+
+    g_strfreev(components);
+
+    if (normalized->len == 0) {
+        g_string_append_c(normalized, '/');
+    }
+
+    return g_string_free(normalized, FALSE);
+}
+
+static int isPathPrefix(const char *prefix, size_t len, const char *path) {
+    if (strncmp(prefix, path, len) != 0) {
+        return FALSE;
+    }
+
+    /* "/" is a prefix of everything, "/mnt" is not a prefix of "/mnt2" */
+    return len == 1 || path[len] == '\0' || path[len] == '/';
+}
+
+static const struct MountEntry *lookupPrefix(MountTable *table,
+                                             const char *path) {
+    const struct MountEntry *best = NULL;
+    const struct MountEntry *entry;
+    size_t bestLen = 0;
+    size_t len;
+    guint i;
+
+    /* A later mount on the same mount point hides the earlier ones */
+    for (i = 0; i < table->mounts->len; i++) {
+        entry = &g_array_index(table->mounts, struct MountEntry, i);
+        len = strlen(entry->mountPoint);
+        if (len >= bestLen && isPathPrefix(entry->mountPoint, len, path)) {
+            best = entry;
+            bestLen = len;
+        }
+    }
+
+    return best;
+}
+
+#ifdef HAVE_OPENAT2
+/* Gets the device of path, or of its nearest parent found in the kernel
+ * caches, without doing I/O. Names missing from the cache and symlinks
+ * whose access time needs an update fail with EAGAIN, their parent is
+ * tried instead. Returns 0 or the errno value. */
+static int cachedDev(const char *path, dev_t *dev) {
+    struct open_how how;
+    struct statx stx;
+    char *current = g_strdup(path);
+    char *parent;
+    char *name;
+    int fd;
+    int rv;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_CLOEXEC;
+    how.resolve = RESOLVE_CACHED;
+
+    while (TRUE) {
+        fd = syscall(SYS_openat2, AT_FDCWD, current, &how, sizeof(how));
+        if (fd >= 0 || (errno != ENOENT && errno != EAGAIN)) {
+            break;
+        }
+
+        /* The parent of ".." is not a prefix of the path */
+        name = strrchr(current, '/') + 1;
+        if (strcmp(current, "/") == 0 || strcmp(name, "..") == 0 ||
+            strcmp(name, ".") == 0) {
+            break;
+        }
+
+        parent = g_path_get_dirname(current);
+        g_free(current);
+        current = parent;
+    }
+
+    g_free(current);
+    if (fd < 0) {
+        return errno;
+    }
+
+    /* Only the device is needed, cached attributes are good enough */
+    rv = statx(fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, 0, &stx);
+    if (rv < 0) {
+        rv = errno;
+    } else {
+        *dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    }
+
+    close(fd);
+    return rv;
+}
+#endif
+
+const char *mountTable_lookup(MountTable *table, const char *path) {
+    const struct MountEntry *best;
+    char *normalized;
+#ifdef HAVE_OPENAT2
+    const struct MountEntry *entry;
+    dev_t dev;
+    guint i;
+#endif
+
+    if (!path || path[0] != '/') {
+        return NULL;
+    }
+
+    refresh(table);
+
+    normalized = normalizePath(path);
+    best = lookupPrefix(table, normalized);
+    g_free(normalized);
+
+#ifdef HAVE_OPENAT2
+    /* Symlinks may lead to another mount, bind mounts share the device */
+    if (cachedDev(path, &dev) == 0 && !(best && best->dev == dev)) {
+        for (i = table->mounts->len; i > 0; i--) {
+            entry = &g_array_index(table->mounts, struct MountEntry, i - 1);
+            if (entry->dev == dev) {
+                return entry->mountPoint;
+            }
+        }
+    }
+#endif
+
+    return best ? best->mountPoint : NULL;
+}
+
+gboolean mountTable_contains(MountTable *table, const char *mountPoint) {
+    const struct MountEntry *entry;
+    guint i;
+
+    refresh(table);
+
+    for (i = 0; i < table->mounts->len; i++) {
+        entry = &g_array_index(table->mounts, struct MountEntry, i);
+        if (entry->mountPoint == mountPoint) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
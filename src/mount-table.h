@@ -0,0 +1,26 @@
+#ifndef __MOUNT_TABLE_H__
+#define __MOUNT_TABLE_H__
+
+#include <glib.h>
+
+/* Maps paths to the mount point they live under, from the mount table of
+ * the process, without blocking on the filesystems. Not thread safe. */
+typedef struct MountTable_t MountTable;
+
+/* The mount table is read again when it is older than ttl microseconds */
+MountTable *mountTable_new(const char *mountinfoPath, gint64 ttl);
+void mountTable_free(MountTable *table);
+
+/* Returns the mount point of the filesystem holding path, or of its
+ * nearest existing parent, or NULL for relative paths or if the mount
+ * table can't be read. Symlinks are followed when the kernel lookup cache
+ * can resolve them, otherwise the path is matched by its longest mount
+ * prefix after removing "." and ".." components. Mount points are
+ * interned strings, comparable by pointer. */
+const char *mountTable_lookup(MountTable *table, const char *path);
+
+/* Returns TRUE if mountPoint, as returned by mountTable_lookup, is still
+ * mounted */
+gboolean mountTable_contains(MountTable *table, const char *mountPoint);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Compare MpscQueue with GAsyncQueue, many producers pushing to one
+ * consumer like the workers pushing responses to the response writer.
+ *
+ *   $ make mpsc-queue-bench
+ *   $ ./mpsc-queue-bench [ITEMS]
+ *   queue=async producers=1 items=1000000 elapsed=... rate=...
+ *   queue=mpsc producers=1 items=1000000 elapsed=... rate=...
+ *   ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "mpsc-queue.h"
+
+#define DEFAULT_ITEMS 1000000
+
+static int item;
+
+struct Bench {
+    const char *name;
+    void *(*new)(void);
+    void (*free)(void *queue);
+    void (*push)(void *queue, gpointer item);
+    gpointer (*pop)(void *queue);
+};
+
+static void *asyncNew(void) {
+    return g_async_queue_new();
+}
+
+static void asyncFree(void *queue) {
+    g_async_queue_unref((GAsyncQueue *) queue);
+}
+
+static void asyncPush(void *queue, gpointer item) {
+    g_async_queue_push((GAsyncQueue *) queue, item);
+}
+
+static gpointer asyncPop(void *queue) {
+    return g_async_queue_pop((GAsyncQueue *) queue);
+}
+
+static void *mpscNew(void) {
+    return mpscQueue_new(4096);
+}
+
+static void mpscFree(void *queue) {
+    mpscQueue_free((MpscQueue *) queue);
+}
+
+static void mpscPush(void *queue, gpointer item) {
+    mpscQueue_push((MpscQueue *) queue, item);
+}
+
+static gpointer mpscPop(void *queue) {
+    return mpscQueue_pop((MpscQueue *) queue);
+}
+
+static const struct Bench benches[] = {
+    { "async", asyncNew, asyncFree, asyncPush, asyncPop },
+    { "mpsc", mpscNew, mpscFree, mpscPush, mpscPop },
+    { NULL }
+};
+
+struct Producer {
+    const struct Bench *bench;
+    void *queue;
+    long items;
+};
+
+static void *produce(void *data) {
+    struct Producer *producer = (struct Producer *) data;
+    long i;
+
+    for (i = 0; i < producer->items; i++) {
+        producer->bench->push(producer->queue, &item);
+    }
+
+    return NULL;
+}
+
+static double run(const struct Bench *bench, int producers, long items) {
+    GThread **threads = g_new(GThread *, producers);
+    struct Producer producer;
+    gint64 start;
+    long total = items / producers * producers;
+    long i;
+    int p;
+
+    producer.bench = bench;
+    producer.queue = bench->new();
+    producer.items = items / producers;
+
+    start = g_get_monotonic_time();
+    for (p = 0; p < producers; p++) {
+        threads[p] = g_thread_new("producer", produce, &producer);
+    }
+
+    for (i = 0; i < total; i++) {
+        bench->pop(producer.queue);
+    }
+
+    for (p = 0; p < producers; p++) {
+        g_thread_join(threads[p]);
+    }
+
+    bench->free(producer.queue);
+    g_free(threads);
+    return (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+}
+
+int main(int argc, char *argv[]) {
+    const struct Bench *bench;
+    long items = DEFAULT_ITEMS;
+    double elapsed;
+    int producers;
+
+    if (argc > 1) {
+        items = atol(argv[1]);
+    }
+
+    for (producers = 1; producers <= 64; producers *= 2) {
+        for (bench = benches; bench->name; bench++) {
+            elapsed = run(bench, producers, items);
+            printf("queue=%s producers=%d items=%ld elapsed=%.3f "
+                   "rate=%.0f/s\n", bench->name, producers, items, elapsed,
+                   items / elapsed);
+        }
+    }
+
+    return 0;
+}
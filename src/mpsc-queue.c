@@ -0,0 +1,181 @@
+#include "mpsc-queue.h"
+
+#include "ring-sync.h"
+
+/*
+ * Every cell has a sequence number telling whose turn it is. For the cell
+ * at position pos (modulo the capacity):
+ *
+ *   seq == pos             free, a producer may claim it
+ *   seq == pos + 1         holds an item for the consumer
+ *   seq == pos + capacity  consumed, free for the next round
+ *
+ * Producers claim a position by advancing tail with a compare and swap,
+ * store the item and publish it by advancing seq. The consumer owns head.
+ *
+ * Producers finding the ring full append to the overflow list instead of
+ * waiting, and keep doing so while it is not empty, so the items of one
+ * producer stay in order. The consumer takes from the overflow list only
+ * once every claimed cell was consumed.
+ *
+ * The consumer going to sleep sets its waiting flag, checks the queue
+ * again and waits on the pushes futex word unless it was bumped since it
+ * started. Producers bump the word and wake it after pushing, if the flag
+ * is set. The glib atomics are full barriers, so one of them sees the
+ * other.
+ */
+
+/* Attempts before sleeping */
+#define MPSC_SPINS 100
+
+struct MpscCell {
+    gint seq;
+    gpointer item;
+};
+
+struct MpscQueue_t {
+    struct MpscCell *cells;
+    guint mask;
+    gint tail;
+    gint head;
+    /* Futex word bumped when an item is pushed */
+    gint pushes;
+    gint consumerWaiting;
+    GMutex overflowLock;
+    GQueue overflow;
+    /* Length of overflow, read without the lock */
+    gint overflowed;
+};
+
+MpscQueue *mpscQueue_new(guint capacity) {
+    MpscQueue *queue = g_new0(MpscQueue, 1);
+    guint size = 2;
+    guint i;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    g_mutex_init(&queue->overflowLock);
+    g_queue_init(&queue->overflow);
+    queue->cells = g_new0(struct MpscCell, size);
+    queue->mask = size - 1;
+    for (i = 0; i < size; i++) {
+        queue->cells[i].seq = i;
+    }
+
+    return queue;
+}
+
+void mpscQueue_free(MpscQueue *queue) {
+    if (!queue) {
+        return;
+    }
+
+    g_queue_clear(&queue->overflow);
+    g_mutex_clear(&queue->overflowLock);
+    g_free(queue->cells);
+    g_free(queue);
+}
+
+static gboolean tryPush(MpscQueue *queue, gpointer item) {
+    struct MpscCell *cell;
+    gint pos;
+    gint diff;
+
+    pos = g_atomic_int_get(&queue->tail);
+    while (TRUE) {
+        cell = &queue->cells[pos & queue->mask];
+        diff = POS_DIFF(g_atomic_int_get(&cell->seq), pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&queue->tail, pos,
+                                                  POS_ADD(pos, 1))) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The consumer did not free this cell yet */
+            return FALSE;
+        }
+
+        pos = g_atomic_int_get(&queue->tail);
+    }
+
+    cell->item = item;
+    g_atomic_int_set(&cell->seq, POS_ADD(pos, 1));
+    return TRUE;
+}
+
+void mpscQueue_push(MpscQueue *queue, gpointer item) {
+    if (g_atomic_int_get(&queue->overflowed) || !tryPush(queue, item)) {
+        g_mutex_lock(&queue->overflowLock);
+        g_queue_push_tail(&queue->overflow, item);
+        g_atomic_int_inc(&queue->overflowed);
+        g_mutex_unlock(&queue->overflowLock);
+    }
+
+    if (g_atomic_int_get(&queue->consumerWaiting)) {
+        g_atomic_int_inc(&queue->pushes);
+        futexWake(&queue->pushes, 1);
+    }
+}
+
+static gpointer popOverflow(MpscQueue *queue) {
+    gpointer item = NULL;
+
+    g_mutex_lock(&queue->overflowLock);
+    /* Cells claimed before the overflow started come first */
+    if (g_atomic_int_get(&queue->tail) == queue->head) {
+        item = g_queue_pop_head(&queue->overflow);
+        if (item) {
+            g_atomic_int_add(&queue->overflowed, -1);
+        }
+    }
+    g_mutex_unlock(&queue->overflowLock);
+
+    return item;
+}
+
+gpointer mpscQueue_tryPop(MpscQueue *queue) {
+    struct MpscCell *cell;
+    gpointer item;
+    gint pos = queue->head;
+
+    cell = &queue->cells[pos & queue->mask];
+    if (g_atomic_int_get(&cell->seq) != POS_ADD(pos, 1)) {
+        if (g_atomic_int_get(&queue->overflowed)) {
+            return popOverflow(queue);
+        }
+        return NULL;
+    }
+
+    item = cell->item;
+    g_atomic_int_set(&cell->seq, POS_ADD(pos, queue->mask + 1));
+    queue->head = POS_ADD(pos, 1);
+    return item;
+}
+
+gpointer mpscQueue_pop(MpscQueue *queue) {
+    gpointer item;
+    gint pushes;
+    int i;
+
+    for (i = 0; i < MPSC_SPINS; i++) {
+        item = mpscQueue_tryPop(queue);
+        if (item) {
+            return item;
+        }
+    }
+
+    while (TRUE) {
+        pushes = g_atomic_int_get(&queue->pushes);
+        g_atomic_int_set(&queue->consumerWaiting, TRUE);
+        item = mpscQueue_tryPop(queue);
+        if (item) {
+            g_atomic_int_set(&queue->consumerWaiting, FALSE);
+            return item;
+        }
+
+        futexWait(&queue->pushes, pushes);
+        g_atomic_int_set(&queue->consumerWaiting, FALSE);
+    }
+}
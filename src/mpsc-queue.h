@@ -0,0 +1,27 @@
+#ifndef __MPSC_QUEUE_H__
+#define __MPSC_QUEUE_H__
+
+#include <glib.h>
+
+/* An unbounded queue of pointers with many producers and one consumer.
+ * Producers claim slots of a ring with a compare and swap instead of a
+ * lock, and never wait: once the ring is full, items go to a locked
+ * overflow list until the consumer catches up. The consumer spins
+ * briefly, then sleeps on a futex while the queue is empty. */
+typedef struct MpscQueue_t MpscQueue;
+
+/* capacity, the size of the ring, is rounded up to a power of 2 */
+MpscQueue *mpscQueue_new(guint capacity);
+void mpscQueue_free(MpscQueue *queue);
+
+/* Adds a non NULL item, the items of one thread are popped in order */
+void mpscQueue_push(MpscQueue *queue, gpointer item);
+
+/* Removes the oldest item, waiting while the queue is empty. Only one
+ * thread may pop. */
+gpointer mpscQueue_pop(MpscQueue *queue);
+
+/* Returns NULL if the queue is empty */
+gpointer mpscQueue_tryPop(MpscQueue *queue);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __RING_SYNC_H__
+#define __RING_SYNC_H__
+
+#include <glib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Shared by the rings of sequence numbered slots of MpscQueue and LogRing,
+ * see mpsc-queue.c for the protocol */
+
+/* Positions wrap around, unsigned arithmetic avoids signed overflow */
+#define POS_ADD(pos, n) ((gint) ((guint) (pos) + (guint) (n)))
+#define POS_DIFF(a, b) ((gint) ((guint) (a) - (guint) (b)))
+
+/* Sleeps while *word is value. EAGAIN and EINTR are left to the caller,
+ * which checks its ring again. */
+static inline void futexWait(gint *word, gint value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void futexWake(gint *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif
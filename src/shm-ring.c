@@ -0,0 +1,212 @@
+#include "shm-ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Single producer, single consumer byte ring in shared memory.
+ *
+ * Nothing but the data lives in the shared mapping. Each end keeps its own
+ * position, and the ends tell each other how many bytes moved through a pair
+ * of eventfds: the producer adds the number of bytes written to dataFd, the
+ * consumer adds the number of bytes read to spaceFd. Reading an eventfd
+ * returns and resets its counter, so each side learns exactly how many
+ * bytes it may read or overwrite, and the eventfd syscalls order the memory
+ * accesses between the processes.
+ *
+ * The eventfds must be non-blocking: collect reads them whenever more room
+ * or data is needed, and waitFor polls them before sleeping. hangupFd is
+ * polled along with them so a dead peer (or a closed fd) ends the wait.
+ */
+
+static int collect(int fd, uint64_t *available) {
+    uint64_t count;
+    ssize_t n;
+
+    n = read(fd, &count, sizeof(count));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+
+        return errno;
+    }
+
+    *available += count;
+    return 0;
+}
+
+static int notifyPeer(int fd, uint64_t count) {
+    while (write(fd, &count, sizeof(count)) < 0) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+/* Waits for fd to become readable, returns 0 or the errno value */
+static int waitFor(int fd, int hangupFd) {
+    struct pollfd fds[2];
+    int rv;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = hangupFd;
+    fds[1].events = 0;
+
+    for (;;) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        rv = poll(fds, 2, -1);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            return 0;
+        }
+
+        if (fds[0].revents & POLLNVAL || fds[1].revents & POLLNVAL) {
+            return EBADF;
+        }
+
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            return EPIPE;
+        }
+    }
+}
+
+void shmRing_initConsumer(ShmRing *ring, char *data, uint64_t size,
+                          int dataFd, int spaceFd) {
+    ring->data = data;
+    ring->size = size;
+    ring->pos = 0;
+    ring->available = 0;
+    ring->dataFd = dataFd;
+    ring->spaceFd = spaceFd;
+}
+
+void shmRing_initProducer(ShmRing *ring, char *data, uint64_t size,
+                          int dataFd, int spaceFd) {
+    shmRing_initConsumer(ring, data, size, dataFd, spaceFd);
+    ring->available = size;
+}
+
+/* Like read(2), blocks until some data is available. Returns 0 if the peer
+ * hung up, -1 with errno set on error. */
+ssize_t shmRing_read(ShmRing *ring, void *buffer, size_t len,
+                     int hangupFd) {
+    uint64_t offset;
+    uint64_t first;
+    uint64_t n;
+    int rv;
+
+    while (ring->available == 0) {
+        rv = collect(ring->dataFd, &ring->available);
+        if (rv == 0 && ring->available == 0) {
+            rv = waitFor(ring->dataFd, hangupFd);
+        }
+
+        if (rv == EPIPE) {
+            return 0;
+        } else if (rv != 0) {
+            errno = rv;
+            return -1;
+        }
+    }
+
+    n = ring->available < len ? ring->available : len;
+    offset = ring->pos % ring->size;
+    first = ring->size - offset < n ? ring->size - offset : n;
+
+    memcpy(buffer, ring->data + offset, first);
+    memcpy((char *) buffer + first, ring->data, n - first);
+
+    ring->pos += n;
+    ring->available -= n;
+
+    rv = notifyPeer(ring->spaceFd, n);
+    if (rv != 0) {
+        errno = rv;
+        return -1;
+    }
+
+    return n;
+}
+
+/* Writes all the iovecs, waiting for the consumer to make room when the
+ * ring is full. Returns 0 or the errno value. */
+int shmRing_writev(ShmRing *ring, const struct iovec *iov, int iovcnt,
+                   int hangupFd) {
+    uint64_t unsignalled = 0;
+    uint64_t offset;
+    uint64_t first;
+    uint64_t n;
+    size_t done;
+    int rv;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        done = 0;
+        while (done < iov[i].iov_len) {
+            /* Only ask the consumer for room the chunk does not fit in */
+            if (ring->available < iov[i].iov_len - done) {
+                rv = collect(ring->spaceFd, &ring->available);
+                if (rv != 0) {
+                    return rv;
+                }
+            }
+
+            if (ring->available == 0) {
+                /* Publish what we have before waiting for room */
+                if (unsignalled > 0) {
+                    rv = notifyPeer(ring->dataFd, unsignalled);
+                    if (rv != 0) {
+                        return rv;
+                    }
+
+                    unsignalled = 0;
+                }
+
+                rv = waitFor(ring->spaceFd, hangupFd);
+                if (rv != 0) {
+                    return rv;
+                }
+
+                continue;
+            }
+
+            n = iov[i].iov_len - done;
+            if (n > ring->available) {
+                n = ring->available;
+            }
+
+            offset = ring->pos % ring->size;
+            first = ring->size - offset < n ? ring->size - offset : n;
+
+            memcpy(ring->data + offset, (char *) iov[i].iov_base + done,
+                   first);
+            memcpy(ring->data, (char *) iov[i].iov_base + done + first,
+                   n - first);
+
+            ring->pos += n;
+            ring->available -= n;
+            unsignalled += n;
+            done += n;
+        }
+    }
+
+    if (unsignalled > 0) {
+        return notifyPeer(ring->dataFd, unsignalled);
+    }
+
+    return 0;
+}
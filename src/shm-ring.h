@@ -0,0 +1,33 @@
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* One direction of the shared memory transport. Only the private state of
+ * one end lives here, see shm-ring.c for the protocol. */
+struct ShmRing_t {
+    char *data;
+    uint64_t size;
+    /* Total bytes read or written, the ring offset is pos % size */
+    uint64_t pos;
+    /* Consumer: bytes published but not read yet.
+     * Producer: bytes free for writing. */
+    uint64_t available;
+    /* Signalled by the producer with the number of bytes written */
+    int dataFd;
+    /* Signalled by the consumer with the number of bytes read */
+    int spaceFd;
+};
+typedef struct ShmRing_t ShmRing;
+
+void shmRing_initConsumer(ShmRing *ring, char *data, uint64_t size,
+                          int dataFd, int spaceFd);
+void shmRing_initProducer(ShmRing *ring, char *data, uint64_t size,
+                          int dataFd, int spaceFd);
+ssize_t shmRing_read(ShmRing *ring, void *buffer, size_t len, int hangupFd);
+int shmRing_writev(ShmRing *ring, const struct iovec *iov, int iovcnt,
+                   int hangupFd);
+
+#endif
@@ -0,0 +1,793 @@
+#include "uring-backend.h"
+
+#ifdef HAVE_LIBURING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <liburing.h>
+
+#include "exported-functions.h"
+#include "utils.h"
+
+/*
+ * Requests are submitted by the request handler. The completion thread
+ * reaps the completions, submits the next step of multi step requests like
+ * readfile, and reports the results. The kernel runs operations that can't
+ * complete inline on its own workers, so a hung mount blocks those workers
+ * instead of pool threads.
+ */
+
+/* Longest read or write submitted at once, their length is 32 bits */
+#define URING_IO_MAX (1 << 30)
+
+/* Alignment of direct I/O buffers */
+#define URING_ALIGN 4096
+
+enum UringKind {
+    URING_STAT,
+    URING_LSTAT,
+    URING_UNLINK,
+    URING_RMDIR,
+    URING_MKDIR,
+    URING_RENAME,
+    URING_LINK,
+    URING_SYMLINK,
+    URING_FSYNC_PATH,
+    URING_READFILE,
+    URING_WRITEFILE,
+    URING_KINDS
+};
+
+struct UringMethod {
+    const char *name;
+    enum UringKind kind;
+    /* Opcodes the kernel must support */
+    int opcodes[4];
+};
+
+static const struct UringMethod uringMethods[] = {
+    { "stat", URING_STAT, {IORING_OP_STATX, -1} },
+    { "lstat", URING_LSTAT, {IORING_OP_STATX, -1} },
+    { "unlink", URING_UNLINK, {IORING_OP_UNLINKAT, -1} },
+    { "rmdir", URING_RMDIR, {IORING_OP_UNLINKAT, -1} },
+    { "mkdir", URING_MKDIR, {IORING_OP_MKDIRAT, -1} },
+    { "rename", URING_RENAME, {IORING_OP_RENAMEAT, -1} },
+    { "link", URING_LINK, {IORING_OP_LINKAT, -1} },
+    { "symlink", URING_SYMLINK, {IORING_OP_SYMLINKAT, -1} },
+    { "fsyncPath", URING_FSYNC_PATH,
+      {IORING_OP_OPENAT, IORING_OP_FSYNC, IORING_OP_CLOSE, -1} },
+    { "readfile", URING_READFILE,
+      {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE} },
+    { "writefile", URING_WRITEFILE,
+      {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE} },
+    { NULL }
+};
+
+/* Steps of a request. Path requests are one STAGE_PATH step, the others
+ * open a file, work on it and close it:
+ *
+ *   fsyncPath  OPEN FSYNC CLOSE
+ *   readfile   OPEN STATX READ... CLOSE
+ *   writefile  OPEN WRITE... FSYNC CLOSE
+ */
+enum UringStage {
+    STAGE_PATH,
+    STAGE_OPEN,
+    STAGE_STATX,
+    STAGE_READ,
+    STAGE_WRITE,
+    STAGE_FSYNC,
+    STAGE_CLOSE
+};
+
+struct UringOp {
+    const struct UringMethod *method;
+    enum UringStage stage;
+    /* Arguments, pointing into the request */
+    const char *path;
+    const char *newpath;
+    long mode;
+    int openFlags;
+    gboolean splice;
+    int fd;
+    /* First error, the file is still closed after it */
+    int res;
+    struct statx stx;
+    /* readfile reads into map, a mapping if spliced, writefile writes
+     * data */
+    char *map;
+    size_t mapLen;
+    const char *data;
+    uint64_t size;
+    uint64_t offset;
+    /* Aligned copy of data for direct writes */
+    char *staging;
+    UringCompletion done;
+    void *doneData;
+};
+
+struct UringBackend_t {
+    struct io_uring ring;
+    /* Guards the submission queue, used by the request handler and the
+     * completion thread */
+    GMutex submitLock;
+    GThread *completionThread;
+    /* Wakes the completion thread to stop, the submission queue may be
+     * full */
+    int stopFd;
+    unsigned entries;
+    gint inflight;
+    gint stopping;
+    gboolean supported[URING_KINDS];
+};
+
+/* Data of the entries of requests that could not be submitted, turned
+ * into no-ops */
+static char discardedOp;
+
+static const struct UringMethod *findMethod(const char *methodName) {
+    int i;
+
+    for (i = 0; uringMethods[i].name; i++) {
+        if (strcmp(uringMethods[i].name, methodName) == 0) {
+            return &uringMethods[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct UringArgs {
+    GString *path;
+    long mode;
+    GString *oldpath;
+    GString *newpath;
+    int direct;
+    int binary;
+    int splice;
+    GByteArray *attachment;
+};
+
+static const ArgSpec pathArgs[] = {
+    ARG(JT_STRING, "path", struct UringArgs, path),
+};
+
+static const ArgSpec mkdirArgs[] = {
+    ARG(JT_STRING, "path", struct UringArgs, path),
+    ARG_OPTIONAL(JT_LONG, "mode", struct UringArgs, mode,
+                 DEFAULT_MKDIR_MODE),
+};
+
+static const ArgSpec twoPathArgs[] = {
+    ARG(JT_STRING, "oldpath", struct UringArgs, oldpath),
+    ARG(JT_STRING, "newpath", struct UringArgs, newpath),
+};
+
+static const ArgSpec readfileArgs[] = {
+    ARG(JT_STRING, "path", struct UringArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct UringArgs, direct, FALSE),
+    ARG_OPTIONAL(JT_BOOLEAN, "binary", struct UringArgs, binary, FALSE),
+    ARG_OPTIONAL(JT_BOOLEAN, "splice", struct UringArgs, splice, FALSE),
+};
+
+static const ArgSpec writefileArgs[] = {
+    ARG(JT_STRING, "path", struct UringArgs, path),
+    ARG_OPTIONAL(JT_BOOLEAN, "direct", struct UringArgs, direct, FALSE),
+    ARG_OPTIONAL(JT_BINARY, "attachment", struct UringArgs, attachment, 0),
+};
+
+static ArgSchema pathSchema = ARG_SCHEMA(pathArgs);
+static ArgSchema mkdirSchema = ARG_SCHEMA(mkdirArgs);
+static ArgSchema twoPathSchema = ARG_SCHEMA(twoPathArgs);
+static ArgSchema readfileSchema = ARG_SCHEMA(readfileArgs);
+static ArgSchema writefileSchema = ARG_SCHEMA(writefileArgs);
+
+/* Fills the arguments of op. Returns -EINVAL if they are invalid or only
+ * the thread pool handles them. */
+static int parseArgs(struct UringOp *op, const JsonNode *args) {
+    GError *tmpError = NULL;
+    struct UringArgs arg = {NULL};
+    ArgSchema *schema;
+
+    switch (op->method->kind) {
+    case URING_MKDIR:
+        schema = &mkdirSchema;
+        break;
+    case URING_RENAME:
+    case URING_LINK:
+    case URING_SYMLINK:
+        schema = &twoPathSchema;
+        break;
+    case URING_READFILE:
+        schema = &readfileSchema;
+        break;
+    case URING_WRITEFILE:
+        schema = &writefileSchema;
+        break;
+    default:
+        schema = &pathSchema;
+        break;
+    }
+
+    if (getArgs(args, schema, &arg, &tmpError) < 0) {
+        g_error_free(tmpError);
+        return -EINVAL;
+    }
+
+    if (schema == &twoPathSchema) {
+        op->path = arg.oldpath->str;
+        op->newpath = arg.newpath->str;
+    } else {
+        op->path = arg.path->str;
+    }
+    op->mode = arg.mode;
+    op->stage = STAGE_PATH;
+
+    switch (op->method->kind) {
+    case URING_FSYNC_PATH:
+        op->stage = STAGE_OPEN;
+        op->openFlags = O_RDONLY;
+        break;
+    case URING_READFILE:
+        /* base64 contents are left to the thread pool */
+        if (!arg.binary) {
+            return -EINVAL;
+        }
+        op->stage = STAGE_OPEN;
+        op->openFlags = O_RDONLY | (arg.direct ? O_DIRECT : 0);
+        op->splice = arg.splice;
+        break;
+    case URING_WRITEFILE:
+        /* Older clients send base64 contents, left to the thread pool */
+        if (!arg.attachment) {
+            return -EINVAL;
+        }
+        op->stage = STAGE_OPEN;
+        op->openFlags = O_WRONLY | O_CREAT | O_TRUNC |
+                        (arg.direct ? O_DIRECT : 0);
+        op->mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        op->data = (const char *) arg.attachment->data;
+        op->size = arg.attachment->len;
+        if (arg.direct && op->size > 0) {
+            if (posix_memalign((void **) &op->staging, URING_ALIGN,
+                               op->size) != 0) {
+                return -ENOMEM;
+            }
+            memcpy(op->staging, op->data, op->size);
+            op->data = op->staging;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* Queues the current step of op. Must be called with submitLock held. */
+static int prepOp(UringBackend *backend, struct UringOp *op,
+                  struct io_uring_sqe **sqeOut) {
+    struct io_uring_sqe *sqe;
+    size_t len;
+
+    sqe = io_uring_get_sqe(&backend->ring);
+    if (!sqe) {
+        return -EAGAIN;
+    }
+
+    switch (op->stage) {
+    case STAGE_PATH:
+        switch (op->method->kind) {
+        case URING_STAT:
+            io_uring_prep_statx(sqe, AT_FDCWD, op->path, 0,
+                                STATX_BASIC_STATS, &op->stx);
+            break;
+        case URING_LSTAT:
+            io_uring_prep_statx(sqe, AT_FDCWD, op->path,
+                                AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                                &op->stx);
+            break;
+        case URING_UNLINK:
+            io_uring_prep_unlinkat(sqe, AT_FDCWD, op->path, 0);
+            break;
+        case URING_RMDIR:
+            io_uring_prep_unlinkat(sqe, AT_FDCWD, op->path, AT_REMOVEDIR);
+            break;
+        case URING_MKDIR:
+            io_uring_prep_mkdirat(sqe, AT_FDCWD, op->path, op->mode);
+            break;
+        case URING_RENAME:
+            io_uring_prep_renameat(sqe, AT_FDCWD, op->path, AT_FDCWD,
+                                   op->newpath, 0);
+            break;
+        case URING_LINK:
+            io_uring_prep_linkat(sqe, AT_FDCWD, op->path, AT_FDCWD,
+                                 op->newpath, 0);
+            break;
+        case URING_SYMLINK:
+            io_uring_prep_symlinkat(sqe, op->path, AT_FDCWD, op->newpath);
+            break;
+        default:
+            break;
+        }
+        break;
+    case STAGE_OPEN:
+        io_uring_prep_openat(sqe, AT_FDCWD, op->path, op->openFlags,
+                             op->mode);
+        break;
+    case STAGE_STATX:
+        io_uring_prep_statx(sqe, op->fd, "", AT_EMPTY_PATH, STATX_SIZE,
+                            &op->stx);
+        break;
+    case STAGE_READ:
+        len = MIN(op->mapLen - op->offset, URING_IO_MAX);
+        io_uring_prep_read(sqe, op->fd, op->map + op->offset, len,
+                           op->offset);
+        break;
+    case STAGE_WRITE:
+        len = MIN(op->size - op->offset, URING_IO_MAX);
+        io_uring_prep_write(sqe, op->fd, op->data + op->offset, len,
+                            op->offset);
+        break;
+    case STAGE_FSYNC:
+        io_uring_prep_fsync(sqe, op->fd, 0);
+        break;
+    case STAGE_CLOSE:
+        io_uring_prep_close(sqe, op->fd);
+        break;
+    }
+
+    io_uring_sqe_set_data(sqe, op);
+    *sqeOut = sqe;
+    return 0;
+}
+
+/* Returns 0 once the kernel took the entry, or an error if the caller must
+ * run the step itself */
+static int submitOp(UringBackend *backend, struct UringOp *op) {
+    struct io_uring_sqe *sqe;
+    int submitted;
+    int rv;
+
+    g_mutex_lock(&backend->submitLock);
+    rv = prepOp(backend, op, &sqe);
+    if (rv < 0) {
+        goto out;
+    }
+
+    submitted = io_uring_submit(&backend->ring);
+    if (submitted < 0 || io_uring_sq_ready(&backend->ring) > 0) {
+        /* The entry can't be taken back, it becomes a no-op submitted with
+         * the next request */
+        rv = submitted < 0 ? submitted : -EAGAIN;
+        g_warning("Could not submit request: %s", iop_strerror(-rv));
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, &discardedOp);
+    }
+
+out:
+    g_mutex_unlock(&backend->submitLock);
+    return rv;
+}
+
+/* Runs the current step of op on this thread. Returns the result the
+ * completion would have. */
+static int runStep(struct UringOp *op) {
+    ssize_t n;
+    int rv;
+
+    switch (op->stage) {
+    case STAGE_STATX:
+        rv = statx(op->fd, "", AT_EMPTY_PATH, STATX_SIZE, &op->stx);
+        break;
+    case STAGE_READ:
+        n = pread(op->fd, op->map + op->offset,
+                  MIN(op->mapLen - op->offset, URING_IO_MAX), op->offset);
+        return n < 0 ? -errno : (int) n;
+    case STAGE_WRITE:
+        n = pwrite(op->fd, op->data + op->offset,
+                   MIN(op->size - op->offset, URING_IO_MAX), op->offset);
+        return n < 0 ? -errno : (int) n;
+    case STAGE_FSYNC:
+        rv = fsync(op->fd);
+        break;
+    case STAGE_CLOSE:
+        rv = close(op->fd);
+        break;
+    default:
+        /* Only the first step is submitted by the request handler */
+        return -ENOSYS;
+    }
+
+    return rv < 0 ? -errno : rv;
+}
+
+/* Takes the result of the current step and moves op to the next one.
+ * Returns FALSE when the request is done. */
+static gboolean nextStage(struct UringOp *op, int res) {
+    size_t blockSize;
+
+    /* Like the exported functions, errors closing the file are ignored */
+    if (res < 0 && op->res == 0 && op->stage != STAGE_CLOSE) {
+        op->res = res;
+    }
+
+    switch (op->stage) {
+    case STAGE_PATH:
+        return FALSE;
+    case STAGE_OPEN:
+        if (res < 0) {
+            return FALSE;
+        }
+        op->fd = res;
+        if (op->method->kind == URING_READFILE) {
+            op->stage = STAGE_STATX;
+        } else if (op->method->kind == URING_WRITEFILE && op->size > 0) {
+            op->stage = STAGE_WRITE;
+        } else {
+            op->stage = STAGE_FSYNC;
+        }
+        return TRUE;
+    case STAGE_STATX:
+        op->stage = STAGE_CLOSE;
+        if (res < 0 || op->stx.stx_size == 0) {
+            return TRUE;
+        }
+
+        /* Aligned for direct I/O, which ends with a short read. Spliced
+         * contents need a mapping, the others become a byte array. */
+        op->size = op->stx.stx_size;
+        blockSize = MAX(op->stx.stx_blksize, URING_ALIGN);
+        op->mapLen = ((op->size + blockSize - 1) / blockSize) * blockSize;
+        if (op->splice) {
+            op->map = mmap(NULL, op->mapLen, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (op->map == MAP_FAILED) {
+                op->map = NULL;
+                op->res = -errno;
+                return TRUE;
+            }
+        } else if (posix_memalign((void **) &op->map, URING_ALIGN,
+                                  op->mapLen) != 0) {
+            op->map = NULL;
+            op->res = -ENOMEM;
+            return TRUE;
+        }
+        op->stage = STAGE_READ;
+        return TRUE;
+    case STAGE_READ:
+        if (res > 0) {
+            op->offset += res;
+            if (op->offset < op->size) {
+                return TRUE;
+            }
+        }
+        op->stage = STAGE_CLOSE;
+        return TRUE;
+    case STAGE_WRITE:
+        if (res == 0) {
+            op->res = -EIO;
+        } else if (res > 0) {
+            op->offset += res;
+            if (op->offset < op->size) {
+                return TRUE;
+            }
+        }
+        op->stage = op->res < 0 ? STAGE_CLOSE : STAGE_FSYNC;
+        return TRUE;
+    case STAGE_FSYNC:
+        op->stage = STAGE_CLOSE;
+        return TRUE;
+    case STAGE_CLOSE:
+        op->fd = -1;
+        return FALSE;
+    }
+
+    return FALSE;
+}
+
+static void statxToStat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = stx->stx_ino;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_atime = stx->stx_atime.tv_sec;
+    st->st_mtime = stx->stx_mtime.tv_sec;
+    st->st_ctime = stx->stx_ctime.tv_sec;
+    st->st_blocks = stx->stx_blocks;
+}
+
+static JsonNode *readfileResult(struct UringOp *op) {
+    GByteArray *bytes;
+    JsonNode *result;
+
+    if (!op->map) {
+        return JsonNode_newFromByteArray(g_byte_array_new());
+    }
+
+    /* Like readfile, the response writer splices the mapping */
+    if (op->splice) {
+        result = JsonNode_newFromMapping(op->map, op->mapLen, op->offset);
+        if (result) {
+            op->map = NULL;
+        }
+        return result;
+    }
+
+    bytes = g_byte_array_new_take((guint8 *) op->map, op->offset);
+    op->map = NULL;
+    return JsonNode_newFromByteArray(bytes);
+}
+
+/* Errors match the ones of the exported functions */
+static GQuark errorDomain(const struct UringOp *op) {
+    switch (op->method->kind) {
+    case URING_FSYNC_PATH:
+        return op->stage == STAGE_OPEN ? IOPROCESS_GENERAL_ERROR :
+               IOPROCESS_STDAPI_ERROR;
+    case URING_READFILE:
+    case URING_WRITEFILE:
+        return IOPROCESS_GENERAL_ERROR;
+    default:
+        return IOPROCESS_STDAPI_ERROR;
+    }
+}
+
+static void freeOp(struct UringOp *op) {
+    if (op->fd != -1) {
+        close(op->fd);
+    }
+
+    if (op->map && op->splice) {
+        munmap(op->map, op->mapLen);
+    } else {
+        free(op->map);
+    }
+
+    free(op->staging);
+    g_free(op);
+}
+
+static void finishOp(UringBackend *backend, struct UringOp *op) {
+    JsonNode *result = NULL;
+    GError *err = NULL;
+    struct stat st;
+    int res = op->res;
+
+    switch (op->method->kind) {
+    case URING_STAT:
+    case URING_LSTAT:
+        if (res == 0) {
+            statxToStat(&op->stx, &st);
+            result = stat_map(&st);
+        }
+        break;
+    case URING_FSYNC_PATH:
+    case URING_WRITEFILE:
+        break;
+    case URING_READFILE:
+        if (res == 0) {
+            result = readfileResult(op);
+            if (!result) {
+                res = -ENOMEM;
+            }
+        }
+        break;
+    default:
+        result = JsonNode_newFromBoolean(res == 0);
+        break;
+    }
+
+    if (res < 0) {
+        g_set_error(&err, errorDomain(op), -res, "%s", iop_strerror(-res));
+    }
+
+    op->done(op->doneData, result, err);
+    freeOp(op);
+    g_atomic_int_add(&backend->inflight, -1);
+}
+
+static void completeOp(UringBackend *backend, struct UringOp *op, int res) {
+    while (nextStage(op, res)) {
+        if (submitOp(backend, op) == 0) {
+            return;
+        }
+
+        /* No room for the next step, it runs here */
+        res = runStep(op);
+    }
+
+    finishOp(backend, op);
+}
+
+static void *completionThread(void *data) {
+    UringBackend *backend = (UringBackend *) data;
+    struct io_uring_cqe *cqe;
+    struct pollfd fds[2];
+    struct UringOp *op;
+    eventfd_t value;
+    int res;
+
+    fds[0].fd = backend->ring.ring_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = backend->stopFd;
+    fds[1].events = POLLIN;
+
+    while (TRUE) {
+        while (io_uring_peek_cqe(&backend->ring, &cqe) == 0) {
+            op = io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&backend->ring, cqe);
+
+            if (op != (struct UringOp *) &discardedOp) {
+                completeOp(backend, op, res);
+            }
+        }
+
+        if (g_atomic_int_get(&backend->stopping) &&
+            g_atomic_int_get(&backend->inflight) == 0) {
+            break;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g_critical("Could not wait for completions: %s",
+                       iop_strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            eventfd_read(backend->stopFd, &value);
+        }
+    }
+
+    return NULL;
+}
+
+static void probeMethods(UringBackend *backend) {
+    struct io_uring_probe *probe;
+    const struct UringMethod *method;
+    int supported;
+    int i;
+
+    probe = io_uring_get_probe_ring(&backend->ring);
+    if (!probe) {
+        return;
+    }
+
+    for (method = uringMethods; method->name; method++) {
+        supported = TRUE;
+        for (i = 0; i < 4 && method->opcodes[i] != -1; i++) {
+            supported &= io_uring_opcode_supported(probe,
+                                                   method->opcodes[i]);
+        }
+        backend->supported[method->kind] = supported;
+        if (!supported) {
+            g_debug("Method '%s' is not supported by io_uring",
+                    method->name);
+        }
+    }
+
+    io_uring_free_probe(probe);
+}
+
+UringBackend *uringBackend_new(unsigned entries, GError **err) {
+    UringBackend *backend = g_new0(UringBackend, 1);
+    int rv;
+
+    backend->stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (backend->stopFd == -1) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, errno, "%s",
+                    iop_strerror(errno));
+        g_free(backend);
+        return NULL;
+    }
+
+    rv = io_uring_queue_init(entries, &backend->ring, 0);
+    if (rv < 0) {
+        g_set_error(err, IOPROCESS_GENERAL_ERROR, -rv, "%s",
+                    iop_strerror(-rv));
+        close(backend->stopFd);
+        g_free(backend);
+        return NULL;
+    }
+
+    backend->entries = entries;
+    g_mutex_init(&backend->submitLock);
+    probeMethods(backend);
+
+    backend->completionThread = g_thread_new("uring-completion",
+                                             completionThread, backend);
+    return backend;
+}
+
+void uringBackend_free(UringBackend *backend) {
+    if (!backend) {
+        return;
+    }
+
+    g_atomic_int_set(&backend->stopping, TRUE);
+    eventfd_write(backend->stopFd, 1);
+
+    g_thread_join(backend->completionThread);
+    io_uring_queue_exit(&backend->ring);
+    close(backend->stopFd);
+    g_mutex_clear(&backend->submitLock);
+    g_free(backend);
+}
+
+gboolean uringBackend_submit(UringBackend *backend, const char *methodName,
+                             const JsonNode *args, UringCompletion done,
+                             void *data) {
+    const struct UringMethod *method;
+    struct UringOp *op;
+
+    method = findMethod(methodName);
+    if (!method || !backend->supported[method->kind]) {
+        return FALSE;
+    }
+
+    /* Every request has one entry in the rings at a time */
+    if (g_atomic_int_add(&backend->inflight, 1) >= (gint) backend->entries) {
+        g_atomic_int_add(&backend->inflight, -1);
+        return FALSE;
+    }
+
+    op = g_new0(struct UringOp, 1);
+    op->method = method;
+    op->fd = -1;
+    op->done = done;
+    op->doneData = data;
+
+    if (parseArgs(op, args) < 0 || submitOp(backend, op) < 0) {
+        freeOp(op);
+        g_atomic_int_add(&backend->inflight, -1);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#else
+
+#include <errno.h>
+
+#include "exported-functions.h"
+#include "utils.h"
+
+UringBackend *uringBackend_new(__attribute__((unused)) unsigned entries,
+                               GError **err) {
+    g_set_error(err, IOPROCESS_GENERAL_ERROR, ENOSYS, "%s",
+                iop_strerror(ENOSYS));
+    return NULL;
+}
+
+void uringBackend_free(__attribute__((unused)) UringBackend *backend) {
+}
+
+gboolean uringBackend_submit(
+        __attribute__((unused)) UringBackend *backend,
+        __attribute__((unused)) const char *methodName,
+        __attribute__((unused)) const JsonNode *args,
+        __attribute__((unused)) UringCompletion done,
+        __attribute__((unused)) void *data) {
+    return FALSE;
+}
+
+#endif
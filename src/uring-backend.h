@@ -0,0 +1,32 @@
+#ifndef __URING_BACKEND_H__
+#define __URING_BACKEND_H__
+
+#include <glib.h>
+
+#include "json-dom.h"
+
+/* Runs simple filesystem requests asynchronously with io_uring instead of
+ * blocking a pool thread. Without HAVE_LIBURING uringBackend_new always
+ * fails and requests run on the thread pools. */
+typedef struct UringBackend_t UringBackend;
+
+/* Called on the completion thread when a request is done, taking
+ * ownership of result and err, either may be NULL */
+typedef void (*UringCompletion)(void *data, JsonNode *result, GError *err);
+
+/* Returns NULL and sets err if io_uring is not available */
+UringBackend *uringBackend_new(unsigned entries, GError **err);
+
+/* Waits until the submitted requests are completed */
+void uringBackend_free(UringBackend *backend);
+
+/* Submits a request, args must be valid until done is called. Returns
+ * FALSE if the method is not supported by the kernel, the arguments are
+ * invalid or left to the threads, too many requests are in flight or the
+ * kernel did not take the request, the caller should then run the request
+ * on a thread. */
+gboolean uringBackend_submit(UringBackend *backend, const char *methodName,
+                             const JsonNode *args, UringCompletion done,
+                             void *data);
+
+#endif